@@ -8,26 +8,40 @@ depth quad.vs depth.fs
 multi basic.vs multi.fs
 
 //SHADERS FOR DEFERRED
-gbuffers basic.vs gbuffers.fs
+gbuffers gbuffers.vs gbuffers.fs
 deferred_global quad.vs deferred_global.fs
 deferred_light quad.vs deferred_light.fs 
 deferred_pbr quad.vs deferred_pbr.fs
 deferred_geometry basic.vs deferred_geometry.fs 
 deferred_geometry_pbr basic.vs deferred_geometry_pbr.fs 
+deferred_lights_batch deferred_lights_batch.vs deferred_lights_batch.fs
+deferred_lights_batch_pbr deferred_lights_batch.vs deferred_lights_batch.fs PBR
 deferred_world_color quad.vs deferred_world_color.fs 
 
 //SHADERS FOR OTHER ELEMETS
 ssao quad.vs ssao.fs
+ssao_downsample quad.vs ssao_downsample.fs
+ssao_temporal quad.vs ssao_temporal.fs
+ssao_upsample quad.vs ssao_upsample.fs
 spherical_probe basic.vs spherical_probe.fs
 irradiance quad.vs irradiance.fs
 reflection_probe basic.vs reflection_probe.fs
-volumetric quad.vs volumetric.fs
+prefilter quad.vs prefilter.fs
 decals basic.vs decals.fs
 
 //POST FX SHADERS
-blur quad.vs blur.fs
-motion_blur quad.vs motion_blur.fs
-tonemapper quad.vs tonemapper.fs
+taa quad.vs taa.fs
+bloom_downsample quad.vs bloom_downsample.fs
+bloom_upsample quad.vs bloom_upsample.fs
+luminance quad.vs luminance.fs
+exposure quad.vs exposure.fs
+@postfx quad.vs postfx.fs MOTION_BLUR,VOLUMETRIC,BLOOM,TONEMAPPER,AUTO_EXPOSURE,SHARPEN
+
+//LAYERED SHADERS (layered.vs and layered.gs are combined on demand with the pixel shader of another one, see Shader::GetLayered)
+
+//FROXEL SHADERS (froxel.vs and froxel.gs are combined with froxel_inject.fs, froxel_temporal.fs and froxel_integrate.fs on demand)
+
+//GPU DRIVEN SHADERS (indirect.vs, cull.cs and hiz.cs are compiled on demand, they require GL 4.3)
 
 
 \basic.vs
@@ -72,6 +86,50 @@ void main()
 	gl_Position = u_viewprojection * vec4( v_world_position, 1.0 );
 }
 
+\gbuffers.vs
+
+#version 330 core
+
+in vec3 a_vertex;
+in vec3 a_normal;
+in vec2 a_coord;
+in vec4 a_color;
+
+uniform vec3 u_camera_pos;
+
+uniform mat4 u_model;
+uniform mat4 u_viewprojection;
+
+//without the jitter, for the velocity
+uniform mat4 u_prev_model;
+uniform mat4 u_unjittered_viewprojection;
+uniform mat4 u_prev_viewprojection;
+
+out vec3 v_position;
+out vec3 v_world_position;
+out vec3 v_normal;
+out vec2 v_uv;
+out vec4 v_color;
+out vec4 v_clip_pos;
+out vec4 v_prev_clip_pos;
+
+uniform float u_time;
+
+void main()
+{	
+	v_normal = (u_model * vec4( a_normal, 0.0) ).xyz;
+	v_position = a_vertex;
+	v_world_position = (u_model * vec4( v_position, 1.0) ).xyz;
+	v_color = a_color;
+	v_uv = a_coord;
+
+	//where it is and where it was, interpolated because the division by w has to be per pixel
+	v_clip_pos = u_unjittered_viewprojection * vec4( v_world_position, 1.0 );
+	v_prev_clip_pos = u_prev_viewprojection * u_prev_model * vec4( v_position, 1.0 );
+
+	gl_Position = u_viewprojection * vec4( v_world_position, 1.0 );
+}
+
 \quad.vs
 
 #version 330 core
@@ -143,127 +201,338 @@ void main()
 
 
 
-\blur.fs
+\bloom_downsample.fs
 
 #version 330 core
 
 uniform sampler2D u_texture; 
 in vec2 v_uv;
 
-uniform vec2 u_offset;
-uniform float u_intensity;
+uniform vec2 u_texel; //size of a texel of the source
+uniform int u_prefilter;
+uniform vec4 u_threshold; //threshold, threshold - knee, 2 * knee, 0.25 / knee
 
 out vec4 FragColor;
 
-void main()
+//keeps the part over the threshold, with a quadratic curve around it
+vec3 prefilter(vec3 color)
 {
-	vec4 sum = vec4(0.0);
+	float brightness = max(color.r, max(color.g, color.b));
+	float soft = clamp(brightness - u_threshold.y, 0.0, u_threshold.z);
+	soft = soft * soft * u_threshold.w;
+	float contribution = max(soft, brightness - u_threshold.x) / max(brightness, 0.0001);
+	return color * contribution;
+}
 
-	sum += texture(u_texture, v_uv + u_offset * -4.0) * 0.05/0.98;
-	sum += texture(u_texture, v_uv + u_offset * -3.0) * 0.09/0.98;
-	sum += texture(u_texture, v_uv + u_offset * -2.0) * 0.12/0.98;
-	sum += texture(u_texture, v_uv + u_offset * -1.0) * 0.15/0.98;
-	sum += texture(u_texture, v_uv) * 0.05/0.98;
-	sum += texture(u_texture, v_uv + u_offset * 1.0) * 0.15/0.98;
-	sum += texture(u_texture, v_uv + u_offset * 2.0) * 0.12/0.98;
-	sum += texture(u_texture, v_uv + u_offset * 3.0) * 0.09/0.98;
-	sum += texture(u_texture, v_uv + u_offset * 4.0) * 0.05/0.98;
+void main()
+{
+	//13 bilinear taps, five overlapping 2x2 boxes to avoid the aliasing of a plain 2x2
+	vec3 a = texture(u_texture, v_uv + u_texel * vec2(-2.0, 2.0)).rgb;
+	vec3 b = texture(u_texture, v_uv + u_texel * vec2(0.0, 2.0)).rgb;
+	vec3 c = texture(u_texture, v_uv + u_texel * vec2(2.0, 2.0)).rgb;
+	vec3 d = texture(u_texture, v_uv + u_texel * vec2(-2.0, 0.0)).rgb;
+	vec3 e = texture(u_texture, v_uv).rgb;
+	vec3 f = texture(u_texture, v_uv + u_texel * vec2(2.0, 0.0)).rgb;
+	vec3 g = texture(u_texture, v_uv + u_texel * vec2(-2.0, -2.0)).rgb;
+	vec3 h = texture(u_texture, v_uv + u_texel * vec2(0.0, -2.0)).rgb;
+	vec3 i = texture(u_texture, v_uv + u_texel * vec2(2.0, -2.0)).rgb;
+	vec3 j = texture(u_texture, v_uv + u_texel * vec2(-1.0, 1.0)).rgb;
+	vec3 k = texture(u_texture, v_uv + u_texel * vec2(1.0, 1.0)).rgb;
+	vec3 l = texture(u_texture, v_uv + u_texel * vec2(-1.0, -1.0)).rgb;
+	vec3 m = texture(u_texture, v_uv + u_texel * vec2(1.0, -1.0)).rgb;
+
+	vec3 color = e * 0.125 + (a + c + g + i) * 0.03125 + (b + d + f + h) * 0.0625 + (j + k + l + m) * 0.125;
+	if (u_prefilter == 1)
+		color = prefilter(min(color, vec3(65000.0)));
 
-	FragColor = sum * u_intensity;
+	FragColor = vec4(color, 1.0);
 }
 
+\bloom_upsample.fs
+
+#version 330 core
+
+uniform sampler2D u_texture; 
+in vec2 v_uv;
 
+uniform vec2 u_texel; //size of a texel of the source
+uniform float u_intensity;
 
+out vec4 FragColor;
 
+void main()
+{
+	//3x3 tent
+	vec3 color = texture(u_texture, v_uv).rgb * 4.0;
+	color += texture(u_texture, v_uv + u_texel * vec2(-1.0, 0.0)).rgb * 2.0;
+	color += texture(u_texture, v_uv + u_texel * vec2(1.0, 0.0)).rgb * 2.0;
+	color += texture(u_texture, v_uv + u_texel * vec2(0.0, -1.0)).rgb * 2.0;
+	color += texture(u_texture, v_uv + u_texel * vec2(0.0, 1.0)).rgb * 2.0;
+	color += texture(u_texture, v_uv + u_texel * vec2(-1.0, -1.0)).rgb;
+	color += texture(u_texture, v_uv + u_texel * vec2(1.0, -1.0)).rgb;
+	color += texture(u_texture, v_uv + u_texel * vec2(-1.0, 1.0)).rgb;
+	color += texture(u_texture, v_uv + u_texel * vec2(1.0, 1.0)).rgb;
+
+	FragColor = vec4(color * (u_intensity / 16.0), 1.0);
+}
 
 
-\motion_blur.fs
+\luminance.fs
 
 #version 330 core
 
-uniform sampler2D u_texture;
-uniform sampler2D u_depth_texture;
+uniform sampler2D u_texture; 
 in vec2 v_uv;
 
-uniform mat4 u_ivp;
-uniform mat4 u_prev_vp;
-uniform vec2 u_iRes;
+uniform vec2 u_texel; //size of a texel of the source
 
 out vec4 FragColor;
 
-void main()
+float logLuminance(vec2 uv)
 {
-	vec2 uv = gl_FragCoord.xy * u_iRes.xy;	
+	vec3 color = texture(u_texture, uv).rgb;
+	return log(max(dot(color, vec3(0.2126, 0.7152, 0.0722)), 0.0001));
+}
 
-	float depth = texture(u_depth_texture, uv).x;
+void main()
+{
+	//4 bilinear taps, 4x4 pixels of the source
+	float lum = logLuminance(v_uv + u_texel * vec2(-1.0, -1.0));
+	lum += logLuminance(v_uv + u_texel * vec2(1.0, -1.0));
+	lum += logLuminance(v_uv + u_texel * vec2(-1.0, 1.0));
+	lum += logLuminance(v_uv + u_texel * vec2(1.0, 1.0));
+	FragColor = vec4(lum * 0.25, 0.0, 0.0, 1.0);
+}
 
-	vec4 screen_pos = vec4(uv.x * 2.0 - 1.0, uv.y * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
-	vec4 world_pos_proj = u_ivp * screen_pos;
-	vec3 world_pos = world_pos_proj.xyz / world_pos_proj.w;
+\exposure.fs
 
-	vec4 prev_screenpos = u_prev_vp * vec4(world_pos, 1.0);
-	prev_screenpos.xyz /= prev_screenpos.w;
-	vec2 prev_uv = prev_screenpos.xy * 0.5 + vec2(0.5);
+#version 330 core
 
-	vec4 color = vec4(0.0);
+uniform sampler2D u_luminance_texture;
+uniform sampler2D u_prev_exposure_texture;
+uniform float u_luminance_lod; //the 1x1 mipmap
+uniform float u_adaptation; //1.0 ignores the previous one
 
-	for (int i = 0; i < 16; i++)
-	{
-		vec2 int_uv = mix(uv, prev_uv, float(i)/16.0);
-		color += texture(u_texture, int_uv);
-	}
-	color /= 16.0f;
+out vec4 FragColor;
 
-	FragColor = color;
+void main()
+{
+	//geometric mean of the luminance of the frame
+	float target = exp(textureLod(u_luminance_texture, vec2(0.5), u_luminance_lod).x);
+	float prev = texture(u_prev_exposure_texture, vec2(0.5)).x;
+	FragColor = vec4(vec3(mix(prev, target, u_adaptation)), 1.0);
 }
 
 
+\taa.fs
+
+#version 330 core
+
+//resolves the jittered frame with the reprojected history, at the window size (it upsamples when u_texture is smaller)
+uniform sampler2D u_texture;
+uniform sampler2D u_history_texture;
+uniform sampler2D u_velocity_texture;
+uniform sampler2D u_depth_texture;
+uniform vec2 u_iRes; //of the output
+uniform vec2 u_source_size; //of u_texture
+uniform vec2 u_jitter; //in pixels of u_texture
+uniform float u_feedback; //0 without history
+uniform mat4 u_ivp; //without jitter
+uniform mat4 u_prev_vp;
+
+out vec4 FragColor;
+
+//the filters work with the colors compressed, so a few very bright pixels do not flicker
+vec3 compress(vec3 color) { return color / (1.0 + max(max(color.r, color.g), color.b)); }
+vec3 decompress(vec3 color) { return color / max(1.0 - max(max(color.r, color.g), color.b), 0.0001); }
 
+void main()
+{
+	vec2 uv = gl_FragCoord.xy * u_iRes;
+	vec2 source_pos = uv * u_source_size;
 
+	//the 3x3 samples around, weighted by their distance to this pixel (a sample is where the jitter put it)
+	ivec2 center = ivec2(floor(source_pos + u_jitter));
+	ivec2 last = ivec2(u_source_size) - ivec2(1);
+	vec3 color = vec3(0.0);
+	vec3 min_color = vec3(1.0);
+	vec3 max_color = vec3(0.0);
+	float total_weight = 0.0;
+	float max_weight = 0.0;
+	float closest_depth = 1.0;
+	ivec2 closest = center;
+	for (int y = -1; y <= 1; ++y)
+		for (int x = -1; x <= 1; ++x)
+		{
+			ivec2 texel = clamp(center + ivec2(x, y), ivec2(0), last);
+			vec3 sample_color = compress(texelFetch(u_texture, texel, 0).rgb);
+			vec2 offset = vec2(texel) + vec2(0.5) - u_jitter - source_pos;
+			float weight = exp(-2.29 * dot(offset, offset)); //close to a Blackman-Harris of one pixel
+			color += sample_color * weight;
+			total_weight += weight;
+			max_weight = max(max_weight, weight);
+			min_color = min(min_color, sample_color);
+			max_color = max(max_color, sample_color);
+
+			float depth = texelFetch(u_depth_texture, texel, 0).x;
+			if (depth < closest_depth)
+			{
+				closest_depth = depth;
+				closest = texel;
+			}
+		}
+	color /= total_weight;
 
+	//the velocity of the closest one, so the edges move with the object in front
+	vec2 velocity = texelFetch(u_velocity_texture, closest, 0).xy;
+	if (closest_depth >= 1.0)
+	{
+		vec4 world_pos = u_ivp * vec4(uv * 2.0 - 1.0, 1.0, 1.0);
+		vec4 prev_pos = u_prev_vp * vec4(world_pos.xyz / world_pos.w, 1.0);
+		velocity = uv - (prev_pos.xy / prev_pos.w * 0.5 + vec2(0.5));
+	}
+	vec2 prev_uv = uv - velocity;
 
+	if (u_feedback == 0.0 || prev_uv.x < 0.0 || prev_uv.y < 0.0 || prev_uv.x > 1.0 || prev_uv.y > 1.0)
+	{
+		FragColor = vec4(decompress(color), 1.0);
+		return;
+	}
 
+	//the history is only valid if it looks like the neighbours of this frame (disocclusions, changes of light)
+	vec3 history = compress(texture(u_history_texture, prev_uv).rgb);
+	history = clamp(history, min_color, max_color);
 
+	//when upsampling the samples far from this pixel are worse than the history
+	float confidence = u_source_size.x * u_iRes.x < 0.99 ? max_weight : 1.0;
+	float blend = (1.0 - u_feedback) * confidence;
+	FragColor = vec4(decompress(mix(history, color, blend)), 1.0);
+}
 
 
-\tonemapper.fs
+\postfx.fs
 
 #version 330 core
 
-in vec2 v_uv;
+//all the post effects in one pass, compiled only with the macros of the enabled ones
+uniform sampler2D u_texture;
+uniform sampler2D u_depth_texture;
+uniform vec2 u_iRes; //of the screen, u_texture can be smaller
 
-uniform sampler2D u_albedo_texture;
+#ifdef SHARPEN
+uniform vec2 u_source_texel;
+uniform float u_sharpness;
+#endif
+
+#ifdef MOTION_BLUR
+uniform sampler2D u_velocity_texture;
+uniform mat4 u_ivp; //without jitter
+uniform mat4 u_prev_vp;
+#endif
+
+#ifdef VOLUMETRIC
+uniform sampler3D u_integrated_texture;
+uniform float u_froxel_slices;
+#include "froxel"
+#endif
 
+#ifdef BLOOM
+uniform sampler2D u_bloom_texture;
+uniform vec2 u_bloom_texel;
+uniform float u_bloom_intensity;
+#endif
+
+#ifdef TONEMAPPER
 uniform float u_scale; //color scale before tonemapper
 uniform float u_average_lum; 
 uniform float u_lumwhite2;
 uniform float u_igamma; //inverse gamma
 uniform float u_brightness;
+#ifdef AUTO_EXPOSURE
+uniform sampler2D u_exposure_texture; //1x1, average luminance computed in the GPU
+#endif
+#endif
 
 out vec4 FragColor;
 
-void main() {
-	vec4 color = texture2D( u_albedo_texture, v_uv );
+void main()
+{
+	vec2 uv = gl_FragCoord.xy * u_iRes.xy;
+	float depth = texture(u_depth_texture, uv).x;
+
+#ifdef MOTION_BLUR
+	//along the movement of the pixel since the last frame
+	vec2 velocity = texture(u_velocity_texture, uv).xy;
+	if (depth >= 1.0)
+	{
+		vec4 world_pos_proj = u_ivp * vec4(uv * 2.0 - 1.0, 1.0, 1.0);
+		vec4 prev_screenpos = u_prev_vp * vec4(world_pos_proj.xyz / world_pos_proj.w, 1.0);
+		velocity = uv - (prev_screenpos.xy / prev_screenpos.w * 0.5 + vec2(0.5));
+	}
 
-	float lum = dot(color.xyz, vec3(0.2126, 0.7152, 0.0722));
-	float L = (u_scale / u_average_lum) * lum;
+	vec3 color = vec3(0.0);
+	for (int i = 0; i < 16; i++)
+		color += texture(u_texture, uv - velocity * (float(i) / 16.0)).rgb;
+	color /= 16.0;
+#else
+	vec3 color = texture(u_texture, uv).rgb;
+#endif
+
+#ifdef SHARPEN
+	//the bilinear upscale blurs, unsharp mask limited to the range of the neighbours to avoid halos
+	vec3 north = texture(u_texture, uv + vec2(0.0, u_source_texel.y)).rgb;
+	vec3 south = texture(u_texture, uv - vec2(0.0, u_source_texel.y)).rgb;
+	vec3 east = texture(u_texture, uv + vec2(u_source_texel.x, 0.0)).rgb;
+	vec3 west = texture(u_texture, uv - vec2(u_source_texel.x, 0.0)).rgb;
+	vec3 min_color = min(min(min(north, south), min(east, west)), color);
+	vec3 max_color = max(max(max(north, south), max(east, west)), color);
+	vec3 sharpened = color + (color * 4.0 - north - south - east - west) * u_sharpness * 0.5;
+	color = clamp(sharpened, min_color, max_color);
+#endif
+
+#ifdef VOLUMETRIC
+	//the light in front of the pixel and how much of the pixel remains
+	float z = depth * 2.0 - 1.0;
+	z = 2.0 * u_camera_nearfar.x * u_camera_nearfar.y / (u_camera_nearfar.y + u_camera_nearfar.x - z * (u_camera_nearfar.y - u_camera_nearfar.x));
+	vec4 volumetric = texture(u_integrated_texture, vec3(uv, froxelSlice(z) - 0.5 / u_froxel_slices));
+	color = color * volumetric.a + volumetric.rgb;
+#endif
+
+#ifdef BLOOM
+	//the last upsample of the pyramid, 3x3 tent
+	vec3 bloom = texture(u_bloom_texture, uv).rgb * 4.0;
+	bloom += texture(u_bloom_texture, uv + u_bloom_texel * vec2(-1.0, 0.0)).rgb * 2.0;
+	bloom += texture(u_bloom_texture, uv + u_bloom_texel * vec2(1.0, 0.0)).rgb * 2.0;
+	bloom += texture(u_bloom_texture, uv + u_bloom_texel * vec2(0.0, -1.0)).rgb * 2.0;
+	bloom += texture(u_bloom_texture, uv + u_bloom_texel * vec2(0.0, 1.0)).rgb * 2.0;
+	bloom += texture(u_bloom_texture, uv + u_bloom_texel * vec2(-1.0, -1.0)).rgb;
+	bloom += texture(u_bloom_texture, uv + u_bloom_texel * vec2(1.0, -1.0)).rgb;
+	bloom += texture(u_bloom_texture, uv + u_bloom_texel * vec2(-1.0, 1.0)).rgb;
+	bloom += texture(u_bloom_texture, uv + u_bloom_texel * vec2(1.0, 1.0)).rgb;
+	color += bloom * (u_bloom_intensity / 16.0);
+#endif
+
+#ifdef TONEMAPPER
+	float lum = max(dot(color, vec3(0.2126, 0.7152, 0.0722)), 0.0001);
+#ifdef AUTO_EXPOSURE
+	float average_lum = texture(u_exposure_texture, vec2(0.5)).x;
+#else
+	float average_lum = u_average_lum;
+#endif
+	float L = (u_scale / average_lum) * lum;
 	float Ld = (L * (1.0 + L / u_lumwhite2)) / (1.0 + L);
 
-	color.xyz = (color.xyz / lum) * Ld;
-	color.xyz = max(color.xyz,vec3(0.001));
-	color.xyz = pow( color.xyz, vec3( u_igamma ) );
+	color = (color / lum) * Ld;
+	color = max(color, vec3(0.001));
+	color = pow(color, vec3(u_igamma));
 
-	color.xyz *= u_brightness;
+	color *= u_brightness;
+#endif
 
-	FragColor = color;
+	FragColor = vec4(color, 1.0);
 }
 
 
-
-
-
-
-
 \gbuffers.fs
 
 #version 330 core
@@ -273,6 +542,8 @@ in vec3 v_world_position;
 in vec3 v_normal;
 in vec2 v_uv;
 in vec4 v_color;
+in vec4 v_clip_pos;
+in vec4 v_prev_clip_pos;
 
 uniform vec4 u_albedo_factor;
 uniform vec3 u_emissive_factor;
@@ -288,11 +559,14 @@ uniform sampler2D u_metallic_texture;
 uniform float u_time;
 uniform float u_alpha_cutoff;
 
-layout(location = 0) out vec4 FragColor;
-layout(location = 1) out vec4 NormalColor;
-layout(location = 2) out vec4 ExtraColor; //for now only emissive
+layout(location = 0) out vec4 FragColor; //albedo and occlusion
+layout(location = 1) out vec4 NormalColor; //octahedral normal and roughness
+layout(location = 2) out vec4 MaterialColor; //metallic and material id
+layout(location = 3) out vec4 VelocityColor; //in uv, from the last frame to this one
+layout(location = 4) out vec4 EmissiveColor; //straight to the illumination buffer
 
 #include "normal"
+#include "gbuffer"
 
 void main()
 {
@@ -306,8 +580,7 @@ void main()
 	float metallic = texture(u_metallic_texture, v_uv).g;
 	float roughness = texture(u_metallic_texture, v_uv).b;
 
-	vec3 normal_map = texture(u_normal_texture, v_uv).rgb;
-	normal_map = normalize(normal_map * 2.0 - vec3(1.0));
+	vec3 normal_map = sampleNormalMap(u_normal_texture, v_uv);
 
 	vec3 N = normalize(v_normal);
 	vec3 WP = v_world_position;
@@ -317,12 +590,11 @@ void main()
 	if(albedo.a < u_alpha_cutoff)
 		discard;
 
-	albedo.a += occlusion;
-	vec4 color = albedo;
-
-	FragColor = color;
-	NormalColor = vec4(normal*0.5 + vec3(0.5), 1.0);
-	ExtraColor = vec4(emissive, roughness);
+	FragColor = vec4(albedo.rgb, occlusion);
+	NormalColor = vec4(encodeNormal(normal), roughness, 1.0);
+	MaterialColor = vec4(metallic, MATERIAL_STANDARD / 255.0, 0.0, 1.0);
+	EmissiveColor = vec4(emissive, 1.0);
+	VelocityColor = vec4((v_clip_pos.xy / v_clip_pos.w - v_prev_clip_pos.xy / v_prev_clip_pos.w) * 0.5, 0.0, 1.0);
 }
 
 
@@ -374,8 +646,7 @@ void main()
 	float roughness = texture(u_metallic_texture, v_uv).g * 0.1; // * u_roughness_factor;
 	float metallicness = texture(u_metallic_texture, v_uv).b; // * u_metallic_factor;
 
-	vec3 normal_map = texture(u_normal_texture, v_uv).rgb;
-	normal_map = normalize(normal_map * 2.0 - 1.0);
+	vec3 normal_map = sampleNormalMap(u_normal_texture, v_uv);
 
 	vec3 WP = v_world_position;
 	vec3 N = normalize(v_normal);
@@ -451,8 +722,7 @@ void main()
 	//roughness *= u_roughness_factor;
 	//metallicness *= u_metallic_factor;
 
-	vec3 normal_map = texture(u_normal_texture, v_uv).rgb;
-	normal_map = normalize(normal_map * 2.0 - 1.0);
+	vec3 normal_map = sampleNormalMap(u_normal_texture, v_uv);
 
 	vec3 WP = v_world_position;
 	vec3 N = normalize(v_normal);
@@ -501,14 +771,13 @@ in vec3 v_position;
 uniform vec3 u_camera_position;
 
 uniform sampler2D u_albedo_texture;
-uniform sampler2D u_emissive_texture;
 uniform sampler2D u_normal_texture;
 uniform sampler2D u_depth_texture;
-uniform sampler2D u_metallic_texture;
 
 #include "lights"
 #include "pbr_equations"
 #include "normal"
+#include "gbuffer"
 
 uniform mat4 u_ivp;
 uniform vec2 u_iRes;
@@ -528,8 +797,7 @@ void main()
 	vec4 world_pos_proj = u_ivp * screen_pos;
 	vec3 world_pos = world_pos_proj.xyz / world_pos_proj.w;
 
-	vec3 normal_map = texture(u_normal_texture, uv).rgb;
-	normal_map = normalize(normal_map * 2.0 - vec3(1.0));
+	vec3 normal_map = decodeNormal(texture(u_normal_texture, uv).rg);
 
 	vec3 V = normalize(u_camera_position - world_pos); 
 	vec3 L = u_light_front;
@@ -565,7 +833,7 @@ void main()
 in vec3 v_normal;
 
 uniform sampler2D u_albedo_texture;
-uniform sampler2D u_emissive_texture;
+uniform sampler2D u_material_texture;
 uniform sampler2D u_normal_texture;
 uniform sampler2D u_depth_texture;
 
@@ -577,10 +845,17 @@ uniform float u_alpha_cutoff;
 #include "lights"
 #include "normal"
 #include "pbr_equations"
+#include "gbuffer"
 
 uniform mat4 u_ivp;
 uniform vec2 u_iRes;
 
+//prefiltered specular of the environment, see prefilterEnvironment
+uniform samplerCube u_environment_texture;
+uniform sampler2D u_brdf_lut;
+uniform float u_environment_max_lod;
+uniform float u_environment_intensity; //only the first pass adds it
+
 out vec4 FragColor;
 
 void main()
@@ -596,12 +871,12 @@ void main()
 	vec4 world_proj = u_ivp * screen_coord;
 	vec3 world_pos = world_proj.xyz / world_proj.w;
 
+	vec4 normal_roughness = texture(u_normal_texture, uv);
 	float occlusion = texture(u_albedo_texture, uv).a;
-	float metallicness = texture(u_normal_texture, uv).a;
-	float roughness = texture(u_emissive_texture, uv).a;
+	float metallicness = texture(u_material_texture, uv).r;
+	float roughness = normal_roughness.b;
 
-	vec3 normal_map = texture(u_normal_texture, uv).rgb;
-	vec3 normal = normalize(normal_map * 2.0 - vec3(1.0)); 
+	vec3 normal = decodeNormal(normal_roughness.rg);
 	
 	//vec3 N = normalize(v_normal);
 	//mat3 TBN = cotangent_frame(N, world_pos, uv);
@@ -629,6 +904,16 @@ void main()
 
 	vec3 color = albedo.rgb * light;
 
+	if(u_environment_intensity > 0.0)
+	{
+		//split sum: the mip of the roughness scaled by the BRDF LUT
+		float NdotV = max(dot(normal, V), 0.0);
+		vec3 R = reflect(-V, normal);
+		vec3 radiance = textureLod(u_environment_texture, R, roughness * u_environment_max_lod).rgb;
+		vec2 brdf = texture(u_brdf_lut, vec2(NdotV, roughness)).rg;
+		color += radiance * (f0 * brdf.x + brdf.y) * occlusion * u_environment_intensity;
+	}
+
 	FragColor = vec4(color, 1.0);
 }
 
@@ -649,14 +934,14 @@ in vec3 v_position;
 uniform vec3 u_camera_position;
 
 uniform sampler2D u_albedo_texture;
-uniform sampler2D u_emissive_texture;
+uniform sampler2D u_material_texture;
 uniform sampler2D u_normal_texture;
 uniform sampler2D u_depth_texture;
-uniform sampler2D u_metallic_texture;
 
 #include "lights"
 #include "pbr_equations"
 #include "normal"
+#include "gbuffer"
 
 uniform mat4 u_ivp;
 uniform vec2 u_iRes;
@@ -678,11 +963,10 @@ void main()
 
 	vec3 light = vec3(0.0);
 
-	vec3 normal_map = texture(u_normal_texture, uv).rgb;
-	normal_map = normalize(normal_map * 2.0 - vec3(1.0));
+	vec3 normal_map = decodeNormal(texture(u_normal_texture, uv).rg);
 
-	float roughness = texture(u_emissive_texture, uv).a * 0.2;
-	float metallicness = texture(u_normal_texture, uv).a * 0.2;
+	float roughness = texture(u_normal_texture, uv).b * 0.2;
+	float metallicness = texture(u_material_texture, uv).r * 0.2;
 
 	vec3 N = normalize(v_normal);
 	vec3 V = normalize(u_camera_position - world_pos); 
@@ -698,7 +982,7 @@ void main()
 
 	vec3 color = albedo.rgb * light; 
 
-	FragColor = vec4(color,albedo.a);
+	FragColor = vec4(color, 1.0);
 	gl_FragDepth = depth;
 }
 
@@ -715,7 +999,7 @@ void main()
 in vec3 v_normal;
 
 uniform sampler2D u_albedo_texture;
-uniform sampler2D u_emissive_texture;
+uniform sampler2D u_material_texture;
 uniform sampler2D u_normal_texture;
 uniform sampler2D u_depth_texture;
 
@@ -727,6 +1011,7 @@ uniform float u_alpha_cutoff;
 #include "lights"
 #include "normal"
 #include "pbr_equations"
+#include "gbuffer"
 
 uniform mat4 u_ivp;
 uniform vec2 u_iRes;
@@ -746,12 +1031,12 @@ void main()
 	vec4 world_proj = u_ivp * screen_coord;
 	vec3 world_pos = world_proj.xyz / world_proj.w;
 
+	vec4 normal_roughness = texture(u_normal_texture, uv);
 	float occlusion = texture(u_albedo_texture, uv).a;
-	float metallicness = texture(u_normal_texture, uv).a;
-	float roughness = texture(u_emissive_texture, uv).a;
+	float metallicness = texture(u_material_texture, uv).r;
+	float roughness = normal_roughness.b;
 
-	vec3 normal_map = texture(u_normal_texture, uv).rgb;
-	vec3 normal = normalize(normal_map * 2.0 - vec3(1.0)); 
+	vec3 normal = decodeNormal(normal_roughness.rg);
 	
 	//vec3 N = normalize(v_normal);
 	//mat3 TBN = cotangent_frame(N, world_pos, uv);
@@ -787,6 +1072,91 @@ void main()
 
 
 
+\deferred_lights_batch.vs
+
+#version 330 core
+
+in vec3 a_vertex;
+
+uniform mat4 u_viewprojection;
+
+#include "lights_batch"
+
+flat out int v_light;
+
+void main()
+{
+	//the sphere of the light of this instance, a bit bigger because it is inscribed in the real one
+	vec4 light = u_lights_position[gl_InstanceID];
+	v_light = gl_InstanceID;
+	gl_Position = u_viewprojection * vec4(light.xyz + a_vertex * light.w * 1.05, 1.0);
+}
+
+\deferred_lights_batch.fs
+
+#version 330 core
+
+flat in int v_light;
+
+uniform sampler2D u_albedo_texture;
+uniform sampler2D u_normal_texture;
+uniform sampler2D u_material_texture;
+uniform sampler2D u_depth_texture;
+
+uniform vec3 u_camera_position;
+
+#include "lights"
+#include "pbr_equations"
+#include "gbuffer"
+#include "lights_batch"
+
+uniform mat4 u_ivp;
+uniform vec2 u_iRes;
+
+out vec4 FragColor;
+
+void main()
+{
+	vec2 uv = gl_FragCoord.xy * u_iRes.xy;
+
+	float depth = texture(u_depth_texture, uv).r;
+	if(depth == 1.0) discard;
+
+	vec4 screen_coord = vec4(uv.x * 2.0 - 1.0, uv.y * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+	vec4 world_proj = u_ivp * screen_coord;
+	vec3 world_pos = world_proj.xyz / world_proj.w;
+
+	vec3 albedo = texture(u_albedo_texture, uv).rgb;
+	vec4 normal_roughness = texture(u_normal_texture, uv);
+	vec3 normal = decodeNormal(normal_roughness.rg);
+
+	vec4 position = u_lights_position[v_light];
+	vec4 color = u_lights_color[v_light];
+	vec4 light_info = vec4(color.w, 0.0, position.w, 0.0);
+	vec3 light = compute_light(light_info, normal, color.rgb, position.xyz, u_lights_front[v_light].xyz, u_lights_cone[v_light].xy, world_pos);
+
+#ifdef PBR
+	//the same than deferred_geometry_pbr, all of them are point or spot lights
+	float metallicness = texture(u_material_texture, uv).r;
+	if(metallicness != 0.0 && metallicness < 0.1)
+	{
+		float roughness = normal_roughness.b;
+		vec3 f0 = mix( vec3(0.5), albedo, metallicness );
+		vec3 V = normalize(u_camera_position - world_pos);
+		vec3 L = normalize(position.xyz - world_pos);
+		vec3 H = normalize(V + L);
+		light += specularBRDF(roughness, f0, max(dot(normal, H), 0.0), max(dot(normal, V), 0.0), max(dot(normal, L), 0.0), max(dot(L, H), 0.0)) * color.rgb;
+	}
+#endif
+
+	FragColor = vec4(albedo * light, 1.0);
+}
+
+
+
+
+
+
 \deferred_world_color.fs
 
 #version 330 core
@@ -826,9 +1196,7 @@ void main()
 in vec2 v_uv;
 
 uniform sampler2D u_albedo_texture;
-uniform sampler2D u_emissive_texture;
 uniform sampler2D u_depth_texture;
-uniform sampler2D u_metallic_texture;
 
 uniform vec3 u_ambient_light;
 
@@ -840,12 +1208,10 @@ void main()
 	if (depth == 1.0) discard;
 
 	vec4 albedo = texture(u_albedo_texture, v_uv);	
-	vec4 emissive = texture(u_emissive_texture, v_uv);
-	float occlusion = texture(u_metallic_texture, v_uv).r;
-
-	vec3 color = vec3(0.0);
+	float occlusion = albedo.a;
 
-	color.xyz += emissive.xyz + albedo.xyz * u_ambient_light * occlusion;
+	//added to the emissive, the geometry pass writes it in the illumination buffer
+	vec3 color = albedo.xyz * u_ambient_light * occlusion;
 
 	FragColor = vec4(color, 1.0);
 	gl_FragDepth = depth;
@@ -861,25 +1227,29 @@ void main()
 
 #version 330 core
 
-in vec3 v_world_position;
-in vec3 v_normal;
-
 uniform sampler2D u_depth_texture;
 uniform sampler2D u_normal_texture;
 
 uniform mat4 u_viewprojection;
 uniform mat4 u_ivp;
 uniform vec2 u_iRes;
-uniform vec3 u_camera_pos;
+uniform vec2 u_camera_nearfar;
 
-#define NUM_POINTS 64
+#define NUM_POINTS 16
 
-uniform vec3 u_points[NUM_POINTS];
+uniform vec3 u_points[NUM_POINTS]; //hemisphere around z
 uniform float u_radius; 
+uniform int u_frame;
+
+#include "gbuffer"
 
 layout(location = 0) out vec4 FragColor;
 
-#include "normal"
+float linearDepth(float depth)
+{
+	float z = depth * 2.0 - 1.0;
+	return 2.0 * u_camera_nearfar.x * u_camera_nearfar.y / (u_camera_nearfar.y + u_camera_nearfar.x - z * (u_camera_nearfar.y - u_camera_nearfar.x));
+}
 
 void main()
 {
@@ -888,7 +1258,6 @@ void main()
 	float depth = texture(u_depth_texture, uv).r;
 
 	float ao = 1.0;
-	vec3 final_ao = vec3(ao);
 
 	if(depth < 1.0)	//skip skybox pixels
 	{
@@ -897,13 +1266,24 @@ void main()
 
 		vec3 world_pos = world_proj.xyz / world_proj.w;
 
-		vec3 normal_map = texture(u_normal_texture, uv).rgb;
-		normal_map = normalize(normal_map * 2.0 - 1.0);
+		vec3 normal_map = decodeNormal(texture(u_normal_texture, uv).rg);
+
+		//interleaved gradient noise, another rotation for every pixel and every frame
+		vec2 noise_pos = gl_FragCoord.xy + vec2(5.588238 * float(u_frame));
+		float angle = 6.2831853 * fract(52.9829189 * fract(dot(noise_pos, vec2(0.06711056, 0.00583715))));
+
+		//the hemisphere oriented to the normal and rotated around it
+		vec3 up = abs(normal_map.y) < 0.999 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0);
+		vec3 tangent = normalize(cross(up, normal_map));
+		vec3 bitangent = cross(normal_map, tangent);
+		tangent = tangent * cos(angle) + bitangent * sin(angle);
+		bitangent = cross(normal_map, tangent);
+		mat3 rotation = mat3(tangent, bitangent, normal_map);
 
 		int outside = 0;
 		for( int i = 0; i < NUM_POINTS; i++)
 		{
-			vec3 p = world_pos + u_points[i] * u_radius;
+			vec3 p = world_pos + rotation * u_points[i] * u_radius;
 		
 			vec4 proj = u_viewprojection * vec4(p,1.0);
 			proj.xy /= proj.w; 
@@ -913,47 +1293,169 @@ void main()
 		
 			float pdepth = texture( u_depth_texture, proj.xy ).x;
 		
-			if( pdepth > proj.z ) 
+			//the ones hidden by something much closer do not count, to avoid the halos
+			if( pdepth > proj.z || linearDepth(proj.z) - linearDepth(pdepth) > u_radius ) 
 				outside++; 
-
 		}
 
 		ao = float(outside) / float(NUM_POINTS);
+	}
 
-		final_ao = vec3(ao); // * normal_map
+	FragColor = vec4(vec3(ao), 1.0);
+}
+
+\ssao_downsample.fs
+
+#version 330 core
+
+uniform sampler2D u_depth_texture;
+uniform sampler2D u_normal_texture;
+
+out vec4 FragColor;
+
+void main()
+{
+	//one of the 2x2 pixels under this one, the closest or the farthest in a checkerboard to keep both sides of the edges
+	ivec2 coord = ivec2(gl_FragCoord.xy) * 2;
+	ivec2 max_coord = textureSize(u_depth_texture, 0) - ivec2(1);
+	bool farthest = ((int(gl_FragCoord.x) + int(gl_FragCoord.y)) & 1) == 1;
+
+	ivec2 best = min(coord, max_coord);
+	float best_depth = texelFetch(u_depth_texture, best, 0).x;
+	for(int i = 1; i < 4; ++i)
+	{
+		ivec2 c = min(coord + ivec2(i & 1, i >> 1), max_coord);
+		float depth = texelFetch(u_depth_texture, c, 0).x;
+		if( farthest ? depth > best_depth : depth < best_depth )
+		{
+			best = c;
+			best_depth = depth;
+		}
 	}
 
-	FragColor = vec4(final_ao, 1.0);
-	
+	FragColor = texelFetch(u_normal_texture, best, 0); //still packed, the ssao decodes it
+	gl_FragDepth = best_depth;
 }
 
+\ssao_temporal.fs
 
+#version 330 core
+
+uniform sampler2D u_ao_texture;
+uniform sampler2D u_history_texture;
+uniform sampler2D u_depth_texture;
+
+uniform mat4 u_ivp;
+uniform mat4 u_prev_viewprojection;
+uniform vec2 u_iRes;
+uniform float u_history_weight;
+
+out vec4 FragColor;
 
+void main()
+{
+	vec2 uv = gl_FragCoord.xy * u_iRes.xy;
+	float ao = texture(u_ao_texture, uv).x;
+	float depth = texture(u_depth_texture, uv).x;
 
+	//the history out of the range of the neighbours belongs to another surface
+	float min_ao = ao;
+	float max_ao = ao;
+	for(int y = -1; y <= 1; ++y)
+		for(int x = -1; x <= 1; ++x)
+		{
+			float neighbour = texture(u_ao_texture, uv + vec2(x, y) * u_iRes).x;
+			min_ao = min(min_ao, neighbour);
+			max_ao = max(max_ao, neighbour);
+		}
 
+	//where this pixel was in the previous frame
+	vec4 world_proj = u_ivp * vec4(uv * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+	vec4 prev_proj = u_prev_viewprojection * vec4(world_proj.xyz / world_proj.w, 1.0);
+	vec2 prev_uv = prev_proj.xy / prev_proj.w * 0.5 + vec2(0.5);
 
+	float weight = u_history_weight;
+	if( depth == 1.0 || prev_proj.w <= 0.0 || any(lessThan(prev_uv, vec2(0.0))) || any(greaterThan(prev_uv, vec2(1.0))) )
+		weight = 0.0;
 
+	float history = clamp(texture(u_history_texture, prev_uv).x, min_ao, max_ao);
+	FragColor = vec4(vec3(mix(ao, history, weight)), 1.0);
+}
 
-\spherical_probe.fs
+\ssao_upsample.fs
 
 #version 330 core
 
-in vec3 v_world_position;
-in vec3 v_normal;
+uniform sampler2D u_ao_texture;
+uniform sampler2D u_half_depth_texture;
+uniform sampler2D u_depth_texture;
 
-uniform vec3 u_coeffs[9];
+uniform vec2 u_iRes;
+uniform vec2 u_camera_nearfar;
 
-const float Pi = 3.141592654;
-const float CosineA0 = Pi;
-const float CosineA1 = (2.0 * Pi) / 3.0;
-const float CosineA2 = Pi * 0.25;
-struct SH9 { float c[9]; }; //to store weights
-struct SH9Color { vec3 c[9]; }; //to store colors
+out vec4 FragColor;
 
-void SHCosineLobe(in vec3 dir, out SH9 sh) //SH9
+float linearDepth(float depth)
 {
-	// Band 0
-	sh.c[0] = 0.282095 * CosineA0;
+	float z = depth * 2.0 - 1.0;
+	return 2.0 * u_camera_nearfar.x * u_camera_nearfar.y / (u_camera_nearfar.y + u_camera_nearfar.x - z * (u_camera_nearfar.y - u_camera_nearfar.x));
+}
+
+void main()
+{
+	vec2 uv = gl_FragCoord.xy * u_iRes.xy;
+	float depth = texture(u_depth_texture, uv).x;
+	if(depth == 1.0)
+	{
+		FragColor = vec4(1.0);
+		return;
+	}
+	float z = linearDepth(depth);
+
+	//4x4 half resolution texels around, weighted by distance and by how close is their depth
+	vec2 half_size = vec2(textureSize(u_ao_texture, 0));
+	vec2 half_coord = uv * half_size - vec2(0.5);
+	vec2 base = floor(half_coord);
+
+	float ao = 0.0;
+	float total = 0.0;
+	for(int y = -1; y <= 2; ++y)
+		for(int x = -1; x <= 2; ++x)
+		{
+			vec2 coord = base + vec2(x, y);
+			vec2 sample_uv = (coord + vec2(0.5)) / half_size;
+			float sample_z = linearDepth(texture(u_half_depth_texture, sample_uv).x);
+			vec2 dist = coord - half_coord;
+			float weight = exp(-0.5 * dot(dist, dist)) * exp(-20.0 * abs(sample_z - z) / z);
+			ao += texture(u_ao_texture, sample_uv).x * weight;
+			total += weight;
+		}
+
+	ao = total > 0.0001 ? ao / total : texture(u_ao_texture, uv).x;
+	FragColor = vec4(vec3(ao), 1.0);
+}
+
+
+\spherical_probe.fs
+
+#version 330 core
+
+in vec3 v_world_position;
+in vec3 v_normal;
+
+uniform vec3 u_coeffs[9];
+
+const float Pi = 3.141592654;
+const float CosineA0 = Pi;
+const float CosineA1 = (2.0 * Pi) / 3.0;
+const float CosineA2 = Pi * 0.25;
+struct SH9 { float c[9]; }; //to store weights
+struct SH9Color { vec3 c[9]; }; //to store colors
+
+void SHCosineLobe(in vec3 dir, out SH9 sh) //SH9
+{
+	// Band 0
+	sh.c[0] = 0.282095 * CosineA0;
 	// Band 1
 	sh.c[1] = 0.488603 * dir.y * CosineA1; 
 	sh.c[2] = 0.488603 * dir.z * CosineA1;
@@ -1026,6 +1528,92 @@ void main()
 
 
 
+\prefilter.fs
+
+#version 330 core
+
+in vec2 v_uv;
+
+uniform samplerCube u_texture;
+uniform int u_face;
+uniform float u_roughness;
+uniform int u_num_samples;
+uniform float u_source_size;
+uniform float u_source_levels;
+
+out vec4 FragColor;
+
+#define PI 3.14159265359
+
+//direction of the texel of the face, with the GL cubemap conventions
+vec3 faceDirection(int face, vec2 uv)
+{
+	vec2 p = uv * 2.0 - vec2(1.0);
+	if (face == 0) return vec3(1.0, -p.y, -p.x);
+	if (face == 1) return vec3(-1.0, -p.y, p.x);
+	if (face == 2) return vec3(p.x, 1.0, p.y);
+	if (face == 3) return vec3(p.x, -1.0, -p.y);
+	if (face == 4) return vec3(p.x, -p.y, 1.0);
+	return vec3(-p.x, -p.y, -1.0);
+}
+
+float radicalInverse(uint bits)
+{
+	bits = (bits << 16u) | (bits >> 16u);
+	bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+	bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+	bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+	bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+	return float(bits) * 2.3283064365386963e-10;
+}
+
+void main()
+{
+	vec3 N = normalize(faceDirection(u_face, v_uv));
+	if (u_roughness == 0.0)
+	{
+		FragColor = vec4(textureLod(u_texture, N, 0.0).rgb, 1.0);
+		return;
+	}
+
+	//V = N, the lobe doesnt stretch at grazing angles but it is the usual approximation
+	vec3 up = abs(N.z) < 0.999 ? vec3(0.0, 0.0, 1.0) : vec3(1.0, 0.0, 0.0);
+	vec3 T = normalize(cross(up, N));
+	vec3 B = cross(N, T);
+
+	float a = u_roughness * u_roughness;
+	float texel_solid_angle = 4.0 * PI / (6.0 * u_source_size * u_source_size);
+	vec3 color = vec3(0.0);
+	float total = 0.0;
+	for (int i = 0; i < u_num_samples; ++i)
+	{
+		//GGX importance sampling of the half vector
+		float phi = 2.0 * PI * float(i) / float(u_num_samples);
+		float xi = radicalInverse(uint(i));
+		float cos_theta = sqrt((1.0 - xi) / (1.0 + (a * a - 1.0) * xi));
+		float sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+		vec3 H = T * (sin_theta * cos(phi)) + B * (sin_theta * sin(phi)) + N * cos_theta;
+		vec3 L = 2.0 * dot(N, H) * H - N;
+		float NoL = dot(N, L);
+		if (NoL <= 0.0)
+			continue;
+
+		//read from the mip that covers the solid angle of the sample, so few samples are enough
+		float f = cos_theta * cos_theta * (a * a - 1.0) + 1.0;
+		float pdf = a * a / (PI * f * f) / 4.0; //D * NoH / (4 * VoH) with V = N
+		float sample_solid_angle = 1.0 / (float(u_num_samples) * pdf + 0.0001);
+		float lod = clamp(0.5 * log2(sample_solid_angle / texel_solid_angle) + 1.0, 0.0, u_source_levels - 1.0);
+
+		color += textureLod(u_texture, L, lod).rgb * NoL;
+		total += NoL;
+	}
+
+	FragColor = vec4(color / max(total, 0.0001), 1.0);
+}
+
+
+
+
 \irradiance.fs
 
 #version 330 core
@@ -1033,10 +1621,9 @@ void main()
 uniform sampler2D u_albedo_texture;
 uniform sampler2D u_normal_texture;
 uniform sampler2D u_depth_texture;
-uniform sampler2D u_probes_texture;
+uniform sampler3D u_probes_volumes[7]; //27 floats of the SH, 4 per volume
 
 uniform float u_irr_normal_distance;
-uniform int u_num_probes;
 uniform float u_irr_multiplier;
 
 uniform mat4 u_ivp;
@@ -1046,6 +1633,8 @@ uniform vec3 u_irr_end;
 uniform vec3 u_irr_dims;
 uniform vec3 u_irr_delta;
 
+#include "gbuffer"
+
 const float Pi = 3.141592654;
 const float CosineA0 = Pi;
 const float CosineA1 = (2.0 * Pi) / 3.0;
@@ -1096,38 +1685,39 @@ void main()
 	vec4 world_pos_proj = u_ivp * screen_pos;
 	vec3 world_pos = world_pos_proj.xyz / world_pos_proj.w;
 
-	vec3 normal_map = texture(u_normal_texture, uv).rgb;
-	normal_map = normalize(normal_map * 2.0 - vec3(1.0));
+	vec3 normal_map = decodeNormal(texture(u_normal_texture, uv).rg);
 
 
 
-	//computing nearest probe index based on world position
+	//computing the position in the grid based on world position
 	vec3 irr_range = u_irr_end - u_irr_start;
 	vec3 irr_local_pos = clamp( world_pos - u_irr_start + normal_map * u_irr_normal_distance, vec3(0.0), irr_range );
 	
 	//convert from world pos to grid pos
 	vec3 irr_norm_pos = irr_local_pos / u_irr_delta;
 	
-	//round values as we cannot fetch between rows for now
-	vec3 local_indices = round( irr_norm_pos );
-	
-	//compute in which row is the probe stored
-	float row = local_indices.x + local_indices.y * u_irr_dims.x + local_indices.z * u_irr_dims.x * u_irr_dims.y;
-	
-	//find the UV.y coord of that row in the probes texture
-	float row_uv = (row + 1.0) / (u_num_probes + 1.0);
-
-
-
+	//every probe is the center of a texel, the filtering interpolates the 8 around
+	vec3 coords = (irr_norm_pos + vec3(0.5)) / u_irr_dims;
+
+	vec4 t0 = texture( u_probes_volumes[0], coords );
+	vec4 t1 = texture( u_probes_volumes[1], coords );
+	vec4 t2 = texture( u_probes_volumes[2], coords );
+	vec4 t3 = texture( u_probes_volumes[3], coords );
+	vec4 t4 = texture( u_probes_volumes[4], coords );
+	vec4 t5 = texture( u_probes_volumes[5], coords );
+	vec4 t6 = texture( u_probes_volumes[6], coords );
+
+	//unpack the coefficients
 	SH9Color sh;
-	
-	//fill the coefficients
-	const float d_uvx = 1.0 / 9.0;
-	for(int i = 0; i < 9; ++i)
-	{
-		vec2 coeffs_uv = vec2( (float(i)+0.5) * d_uvx, row_uv );
-		sh.c[i] = texture( u_probes_texture, coeffs_uv).xyz;
-	}
+	sh.c[0] = t0.xyz;
+	sh.c[1] = vec3( t0.w, t1.xy );
+	sh.c[2] = vec3( t1.zw, t2.x );
+	sh.c[3] = t2.yzw;
+	sh.c[4] = t3.xyz;
+	sh.c[5] = vec3( t3.w, t4.xy );
+	sh.c[6] = vec3( t4.zw, t5.x );
+	sh.c[7] = t5.yzw;
+	sh.c[8] = t6.xyz;
 	
 	vec3 irradiance = max(vec3(0.0), ComputeSHIrradiance( normal_map, sh ) * u_irr_multiplier);
 	irradiance *= albedo.xyz;
@@ -1140,107 +1730,166 @@ void main()
 
 
 
-\volumetric.fs
+\froxel_inject.fs
 
 #version 330 core
 
-uniform sampler2D u_depth_texture;
-
-uniform mat4 u_viewprojection;
-uniform mat4 u_ivp;
-uniform vec2 u_iRes;
-uniform vec3 u_camera_position;
-uniform float u_air_density;
-
-uniform float u_rand;
-uniform float u_time;
+in vec2 v_uv;
+flat in int v_layer;
 
-#define SAMPLES 64
+uniform float u_froxel_slices;
+uniform float u_jitter;
+uniform float u_density; //only in the first pass, the lights just add their light
 
+#include "froxel"
 #include "lights"
 
 layout(location = 0) out vec4 FragColor;
 
-float rand(vec2 co)
+void main()
 {
-    return fract(sin(dot(co, vec2(12.9898, 78.233))) * 43758.5453123);
+	//another depth inside the froxel every frame, the temporal filter averages them
+	vec3 pos = froxelPosition(v_uv, froxelDepth((float(v_layer) + u_jitter) / u_froxel_slices));
+
+	vec3 light = vec3(0.0);
+	if (int(u_light_info.x) == DIRECTIONAL_LIGHT)
+	{
+		light = u_light_color;		
+	}
+	else if (int(u_light_info.x) == POINT_LIGHT || int(u_light_info.x) == SPOT_LIGHT)
+	{
+		vec3 L = u_light_position - pos;
+		float dist = length(L);
+		L /= dist; //to normalize L
+	
+		float attenuation = max(0.0, (u_light_info.z - dist) / u_light_info.z);
+	
+		if (int(u_light_info.x) == SPOT_LIGHT)
+		{
+			float cos_angle = dot(u_light_front, L);
+			if (cos_angle < u_light_cone.y) attenuation = 0.0;
+			else if (cos_angle < u_light_cone.x) attenuation *= 1.0 - (cos_angle - u_light_cone.x) / (u_light_cone.y - u_light_cone.x);
+		}
+		light = u_light_color * attenuation;
+	}
+
+	if (u_shadow_param.x != 0.0 && int(u_light_info.x) != NO_LIGHT) light *= testShadow(pos);
+
+	//light scattered by the air and how much it absorbs
+	FragColor = vec4(u_ambient_light + light, u_density);
 }
 
+\froxel_temporal.fs
+
+#version 330 core
+
+in vec2 v_uv;
+flat in int v_layer;
+
+uniform sampler3D u_scattering_texture;
+uniform sampler3D u_history_texture;
+
+uniform mat4 u_prev_viewprojection;
+uniform float u_froxel_slices;
+uniform float u_history_weight;
+
+#include "froxel"
+
+layout(location = 0) out vec4 FragColor;
+
 void main()
 {
-	vec2 uv = gl_FragCoord.xy * u_iRes.xy;
-		
-	float depth = texture(u_depth_texture, uv).r;
+	vec3 coord = vec3(v_uv, (float(v_layer) + 0.5) / u_froxel_slices);
+	vec4 current = texture(u_scattering_texture, coord);
 
-	// if(depth < 1.0)	//skip skybox pixels
-	
-	vec4 screen_coord = vec4(uv.x * 2.0 - 1.0, uv.y * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
-	vec4 world_proj = u_ivp * screen_coord;
-	vec3 world_pos = world_proj.xyz / world_proj.w;
+	//where was this froxel in the previous frame, w is the view depth
+	vec3 pos = froxelPosition(v_uv, froxelDepth(coord.z));
+	vec4 prev_proj = u_prev_viewprojection * vec4(pos, 1.0);
+	vec3 prev_coord = vec3(prev_proj.xy / prev_proj.w * 0.5 + vec2(0.5), froxelSlice(prev_proj.w));
 
-	vec3 ray_start = u_camera_position;
-	vec3 ray_direction = world_pos - ray_start;
-	float ray_lenght = length(ray_direction);
+	float weight = u_history_weight;
+	if (prev_proj.w <= 0.0 || any(lessThan(prev_coord, vec3(0.0))) || any(greaterThan(prev_coord, vec3(1.0))))
+		weight = 0.0;
 
-	ray_direction /= ray_lenght;
-	ray_direction = normalize(ray_direction);
-	ray_lenght = min(500.0, ray_lenght);
-	float step_dist = ray_lenght / float(SAMPLES);
+	FragColor = mix(current, texture(u_history_texture, prev_coord), weight);
+}
+
+\froxel_integrate.fs
 
-	ray_start += ray_direction * rand(uv + vec2(u_rand, u_time)) * step_dist;
+#version 330 core
 
-	vec3 current_pos = ray_start;
-	vec3 ray_offset = ray_direction * step_dist;
+in vec2 v_uv;
+flat in int v_layer;
 
-	vec3 volumetric = vec3(0.0);
-	float transparency = 1.0;
-	float air_step = u_air_density * step_dist / 10;
+uniform sampler3D u_scattering_texture;
+uniform float u_froxel_slices;
 
-	for (int i = 0; i < SAMPLES; i++)
+#include "froxel"
+
+layout(location = 0) out vec4 FragColor;
+
+void main()
+{
+	//front to back from the camera to the far side of this slice
+	vec3 light = vec3(0.0);
+	float transmittance = 1.0;
+	float start = froxelDepth(0.0);
+	for (int i = 0; i <= v_layer; ++i)
 	{
-		vec3 v = vec3(1.0);
-		vec3 light = vec3(0.0);
-		float shadow_factor = 1.0;
-		if (u_shadow_param.x != 0.0) shadow_factor = testShadow(current_pos);
-		
-		if (int(u_light_info.x) == DIRECTIONAL_LIGHT)
-		{
-			light += u_light_color;		
-		}
-		else if (int(u_light_info.x) == POINT_LIGHT || int(u_light_info.x) == SPOT_LIGHT)
-		{
-			vec3 L = u_light_position - current_pos;
-			float dist = length(L);
-			L /= dist; //to normalize L
-		
-			float attenuation = max(0.0, (u_light_info.z - dist) / u_light_info.z);
-		
-			if (int(u_light_info.x) == SPOT_LIGHT)
-			{
-				float cos_angle = dot(u_light_front, L);
-				if (cos_angle < u_light_cone.y) attenuation = 0.0;
-				else if (cos_angle < u_light_cone.x) attenuation *= 1.0 - (cos_angle - u_light_cone.x) / (u_light_cone.y - u_light_cone.x);
-			}
-			light = u_light_color * attenuation;
-		}
+		float end = froxelDepth(float(i + 1) / u_froxel_slices);
+		vec4 scattering = texture(u_scattering_texture, vec3(v_uv, (float(i) + 0.5) / u_froxel_slices));
+		float extinction = exp(-scattering.a * (end - start));
+		light += transmittance * scattering.rgb * (1.0 - extinction);
+		transmittance *= extinction;
+		start = end;
+	}
 
-		light *= shadow_factor;
+	FragColor = vec4(light, transmittance);
+}
 
-		volumetric += (u_ambient_light + light) * transparency * air_step;
+\froxel.vs
 
-		current_pos.xyz += ray_offset;
+#version 330 core
 
-		transparency -= air_step;
-		if (transparency < 0.001) break;
-	}
+in vec3 a_vertex;
+in vec2 a_coord;
 
-	FragColor = vec4(volumetric, 1.0 - clamp(transparency, 0.0, 1.0)); 
-	
+out vec2 gs_uv;
+flat out int gs_layer;
+
+void main()
+{	
+	//every instance of the quad is one slice of the volume
+	gs_uv = a_coord;
+	gs_layer = gl_InstanceID;
+	gl_Position = vec4( a_vertex, 1.0 );
 }
 
+\froxel.gs
 
+#version 330 core
 
+layout(triangles) in;
+layout(triangle_strip, max_vertices = 3) out;
 
+in vec2 gs_uv[];
+flat in int gs_layer[];
+
+out vec2 v_uv;
+flat out int v_layer;
+
+void main()
+{
+	for (int i = 0; i < 3; ++i)
+	{
+		gl_Layer = gs_layer[0];
+		gl_Position = gl_in[i].gl_Position;
+		v_uv = gs_uv[i];
+		v_layer = gs_layer[0];
+		EmitVertex();
+	}
+	EndPrimitive();
+}
 
 
 \decals.fs
@@ -1254,9 +1903,7 @@ uniform mat4 u_imodel;
 uniform sampler2D u_depth_texture;
 uniform sampler2D u_color_texture;
 
-layout(location = 0) out vec4 FragColor;
-layout(location = 1) out vec4 NormalColor;
-layout(location = 2) out vec4 ExtraColor; //for now only emissive
+layout(location = 0) out vec4 FragColor; //only the albedo, the occlusion is kept
 
 void main()
 {	
@@ -1278,8 +1925,6 @@ void main()
 	vec4 color = texture(u_color_texture, decal_uv);
 
 	FragColor = color;
-	ExtraColor = vec4(0.0);
-	NormalColor = vec4(0.0);
 }
 
 
@@ -1378,6 +2023,76 @@ void main()
 
 
 
+\layered.vs
+
+#version 330 core
+
+in vec3 a_vertex;
+in vec3 a_normal;
+in vec2 a_coord;
+in vec4 a_color;
+
+uniform mat4 u_model;
+uniform mat4 u_layer_viewprojection[6]; //one per face of the cubemap
+
+//the same than basic.vs, layered.gs passes them to the pixel shader
+out vec3 gs_position;
+out vec3 gs_world_position;
+out vec3 gs_normal;
+out vec2 gs_uv;
+out vec4 gs_color;
+flat out int gs_layer;
+
+void main()
+{
+	gs_normal = (u_model * vec4( a_normal, 0.0) ).xyz;
+	gs_position = a_vertex;
+	gs_world_position = (u_model * vec4( a_vertex, 1.0) ).xyz;
+	gs_color = a_color;
+	gs_uv = a_coord;
+
+	//every instance is one face
+	gs_layer = gl_InstanceID;
+	gl_Position = u_layer_viewprojection[gl_InstanceID] * vec4( gs_world_position, 1.0 );
+}
+
+\layered.gs
+
+#version 330 core
+
+layout(triangles) in;
+layout(triangle_strip, max_vertices = 3) out;
+
+in vec3 gs_position[];
+in vec3 gs_world_position[];
+in vec3 gs_normal[];
+in vec2 gs_uv[];
+in vec4 gs_color[];
+flat in int gs_layer[];
+
+out vec3 v_position;
+out vec3 v_world_position;
+out vec3 v_normal;
+out vec2 v_uv;
+out vec4 v_color;
+
+void main()
+{
+	//the triangle goes to the face of its instance
+	for (int i = 0; i < 3; ++i)
+	{
+		gl_Layer = gs_layer[0];
+		gl_Position = gl_in[i].gl_Position;
+		v_position = gs_position[i];
+		v_world_position = gs_world_position[i];
+		v_normal = gs_normal[i];
+		v_uv = gs_uv[i];
+		v_color = gs_color[i];
+		EmitVertex();
+	}
+	EndPrimitive();
+}
+
 \instanced.vs
 
 #version 330 core
@@ -1425,6 +2140,203 @@ void main()
 
 
 
+\indirect.vs
+
+#version 430 core
+
+//must match sGPUInstance in gpu_culling.h
+struct sInstance {
+	mat4 model;
+	mat4 prev_model;
+	vec4 center;
+	vec4 halfsize;
+	uint mesh_index;
+	uint command_index;
+	uint padding0;
+	uint padding1;
+};
+
+layout(std430, binding = 0) readonly buffer Instances { sInstance u_instances[]; };
+
+in vec3 a_vertex;
+in vec3 a_normal;
+in vec2 a_coord;
+in uint a_instance_id; //comes from the base instance of the indirect command
+
+uniform vec3 u_camera_pos;
+uniform mat4 u_viewprojection;
+uniform mat4 u_unjittered_viewprojection;
+uniform mat4 u_prev_viewprojection;
+
+out vec3 v_position;
+out vec3 v_world_position;
+out vec3 v_normal;
+out vec2 v_uv;
+out vec4 v_color;
+out vec4 v_clip_pos;
+out vec4 v_prev_clip_pos;
+
+void main()
+{
+	mat4 model = u_instances[a_instance_id].model;
+
+	v_normal = (model * vec4( a_normal, 0.0) ).xyz;
+	v_position = a_vertex;
+	v_world_position = (model * vec4( v_position, 1.0) ).xyz;
+	v_color = vec4(1.0);
+	v_uv = a_coord;
+
+	//the prev_model is the model of the previous frame, so moving instances get their own velocity
+	vec3 prev_world_position = (u_instances[a_instance_id].prev_model * vec4( v_position, 1.0) ).xyz;
+	v_clip_pos = u_unjittered_viewprojection * vec4( v_world_position, 1.0 );
+	v_prev_clip_pos = u_prev_viewprojection * vec4( prev_world_position, 1.0 );
+
+	gl_Position = u_viewprojection * vec4( v_world_position, 1.0 );
+}
+
+\cull.cs
+
+#version 430 core
+
+layout(local_size_x = 64) in;
+
+//must match sGPUInstance in gpu_culling.h
+struct sInstance {
+	mat4 model;
+	mat4 prev_model;
+	vec4 center;
+	vec4 halfsize;
+	uint mesh_index;
+	uint command_index;
+	uint padding0;
+	uint padding1;
+};
+
+//must match sDrawElementsIndirectCommand in gpu_culling.h
+struct sCommand {
+	uint count;
+	uint instance_count;
+	uint first_index;
+	int base_vertex;
+	uint base_instance;
+};
+
+layout(std430, binding = 0) readonly buffer Instances { sInstance u_instances[]; };
+layout(std430, binding = 1) buffer Commands { sCommand u_commands[]; };
+
+uniform int u_num_instances;
+uniform vec4 u_frustum[6];
+
+uniform int u_use_hiz;
+uniform sampler2D u_hiz_texture;
+uniform mat4 u_hiz_viewprojection;
+uniform vec2 u_hiz_size;
+uniform int u_hiz_levels;
+
+bool insideFrustum(vec3 center, vec3 halfsize)
+{
+	for(int i = 0; i < 6; ++i)
+	{
+		vec4 plane = u_frustum[i];
+		float dist = dot(plane.xyz, center) + plane.w;
+		float radius = dot(abs(plane.xyz), halfsize);
+		if(dist <= -radius)
+			return false;
+	}
+	return true;
+}
+
+//test the screen rect of the box against the farthest depth stored in the pyramid
+bool occludedHiZ(vec3 center, vec3 halfsize)
+{
+	vec2 min_uv = vec2(1.0);
+	vec2 max_uv = vec2(0.0);
+	float min_depth = 1.0;
+
+	for(int i = 0; i < 8; ++i)
+	{
+		vec3 corner = center + halfsize * vec3((i & 1) != 0 ? 1.0 : -1.0, (i & 2) != 0 ? 1.0 : -1.0, (i & 4) != 0 ? 1.0 : -1.0);
+		vec4 clip = u_hiz_viewprojection * vec4(corner, 1.0);
+		if(clip.w <= 0.0)
+			return false; //crosses the camera plane, cannot be tested
+		vec3 ndc = clip.xyz / clip.w;
+		min_uv = min(min_uv, ndc.xy * 0.5 + 0.5);
+		max_uv = max(max_uv, ndc.xy * 0.5 + 0.5);
+		min_depth = min(min_depth, ndc.z * 0.5 + 0.5);
+	}
+
+	min_uv = clamp(min_uv, vec2(0.0), vec2(1.0));
+	max_uv = clamp(max_uv, vec2(0.0), vec2(1.0));
+
+	//choose the level where the rect covers at most 2x2 texels
+	vec2 size = (max_uv - min_uv) * u_hiz_size;
+	float level = ceil(log2(max(max(size.x, size.y), 1.0)));
+	level = clamp(level, 0.0, float(u_hiz_levels - 1));
+
+	float far_depth = textureLod(u_hiz_texture, min_uv, level).x;
+	far_depth = max(far_depth, textureLod(u_hiz_texture, vec2(max_uv.x, min_uv.y), level).x);
+	far_depth = max(far_depth, textureLod(u_hiz_texture, vec2(min_uv.x, max_uv.y), level).x);
+	far_depth = max(far_depth, textureLod(u_hiz_texture, max_uv, level).x);
+
+	return min_depth > far_depth;
+}
+
+void main()
+{
+	uint id = gl_GlobalInvocationID.x;
+	if(id >= uint(u_num_instances))
+		return;
+
+	vec3 center = u_instances[id].center.xyz;
+	vec3 halfsize = u_instances[id].halfsize.xyz;
+
+	bool visible = insideFrustum(center, halfsize);
+	if(visible && u_use_hiz == 1)
+		visible = !occludedHiZ(center, halfsize);
+
+	u_commands[u_instances[id].command_index].instance_count = visible ? 1u : 0u;
+}
+
+\hiz.cs
+
+#version 430 core
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+layout(r32f, binding = 0) writeonly uniform image2D u_output;
+layout(r32f, binding = 1) readonly uniform image2D u_input;
+uniform sampler2D u_depth_texture; //only used to fill the first level
+
+uniform int u_from_depth;
+uniform ivec2 u_input_size;
+uniform ivec2 u_output_size;
+
+float readDepth(ivec2 coord)
+{
+	if(u_from_depth == 1)
+		return texelFetch(u_depth_texture, coord, 0).x;
+	return imageLoad(u_input, coord).x;
+}
+
+void main()
+{
+	ivec2 coord = ivec2(gl_GlobalInvocationID.xy);
+	if(coord.x >= u_output_size.x || coord.y >= u_output_size.y)
+		return;
+
+	//conservative, keep the farthest depth of all the texels covered by this one
+	ivec2 start = (coord * u_input_size) / u_output_size;
+	ivec2 end = ((coord + 1) * u_input_size + u_output_size - 1) / u_output_size;
+	end = min(max(end, start + 1), u_input_size);
+
+	float depth = 0.0;
+	for(int y = start.y; y < end.y; ++y)
+		for(int x = start.x; x < end.x; ++x)
+			depth = max(depth, readDepth(ivec2(x, y)));
+
+	imageStore(u_output, coord, vec4(depth));
+}
+
 \normal
 
 mat3 cotangent_frame(vec3 N, vec3 p, vec2 uv)
@@ -1446,6 +2358,60 @@ mat3 cotangent_frame(vec3 N, vec3 p, vec2 uv)
 	return mat3( T * invmax, B * invmax, N );
 }
 
+//only xy is used, z is rebuilt so cooked BC5 normal maps (which have no blue channel) work too
+//materials without normal map get a flat (0.5,0.5,1) texture so this returns (0,0,1)
+vec3 sampleNormalMap(sampler2D tex, vec2 uv)
+{
+	vec2 xy = texture(tex, uv).xy * 2.0 - 1.0;
+	return vec3(xy, sqrt(clamp(1.0 - dot(xy, xy), 0.0, 1.0)));
+}
+
+\gbuffer
+
+//layout of the gbuffer, see Renderer::createRenderTargets
+//0: RGBA8 albedo, occlusion
+//1: RGB10A2 octahedral normal, roughness
+//2: RG8 metallic, material id
+//3: RG16F velocity
+//the emissive is written in the illumination buffer by the geometry pass
+
+//only one shading model for now, the id is reserved for others (skin, foliage...)
+#define MATERIAL_STANDARD 0.0
+
+vec2 octWrap(vec2 v)
+{
+	return (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+//unit vector to the octahedron unfolded in [0..1], the error is uniform in all directions
+vec2 encodeNormal(vec3 n)
+{
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	n.xy = n.z >= 0.0 ? n.xy : octWrap(n.xy);
+	return n.xy * 0.5 + vec2(0.5);
+}
+
+vec3 decodeNormal(vec2 f)
+{
+	f = f * 2.0 - vec2(1.0);
+	vec3 n = vec3(f.x, f.y, 1.0 - abs(f.x) - abs(f.y));
+	float t = clamp(-n.z, 0.0, 1.0);
+	n.x += n.x >= 0.0 ? -t : t;
+	n.y += n.y >= 0.0 ? -t : t;
+	return normalize(n);
+}
+
+\lights_batch
+
+//must match MAX_BATCHED_LIGHTS in renderer.h
+#define MAX_BATCHED_LIGHTS 32
+
+//point and spot lights without shadows, one per instance
+uniform vec4 u_lights_position[MAX_BATCHED_LIGHTS]; //xyz position, w max_distance
+uniform vec4 u_lights_color[MAX_BATCHED_LIGHTS]; //rgb color * intensity, w light_type
+uniform vec4 u_lights_front[MAX_BATCHED_LIGHTS];
+uniform vec4 u_lights_cone[MAX_BATCHED_LIGHTS]; //cos(min_angle), cos(max_angle)
+
 
 
 
@@ -1543,6 +2509,33 @@ vec3 specular_phong_pbr(vec3 N, vec3 L, vec3 V, vec3 WP, float ks, vec3 alpha, v
 
 
 
+\froxel
+
+//froxels are the voxels of a grid aligned with the frustum of the camera
+//the slices are distributed exponentially, with more resolution close to the camera
+uniform vec2 u_froxel_range; //view depth of the first and the last slice
+uniform vec2 u_camera_nearfar;
+uniform vec3 u_camera_position;
+uniform mat4 u_ivp;
+
+//slice from 0 to 1
+float froxelDepth(float slice)
+{
+	return u_froxel_range.x * pow(u_froxel_range.y / u_froxel_range.x, slice);
+}
+
+float froxelSlice(float depth)
+{
+	return log(max(depth, u_froxel_range.x) / u_froxel_range.x) / log(u_froxel_range.y / u_froxel_range.x);
+}
+
+vec3 froxelPosition(vec2 uv, float depth)
+{
+	vec4 far_proj = u_ivp * vec4(uv * 2.0 - 1.0, 1.0, 1.0);
+	vec3 far_pos = far_proj.xyz / far_proj.w;
+	return u_camera_position + (far_pos - u_camera_position) * (depth / u_camera_nearfar.y);
+}
+
 \lights
 
 //light_type
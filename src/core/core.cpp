@@ -6,6 +6,8 @@
 
 #include "../gfx/gfx.h" //check errors
 #include "../gfx/texture.h" //??
+#include "../gfx/uploadring.h"
+#include "../gfx/texturestreamer.h"
 #include "../utils/utils.h" //cleanPath
 
 #ifdef WIN32
@@ -47,7 +49,7 @@ void CORE::init()
 	//prepare SDL
 	SDL_Init(SDL_INIT_EVERYTHING);
 	Input::init();
-	TaskManager::background.startThread();
+	TaskManager::background.startThread(0); //images are decoded in parallel
 }
 
 //create a window using SDL
@@ -260,8 +262,12 @@ void CORE::mainLoop(CORE::Window* window, BaseApplication* app)
 		//update app logic
 		app->update(elapsed_time);
 
-		//execute a task in the main task manager (blocking)
-		TaskManager::foreground.fetchTask();
+		//execute tasks in the main task manager (blocking), with a budget so many small tasks dont take many frames
+		TaskManager::foreground.fetchTasks(2.0f);
+
+		//stream the textures loaded in the background
+		GFX::TextureUploadRing::global.update();
+		GFX::TextureStreamer::global.update();
 
 		//check errors in opengl only when working in debug
 #ifdef _DEBUG
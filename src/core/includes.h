@@ -22,8 +22,11 @@
 	#pragma comment(lib, "glew32s.lib")
 #endif
 
-#define OPENGL_VERSION_MAJOR 3
-#define OPENGL_VERSION_MINOR 1
+//build with -DOPENGL_VERSION_MAJOR=4 -DOPENGL_VERSION_MINOR=5 to use the GPU driven path (mesa llvmpipe supports it)
+#ifndef OPENGL_VERSION_MAJOR
+	#define OPENGL_VERSION_MAJOR 3
+	#define OPENGL_VERSION_MINOR 1
+#endif
 
 //SDL
 //#pragma comment(lib, "SDL2.lib")
@@ -3,14 +3,15 @@
 #include <thread>         // std::thread
 #include <chrono>		  //ms
 #include <cassert>
+#include <algorithm>
 
 TaskManager TaskManager::foreground;
 TaskManager TaskManager::background;
+WorkerPool WorkerPool::global;
 
 TaskManager::TaskManager()
 {
 	must_loop = false;
-	_thread = NULL;
 }
 
 void TaskManager::loop()
@@ -20,19 +21,14 @@ void TaskManager::loop()
 
 	while (must_loop)
 	{
-		if (pending_tasks.empty())
-		{
+		if (!fetchTask())
 			std::this_thread::sleep_for(10ms);
-			continue;
-		}
-
-		fetchTask();
 	}
 
 	std::cout << "Ending Task Manager" << std::endl;
 }
 
-void TaskManager::fetchTask()
+bool TaskManager::fetchTask()
 {
 	Task* task = NULL;
 	try
@@ -40,7 +36,7 @@ void TaskManager::fetchTask()
 		//lock
 		const std::lock_guard<std::mutex> lock(tasks_mutex);
 		if (pending_tasks.empty())
-			return;
+			return false;
 		task = pending_tasks.front();
 		pending_tasks.pop_front();
 		//unlock after finishing scope
@@ -55,6 +51,21 @@ void TaskManager::fetchTask()
 		delete task;
 		task = NULL;
 	}
+
+	//the task may have added others
+	const std::lock_guard<std::mutex> lock(tasks_mutex);
+	return !pending_tasks.empty();
+}
+
+void TaskManager::fetchTasks(float max_ms)
+{
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	//at least one, the queue is only checked under the lock
+	while (fetchTask())
+	{
+		if (std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count() >= max_ms)
+			break;
+	}
 }
 
 void thread_loop_func(TaskManager* manager)
@@ -63,11 +74,14 @@ void thread_loop_func(TaskManager* manager)
 	//join?
 }
 
-void TaskManager::startThread()
+void TaskManager::startThread(int num_threads)
 {
-	assert(!_thread && "TaskManager already in a thread");
+	assert(threads.empty() && "TaskManager already in a thread");
+	if (num_threads <= 0)
+		num_threads = std::max((int)std::thread::hardware_concurrency() / 2, 1);
 	must_loop = true;
-	_thread = new std::thread(thread_loop_func, this);
+	for (int i = 0; i < num_threads; ++i)
+		threads.push_back(new std::thread(thread_loop_func, this));
 }
 
 void TaskManager::addTask(Task* task)
@@ -76,4 +90,113 @@ void TaskManager::addTask(Task* task)
 	const std::lock_guard<std::mutex> lock(tasks_mutex);
 	pending_tasks.push_back(task);
 	//release pending_tasks automatically
-}
\ No newline at end of file
+}
+
+WorkerPool::WorkerPool()
+{
+	next_job = 0;
+	pending_jobs = 0;
+	num_jobs = 0;
+	active_workers = 0;
+	generation = 0;
+	must_loop = false;
+}
+
+WorkerPool::~WorkerPool()
+{
+	stopThreads();
+}
+
+void worker_loop_func(WorkerPool* pool)
+{
+	pool->loop();
+}
+
+void WorkerPool::startThreads(int num_threads)
+{
+	assert(!threads.size() && "WorkerPool already started");
+	if (num_threads <= 0)
+		num_threads = (int)std::thread::hardware_concurrency() - 1;
+	must_loop = true;
+	for (int i = 0; i < num_threads; ++i)
+		threads.push_back(new std::thread(worker_loop_func, this));
+}
+
+void WorkerPool::stopThreads()
+{
+	{
+		const std::lock_guard<std::mutex> lock(pool_mutex);
+		must_loop = false;
+	}
+	start_condition.notify_all();
+	for (auto thread : threads)
+	{
+		thread->join();
+		delete thread;
+	}
+	threads.clear();
+}
+
+void WorkerPool::loop()
+{
+	unsigned int last_generation = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(pool_mutex);
+			start_condition.wait(lock, [&] { return !must_loop || generation != last_generation; });
+			if (!must_loop)
+				return;
+			last_generation = generation;
+			active_workers++;
+		}
+
+		runJobs();
+
+		{
+			const std::lock_guard<std::mutex> lock(pool_mutex);
+			active_workers--;
+		}
+		done_condition.notify_all();
+	}
+}
+
+void WorkerPool::runJobs()
+{
+	while (true)
+	{
+		int job = next_job.fetch_add(1);
+		if (job >= num_jobs)
+			break;
+		job_func(job);
+		pending_jobs--;
+	}
+}
+
+void WorkerPool::parallelFor(int num, std::function<void(int)> func)
+{
+	if (num <= 0)
+		return;
+
+	if (!threads.size() && std::thread::hardware_concurrency() > 1)
+		startThreads();
+
+	{
+		//a worker woken late for the previous call can still be inside runJobs, it must leave before the reset
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		done_condition.wait(lock, [&] { return active_workers == 0; });
+		job_func = func;
+		num_jobs = num;
+		pending_jobs = num;
+		next_job = 0;
+		generation++;
+	}
+	start_condition.notify_all();
+
+	runJobs(); //the caller also works
+
+	//wait till all jobs are done and no worker is still inside runJobs
+	std::unique_lock<std::mutex> lock(pool_mutex);
+	done_condition.wait(lock, [&] { return pending_jobs == 0 && active_workers == 0; });
+	job_func = nullptr;
+}
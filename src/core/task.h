@@ -5,6 +5,8 @@
 #include <mutex>
 #include <thread>         // std::thread
 #include <functional>
+#include <atomic>
+#include <condition_variable>
 
 //any task executed in BG should inherit from this one
 class Task {
@@ -21,14 +23,45 @@ public:
 	std::list<Task*> pending_tasks;
 	std::mutex tasks_mutex;  // protects pending_tasks
 	bool must_loop;
-	std::thread* _thread;
+	std::vector<std::thread*> threads;
 
 	static TaskManager foreground;
 	static TaskManager background;
 
 	TaskManager();
 	void addTask(Task* task);
-	void fetchTask();
+	bool fetchTask(); //returns if there are more pending
+	void fetchTasks(float max_ms); //executes tasks till there are no more or the time runs out (at least one)
 	void loop();
-	void startThread();
-};
\ No newline at end of file
+	void startThread(int num_threads = 1); //tasks run in parallel when using more than one, 0 means half of the hardware threads
+};
+
+//pool of threads to split work that must be finished before continuing (not reentrant, call it from the main thread)
+class WorkerPool {
+public:
+	std::vector<std::thread*> threads;
+	std::mutex pool_mutex;
+	std::condition_variable start_condition;
+	std::condition_variable done_condition;
+	std::function<void(int)> job_func;
+	std::atomic<int> next_job;
+	std::atomic<int> pending_jobs;
+	int num_jobs;
+	int active_workers;
+	unsigned int generation;
+	bool must_loop;
+
+	static WorkerPool global;
+
+	WorkerPool();
+	~WorkerPool();
+	void startThreads(int num_threads = 0); //0 means one less than the hardware threads
+	void stopThreads();
+	int getNumThreads() { return (int)threads.size() + 1; } //the caller works too
+
+	//calls func(0..num-1) spread among the threads and waits till all are done
+	void parallelFor(int num, std::function<void(int)> func);
+
+	void loop();
+	void runJobs();
+};
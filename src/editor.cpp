@@ -295,6 +295,18 @@ void SceneEditor::renderTexturesPanel()
 	if (ImGui::Begin("Textures", nullptr, flags))// Create a window
 	{
 		ImGui::Checkbox("Big", &show_big);
+
+		//streaming
+		GFX::TextureStreamer& streamer = GFX::TextureStreamer::global;
+		ImGui::SameLine();
+		ImGui::Checkbox("Streaming", &streamer.enabled);
+		int budget_mb = streamer.budget >> 20;
+		ImGui::SameLine();
+		ImGui::SetNextItemWidth(200);
+		if (ImGui::SliderInt("VRAM budget (MB)", &budget_mb, 16, 2048))
+			streamer.budget = budget_mb << 20;
+		ImGui::Text("%s", streamer.getStats().c_str());
+
 		for (auto it : GFX::Texture::sTextures)
 		{
 			GFX::Texture* tex = it.second;
@@ -307,7 +319,10 @@ void SceneEditor::renderTexturesPanel()
 			ImGui::Image((ImTextureID)tex->texture_id, ImVec2(s,s));
 			if (ImGui::IsItemClicked(0))
 				selected_texture = selected_texture == tex->index ? -1 : tex->index;
-			ImGui::Text("%dx%d %s", (int)tex->width, (int)tex->height, tex->filename.c_str());
+			ImGui::Text("%dx%d %s %dKB", (int)tex->width, (int)tex->height, tex->filename.c_str(), tex->getVRAMSize() >> 10);
+			if (tex->streamed)
+				ImGui::Text("Source: %dx%d Mip: %d Required: %d%s Last used: %d frames ago", tex->full_width, tex->full_height,
+					tex->resident_mip, tex->required_mip, tex->pending_mip != -1 ? " (loading)" : "", (int)(streamer.frame - tex->last_used_frame));
 		}
 	}
 	ImGui::End();
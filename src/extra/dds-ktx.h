@@ -147,6 +147,7 @@ typedef enum ddsktx_format
     DDSKTX_FORMAT_RG11B10F,
     DDSKTX_FORMAT_RG8,
     DDSKTX_FORMAT_RG8S,
+    DDSKTX_FORMAT_RGB9E5,
     _DDSKTX_FORMAT_COUNT
 } ddsktx_format;
 
@@ -624,7 +625,8 @@ static const ddsktx__block_info k__block_info[] =
     {  32, 1, 1,  4, 1, 1,  0, 0, 10, 10, 10,  2, (uint8_t)(DDSKTX__ENCODE_UNORM) }, // RGB10A2
     {  32, 1, 1,  4, 1, 1,  0, 0, 11, 11, 10,  0, (uint8_t)(DDSKTX__ENCODE_UNORM) }, // RG11B10F
     {  16, 1, 1,  2, 1, 1,  0, 0,  8,  8,  0,  0, (uint8_t)(DDSKTX__ENCODE_UNORM) }, // RG8
-    {  16, 1, 1,  2, 1, 1,  0, 0,  8,  8,  0,  0, (uint8_t)(DDSKTX__ENCODE_SNORM) }  // RG8S
+    {  16, 1, 1,  2, 1, 1,  0, 0,  8,  8,  0,  0, (uint8_t)(DDSKTX__ENCODE_SNORM) }, // RG8S
+    {  32, 1, 1,  4, 1, 1,  0, 0,  9,  9,  9,  0, (uint8_t)(DDSKTX__ENCODE_FLOAT) }  // RGB9E5
 };
 
 // KTX: https://www.khronos.org/opengles/sdk/tools/KTX/file_format_spec/
@@ -822,6 +824,7 @@ static const ddsktx__ktx_format_info k__translate_ktx_fmt[] = {
         { DDSKTX__KTX_R11F_G11F_B10F,                           DDSKTX__KTX_ZERO,                                       DDSKTX__KTX_RGB,                                      DDSKTX__KTX_UNSIGNED_INT_10F_11F_11F_REV, }, // RG11B10F
         { DDSKTX__KTX_RG8,                                      DDSKTX__KTX_ZERO,                                       DDSKTX__KTX_RG,                                       DDSKTX__KTX_UNSIGNED_BYTE,                }, // RG8
         { DDSKTX__KTX_RG8_SNORM,                                DDSKTX__KTX_ZERO,                                       DDSKTX__KTX_RG,                                       DDSKTX__KTX_BYTE,                         }, // RG8S
+        { DDSKTX__KTX_RGB9_E5,                                  DDSKTX__KTX_ZERO,                                       DDSKTX__KTX_RGB,                                      DDSKTX__KTX_UNSIGNED_INT_5_9_9_9_REV,     }, // RGB9E5
         { DDSKTX__KTX_R16I,                                     DDSKTX__KTX_ZERO,                                       DDSKTX__KTX_RED,                                      DDSKTX__KTX_UNSIGNED_SHORT,               }, // R16I
         { DDSKTX__KTX_R16UI,                                    DDSKTX__KTX_ZERO,                                       DDSKTX__KTX_RED,                                      DDSKTX__KTX_UNSIGNED_SHORT,               }, // R16UI
 };
@@ -886,7 +889,8 @@ static const ddsktx__format_info k__formats_info[] = {
     {"RGB10A2", true},
     {"RG11B10F", false},
     {"RG8", false},
-    {"RG8S", false}
+    {"RG8S", false},
+    {"RGB9E5", false}
 };
 
 
@@ -100,6 +100,17 @@ short* HDRE::getFaceh(int level, int face)
     return this->pixels_h[level][face];
 }
 
+int HDRE::getLevelSize(int level)
+{
+	if (level >= N_LEVELS || !this->pixels_f[level][0])
+		return 0;
+	// old versions store the small levels as 8x8
+	int size = this->width >> level;
+	if (this->header.version <= 2.0 && size < 8)
+		size = 8;
+	return size;
+}
+
 
 bool HDRE::load(const char* filename)
 {
@@ -177,16 +188,8 @@ bool HDRE::load(const char* filename)
 
 		for (int j = 0; j < N_FACES; j++)
 		{
-			// allocate memory
-			this->pixels_f[i][j] = new float[faceSize];
-
-			// set data
-			for (int k = 0; k < faceSize; k++) {
-
-				float value = this->data[mapOffset + faceOffset + k];
-
-				this->pixels_f[i][j][k] = value;
-			}
+			// faces point inside data, no need to copy them
+			this->pixels_f[i][j] = this->data + mapOffset + faceOffset;
 
 			// update face offset
 			faceOffset += faceSize;
@@ -211,7 +214,8 @@ bool HDRE::clean()
 	try
 	{
 		if (data)
-			delete data;
+			delete[] data;
+		data = nullptr;
 
         for (int j = 0; j < N_FACES; j++)
         {
@@ -221,10 +225,7 @@ bool HDRE::clean()
 				pixels_h[i][j] = nullptr;
 			}
             for (int i = 0; i < N_LEVELS; i++)
-            {
-                delete pixels_f[i][j];
-                pixels_f[i][j] = nullptr;
-            }
+                pixels_f[i][j] = nullptr; //inside data
 		}
 
 		return true;
@@ -94,6 +94,8 @@ public:
     short* getFaceh(int level, int face);	// Specific level and face
 	short** getFacesh(int level = 0);		// [[]]: Array per face with all level data
 
+	int getLevelSize(int level); // width of the faces, 0 if that level is not stored
+
 	//sHDRELevel getLevel(int level = 0);
 
 	static HDRE* Get(const char* filename);
@@ -0,0 +1,156 @@
+#include "environment.h"
+#include "texture.h"
+#include "shader.h"
+#include "mesh.h"
+#include "gfx.h"
+#include "../core/task.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+namespace GFX {
+
+//the source levels available to sample from
+static int getSourceLevels(Texture* cubemap)
+{
+	if (!cubemap->mipmaps)
+		return 1;
+	GLint max_level = 1000;
+	glBindTexture(GL_TEXTURE_CUBE_MAP, cubemap->texture_id);
+	glGetTexParameteriv(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, &max_level);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	return std::min((int)max_level + 1, (int)std::log2(cubemap->width) + 1);
+}
+
+Texture* prefilterEnvironment(Texture* cubemap, int size, int num_samples, Texture* output)
+{
+	assert(cubemap && cubemap->texture_type == GL_TEXTURE_CUBE_MAP);
+	Shader* shader = Shader::Get("prefilter");
+	if (!shader)
+		return output;
+
+	if (output)
+		size = (int)output->width;
+	else
+	{
+		output = new Texture();
+		output->createCubemap(size, size, NULL, GL_RGBA, GL_HALF_FLOAT, true);
+		for (int level = 1; level < PREFILTER_LEVELS; ++level)
+			output->uploadCubemap(GL_RGBA, GL_HALF_FLOAT, false, NULL, 0, level);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, output->texture_id);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, PREFILTER_LEVELS - 1);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	}
+
+	//raw FBO because GFX::FBO cannot render to a mip of a cubemap
+	static GLuint fbo_id = 0;
+	if (!fbo_id)
+		glGenFramebuffers(1, &fbo_id);
+
+	GLint prev_fbo = 0;
+	GLint prev_viewport[4];
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prev_fbo);
+	glGetIntegerv(GL_VIEWPORT, prev_viewport);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo_id);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_BLEND);
+	glDisable(GL_CULL_FACE);
+	glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
+	Mesh* quad = Mesh::getQuad();
+	shader->enable();
+	shader->setTexture("u_texture", cubemap, 0);
+	shader->setUniform("u_num_samples", num_samples);
+	shader->setUniform("u_source_size", cubemap->width);
+	shader->setUniform("u_source_levels", (float)getSourceLevels(cubemap));
+
+	for (int level = 0; level < PREFILTER_LEVELS; ++level)
+	{
+		int level_size = std::max(size >> level, 1);
+		glViewport(0, 0, level_size, level_size);
+		shader->setUniform("u_roughness", level / (float)(PREFILTER_LEVELS - 1));
+		for (int face = 0; face < 6; ++face)
+		{
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, output->texture_id, level);
+			shader->setUniform("u_face", face);
+			quad->render(GL_TRIANGLES);
+		}
+	}
+	shader->disable();
+
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X, 0, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, prev_fbo);
+	glViewport(prev_viewport[0], prev_viewport[1], prev_viewport[2], prev_viewport[3]);
+	glEnable(GL_DEPTH_TEST);
+	assert(checkGLErrors() && "Error prefiltering environment");
+	return output;
+}
+
+//van der corput in base 2, the second coordinate of the hammersley sequence
+static float radicalInverse(uint32 bits)
+{
+	bits = (bits << 16u) | (bits >> 16u);
+	bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+	bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+	bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+	bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+	return bits * 2.3283064365386963e-10f;
+}
+
+void computeBRDFLUT(int size, int num_samples, std::vector<float>& output)
+{
+	output.resize(size * size * 2);
+
+	//every row is one roughness
+	WorkerPool::global.parallelFor(size, [&](int y) {
+		float roughness = (y + 0.5f) / size;
+		float a = roughness * roughness;
+		float k = a / 2.0f; //for IBL, not the same k than the lights
+		for (int x = 0; x < size; ++x)
+		{
+			float NoV = (x + 0.5f) / size;
+			vec3 V(sqrtf(1.0f - NoV * NoV), 0.0f, NoV); //N is (0,0,1)
+			float scale = 0.0f;
+			float bias = 0.0f;
+			for (int i = 0; i < num_samples; ++i)
+			{
+				//GGX importance sampling of the half vector
+				float phi = 2.0f * (float)PI * i / num_samples;
+				float xi = radicalInverse(i);
+				float cos_theta = sqrtf((1.0f - xi) / (1.0f + (a * a - 1.0f) * xi));
+				float sin_theta = sqrtf(1.0f - cos_theta * cos_theta);
+				vec3 H(sin_theta * cosf(phi), sin_theta * sinf(phi), cos_theta);
+				float VoH = V.dot(H);
+				vec3 L = H * (2.0f * VoH) - V;
+				float NoL = L.z;
+				if (NoL <= 0.0f)
+					continue;
+				VoH = std::max(VoH, 0.0f);
+				float G = (NoV / (NoV * (1.0f - k) + k)) * (NoL / (NoL * (1.0f - k) + k));
+				float G_vis = G * VoH / (H.z * NoV);
+				float Fc = powf(1.0f - VoH, 5.0f);
+				scale += (1.0f - Fc) * G_vis;
+				bias += Fc * G_vis;
+			}
+			output[(y * size + x) * 2] = scale / num_samples;
+			output[(y * size + x) * 2 + 1] = bias / num_samples;
+		}
+	});
+}
+
+Texture* getBRDFLUT()
+{
+	static Texture* lut = NULL;
+	if (lut)
+		return lut;
+
+	std::vector<float> data;
+	computeBRDFLUT(128, 512, data);
+	lut = new Texture();
+	lut->create(128, 128, GL_RG, GL_FLOAT, false, (Uint8*)&data[0], GL_RG16F);
+	return lut;
+}
+
+};
@@ -0,0 +1,31 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "../core/includes.h"
+
+#include <vector>
+
+namespace GFX {
+
+	class Texture;
+
+	//Image based lighting for the PBR shaders, using the split sum approximation.
+	//The specular of an environment is a cubemap where every mip is the GGX convolution for one roughness
+	//(roughness = level / (PREFILTER_LEVELS - 1)), so the shading only needs one textureLod per pixel.
+	//The convolution is a shader pass with importance sampling, reading from the mips of the source to avoid the noise.
+	//The BRDF LUT (scale and bias of f0 by N.V and roughness) is computed in the CPU by the worker threads.
+
+	#define PREFILTER_LEVELS 6
+
+	//returns a new RGBA16F cubemap of size x size, the source must have its mipmaps (it is not modified)
+	//output can be a cubemap returned by a previous call, to update it without allocating another one
+	Texture* prefilterEnvironment(Texture* cubemap, int size = 128, int num_samples = 64, Texture* output = NULL);
+
+	//RG floats, x is N.V and y the roughness
+	void computeBRDFLUT(int size, int num_samples, std::vector<float>& output);
+
+	//computed the first time it is used
+	Texture* getBRDFLUT();
+};
+
+#endif
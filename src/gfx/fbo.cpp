@@ -14,6 +14,7 @@ namespace GFX
 
 		renderbuffer_color = 0;
 		renderbuffer_depth = 0;
+		layered_depth = NULL;
 		num_color_textures = 0;
 		owns_textures = false;
 		width = 0;
@@ -23,6 +24,7 @@ namespace GFX
 	FBO::~FBO()
 	{
 		freeTextures();
+		delete layered_depth;
 		if (fbo_id)
 			glDeleteFramebuffers(1, &fbo_id);
 		if (renderbuffer_color)
@@ -102,14 +104,10 @@ namespace GFX
 		assert(textures.size() >= 0 && textures.size() <= 4);
 		assert(glGetError() == GL_NO_ERROR);
 		assert(textures.size() || depth_texture); //at least one texture
-		int format = 0; //RGB,RGBA
-		int type = 0;//UNSIGNED_BYTE
 		if (textures.size())
 		{
 			width = (int)textures[0]->width;
 			height = (int)textures[0]->height;
-			format = (int)textures[0]->format;
-			type = (int)textures[0]->type;
 		}
 		else
 		{
@@ -133,8 +131,9 @@ namespace GFX
 			if (!renderbuffer_depth)
 				glGenRenderbuffers(1, &renderbuffer_depth);
 			glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer_depth);
-			glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, width, height);
-			glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffer_depth);
+			//with stencil, the light volumes of the deferred need it
+			glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+			glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffer_depth);
 		}
 		checkGLErrors();
 
@@ -146,7 +145,7 @@ namespace GFX
 		{
 			Texture* texture = i < textures.size() ? textures[i] : NULL;
 			assert(!texture || (texture->width == width && texture->height == height)); //incorrect size, textures must have same size
-			assert(!texture || (texture->type == type && texture->format == format)); //incorrect texture format
+			//the formats can be different (since GL 3.0), the gbuffer has the velocity in RG16F
 
 			if (texture)
 			{
@@ -225,6 +224,44 @@ namespace GFX
 		return true;
 	}
 
+	bool FBO::setLayeredTexture(Texture* texture)
+	{
+		assert(texture && (texture->texture_type == GL_TEXTURE_CUBE_MAP || texture->texture_type == GL_TEXTURE_3D));
+		width = (int)texture->width;
+		height = (int)texture->height;
+		bool is_cubemap = texture->texture_type == GL_TEXTURE_CUBE_MAP;
+
+		//a renderbuffer cannot be layered, the depth must be a cubemap too
+		if (is_cubemap && (!layered_depth || layered_depth->width != width))
+		{
+			delete layered_depth;
+			layered_depth = new Texture();
+			layered_depth->createCubemap(width, height, NULL, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, false, GL_DEPTH_COMPONENT24);
+		}
+
+		if (fbo_id == 0)
+			glGenFramebuffersEXT(1, &fbo_id);
+		glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo_id);
+		glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture->texture_id, 0);
+		glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, is_cubemap ? layered_depth->texture_id : 0, 0); //volumes have no depth
+
+		memset(bufs, 0, sizeof(bufs));
+		bufs[0] = GL_COLOR_ATTACHMENT0;
+		color_textures[0] = texture;
+		color_textures[1] = color_textures[2] = color_textures[3] = NULL;
+		num_color_textures = 1;
+		glDrawBuffers(4, bufs);
+
+		GLenum status = glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT);
+		glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+		if (status != GL_FRAMEBUFFER_COMPLETE_EXT)
+		{
+			std::cout << "Error: Layered framebuffer object is not completed: " << status << std::endl;
+			return false;
+		}
+		return true;
+	}
+
 	void FBO::bind()
 	{
 		assert(glGetError() == GL_NO_ERROR);
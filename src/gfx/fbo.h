@@ -21,7 +21,8 @@ namespace GFX {
 		bool owns_textures;
 
 		GLuint renderbuffer_color;
-		GLuint renderbuffer_depth;//not used
+		GLuint renderbuffer_depth; //depth and stencil, when there is no depth texture
+		Texture* layered_depth; //depth cubemap for setLayeredTexture
 
 		FBO();
 		~FBO();
@@ -30,6 +31,8 @@ namespace GFX {
 		bool setTexture(Texture* texture, int cubemap_face = -1);
 		bool setTextures(std::vector<Texture*> textures, Texture* depth = NULL, int cubemap_face = -1);
 		bool setDepthOnly(int width, int height); //use this for shadowmaps
+		//attaches all the faces of a cubemap or all the slices of a 3D texture, the shaders choose one with gl_Layer (see Shader::GetLayered)
+		bool setLayeredTexture(Texture* texture);
 
 		void bind();
 		void unbind();
@@ -0,0 +1,159 @@
+#include "framegraph.h"
+#include "rendertargetpool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+
+namespace GFX {
+
+FrameGraph::FrameGraph()
+{
+	num_executed = 0;
+	num_culled = 0;
+}
+
+void FrameGraph::begin()
+{
+	//the targets of the previous frame are already back in the pool
+	resources.clear();
+	passes.clear();
+}
+
+int FrameGraph::createTarget(const char* name, int width, int height, int num_textures, int format, int type, bool use_depth_texture)
+{
+	Resource resource;
+	resource.name = name;
+	resource.width = width;
+	resource.height = height;
+	resource.num_textures = num_textures;
+	resource.format = format;
+	resource.type = type;
+	resource.use_depth_texture = use_depth_texture;
+	resource.imported = false;
+	resource.fbo = nullptr;
+	resource.first_pass = -1;
+	resource.last_pass = -1;
+	resources.push_back(resource);
+	return (int)resources.size() - 1;
+}
+
+int FrameGraph::importTarget(const char* name, FBO* fbo)
+{
+	int index = createTarget(name, 0, 0);
+	resources[index].imported = true;
+	resources[index].fbo = fbo;
+	return index;
+}
+
+int FrameGraph::addPass(const char* name, std::function<void()> execute, bool side_effects)
+{
+	Pass pass;
+	pass.name = name;
+	pass.execute = execute;
+	pass.side_effects = side_effects;
+	pass.culled = false;
+	passes.push_back(pass);
+	return (int)passes.size() - 1;
+}
+
+void FrameGraph::read(int pass, int resource)
+{
+	assert(pass >= 0 && pass < (int)passes.size() && resource >= 0 && resource < (int)resources.size());
+	passes[pass].reads.push_back(resource);
+}
+
+void FrameGraph::write(int pass, int resource)
+{
+	assert(pass >= 0 && pass < (int)passes.size() && resource >= 0 && resource < (int)resources.size());
+	passes[pass].writes.push_back(resource);
+}
+
+FBO* FrameGraph::getTarget(int resource)
+{
+	assert(resource >= 0 && resource < (int)resources.size());
+	assert((resources[resource].imported || resources[resource].fbo) && "the pass did not declare the target");
+	return resources[resource].fbo;
+}
+
+bool FrameGraph::isCulled(int pass)
+{
+	assert(pass >= 0 && pass < (int)passes.size());
+	return passes[pass].culled;
+}
+
+void FrameGraph::cull()
+{
+	//from the last pass to the first, a pass is needed if it has side effects or a later pass reads what it writes
+	std::vector<bool> needed(resources.size(), false);
+	for (int i = (int)passes.size() - 1; i >= 0; --i)
+	{
+		Pass& pass = passes[i];
+		bool used = pass.side_effects;
+		for (int resource : pass.writes)
+			used = used || needed[resource];
+		pass.culled = !used;
+		if (pass.culled)
+			continue;
+		for (int resource : pass.reads)
+			needed[resource] = true;
+	}
+
+	//the lifetime of every target is from the first to the last pass that is not culled
+	for (int i = 0; i < (int)passes.size(); ++i)
+	{
+		if (passes[i].culled)
+			continue;
+		for (int k = 0; k < 2; ++k)
+			for (int resource : (k == 0 ? passes[i].reads : passes[i].writes))
+			{
+				Resource& r = resources[resource];
+				if (r.first_pass == -1)
+					r.first_pass = i;
+				r.last_pass = i;
+			}
+	}
+}
+
+void FrameGraph::execute()
+{
+	cull();
+
+	num_executed = 0;
+	num_culled = 0;
+	culled_names.clear();
+	RenderTargetPool& pool = RenderTargetPool::global;
+	for (int i = 0; i < (int)passes.size(); ++i)
+	{
+		Pass& pass = passes[i];
+		if (pass.culled)
+		{
+			num_culled++;
+			culled_names += (culled_names.size() ? ", " : "") + pass.name;
+			continue;
+		}
+
+		for (auto& resource : resources)
+			if (resource.first_pass == i && !resource.imported)
+				resource.fbo = pool.acquire(resource.width, resource.height, resource.num_textures, resource.format, resource.type, resource.use_depth_texture);
+
+		pass.execute();
+		num_executed++;
+
+		for (auto& resource : resources)
+			if (resource.last_pass == i && !resource.imported)
+			{
+				pool.release(resource.fbo);
+				resource.fbo = nullptr;
+			}
+	}
+}
+
+std::string FrameGraph::getStats()
+{
+	char str[256];
+	sprintf(str, "Passes: %d Culled: %d", num_executed, num_culled);
+	return culled_names.size() ? std::string(str) + " (" + culled_names + ")" : std::string(str);
+}
+
+};
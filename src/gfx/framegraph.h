@@ -0,0 +1,78 @@
+#ifndef FRAMEGRAPH_H
+#define FRAMEGRAPH_H
+
+#include "../core/includes.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace GFX {
+
+	class FBO;
+
+	//the passes of a frame with the targets they read and write, executed in the order they were added.
+	//A pass whose targets nobody reads is culled (it costs nothing), unless it has side effects (it draws to the screen).
+	//The transient targets are acquired from the RenderTargetPool right before the first pass that uses them and released
+	//after the last one, so the ones whose lifetimes do not overlap share the memory.
+	//Imported targets are not from the pool (the gbuffer, the histories), they are only there for the dependencies.
+	//The graph is declared again every frame, after begin.
+	class FrameGraph {
+	public:
+		struct Resource {
+			std::string name;
+			int width;
+			int height;
+			int num_textures;
+			int format;
+			int type;
+			bool use_depth_texture;
+			bool imported;
+			FBO* fbo; //only valid inside the passes that use it
+			int first_pass;
+			int last_pass;
+		};
+
+		struct Pass {
+			std::string name;
+			std::function<void()> execute;
+			std::vector<int> reads;
+			std::vector<int> writes;
+			bool side_effects;
+			bool culled;
+		};
+
+		std::vector<Resource> resources;
+		std::vector<Pass> passes;
+
+		//stats of the last frame
+		int num_executed;
+		int num_culled;
+		std::string culled_names;
+
+		FrameGraph();
+
+		void begin(); //clears the graph of the previous frame
+
+		//returns the index of the resource, same parameters than FBO::create
+		int createTarget(const char* name, int width, int height, int num_textures = 1, int format = GL_RGB, int type = GL_UNSIGNED_BYTE, bool use_depth_texture = false);
+		int importTarget(const char* name, FBO* fbo); //fbo can be null if it is not a FBO (the froxel volumes)
+
+		//returns the index of the pass
+		int addPass(const char* name, std::function<void()> execute, bool side_effects = false);
+		void read(int pass, int resource);
+		void write(int pass, int resource);
+
+		FBO* getTarget(int resource); //inside the passes that declared it
+		bool isCulled(int pass); //after execute
+
+		void execute(); //culls and runs the rest
+		std::string getStats();
+
+	private:
+		void cull();
+	};
+
+};
+
+#endif
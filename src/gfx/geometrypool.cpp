@@ -0,0 +1,270 @@
+#include "geometrypool.h"
+#include "mesh.h"
+#include "gfx.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <iterator> //std::prev
+
+namespace GFX {
+
+GeometryPool GeometryPool::global;
+
+BufferArena::BufferArena(uint32 element_size, uint32 initial_capacity)
+{
+	buffer_id = 0;
+	this->element_size = element_size;
+	capacity = initial_capacity;
+	used = 0;
+	num_buffer_allocations = 0;
+}
+
+int BufferArena::allocate(uint32 size, int* owner)
+{
+	assert(owner);
+	if (!size)
+		return -1;
+
+	//the buffer is created the first time it is needed
+	if (!buffer_id)
+		compact(capacity);
+
+	//first fit
+	std::map<uint32, uint32>::iterator it = free_ranges.begin();
+	for (; it != free_ranges.end(); ++it)
+		if (it->second >= size)
+			break;
+
+	//no hole is big enough, compact it (and grow if there is not enough free space)
+	if (it == free_ranges.end())
+	{
+		uint32 new_capacity = capacity;
+		while (new_capacity - used < size)
+			new_capacity *= 2;
+		compact(new_capacity);
+		it = free_ranges.begin(); //after compacting there is only one range at the end
+	}
+
+	uint32 offset = it->first;
+	uint32 remaining = it->second - size;
+	free_ranges.erase(it);
+	if (remaining)
+		free_ranges[offset + size] = remaining;
+
+	allocations[offset] = std::make_pair(size, owner);
+	used += size;
+	*owner = (int)offset;
+	return (int)offset;
+}
+
+void BufferArena::free(uint32 offset)
+{
+	std::map<uint32, std::pair<uint32, int*>>::iterator alloc = allocations.find(offset);
+	assert(alloc != allocations.end() && "range not allocated in this arena");
+	if (alloc == allocations.end())
+		return;
+
+	uint32 size = alloc->second.first;
+	allocations.erase(alloc);
+	used -= size;
+
+	//merge with the next free range
+	std::map<uint32, uint32>::iterator next = free_ranges.lower_bound(offset);
+	if (next != free_ranges.end() && offset + size == next->first)
+	{
+		size += next->second;
+		next = free_ranges.erase(next);
+	}
+
+	//merge with the previous one
+	if (next != free_ranges.begin())
+	{
+		std::map<uint32, uint32>::iterator prev = std::prev(next);
+		if (prev->first + prev->second == offset)
+		{
+			prev->second += size;
+			return;
+		}
+	}
+
+	free_ranges[offset] = size;
+}
+
+void BufferArena::upload(uint32 offset, uint32 size, const void* data)
+{
+	assert(buffer_id && offset + size <= capacity);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_id);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)offset * element_size, (GLsizeiptr)size * element_size, data);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void BufferArena::download(uint32 offset, uint32 size, void* data)
+{
+	assert(buffer_id && offset + size <= capacity);
+	glBindBuffer(GL_COPY_READ_BUFFER, buffer_id);
+	glGetBufferSubData(GL_COPY_READ_BUFFER, (GLintptr)offset * element_size, (GLsizeiptr)size * element_size, data);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+}
+
+void BufferArena::compact(uint32 new_capacity)
+{
+	assert(new_capacity >= used);
+
+	GLuint new_buffer_id = 0;
+	glGenBuffers(1, &new_buffer_id);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, new_buffer_id);
+	glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)new_capacity * element_size, NULL, GL_STATIC_DRAW);
+	num_buffer_allocations++;
+
+	//copy every range one after the other, the GPU does the copy
+	std::map<uint32, std::pair<uint32, int*>> new_allocations;
+	uint32 pos = 0;
+	if (buffer_id)
+		glBindBuffer(GL_COPY_READ_BUFFER, buffer_id);
+	for (auto& alloc : allocations)
+	{
+		uint32 size = alloc.second.first;
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, (GLintptr)alloc.first * element_size, (GLintptr)pos * element_size, (GLsizeiptr)size * element_size);
+		*alloc.second.second = (int)pos;
+		new_allocations[pos] = alloc.second;
+		pos += size;
+	}
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	if (buffer_id)
+		glDeleteBuffers(1, &buffer_id);
+	buffer_id = new_buffer_id;
+	capacity = new_capacity;
+	allocations.swap(new_allocations);
+
+	free_ranges.clear();
+	if (capacity > used)
+		free_ranges[used] = capacity - used;
+	checkGLErrors();
+}
+
+uint32 BufferArena::getFragmentedSize()
+{
+	uint32 total = 0;
+	for (auto& range : free_ranges)
+		if (range.first + range.second != capacity)
+			total += range.second;
+	return total;
+}
+
+void BufferArena::release()
+{
+	//the owners will not find their data anymore
+	for (auto& alloc : allocations)
+		*alloc.second.second = -1;
+	allocations.clear();
+	free_ranges.clear();
+	used = 0;
+
+	if (buffer_id)
+		glDeleteBuffers(1, &buffer_id);
+	buffer_id = 0;
+}
+
+GeometryPool::GeometryPool() :
+	vertices(sizeof(Mesh::tInterleaved), 1 << 18), //8MB
+	indices(sizeof(uint32), 1 << 20) //4MB
+{
+	auto_defragment = true;
+	num_meshes = 0;
+}
+
+bool GeometryPool::addMesh(Mesh* mesh)
+{
+	uint32 num_vertices = mesh->getNumCPUVertices();
+	uint32 num_indices = (uint32)mesh->m_indices.size();
+	if (!num_vertices)
+		return false;
+
+	//if the size changed it needs a new range
+	if (mesh->pool_vertex_offset != -1 && (mesh->pool_num_vertices != num_vertices || mesh->pool_num_indices != num_indices))
+		removeMesh(mesh);
+
+	if (mesh->pool_vertex_offset == -1)
+	{
+		vertices.allocate(num_vertices, &mesh->pool_vertex_offset);
+		if (num_indices)
+			indices.allocate(num_indices, &mesh->pool_index_offset);
+		mesh->pool_num_vertices = num_vertices;
+		mesh->pool_num_indices = num_indices;
+		num_meshes++;
+	}
+
+	//the pool always stores interleaved vertices, missing streams are filled with zeros
+	if (mesh->interleaved.size())
+		vertices.upload(mesh->pool_vertex_offset, num_vertices, &mesh->interleaved[0]);
+	else
+	{
+		std::vector<Mesh::tInterleaved> data(num_vertices); //the vectors start at zero
+		for (uint32 i = 0; i < num_vertices; ++i)
+		{
+			data[i].vertex = mesh->vertices[i];
+			if (i < mesh->normals.size())
+				data[i].normal = mesh->normals[i];
+			if (i < mesh->uvs.size())
+				data[i].uv = mesh->uvs[i];
+		}
+		vertices.upload(mesh->pool_vertex_offset, num_vertices, &data[0]);
+	}
+
+	//indices are relative to the mesh, the vertex offset is applied when binding the attributes
+	if (num_indices)
+		indices.upload(mesh->pool_index_offset, num_indices, &mesh->m_indices[0]);
+
+	return true;
+}
+
+void GeometryPool::removeMesh(Mesh* mesh)
+{
+	if (mesh->pool_vertex_offset == -1)
+		return;
+
+	vertices.free(mesh->pool_vertex_offset);
+	if (mesh->pool_index_offset != -1)
+		indices.free(mesh->pool_index_offset);
+	mesh->pool_vertex_offset = mesh->pool_index_offset = -1;
+	mesh->pool_num_vertices = mesh->pool_num_indices = 0;
+	num_meshes--;
+
+	//too many holes, move everything together
+	if (auto_defragment && (vertices.getFragmentedSize() > vertices.capacity / 4 || indices.getFragmentedSize() > indices.capacity / 4))
+		defragment();
+}
+
+void GeometryPool::defragment()
+{
+	if (vertices.buffer_id)
+		vertices.compact(vertices.capacity);
+	if (indices.buffer_id)
+		indices.compact(indices.capacity);
+}
+
+void GeometryPool::release()
+{
+	vertices.release();
+	indices.release();
+	num_meshes = 0;
+}
+
+std::string GeometryPool::getStats()
+{
+	float vertices_mb = vertices.capacity * (float)vertices.element_size / (1024.0f * 1024.0f);
+	float indices_mb = indices.capacity * (float)indices.element_size / (1024.0f * 1024.0f);
+	char str[256];
+	sprintf(str, "Pool meshes: %d Vertices: %d%% of %.1fMB Indices: %d%% of %.1fMB Holes: %d/%d GL allocs: %d",
+		num_meshes,
+		vertices.capacity ? int(100.0f * vertices.used / vertices.capacity) : 0, vertices_mb,
+		indices.capacity ? int(100.0f * indices.used / indices.capacity) : 0, indices_mb,
+		(int)vertices.free_ranges.size(), (int)indices.free_ranges.size(),
+		vertices.num_buffer_allocations + indices.num_buffer_allocations);
+	return str;
+}
+
+};
@@ -0,0 +1,68 @@
+#ifndef GEOMETRYPOOL_H
+#define GEOMETRYPOOL_H
+
+#include "../core/includes.h"
+#include "../core/math.h"
+
+#include <map>
+#include <string>
+
+namespace GFX {
+
+	class Mesh;
+
+	//big GL buffer shared by many meshes, every mesh gets a range from a free list
+	//offsets and sizes are in elements, not bytes
+	class BufferArena {
+	public:
+		GLuint buffer_id;
+		uint32 element_size; //in bytes
+		uint32 capacity;
+		uint32 used;
+
+		std::map<uint32, uint32> free_ranges; //offset -> size
+		std::map<uint32, std::pair<uint32, int*>> allocations; //offset -> size and where the owner stores the offset
+
+		int num_buffer_allocations; //times glBufferData was called, for stats
+
+		BufferArena(uint32 element_size, uint32 initial_capacity);
+
+		//returns the offset, when moving the data (defragment or grow) the *owner is updated
+		int allocate(uint32 size, int* owner);
+		void free(uint32 offset);
+		void upload(uint32 offset, uint32 size, const void* data);
+		void download(uint32 offset, uint32 size, void* data); //stalls till the GPU is done
+
+		//moves all the ranges to the beginning of a new buffer (also used to grow it)
+		void compact(uint32 new_capacity);
+
+		uint32 getFragmentedSize(); //free elements that are not at the end
+		void release();
+	};
+
+	//all the meshes share one vertex buffer (interleaved vertex, normal and uv) and one index buffer,
+	//so there are only a couple of GL allocations and no buffer switches between meshes.
+	//Extra streams (colors, weights, second uvs) keep their own VBOs.
+	class GeometryPool {
+	public:
+		static GeometryPool global;
+
+		BufferArena vertices;
+		BufferArena indices;
+
+		bool auto_defragment; //compact when removing meshes leaves too many holes
+		int num_meshes;
+
+		GeometryPool();
+
+		bool addMesh(Mesh* mesh); //also used to update the data of a mesh already in the pool
+		void removeMesh(Mesh* mesh);
+		void defragment();
+		void release();
+
+		std::string getStats();
+	};
+
+};
+
+#endif
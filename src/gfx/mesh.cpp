@@ -5,6 +5,7 @@
 #include "../core/includes.h"
 #include "math.h"
 #include "gfx.h"
+#include "geometrypool.h"
 
 #include <cassert>
 #include <iostream>
@@ -23,6 +24,8 @@ namespace GFX {
 bool Mesh::use_binary = false;			//checks if there is .wbin, it there is one tries to read it instead of the other file
 bool Mesh::auto_upload_to_vram = true;	//uploads the mesh to the GPU VRAM to speed up rendering
 bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved array
+bool Mesh::use_geometry_pool = true;	//all the meshes share the same vertex and index buffers
+eMeshRetention Mesh::default_retention = eMeshRetention::KEEP_COLLISION; //loaded meshes only keep what picking needs
 
 std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
 long Mesh::num_meshes_rendered = 0;
@@ -39,6 +42,11 @@ Mesh::Mesh()
 	index = s_last_index++;
 	radius = 0;
 	vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
+	pool_vertex_offset = pool_index_offset = -1;
+	pool_num_vertices = pool_num_indices = 0;
+	retention = default_retention;
+	cpu_data_released = false;
+	released_bytes = 0;
 	collision_model = NULL;
 
 	clear();
@@ -94,6 +102,8 @@ void Mesh::clear()
     #endif
 
 
+	GeometryPool::global.removeMesh(this);
+
 	//VBOs ids
 	vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = uvs1_vbo_id = 0;
 
@@ -107,9 +117,12 @@ void Mesh::clear()
 	bones.clear();
 	weights.clear();
 	m_uvs1.clear();
+	cpu_data_released = false;
+	released_bytes = 0;
 
 	if (collision_model)
 		delete (CollisionModel3D*)collision_model;
+	collision_model = NULL;
 }
 
 int vertex_location = -1;
@@ -133,7 +146,12 @@ void Mesh::enableBuffers(Shader* sh)
 	int offset_normal = 0;
 	int offset_uv = 0;
 
-	if (interleaved.size())
+	//meshes in the pool use the shared buffer, the offset of the mesh acts as base vertex
+	bool pooled = pool_vertex_offset != -1;
+	GLuint interleaved_id = pooled ? GeometryPool::global.vertices.buffer_id : interleaved_vbo_id;
+	size_t base_offset = pooled ? pool_vertex_offset * sizeof(tInterleaved) : 0;
+
+	if (interleaved.size() || pooled)
 	{
 		spacing = sizeof(tInterleaved);
 		offset_normal = sizeof(Vector3f);
@@ -143,10 +161,10 @@ void Mesh::enableBuffers(Shader* sh)
 	if (vertex_location != -1)
 	{
 		glEnableVertexAttribArray(vertex_location);
-		if (vertices_vbo_id || interleaved_vbo_id)
+		if (vertices_vbo_id || interleaved_id)
 		{
-			glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : vertices_vbo_id);
-			glVertexAttribPointer(vertex_location, 3, GL_FLOAT, GL_FALSE, spacing, 0);
+			glBindBuffer(GL_ARRAY_BUFFER, interleaved_id ? interleaved_id : vertices_vbo_id);
+			glVertexAttribPointer(vertex_location, 3, GL_FLOAT, GL_FALSE, spacing, (void*)base_offset);
 		}
 		else
 			glVertexAttribPointer(vertex_location, 3, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].vertex : &vertices[0]);
@@ -160,10 +178,10 @@ void Mesh::enableBuffers(Shader* sh)
 		if (normal_location != -1)
 		{
 			glEnableVertexAttribArray(normal_location);
-			if (normals_vbo_id || interleaved_vbo_id)
+			if (normals_vbo_id || interleaved_id)
 			{
-				glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : normals_vbo_id);
-				glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, (void*)offset_normal);
+				glBindBuffer(GL_ARRAY_BUFFER, interleaved_id ? interleaved_id : normals_vbo_id);
+				glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, (void*)(base_offset + offset_normal));
 			}
 			else
 				glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].normal : &normals[0]);
@@ -178,10 +196,10 @@ void Mesh::enableBuffers(Shader* sh)
 		if (uv_location != -1)
 		{
 			glEnableVertexAttribArray(uv_location);
-			if (uvs_vbo_id || interleaved_vbo_id)
+			if (uvs_vbo_id || interleaved_id)
 			{
-				glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : uvs_vbo_id);
-				glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, (void*)offset_uv);
+				glBindBuffer(GL_ARRAY_BUFFER, interleaved_id ? interleaved_id : uvs_vbo_id);
+				glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, (void*)(base_offset + offset_uv));
 			}
 			else
 				glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].uv : &uvs[0]);
@@ -270,7 +288,7 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 		assert(0 && "no shader or shader not compiled or enabled");
 		return;
 	}
-	assert((interleaved.size() || vertices.size()) && "No vertices in this mesh");
+	assert((interleaved.size() || vertices.size() || pool_vertex_offset != -1) && "No vertices in this mesh");
 
 	//bind buffers to attribute locations
 	enableBuffers(shader);
@@ -287,10 +305,18 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 
 void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 {
+	bool pooled = pool_vertex_offset != -1;
+	int num_indices = pooled ? (int)pool_num_indices : (int)m_indices.size();
+	GLuint indices_id = pooled ? GeometryPool::global.indices.buffer_id : indices_vbo_id;
+	size_t base_offset = pooled && num_indices ? pool_index_offset * sizeof(uint32) : 0; //in bytes
+
 	int start = 0; //in primitives
 	int size = (int)vertices.size();
-	if (m_indices.size())
-		size = (int)m_indices.size();
+	if (num_indices)
+		size = num_indices;
+	else
+	if (pooled)
+		size = (int)pool_num_vertices;
 	else
 	if (interleaved.size())
 		size = (int)interleaved.size();
@@ -304,26 +330,22 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 	}
 
 	//DRAW
-	if (m_indices.size())
+	if (num_indices)
 	{
 		if (num_instances > 0)
 		{
-			assert(indices_vbo_id && "indices must be uploaded to the GPU");
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			#ifdef OPENGL_ES3
-				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start + sizeof(Vector3u)), num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
+			assert(indices_id && "indices must be uploaded to the GPU");
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_id);
+			glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(base_offset + start * sizeof(Vector3u)), num_instances);
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 		}
 		else
 		{
-			if (indices_vbo_id)
+			if (indices_id)
 			{
 				/*if (size != 90)*/ {
-					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-					glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) (start * sizeof(Vector3u)));
+					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_id);
+					glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) (base_offset + start * sizeof(Vector3u)));
 					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 				}
 				checkGLErrors();
@@ -335,13 +357,7 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 	else
 	{
 		if (num_instances > 0)
-		{
-			#ifdef OPENGL_ES3
-				glDrawArraysInstanced(primitive, start, size, num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
-		}
+			glDrawArraysInstanced(primitive, start, size, num_instances);
 		else
 			glDrawArrays(primitive, start, size);
 	}
@@ -506,6 +522,7 @@ void Mesh::renderAnimated( unsigned int primitive, Skeleton* skeleton )
 
 void Mesh::uploadToVRAM()
 {
+	fetchCPUData();
 	assert(vertices.size() || interleaved.size());
 
 	if (glGenBuffersARB == nullptr)
@@ -514,7 +531,10 @@ void Mesh::uploadToVRAM()
 		exit(0);
 	}
 
-	if (interleaved.size())
+	//vertices and indices go to the shared buffers, only the extra streams have their own VBOs
+	bool pooled = use_geometry_pool && GeometryPool::global.addMesh(this);
+
+	if (interleaved.size() && !pooled)
 	{
 		// Vertex,Normal,UV
 		if (interleaved_vbo_id == 0)
@@ -522,7 +542,7 @@ void Mesh::uploadToVRAM()
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, interleaved_vbo_id);
 		glBufferDataARB(GL_ARRAY_BUFFER_ARB, interleaved.size() * sizeof(tInterleaved), &interleaved[0], GL_STATIC_DRAW_ARB);
 	}
-	else
+	else if (!pooled)
 	{
 		// Vertices
 		if (vertices_vbo_id == 0)
@@ -585,7 +605,7 @@ void Mesh::uploadToVRAM()
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
 
 	// Indices
-	if (m_indices.size())
+	if (m_indices.size() && !pooled)
 	{
 		if (indices_vbo_id == 0)
 			glGenBuffersARB(1, &indices_vbo_id);
@@ -603,6 +623,12 @@ bool Mesh::createCollisionModel(bool is_static)
 	if (collision_model)
 		return true;
 
+	//the collision model has its own copy, so the arrays can be released again after
+	//with KEEP_COLLISION the positions and the indices are still in RAM, that is all it needs
+	bool must_fetch = cpu_data_released && retention != eMeshRetention::KEEP_COLLISION;
+	if (must_fetch && !fetchCPUData())
+		return false;
+
 	double time = getTime();
 	std::cout << "Creating collision model for: " << this->name << " (" << (interleaved.size() ? interleaved.size() : vertices.size()) / 3 << ") ...";
 
@@ -660,6 +686,9 @@ bool Mesh::createCollisionModel(bool is_static)
 	collision_model->finalize();
 	this->collision_model = collision_model;
 
+	if (must_fetch)
+		applyRetention();
+
 	std::cout << "[OK] Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 
 	return true;
@@ -845,7 +874,7 @@ bool Mesh::readBin(const char* filename)
 	{
 		m_indices.resize(info.num_indices);
 		memcpy((void*)&m_indices[0], pos, sizeof(unsigned int) * info.num_indices);
-		pos += sizeof(Vector3u) * info.num_indices;
+		pos += sizeof(unsigned int) * info.num_indices;
 	}
 
 	if (info.streams[5] == 'B')
@@ -862,13 +891,7 @@ bool Mesh::readBin(const char* filename)
 		pos += sizeof(Vector4f) * info.size;
 	}
 
-	if (info.streams[7] == 'u')
-	{
-		m_uvs1.resize(info.size);
-		memcpy((void*)&m_uvs1[0], pos, sizeof(Vector2f) * info.size);
-		pos += sizeof(Vector2f) * info.size;
-	}
-
+	//same order used in writeBin
 	if (info.num_bones)
 	{
 		bones_info.resize(info.num_bones);
@@ -876,6 +899,13 @@ bool Mesh::readBin(const char* filename)
 		pos += sizeof(BoneInfo) * info.num_bones;
 	}
 
+	if (info.streams[7] == 'u')
+	{
+		m_uvs1.resize(info.size);
+		memcpy((void*)&m_uvs1[0], pos, sizeof(Vector2f) * info.size);
+		pos += sizeof(Vector2f) * info.size;
+	}
+
 	aabb_max = info.aabb_max;
 	aabb_min = info.aabb_min;
 	box.center = info.center;
@@ -887,7 +917,9 @@ bool Mesh::readBin(const char* filename)
 	memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
 	pos += sizeof(sSubmeshInfo) * info.num_submeshes;
 
-	createCollisionModel();
+	delete[] data;
+
+	//the collision model is created the first time it is used
 	return true;
 }
 
@@ -1441,6 +1473,39 @@ void Mesh::createSphere(float radius, float slices, float arcs)
 	this->radius = radius;
 }
 
+void Mesh::createCone(float radius, float height, float slices)
+{
+	vec3 apex(0, 0, 0);
+	vec3 center(0, 0, height);
+	for (int i = 0; i < slices; ++i)
+	{
+		float angle1 = (i / slices) * M_PI * 2;
+		float angle2 = ((i + 1) / slices) * M_PI * 2;
+		vec3 A(cos(angle1) * radius, sin(angle1) * radius, height);
+		vec3 B(cos(angle2) * radius, sin(angle2) * radius, height);
+		vec3 N = normalize(cross(B - apex, A - apex));
+
+		//the side and the cap, counterclockwise seen from outside
+		vertices.push_back(apex);
+		vertices.push_back(B);
+		vertices.push_back(A);
+		vertices.push_back(center);
+		vertices.push_back(A);
+		vertices.push_back(B);
+
+		normals.push_back(N);
+		normals.push_back(N);
+		normals.push_back(N);
+		normals.push_back(vec3(0, 0, 1));
+		normals.push_back(vec3(0, 0, 1));
+		normals.push_back(vec3(0, 0, 1));
+	}
+
+	box.center.set(0, 0, height * 0.5f);
+	box.halfsize.set(radius, radius, height * 0.5f);
+	this->radius = (float)box.halfsize.length();
+}
+
 
 void Mesh::createWireBox()
 {
@@ -1717,6 +1782,8 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 		}
 
 		std::cout << "[OK BIN]  Faces: " << (m->interleaved.size() ? m->interleaved.size() : m->vertices.size()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+		m->cooked_filename = binfilename;
+		m->applyRetention();
 		sMeshesLoaded[filename] = m;
 		return m;
 	}
@@ -1755,10 +1822,12 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 	if (use_binary)
 	{
 		std::cout << "\t\t Writing .BIN ... ";
-		m->writeBin(filename);
+		if (m->writeBin(filename))
+			m->cooked_filename = binfilename;
 		std::cout << "[OK]" << std::endl;
 	}
 
+	m->applyRetention();
 	m->registerMesh(name);
 	return m;
 }
@@ -1771,12 +1840,133 @@ void Mesh::registerMesh( std::string name )
 
 void Mesh::Release()
 {
+	//no need to compact the pool while everything is being destroyed
+	GeometryPool::global.auto_defragment = false;
 	for (auto m : sMeshesLoaded)
 	{
         stdlog("Destroy mesh: " + m.first );
 		delete m.second;
 	}
 	sMeshesLoaded.clear();
+	GeometryPool::global.release();
+}
+
+//frees the arrays that are already in the GPU, the extra streams (colors, weights...) are always kept
+void Mesh::applyRetention()
+{
+	if (retention == eMeshRetention::KEEP_ALL || pool_vertex_offset == -1)
+		return;
+
+	size_t before = getCPUMemory();
+
+	//keep only the positions
+	if (retention == eMeshRetention::KEEP_COLLISION && interleaved.size())
+	{
+		vertices.resize(interleaved.size());
+		for (size_t i = 0; i < interleaved.size(); ++i)
+			vertices[i] = interleaved[i].vertex;
+	}
+
+	//swap to really free the memory
+	std::vector<tInterleaved>().swap(interleaved);
+	std::vector<Vector3f>().swap(normals);
+	std::vector<Vector2f>().swap(uvs);
+	if (retention == eMeshRetention::KEEP_NONE)
+	{
+		std::vector<Vector3f>().swap(vertices);
+		std::vector<unsigned int>().swap(m_indices);
+	}
+
+	released_bytes += before - getCPUMemory();
+	cpu_data_released = true;
+}
+
+void Mesh::setRetention(eMeshRetention retention)
+{
+	this->retention = retention;
+	fetchCPUData();
+	applyRetention();
+}
+
+bool Mesh::fetchCPUData()
+{
+	if (!cpu_data_released)
+		return true;
+
+	bool fetched = false;
+
+	//from the cooked file if there is one
+	if (cooked_filename.size())
+	{
+		Mesh cooked;
+		if (cooked.readBin(cooked_filename.c_str()) && cooked.getNumVertices() == pool_num_vertices)
+		{
+			interleaved.swap(cooked.interleaved);
+			vertices.swap(cooked.vertices);
+			normals.swap(cooked.normals);
+			uvs.swap(cooked.uvs);
+			m_indices.swap(cooked.m_indices);
+			fetched = true;
+		}
+	}
+
+	//otherwise read it back from the pool (it stalls, but it only happens once)
+	if (!fetched && pool_vertex_offset != -1)
+	{
+		interleaved.resize(pool_num_vertices);
+		GeometryPool::global.vertices.download(pool_vertex_offset, pool_num_vertices, &interleaved[0]);
+		m_indices.resize(pool_num_indices);
+		if (pool_num_indices)
+			GeometryPool::global.indices.download(pool_index_offset, pool_num_indices, &m_indices[0]);
+		vertices.clear();
+		normals.clear();
+		uvs.clear();
+		fetched = true;
+	}
+
+	if (!fetched)
+	{
+		std::cout << "[ERROR] cannot fetch the data of mesh: " << name << std::endl;
+		return false;
+	}
+
+	cpu_data_released = false;
+	released_bytes = 0;
+	return true;
+}
+
+size_t Mesh::getCPUMemory()
+{
+	return vertices.capacity() * sizeof(Vector3f) + normals.capacity() * sizeof(Vector3f) + uvs.capacity() * sizeof(Vector2f) +
+		m_uvs1.capacity() * sizeof(Vector2f) + colors.capacity() * sizeof(Vector4f) + interleaved.capacity() * sizeof(tInterleaved) +
+		m_indices.capacity() * sizeof(unsigned int) + bones.capacity() * sizeof(Vector4ub) + weights.capacity() * sizeof(Vector4f);
+}
+
+void Mesh::setRetentionToAll(eMeshRetention retention)
+{
+	for (auto it : sMeshesLoaded)
+		it.second->setRetention(retention);
+}
+
+std::string Mesh::getMemoryReport()
+{
+	size_t cpu_bytes = 0;
+	size_t released = 0;
+	int num_released = 0;
+	int num_collision = 0;
+	for (auto it : sMeshesLoaded)
+	{
+		Mesh* mesh = it.second;
+		cpu_bytes += mesh->getCPUMemory();
+		released += mesh->released_bytes;
+		num_released += mesh->cpu_data_released ? 1 : 0;
+		num_collision += mesh->collision_model ? 1 : 0;
+	}
+
+	char str[256];
+	sprintf(str, "Meshes: %d RAM: %.1fMB Saved: %.1fMB (%d released) Collision models: %d",
+		(int)sMeshesLoaded.size(), cpu_bytes / (1024.0f * 1024.0f), released / (1024.0f * 1024.0f), num_released, num_collision);
+	return str;
 }
 
 };
\ No newline at end of file
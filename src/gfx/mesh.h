@@ -20,6 +20,13 @@ namespace GFX {
 	//version from 11/5/2020
 #define MESH_BIN_VERSION 11 //this is used to regenerate bins if the format changes
 
+	//how much geometry stays in RAM after uploading it to the GPU
+	enum eMeshRetention {
+		KEEP_ALL,
+		KEEP_COLLISION, //only positions and indices (picking, collisions and occluders)
+		KEEP_NONE //everything is fetched again when needed
+	};
+
 	struct sSubmeshInfo
 	{
 		char name[64];
@@ -35,6 +42,8 @@ namespace GFX {
 		static bool use_binary; //always load the binary version of a mesh when possible
 		static bool interleave_meshes; //loaded meshes will me automatically interleaved
 		static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
+		static bool use_geometry_pool; //vertices and indices are stored in the shared GeometryPool buffers
+		static eMeshRetention default_retention; //for the meshes loaded from now on
 		static long num_meshes_rendered;
 		static long num_triangles_rendered;
 		static uint32 s_last_index;
@@ -83,6 +92,18 @@ namespace GFX {
 		unsigned int weights_vbo_id;
 		unsigned int uvs1_vbo_id;
 
+		//range inside the GeometryPool, -1 if not in the pool (updated by the pool when it moves the data)
+		int pool_vertex_offset; //acts as base vertex
+		int pool_index_offset;
+		uint32 pool_num_vertices;
+		uint32 pool_num_indices;
+
+		//CPU data released after the upload (only meshes in the pool)
+		eMeshRetention retention;
+		bool cpu_data_released;
+		size_t released_bytes;
+		std::string cooked_filename; //.mbin used to read again the data, if empty it is read back from the GPU
+
 		Mesh();
 		~Mesh();
 
@@ -101,8 +122,17 @@ namespace GFX {
 		bool readBin(const char* filename);
 		bool writeBin(const char* filename);
 
+		//retention of the CPU data
+		void applyRetention(); //releases the arrays not needed according to the retention
+		void setRetention(eMeshRetention retention);
+		bool fetchCPUData(); //brings back the released arrays, call it before accessing them
+		size_t getCPUMemory(); //bytes used by the arrays
+		static void setRetentionToAll(eMeshRetention retention);
+		static std::string getMemoryReport();
+
 		unsigned int getNumSubmeshes() { return (unsigned int)submeshes.size(); }
-		unsigned int getNumVertices() { return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
+		unsigned int getNumVertices() { return pool_vertex_offset != -1 ? pool_num_vertices : getNumCPUVertices(); } //still valid after the retention releases the arrays
+		unsigned int getNumCPUVertices() { return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); } //use it before indexing the arrays
 
 		//collision testing
 		void* collision_model;
@@ -122,6 +152,7 @@ namespace GFX {
 		void createSubdividedPlane(float size = 1, int subdivisions = 256, bool centered = false);
 		void createCube(Vector3f size);
 		void createSphere(float radius, float slices = 24,float arcs = 16);
+		void createCone(float radius, float height, float slices = 24); //apex in the origin, the base in z = height
 		void createWireBox();
 		void createGrid(float dist);
 
@@ -0,0 +1,126 @@
+#include "rendertargetpool.h"
+#include "fbo.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+
+namespace GFX {
+
+RenderTargetPool RenderTargetPool::global;
+
+RenderTargetPool::RenderTargetPool()
+{
+	unused_frames = 60;
+	frame = 0;
+	num_acquired = 0;
+	max_in_use = 0;
+	num_in_use = 0;
+	frame_acquired = 0;
+	frame_max_in_use = 0;
+}
+
+FBO* RenderTargetPool::acquire(int width, int height, int num_textures, int format, int type, bool use_depth_texture)
+{
+	frame_acquired++;
+	num_in_use++;
+	frame_max_in_use = std::max(frame_max_in_use, num_in_use);
+
+	for (auto& target : targets)
+	{
+		if (target.in_use || target.fbo->width != width || target.fbo->height != height || target.num_textures != num_textures ||
+			target.format != format || target.type != type || target.use_depth_texture != use_depth_texture)
+			continue;
+		target.in_use = true;
+		target.last_frame = frame;
+		return target.fbo;
+	}
+
+	Target target;
+	target.fbo = new FBO();
+	target.fbo->create(width, height, num_textures, format, type, use_depth_texture);
+	target.num_textures = num_textures;
+	target.format = format;
+	target.type = type;
+	target.use_depth_texture = use_depth_texture;
+	target.in_use = true;
+	target.last_frame = frame;
+	target.bytes = 0;
+	for (int i = 0; i < num_textures; ++i)
+		target.bytes += target.fbo->color_textures[i]->getVRAMSize();
+	if (target.fbo->depth_texture)
+		target.bytes += target.fbo->depth_texture->getVRAMSize();
+	targets.push_back(target);
+	return target.fbo;
+}
+
+void RenderTargetPool::release(FBO* fbo)
+{
+	if (!fbo)
+		return;
+	for (auto& target : targets)
+	{
+		if (target.fbo != fbo)
+			continue;
+		assert(target.in_use && "render target released twice");
+		target.in_use = false;
+		num_in_use--;
+		return;
+	}
+	assert(0 && "the FBO is not from the pool");
+}
+
+void RenderTargetPool::endFrame()
+{
+	//the ones in use are kept, a pass can hold its target until the next frame
+	for (size_t i = 0; i < targets.size();)
+	{
+		if (!targets[i].in_use && frame - targets[i].last_frame > unused_frames)
+		{
+			delete targets[i].fbo;
+			targets[i] = targets.back();
+			targets.pop_back();
+		}
+		else
+			++i;
+	}
+
+	num_acquired = frame_acquired;
+	max_in_use = frame_max_in_use;
+	frame_acquired = 0;
+	frame_max_in_use = num_in_use;
+	frame++;
+}
+
+void RenderTargetPool::clear()
+{
+	for (size_t i = 0; i < targets.size();)
+	{
+		if (!targets[i].in_use)
+		{
+			delete targets[i].fbo;
+			targets[i] = targets.back();
+			targets.pop_back();
+		}
+		else
+			++i;
+	}
+}
+
+uint32 RenderTargetPool::getBytes()
+{
+	uint32 bytes = 0;
+	for (auto& target : targets)
+		bytes += target.bytes;
+	return bytes;
+}
+
+std::string RenderTargetPool::getStats()
+{
+	char str[256];
+	sprintf(str, "Render targets: %d VRAM: %.1fMB Acquired: %d Max in use: %d",
+		(int)targets.size(), getBytes() / (1024.0f * 1024.0f), num_acquired, max_in_use);
+	return str;
+}
+
+};
@@ -0,0 +1,62 @@
+#ifndef RENDERTARGETPOOL_H
+#define RENDERTARGETPOOL_H
+
+#include "../core/includes.h"
+#include "../core/math.h"
+
+#include <string>
+#include <vector>
+
+namespace GFX {
+
+	class FBO;
+
+	//transient render targets shared by the passes of a frame.
+	//A pass acquires the FBO it writes and releases it once the last pass that reads it has finished, the next acquire
+	//with the same size and format gets the same one, so targets whose lifetimes do not overlap share the memory.
+	//A pass that is disabled acquires nothing, and the free targets that are not used for some frames are deleted,
+	//which is also how the pool follows a resize of the window or a change of the render resolution.
+	//The content of an acquired target is undefined, the pass has to clear it or overwrite all of it.
+	class RenderTargetPool {
+	public:
+		struct Target {
+			FBO* fbo;
+			int num_textures;
+			int format;
+			int type;
+			bool use_depth_texture;
+			bool in_use;
+			long last_frame; //last time it was acquired
+			uint32 bytes;
+		};
+
+		static RenderTargetPool global;
+
+		std::vector<Target> targets;
+		int unused_frames; //frames a free target is kept
+		long frame;
+
+		//stats of the last frame
+		int num_acquired;
+		int max_in_use; //at the same time
+		int num_in_use;
+
+		RenderTargetPool();
+
+		//same parameters than FBO::create
+		FBO* acquire(int width, int height, int num_textures = 1, int format = GL_RGB, int type = GL_UNSIGNED_BYTE, bool use_depth_texture = false);
+		void release(FBO* fbo); //null is ignored
+		void endFrame(); //once per frame, after the last pass
+		void clear(); //deletes the free ones
+
+		uint32 getBytes();
+		std::string getStats();
+
+	private:
+		int frame_acquired;
+		int frame_max_in_use;
+	};
+
+};
+
+#endif
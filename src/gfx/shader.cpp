@@ -10,6 +10,14 @@
 
 #include "texture.h"
 
+#ifdef WIN32
+	#include <direct.h>
+#else
+	#include <sys/stat.h>
+#endif
+
+#define SHADER_BIN_VERSION 1 //this is used to regenerate bins if the format changes
+
 #ifndef MAX
 	#define MAX(A,B) ((A)>(B)?(A):(B))
 #endif 
@@ -64,12 +72,25 @@ std::map<std::string,Shader*> Shader::s_Shaders;
 bool Shader::s_ready = false;
 Shader* Shader::current = NULL;
 std::vector<char> Shader::lines_with_error;
+bool Shader::s_use_binary_cache = true;
+std::string Shader::s_binary_cache_path = "data/shader_cache/";
+int Shader::s_num_from_binary = 0;
+int Shader::s_num_compiled = 0;
+
+typedef struct
+{
+	int version;
+	int header_bytes;
+	uint64 hash; //of the code and the driver
+	GLenum format; //of the driver
+	int size;
+} sShaderBinInfo;
 
 Shader::Shader()
 {
 	if(!Shader::s_ready)
 		Shader::init();
-	program = vs = fs = cs = 0;
+	program = vs = fs = cs = gs = 0;
 	compiled = false;
 	from_atlas = false;
 
@@ -195,7 +216,7 @@ bool Shader::hasInfoLog() const
 
 // ******************************************
 
-bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
+bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm, const std::string& gsm)
 {
 	if (glCreateProgram == 0)
 	{
@@ -220,6 +241,16 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 		return false;
 	}
 
+	if (gsm.size() && !createGeometryShaderObject(gsm))
+	{
+		printf("Geometry shader compilation failed\n");
+		return false;
+	}
+
+	//so the driver keeps the binary for the cache
+	if (s_use_binary_cache && IsBinaryCacheSupported())
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
 	glLinkProgram(program);
 	assert (glGetError() == GL_NO_ERROR);
 
@@ -245,6 +276,177 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 	return true;
 }
 
+bool Shader::compileComputeFromMemory(const std::string& csm)
+{
+	if (program != 0)
+		glDeleteProgram(program);
+	program = glCreateProgram();
+	assert (glGetError() == GL_NO_ERROR);
+
+	if (!createComputeShaderObject(csm))
+	{
+		printf("Compute shader compilation failed\n");
+		return false;
+	}
+
+	if (s_use_binary_cache && IsBinaryCacheSupported())
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
+	glLinkProgram(program);
+	assert (glGetError() == GL_NO_ERROR);
+
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	assert(glGetError() == GL_NO_ERROR);
+
+	if (!linked)
+	{
+		saveProgramInfoLog(program);
+		release();
+		return false;
+	}
+
+	compiled = true;
+	locations.clear(); //regenerate table
+
+	return true;
+}
+
+bool Shader::IsBinaryCacheSupported()
+{
+	static int supported = -1;
+	if (supported != -1)
+		return supported == 1;
+
+	//glGetProgramBinary is core since 4.1
+	GLint major = 0;
+	GLint minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	bool available = major > 4 || (major == 4 && minor >= 1);
+
+	GLint num_extensions = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+	for (int i = 0; i < num_extensions && !available; ++i)
+		if (strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), "GL_ARB_get_program_binary") == 0)
+			available = true;
+
+	//some drivers support it without any format
+	GLint num_formats = 0;
+	if (available)
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+	supported = num_formats > 0 ? 1 : 0;
+	return supported == 1;
+}
+
+bool Shader::loadBinary(const std::string& filename, uint64 hash)
+{
+	std::vector<unsigned char> data;
+	if (!readFileBin(filename, data) || data.size() < 4 + sizeof(sShaderBinInfo) || memcmp(&data[0], "SBIN", 4) != 0)
+		return false;
+
+	sShaderBinInfo info;
+	memcpy(&info, &data[4], sizeof(sShaderBinInfo));
+	if (info.version != SHADER_BIN_VERSION || info.header_bytes != sizeof(sShaderBinInfo) || info.hash != hash ||
+		data.size() != 4 + sizeof(sShaderBinInfo) + info.size)
+		return false; //from another version of the code or of the driver
+
+	release();
+	program = glCreateProgram();
+	glProgramBinary(program, info.format, &data[4 + sizeof(sShaderBinInfo)], info.size);
+
+	//the driver can reject it even with the same hash, then it is compiled as usual
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	glGetError();
+	if (!linked)
+	{
+		release();
+		return false;
+	}
+
+	compiled = true;
+	locations.clear(); //regenerate table
+	return true;
+}
+
+bool Shader::saveBinary(const std::string& filename, uint64 hash)
+{
+	GLint size = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+	if (!size)
+		return false;
+
+	std::vector<unsigned char> binary(size);
+	sShaderBinInfo info;
+	memset(&info, 0, sizeof(info));
+	info.version = SHADER_BIN_VERSION;
+	info.header_bytes = sizeof(sShaderBinInfo);
+	info.hash = hash;
+	glGetProgramBinary(program, size, &size, &info.format, &binary[0]);
+	info.size = size;
+	if (glGetError() != GL_NO_ERROR)
+		return false;
+
+	//the folder is created the first time
+	#ifdef WIN32
+		_mkdir(getFolderName(filename).c_str());
+	#else
+		mkdir(getFolderName(filename).c_str(), 0755);
+	#endif
+
+	FILE* f = fopen(filename.c_str(), "wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write shader BIN: " << filename << std::endl;
+		return false;
+	}
+
+	//watermark
+	fwrite("SBIN", sizeof(char), 4, f);
+	fwrite(&info, sizeof(sShaderBinInfo), 1, f);
+	fwrite(&binary[0], sizeof(unsigned char), size, f);
+	fclose(f);
+	return true;
+}
+
+//FNV-1a, the key of the binary cache
+static uint64 hashString(const std::string& str, uint64 hash = 14695981039346656037ULL)
+{
+	for (size_t i = 0; i < str.size(); ++i)
+	{
+		hash ^= (unsigned char)str[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+//empty when the cache is not used, the names of the permutations have brackets
+static std::string getBinaryFilename(const char* name)
+{
+	if (!Shader::s_use_binary_cache || !Shader::IsBinaryCacheSupported())
+		return "";
+	std::string filename = name;
+	for (size_t i = 0; i < filename.size(); ++i)
+		if (!isalnum((unsigned char)filename[i]) && filename[i] != '_' && filename[i] != '-')
+			filename[i] = '_';
+	return Shader::s_binary_cache_path + filename + ".sbin";
+}
+
+//a binary only works with the same driver and GPU
+static uint64 hashDriver()
+{
+	static uint64 hash = 0;
+	if (!hash)
+	{
+		const char* strings[3] = { (const char*)glGetString(GL_VENDOR), (const char*)glGetString(GL_RENDERER), (const char*)glGetString(GL_VERSION) };
+		hash = 14695981039346656037ULL;
+		for (int i = 0; i < 3; ++i)
+			hash = hashString(strings[i] ? strings[i] : "", hash);
+	}
+	return hash;
+}
+
 bool Shader::validate()
 {
 	glValidateProgram(program);
@@ -279,6 +481,11 @@ bool Shader::createComputeShaderObject(const std::string& shader)
 	return createShaderObject(GL_COMPUTE_SHADER, cs, shader);
 }
 
+bool Shader::createGeometryShaderObject(const std::string& shader)
+{
+	return createShaderObject(GL_GEOMETRY_SHADER, gs, shader);
+}
+
 
 bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::string& code)
 {
@@ -351,6 +558,13 @@ void Shader::release()
 		cs = 0;
 	}
 
+	if (gs)
+	{
+		glDeleteShader(gs);
+		assert(glGetError() == GL_NO_ERROR);
+		gs = 0;
+	}
+
 	if (program)
 	{
 		glDeleteProgram(program);
@@ -1011,6 +1225,7 @@ bool Shader::LoadAtlas(const char* filename, const char* base_path_cstr)
 		}
 	}
 
+	std::cout << " * Shaders: " << s_num_from_binary << " from the binary cache, " << s_num_compiled << " compiled" << std::endl;
 	return true;
 }
 
@@ -1069,7 +1284,7 @@ std::string Shader::ExpandIncludes(std::string name, std::string content, std::m
 	return subfile_content;
 }
 
-Shader* Shader::CompileShader(const char* name, const char* vs_code, const char* fs_code, const char* macros = nullptr)
+Shader* Shader::CompileShader(const char* name, const char* vs_code, const char* fs_code, const char* macros, const char* gs_code)
 {
 	//expand macros
 	std::string macros_str = "";
@@ -1082,6 +1297,7 @@ Shader* Shader::CompileShader(const char* name, const char* vs_code, const char*
 
 	std::string vs(vs_code);
 	std::string fs(fs_code);
+	std::string gs(gs_code ? gs_code : "");
 	std::string version;
 
 	//add macros after #version, otherwise it crashes
@@ -1092,10 +1308,14 @@ Shader* Shader::CompileShader(const char* name, const char* vs_code, const char*
 		vs = vs.substr(index);
 		index = fs.find_first_of('\n');
 		fs = fs.substr(index);
+		if (gs.size())
+			gs = gs.substr(gs.find_first_of('\n'));
 	}
 
 	vs = version + "\n" + macros_str + "\n" + vs;
 	fs = version + "\n" + macros_str + "\n" + fs;
+	if (gs.size())
+		gs = version + "\n" + macros_str + "\n" + gs;
 
 	Shader* shader = NULL;
 	auto it2 = s_Shaders.find(name);
@@ -1107,12 +1327,25 @@ Shader* Shader::CompileShader(const char* name, const char* vs_code, const char*
 	else
 		shader = it2->second;
 
-	if (!shader->compileFromMemory(vs.c_str(), fs.c_str()))
+	//the binary of a previous run if nothing changed
+	std::string binary_filename = getBinaryFilename(name);
+	uint64 hash = binary_filename.size() ? hashString(vs + '\0' + fs + '\0' + gs, hashDriver()) : 0;
+	bool from_binary = binary_filename.size() && shader->loadBinary(binary_filename, hash);
+	if (!from_binary && !shader->compileFromMemory(vs, fs, gs))
 	{
+		s_Shaders.erase(name);
 		delete shader;
 		std::cout << " * Compilation error in shader at atlas: " << name << std::endl;
 		return nullptr; //stop here
 	}
+	if (from_binary)
+		s_num_from_binary++;
+	else
+	{
+		s_num_compiled++;
+		if (binary_filename.size())
+			shader->saveBinary(binary_filename, hash);
+	}
 
 	//shader->vs_filename = subshader.vs_name;
 	//shader->ps_filename = subshader.fs_name;
@@ -1122,6 +1355,90 @@ Shader* Shader::CompileShader(const char* name, const char* vs_code, const char*
 	return shader;
 }
 
+Shader* Shader::CompileComputeShader(const char* name, const char* cs_code, const char* macros)
+{
+	//expand macros
+	std::string macros_str = "";
+	if (macros)
+	{
+		auto t = tokenize(macros, ",");
+		for (size_t j = 0; j < t.size(); ++j)
+			macros_str += "#define " + t[j] + "\n";
+	}
+
+	std::string cs(cs_code);
+	std::string version;
+
+	//add macros after #version, otherwise it crashes
+	if (cs[0] == '#')
+	{
+		size_t index = cs.find_first_of('\n');
+		version = cs.substr(0, index);
+		cs = cs.substr(index);
+	}
+
+	cs = version + "\n" + macros_str + "\n" + cs;
+
+	Shader* shader = NULL;
+	auto it2 = s_Shaders.find(name);
+	if (it2 == s_Shaders.end())
+	{
+		shader = new Shader();
+		s_Shaders[name] = shader;
+	}
+	else
+		shader = it2->second;
+
+	std::string binary_filename = getBinaryFilename(name);
+	uint64 hash = binary_filename.size() ? hashString(cs, hashDriver()) : 0;
+	bool from_binary = binary_filename.size() && shader->loadBinary(binary_filename, hash);
+	if (!from_binary && !shader->compileComputeFromMemory(cs))
+	{
+		s_Shaders.erase(name);
+		delete shader;
+		std::cout << " * Compilation error in compute shader at atlas: " << name << std::endl;
+		return nullptr;
+	}
+	if (from_binary)
+		s_num_from_binary++;
+	else
+	{
+		s_num_compiled++;
+		if (binary_filename.size())
+			shader->saveBinary(binary_filename, hash);
+	}
+
+	shader->from_atlas = true;
+	return shader;
+}
+
+Shader* Shader::GetLayered(const char* name)
+{
+	std::string layered_name = std::string(name) + "_layered";
+	auto it = s_Shaders.find(layered_name);
+	if (it != s_Shaders.end())
+		return it->second;
+
+	Shader* shader = Get(name);
+	std::string vs_code, gs_code, fs_code;
+	if (!shader || !shader->from_atlas ||
+		!GetShaderFile("layered.vs", vs_code) ||
+		!GetShaderFile("layered.gs", gs_code) ||
+		!GetShaderFile(shader->fs_filename.c_str(), fs_code))
+	{
+		std::cout << " * Error in shader atlas, couldnt find files for the layered version of " << name << std::endl;
+		return nullptr;
+	}
+
+	Shader* layered = CompileShader(layered_name.c_str(), vs_code.c_str(), fs_code.c_str(), shader->macros.c_str(), gs_code.c_str());
+	if (!layered)
+		return nullptr;
+	layered->vs_filename = "layered.vs";
+	layered->fs_filename = shader->fs_filename;
+	layered->from_atlas = true;
+	return layered;
+}
+
 bool Shader::GetShaderFile(const char* filename, std::string& content)
 {
 	auto it = s_shader_files.find(filename);
@@ -44,7 +44,8 @@ namespace GFX {
 		bool load(const std::string& vsf, const std::string& psf, const char* macros);
 
 		//internal functions
-		bool compileFromMemory(const std::string& vsm, const std::string& psm);
+		bool compileFromMemory(const std::string& vsm, const std::string& psm, const std::string& gsm = "");
+		bool compileComputeFromMemory(const std::string& csm); //requires GL 4.3
 		void release();
 		void enable();
 		void disable();
@@ -114,6 +115,8 @@ namespace GFX {
 		void setMacros(const char* macros);
 
 		static Shader* Get(const char* vsf, const char* psf = NULL, const char* macros = NULL);
+		//the shader of the atlas rendering the six faces of a cubemap in one pass (layered.vs and layered.gs), compiled on demand
+		static Shader* GetLayered(const char* name);
 		static void ReloadAll();
 		static std::map<std::string, Shader*> s_Shaders;
 
@@ -126,6 +129,7 @@ namespace GFX {
 		GLuint vs;
 		GLuint fs;
 		GLuint cs; //compute
+		GLuint gs; //geometry, optional
 		GLuint program;
 		std::string info_log;
 		std::string log;
@@ -134,7 +138,8 @@ namespace GFX {
 
 		bool createVertexShaderObject(const std::string& shader);
 		bool createFragmentShaderObject(const std::string& shader);
-		bool createComputeShaderObject(const std::string& shader); //not used yet
+		bool createComputeShaderObject(const std::string& shader);
+		bool createGeometryShaderObject(const std::string& shader);
 		bool createShaderObject(unsigned int type, GLuint& handle, const std::string& shader);
 		void saveShaderInfoLog(GLuint obj);
 		void saveProgramInfoLog(GLuint obj);
@@ -156,7 +161,9 @@ namespace GFX {
 		static std::map<std::string, std::string> s_shader_files; //stores strings with shadercode
 
 		//compiles and stores shader, if exist it will recompile it!
-		static Shader* CompileShader(const char* name, const char* vs_code, const char* fs_code, const char* macros);
+		static Shader* CompileShader(const char* name, const char* vs_code, const char* fs_code, const char* macros, const char* gs_code = nullptr);
+		//compute shaders are not listed in the atlas header, they are compiled on demand from a subfile
+		static Shader* CompileComputeShader(const char* name, const char* cs_code, const char* macros);
 		static std::string ExpandIncludes(std::string name, std::string content, std::map<std::string, std::string>& subfiles, const std::string& base_path);
 		static bool LoadAtlas(const char* filename, const char* base_path = nullptr);
 		static bool GetShaderFile(const char* filename, std::string& content);
@@ -183,6 +190,17 @@ namespace GFX {
 		static UberShader* GetUberShader(const char* name);
 
 		static Shader* getDefaultShader(std::string name);
+
+		//Binary cache of the programs of the atlas, a linked program is stored in s_binary_cache_path and the next runs
+		//load it instead of compiling the code (GL 4.1 or GL_ARB_get_program_binary).
+		//The file has the hash of the code (with the macros) and of the driver, it is replaced when any of them changes.
+		static bool s_use_binary_cache;
+		static std::string s_binary_cache_path;
+		static int s_num_from_binary; //since the start
+		static int s_num_compiled;
+		static bool IsBinaryCacheSupported();
+		bool loadBinary(const std::string& filename, uint64 hash);
+		bool saveBinary(const std::string& filename, uint64 hash);
 	};
 
 	//Frontend for Uniform Buffer Objects or Shared Storage Buffer Objects
@@ -8,8 +8,12 @@
 #include "fbo.h"
 #include "mesh.h"
 #include "shader.h"
+#include "uploadring.h"
+#include "texturestreamer.h"
 
 #include "../utils/utils.h"
+#include "../utils/texture_cooker.h"
+#include "../utils/image_decoder.h"
 #include "../extra/picopng.h"
 #include "../extra/jpgd.h"
 #define DDSKTX_IMPLEMENT
@@ -58,6 +62,9 @@ namespace GFX
 	int Texture::default_mag_filter = GL_LINEAR;
 	int Texture::default_min_filter = GL_LINEAR_MIPMAP_LINEAR;
 	FBO* Texture::global_fbo = NULL;
+	bool Texture::use_cooked_textures = true;
+	bool Texture::cook_missing_textures = false;
+	unsigned int Texture::hdre_format = GL_RGB9_E5;
 
 	Texture::Texture()
 	{
@@ -141,6 +148,7 @@ namespace GFX
 			delete m;
 		}
 		sTexturesLoaded.clear();
+		TextureUploadRing::global.release();
 	}
 
 	void Texture::debugInMenu()
@@ -178,7 +186,6 @@ namespace GFX
 		upload(format, type, mipmaps, data, internal_format);
 	}
 
-	/*
 	void Texture::create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
 	{
 		assert(width && height && depth && "texture must have a size");
@@ -189,7 +196,7 @@ namespace GFX
 		this->format = format;
 		this->internal_format = internal_format;
 		this->type = type;
-		this->mipmaps = mipmaps && isPowerOfTwo(width) && isPowerOfTwo(height) && format != GL_DEPTH_COMPONENT && isPowerOfTwo(this->depth);
+		this->mipmaps = mipmaps && isPowerOfTwo(width) && isPowerOfTwo(height) && format != GL_DEPTH_COMPONENT && isPowerOfTwo(depth);
 
 		//Delete previous texture and ensure that previous bounded texture_id is not of another texture type
 		if (this->texture_id != 0)
@@ -204,7 +211,6 @@ namespace GFX
 
 		upload3D(format, type, mipmaps, data, internal_format);
 	}
-	*/
 
 	void Texture::createCubemap(unsigned int width, unsigned int height, Uint8** data, unsigned int format, unsigned int type, bool mipmaps, unsigned int internal_format)
 	{
@@ -256,7 +262,7 @@ namespace GFX
 		return texture;
 	}
 
-	Texture* Texture::GetAsync(const char* filename, bool mipmaps, bool wrap)
+	Texture* Texture::GetAsync(const char* filename, bool mipmaps, bool wrap, int mip_flags, float alpha_cutoff)
 	{
 		//disable loading textures in thread
 		//return Get(filename, mipmaps, wrap);
@@ -274,9 +280,17 @@ namespace GFX
 		//register
 		temp->setName(filename);
 		temp->loading = true;
+		temp->streamed = true;
+		temp->pending_mip = 0;
+		temp->mip_flags = mip_flags >= 0 ? mip_flags : getMipFlagsFromName(filename);
+		temp->alpha_cutoff = alpha_cutoff;
+
+		//the staging memory needs the GL context, so it is created here
+		if (TextureUploadRing::global.enabled && !TextureUploadRing::global.isReady())
+			TextureUploadRing::global.init();
 
 		//add action to BG Thread 
-		LoadTextureTask* task = new LoadTextureTask(filename);
+		LoadTextureTask* task = new LoadTextureTask(filename, -1, temp->mip_flags, alpha_cutoff);
 		TaskManager::background.addTask(task);
 
 		return temp;
@@ -294,6 +308,28 @@ namespace GFX
 			setName(filename);
 			return true;
 		}
+		if (ext == "ktx")
+		{
+			if (!loadKTX(filename))
+				return false;
+			setName(filename);
+			return true;
+		}
+
+		//cooked version already compressed and with mipmaps
+		std::string cooked = use_cooked_textures ? getCookedTextureFilename(filename) : "";
+		if (cooked.size() && loadKTX(cooked.c_str()))
+		{
+			if (!wrap)
+			{
+				glBindTexture(this->texture_type, texture_id);
+				glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+				glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+				glBindTexture(this->texture_type, 0);
+			}
+			setName(filename);
+			return true;
+		}
 
 		//image based textures
 		::Image* image = new ::Image();
@@ -303,6 +339,11 @@ namespace GFX
 			return false;
 		}
 
+		if (mip_flags < 0)
+			mip_flags = getMipFlagsFromName(filename);
+		if (cook_missing_textures && use_cooked_textures && type == GL_UNSIGNED_BYTE)
+			cookImage(image, (std::string(filename) + ".ktx").c_str(), COOK_AUTO, mip_flags);
+
 		loadFromImage(image, mipmaps, wrap, type);
 		setName(filename);
 
@@ -316,9 +357,19 @@ namespace GFX
 		if (type == GL_FLOAT)
 			internal_format = (image->num_channels == 3 ? GL_RGB32F : GL_RGBA32F);
 
+		//the mips are generated in the CPU (in linear space, normalmaps renormalized...) instead of glGenerateMipmap, any size
+		bool cpu_mipmaps = mipmaps && type == GL_UNSIGNED_BYTE;
+
 		//upload to VRAM
 		// We have to synchronously upload for now because Image class is not ref-counted
-		create(image->width, image->height, (image->num_channels == 3 ? GL_RGB : GL_RGBA), type, mipmaps, image->data, 0);
+		create(image->width, image->height, (image->num_channels == 3 ? GL_RGB : GL_RGBA), type, mipmaps, cpu_mipmaps ? NULL : image->data, 0);
+		if (cpu_mipmaps)
+		{
+			int num_levels = getNumMipLevels(image->width, image->height);
+			std::vector<Uint8> mip_chain(getMipChainSize(image->width, image->height, image->num_channels, num_levels));
+			generateMipChain(image->data, image->width, image->height, image->num_channels, &mip_chain[0], getMipFlags(), alpha_cutoff, num_levels);
+			uploadMipChain(&mip_chain[0], num_levels);
+		}
 
 		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
@@ -332,7 +383,7 @@ namespace GFX
 
 	void Texture::upload(::Image* img)
 	{
-		create(img->width, img->height, img->num_channels == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, true, img->data);
+		loadFromImage(img); //with the mips of the CPU
 	}
 
 	void Texture::upload(FloatImage* img)
@@ -356,6 +407,8 @@ namespace GFX
 				internal_format = format == GL_RGB ? GL_RGB32F : GL_RGBA32F;
 			else if (type == GL_HALF_FLOAT)
 				internal_format = format == GL_RGB ? GL_RGB16F : GL_RGBA16F;
+			else if (type == GL_UNSIGNED_INT_2_10_10_10_REV)
+				internal_format = GL_RGB10_A2;
 		}
 
 		glTexImage2D(this->texture_type, 0, internal_format == 0 ? format : internal_format, width, height, 0, format, type, data);
@@ -373,7 +426,35 @@ namespace GFX
 		assert(checkGLErrors() && "Error uploading texture");
 	}
 
-	/*
+	void Texture::uploadMipChain(const Uint8* data, int num_levels)
+	{
+		assert(texture_id && texture_type == GL_TEXTURE_2D && type == GL_UNSIGNED_BYTE && "Must create the texture before uploading the levels.");
+		int num_channels = format == GL_RGB ? 3 : 4;
+		int level_width = (int)width;
+		int level_height = (int)height;
+
+		glBindTexture(this->texture_type, texture_id);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1); //small levels have rows not multiple of 4
+		for (int level = 0; level < num_levels; ++level)
+		{
+			glTexImage2D(this->texture_type, level, internal_format == 0 ? format : internal_format, level_width, level_height, 0, format, type, data);
+			data += level_width * level_height * num_channels;
+			level_width = std::max(level_width / 2, 1);
+			level_height = std::max(level_height / 2, 1);
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		this->mipmaps = num_levels > 1; //create() only allows them in power of two sizes
+		glTexParameteri(this->texture_type, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+		glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, num_levels > 1 ? Texture::default_min_filter : GL_LINEAR);
+		glBindTexture(this->texture_type, 0);
+		assert(checkGLErrors() && "Error uploading mipmaps");
+	}
+
+	int Texture::getMipFlags()
+	{
+		return mip_flags >= 0 ? mip_flags : getMipFlagsFromName(filename.c_str());
+	}
+
 	void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format) {
 		assert(texture_id && "Must create texture before uploading data.");
 		assert(texture_type == GL_TEXTURE_3D && "Texture type does not match.");
@@ -394,7 +475,6 @@ namespace GFX
 		glBindTexture(this->texture_type, 0);
 		assert(checkGLErrors() && "Error uploading texture");
 	}
-	*/
 
 	void Texture::uploadCubemap(unsigned int format, unsigned int t, bool mips, Uint8** data, unsigned int intFormat, int level) {
 
@@ -530,41 +610,126 @@ namespace GFX
 		return loadKTX(buffer);
 	}
 
-	bool Texture::loadKTX(std::vector<unsigned char>& buffer)
+	bool Texture::loadKTX(std::vector<unsigned char>& buffer, int first_mip)
 	{
-		std::vector<unsigned char> out_image;
-
 		ddsktx_texture_info tc = { 0 };
-		if (!ddsktx_parse(&tc, &buffer[0], buffer.size(), NULL))
+		if (!buffer.size() || !ddsktx_parse(&tc, &buffer[0], (int)buffer.size(), NULL))
 			return false;
 
-		this->texture_type = GL_TEXTURE_2D;
-		if (tc.flags & DDSKTX_TEXTURE_FLAG_CUBEMAP)
-			this->texture_type = GL_TEXTURE_CUBE_MAP;
-		else if (tc.flags & DDSKTX_TEXTURE_FLAG_VOLUME)
-			this->texture_type = GL_TEXTURE_3D;
+		//the mips before first_mip are skipped, used by the streaming
+		if (first_mip < 0)
+			first_mip = TextureStreamer::global.getPreviewMip(tc.width, tc.height);
+		first_mip = std::min(first_mip, tc.num_mips - 1);
+
+		//formats available in desktop GL (BC1/BC3 from s3tc, BC4/BC5 are RGTC)
+		bool compressed = ddsktx_format_compressed(tc.format);
+		unsigned int gl_internal_format = 0;
+		unsigned int gl_format = GL_RGBA;
+		unsigned int gl_type = GL_UNSIGNED_BYTE;
+		switch (tc.format)
+		{
+			case DDSKTX_FORMAT_BC1: gl_internal_format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT; gl_format = GL_RGB; break;
+			case DDSKTX_FORMAT_BC3: gl_internal_format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT; break;
+			case DDSKTX_FORMAT_BC4: gl_internal_format = GL_COMPRESSED_RED_RGTC1; gl_format = GL_RED; break;
+			case DDSKTX_FORMAT_BC5: gl_internal_format = GL_COMPRESSED_RG_RGTC2; gl_format = GL_RG; break;
+			case DDSKTX_FORMAT_BC7: gl_internal_format = GL_COMPRESSED_RGBA_BPTC_UNORM; break; //GL 4.2
+			case DDSKTX_FORMAT_RGBA8: gl_internal_format = GL_RGBA; break;
+			case DDSKTX_FORMAT_RGB8: gl_internal_format = GL_RGB; gl_format = GL_RGB; break;
+			case DDSKTX_FORMAT_RGBA16F: gl_internal_format = GL_RGBA16F; gl_type = GL_HALF_FLOAT; break;
+			case DDSKTX_FORMAT_RGB9E5: gl_internal_format = GL_RGB9_E5; gl_format = GL_RGB; gl_type = GL_UNSIGNED_INT_5_9_9_9_REV; break; //cooked HDRE
+			default:
+				std::cout << "[ERROR] KTX format not supported: " << ddsktx_format_str(tc.format) << std::endl;
+				return false;
+		}
+		if (tc.flags & DDSKTX_TEXTURE_FLAG_VOLUME)
+		{
+			std::cout << "[ERROR] KTX 3D textures not supported" << std::endl;
+			return false;
+		}
+
+		//always a new id, so no levels of a previous size are left in VRAM
+		if (texture_id)
+			glDeleteTextures(1, &texture_id);
+		texture_id = 0;
+		this->texture_type = (tc.flags & DDSKTX_TEXTURE_FLAG_CUBEMAP) ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+		this->width = (float)std::max(tc.width >> first_mip, 1);
+		this->height = (float)std::max(tc.height >> first_mip, 1);
+		this->depth = 0;
+		this->format = gl_format;
+		this->type = gl_type;
+		this->internal_format = gl_internal_format;
+		this->mipmaps = tc.num_mips - first_mip > 1;
+		this->full_width = tc.width;
+		this->full_height = tc.height;
+		this->resident_mip = first_mip;
+		this->pending_mip = -1;
 
 		if (texture_id == 0)
 			glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
 		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 
-		for (int mip = 0; mip < tc.num_mips; mip++) {
-			ddsktx_sub_data sub_data;
-			ddsktx_get_sub(&tc, &sub_data, &buffer[0], buffer.size(), 0, 0, mip);
-			// Fill/Set texture sub resource data (mips in this case)
-			/*
-			if (ddsktx_format_compressed(tc.format))
-				//glCompressedTexImage2D(this->texture_type,mip,
-			else
-				glTexImage2D(this->texture_type, mip, internal_format == 0 ? format : internal_format, width, height, 0, format, type, data);
-				//glTexImage2D(..);
-			*/
+		int num_faces = texture_type == GL_TEXTURE_CUBE_MAP ? 6 : 1;
+		for (int face = 0; face < num_faces; ++face)
+		{
+			unsigned int target = texture_type == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : GL_TEXTURE_2D;
+			for (int mip = first_mip; mip < tc.num_mips; mip++)
+			{
+				ddsktx_sub_data sub_data;
+				ddsktx_get_sub(&tc, &sub_data, &buffer[0], (int)buffer.size(), 0, face, mip);
+				if (compressed)
+					glCompressedTexImage2D(target, mip - first_mip, gl_internal_format, sub_data.width, sub_data.height, 0, sub_data.size_bytes, sub_data.buff);
+				else
+					glTexImage2D(target, mip - first_mip, gl_internal_format, sub_data.width, sub_data.height, 0, gl_format, gl_type, sub_data.buff);
+			}
 		}
 
-		return true;
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glTexParameteri(this->texture_type, GL_TEXTURE_MAX_LEVEL, tc.num_mips - 1 - first_mip);
+		glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+		glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);
+		bool repeat = this->mipmaps && texture_type == GL_TEXTURE_2D;
+		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, repeat ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, repeat ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+		glBindTexture(this->texture_type, 0);
+
+		return checkGLErrors();
 	}
 
 
+	float Texture::getBytesPerPixel()
+	{
+		switch (internal_format)
+		{
+			case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+			case GL_COMPRESSED_RED_RGTC1: return 0.5f;
+			case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+			case GL_COMPRESSED_RG_RGTC2:
+			case GL_COMPRESSED_RGBA_BPTC_UNORM: return 1.0f;
+			case GL_RGB9_E5: return 4.0f;
+		}
+
+		float channels = 4; //RGB is usually stored with padding
+		if (format == GL_RED || format == GL_DEPTH_COMPONENT) channels = 1;
+		else if (format == GL_RG) channels = 2;
+		float size = 1;
+		if (type == GL_FLOAT || type == GL_UNSIGNED_INT) size = 4;
+		else if (type == GL_HALF_FLOAT || type == GL_UNSIGNED_SHORT) size = 2;
+		return channels * size;
+	}
+
+	uint32 Texture::getVRAMSize()
+	{
+		float size = width * height * getBytesPerPixel();
+		if (mipmaps)
+			size *= 4.0f / 3.0f;
+		if (texture_type == GL_TEXTURE_CUBE_MAP)
+			size *= 6;
+		else if (depth)
+			size *= depth;
+		return (uint32)size;
+	}
+
 	void Texture::bind()
 	{
 		//glEnable(this->texture_type); //enable the textures 
@@ -653,6 +818,16 @@ namespace GFX
 		return white;
 	}
 
+	Texture* Texture::getFlatNormalTexture()
+	{
+		static Texture* flat_normal = NULL;
+		if (flat_normal)
+			return flat_normal;
+		const Uint8 data[3] = { 128,128,255 }; //(0,0,1) in tangent space
+		flat_normal = new Texture(1, 1, GL_RGB, GL_UNSIGNED_BYTE, true, (Uint8*)data);
+		return flat_normal;
+	}
+
 	void Texture::copyTo(Texture* destination, Shader* shader)
 	{
 		if (!destination) //to current viewport
@@ -739,20 +914,21 @@ void Image::fromTexture(GFX::Texture* texture)
 
 bool Image::load(const char* filename)
 {
-	std::string str = filename;
-	std::string ext = str.substr(str.size() - 4, 4);
 	double time = getTime();
 	std::cout << " + Image loading: " << TermColor::YELLOW << filename << TermColor::DEFAULT << " ... ";
 
 	bool found = false;
 
-	if (ext == ".tga" || ext == ".TGA")
-		found = loadTGA(filename);
-	else if (ext == ".png" || ext == ".PNG")
-		found = loadPNG(filename);
-	else if (ext == ".jpg" || ext == ".JPG" || ext == "JPEG" || ext == "jpeg")
-		found = loadJPG(filename);
-	else
+	//the format comes from the content of the file, not from the extension
+	std::vector<unsigned char> buffer;
+	readFileBin(filename, buffer);
+	eImageFormat format = getImageFormat(buffer, filename);
+
+	if (format == IMAGE_TGA)
+		found = loadTGA(buffer); //already in memory
+	else if (format == IMAGE_PNG || format == IMAGE_JPG)
+		found = decodeImage(buffer, this);
+	else if (buffer.size())
 	{
 		std::cout << "[ERROR]: unsupported format" << std::endl;
 		return false; //unsupported file type
@@ -772,31 +948,25 @@ bool Image::load(const char* filename)
 //TGA format from: http://www.paulbourke.net/dataformats/tga/
 //also on https://gshaw.ca/closecombat/formats/tga.html
 bool Image::loadTGA(const char* filename)
+{
+	std::vector<unsigned char> buffer;
+	if (!readFileBin(filename, buffer))
+		return false;
+	return loadTGA(buffer);
+}
+
+bool Image::loadTGA(std::vector<unsigned char>& buffer)
 {
 	GLubyte TGAheader[12] = {0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-    GLubyte TGAcompare[12];
-    GLubyte header[6];
-    GLuint bytesPerPixel;
-    GLuint imageSize;
-    //GLuint type = GL_RGBA;
+	GLuint imageSize;
+	//GLuint type = GL_RGBA;
 
-    FILE * file = fopen(filename, "rb");
-    
-    if ( file == NULL || fread(TGAcompare, 1, sizeof(TGAcompare), file) != sizeof(TGAcompare) ||
-        memcmp(TGAheader, TGAcompare, sizeof(TGAheader)) != 0 ||
-        fread(header, 1, sizeof(header), file) != sizeof(header))
-    {
-        if (file == NULL)
-            return NULL;
-        else
-        {
-            fclose(file);
-            return NULL;
-        }
-    }
-
-    width = header[1] * 256 + header[0];
-    height = header[3] * 256 + header[2];
+	if (buffer.size() < 18 || memcmp(TGAheader, &buffer[0], sizeof(TGAheader)) != 0)
+		return false;
+	const GLubyte* header = &buffer[12];
+
+	width = header[1] * 256 + header[0];
+	height = header[3] * 256 + header[2];
 	num_channels = header[4] / 8;
 
 	bool error = false;
@@ -807,42 +977,31 @@ bool Image::loadTGA(const char* filename)
 		std::cerr << "File format not supported: " << num_channels << " bytes per pixel" << std::endl;
 	}
     
-    if (width <= 0 || height <= 0)
+	if (width <= 0 || height <= 0)
 	{
 		error = true;
 		std::cerr << "Wrong texture size: " << width << "x" << height << " pixels" << std::endl;
 	}
 
-	if (error)
-    {
-        fclose(file);
-        return false;
-    }
+	imageSize = width * height * num_channels;
+	if (error || buffer.size() < 18 + imageSize)
+		return false;
 
-    imageSize = width * height * num_channels;
-    
-    data = new GLubyte[imageSize];
-    if (data == NULL || fread(data, 1, imageSize, file) != imageSize)
-    {
-        if (data != NULL)
-            delete []data;
-        fclose(file);
-        return NULL;
-    }
+	data = new GLubyte[imageSize];
+	memcpy(data, &buffer[18], imageSize);
 
 	if (header[5] & (1 << 5)) //flip
 		origin_topleft = true;
     
 	//flip BGR to RGB pixels
 	#pragma omp simd
-    for (GLuint i = 0; i < int(imageSize); i += num_channels)
-    {
-        uint8 temp = data[i];
-        data[i] = data[i + 2];
-        data[i + 2] = temp;
-    }
-    
-    fclose(file);
+	for (GLuint i = 0; i < imageSize; i += num_channels)
+	{
+		uint8 temp = data[i];
+		data[i] = data[i + 2];
+		data[i + 2] = temp;
+	}
+
 	return true;
 }
 
@@ -1014,7 +1173,7 @@ bool FloatImage::loadIBIN(const char* filename)
 	return true;
 }
 
-void FloatImage::fromTexture(GFX::Texture* texture)
+void FloatImage::fromTexture(GFX::Texture* texture, int cubemap_face)
 {
 	assert(texture);
 	assert(texture->type == GL_FLOAT);
@@ -1028,7 +1187,7 @@ void FloatImage::fromTexture(GFX::Texture* texture)
 	}
 
 	texture->bind();
-	glGetTexImage(GL_TEXTURE_2D, 0, num_channels == 3 ? GL_RGB : GL_RGBA, GL_FLOAT, data);
+	glGetTexImage(cubemap_face == -1 ? GL_TEXTURE_2D : GL_TEXTURE_CUBE_MAP_POSITIVE_X + cubemap_face, 0, num_channels == 3 ? GL_RGB : GL_RGBA, GL_FLOAT, data);
 }
 
 void FloatImage::fromScreen(int width, int height)
@@ -1053,76 +1212,174 @@ bool isPowerOfTwo( int n )
 
 GFX::Texture* CubemapFromHDRE(const char* filename, GFX::Texture* output)
 {
+	GFX::Texture* texture = output ? output : new GFX::Texture();
+
+	//already converted in a previous run
+	std::string cooked = GFX::Texture::use_cooked_textures ? getCookedTextureFilename(filename) : "";
+	if (cooked.size() && texture->loadKTX(cooked.c_str()))
+		return texture;
+
 	HDRE* hdre = HDRE::Get(filename);
-	if (!hdre)
+	std::vector<std::vector<uint8>> levels;
+	unsigned int internal_format = GFX::Texture::hdre_format;
+	if (!hdre || !convertHDRE(hdre, internal_format, levels))
+	{
+		delete hdre;
+		if (!output)
+			delete texture;
 		return NULL;
+	}
 
-	GFX::Texture* texture = output ? output : new GFX::Texture();
-	if (hdre->getFacesf(0))
+	//packed instead of floats, a quarter of the memory and of the bytes to upload
+	bool rgb9e5 = internal_format == GL_RGB9_E5;
+	unsigned int format = rgb9e5 ? GL_RGB : GL_RGBA;
+	unsigned int type = rgb9e5 ? GL_UNSIGNED_INT_5_9_9_9_REV : GL_HALF_FLOAT;
+	for (int i = 0; i < (int)levels.size(); ++i)
 	{
-		texture->createCubemap(hdre->width, hdre->height, (Uint8**)hdre->getFacesf(0),
-			hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA, GL_FLOAT);
-		for (int i = 1; i < hdre->levels; ++i)
-			texture->uploadCubemap(texture->format, texture->type, false,
-				(Uint8**)hdre->getFacesf(i), GL_RGBA32F, i);
+		size_t face_size = levels[i].size() / 6;
+		Uint8* faces[6];
+		for (int face = 0; face < 6; ++face)
+			faces[face] = &levels[i][face * face_size];
+		if (i == 0)
+			texture->createCubemap(hdre->width, hdre->height, faces, format, type, levels.size() > 1, internal_format);
+		else
+			texture->uploadCubemap(format, type, false, faces, internal_format, i);
 	}
-	else
-		if (hdre->getFacesh(0))
-		{
-			texture->createCubemap(hdre->width, hdre->height, (Uint8**)hdre->getFacesh(0),
-				hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA, GL_HALF_FLOAT);
-			for (int i = 1; i < hdre->levels; ++i)
-				texture->uploadCubemap(texture->format, texture->type, false,
-					(Uint8**)hdre->getFacesh(i), GL_RGBA16F, i);
-		}
+	glBindTexture(GL_TEXTURE_CUBE_MAP, texture->texture_id);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, (int)levels.size() - 1);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+	if (GFX::Texture::cook_missing_textures && GFX::Texture::use_cooked_textures)
+		writeCubemapKTX((std::string(filename) + ".ktx").c_str(), hdre->width, internal_format, levels);
+
+	//it is in VRAM, the floats are not needed anymore
+	delete hdre;
 	return texture;
 }
 
 
 //*********************
 
-LoadTextureTask::LoadTextureTask(const char* str)
+LoadTextureTask::LoadTextureTask(const char* str, int mip, int mip_flags, float alpha_cutoff)
 {
 	filename = str;
 	image = NULL;
+	this->mip = mip;
+	this->mip_flags = mip_flags >= 0 ? mip_flags : getMipFlagsFromName(str);
+	this->alpha_cutoff = alpha_cutoff;
 }
 
 void LoadTextureTask::onExecute()
 {
+	//cooked version, only has to be read from disk
+	std::string cooked = GFX::Texture::use_cooked_textures ? getCookedTextureFilename(filename.c_str()) : "";
+	std::vector<unsigned char> ktx_data;
+	if (cooked.size() && readFileBin(cooked, ktx_data))
+	{
+		TaskManager::foreground.addTask(new UploadTextureTask(filename.c_str(), ktx_data, mip));
+		return;
+	}
+
+	GFX::TextureUploadRing& ring = GFX::TextureUploadRing::global;
+	bool cook = GFX::Texture::cook_missing_textures && GFX::Texture::use_cooked_textures;
+	std::vector<unsigned char> buffer;
+	int width = 0, height = 0, channels = 0;
+	bool has_info = readFileBin(filename, buffer) && getImageInfo(buffer, width, height, channels);
+
+	//decoded in RAM, the mips are generated from it straight into the staging memory (which is write only)
 	image = new Image();
-	if (!image->load(filename.c_str()))
+	if (has_info ? !decodeImage(buffer, image) : !image->load(filename.c_str()))
+	{
+		std::cout << "[ERROR] Image could not be loaded: " << filename << std::endl;
+		delete image;
+		image = NULL;
+		return;
+	}
+
+	//already in a background thread, so cooking here doesnt stall the app
+	if (cook)
+		cookImage(image, (filename + ".ktx").c_str(), COOK_AUTO, mip_flags);
+
+	//only the mips needed by the streaming are uploaded, they come from the same chain than a full load
+	//(filtered with the mip_flags) so the levels dont change when the streamer moves between them
+	int full_width = image->width;
+	int full_height = image->height;
+	int full_levels = getNumMipLevels(full_width, full_height);
+	int first_mip = mip < 0 ? GFX::TextureStreamer::global.getPreviewMip(full_width, full_height) : mip;
+	first_mip = std::min(std::max(first_mip, 0), full_levels - 1);
+	int mip_width = std::max(full_width >> first_mip, 1);
+	int mip_height = std::max(full_height >> first_mip, 1);
+
+	//all the levels are generated here, so the main thread only has to copy them
+	int num_levels = full_levels - first_mip;
+	uint32 chain_size = (uint32)getMipChainSize(mip_width, mip_height, image->num_channels, num_levels);
+
+	//written straight to the staging ring, the main thread only has to issue the upload
+	GFX::TextureUploadRing::Region* region = NULL;
+	uint8* staging = ring.enabled ? ring.allocateBlocking(chain_size, &region) : NULL;
+	if (staging)
 	{
+		generateMipChain(image->data, full_width, full_height, image->num_channels, staging, mip_flags, alpha_cutoff, full_levels, first_mip);
+		ring.queueUpload(filename.c_str(), region, mip_width, mip_height, image->num_channels, first_mip, full_width, full_height, num_levels);
 		delete image;
 		image = NULL;
 		return;
 	}
 
+	//the first level replaces the pixels of the image, the rest go in the chain
+	std::vector<unsigned char> chain(chain_size);
+	generateMipChain(image->data, full_width, full_height, image->num_channels, &chain[0], mip_flags, alpha_cutoff, full_levels, first_mip);
+	if (first_mip > 0)
+	{
+		image->resize(mip_width, mip_height, image->num_channels);
+		memcpy(image->data, &chain[0], (size_t)mip_width * mip_height * image->num_channels);
+	}
+
 	//image loaded, ready to go back to main thread
-	UploadTextureTask* upload_task = new UploadTextureTask(filename.c_str(), image);
+	UploadTextureTask* upload_task = new UploadTextureTask(filename.c_str(), image, first_mip, full_width, full_height);
+	if (num_levels > 1)
+	{
+		upload_task->mip_chain.swap(chain);
+		upload_task->num_levels = num_levels;
+	}
 	TaskManager::foreground.addTask(upload_task);
 }
 
-UploadTextureTask::UploadTextureTask(const char* filename, Image* image)
+UploadTextureTask::UploadTextureTask(const char* filename, Image* image, int mip, int full_width, int full_height)
 {
 	this->filename = filename;
 	this->image = image;
+	this->mip = mip;
+	this->full_width = full_width;
+	this->full_height = full_height;
+	this->num_levels = 1;
 	assert(image && "image cannot be null");
 }
 
+UploadTextureTask::UploadTextureTask(const char* filename, std::vector<unsigned char>& ktx_data, int mip)
+{
+	this->filename = filename;
+	this->image = NULL;
+	this->mip = mip;
+	this->full_width = this->full_height = 0; //read from the file
+	this->num_levels = 1;
+	this->ktx_data.swap(ktx_data);
+}
+
 void UploadTextureTask::onExecute()
 {
 	GFX::Texture* texture = NULL;
-	if (!image)
+	if (!image && !ktx_data.size())
 	{
 		std::cerr << "Image is null: " << filename << std::endl;
 		return;
 	}
-	assert(image && "image cant be null");
-
 	//in case somehow it got loaded while I was loading it in the background
 	auto it = GFX::Texture::sTexturesLoaded.find(filename);
 	if (it == GFX::Texture::sTexturesLoaded.end())
 	{
+		if (!image)
+			return;
 		/*
 		//create texture
 		if (!texture)
@@ -1135,9 +1392,32 @@ void UploadTextureTask::onExecute()
 
 	texture = it->second;
 
-	//upload to GPU
-	texture->loadFromImage(image);
+	//cooked textures are uploaded directly
+	if (!image)
+	{
+		if (!texture->loadKTX(ktx_data, mip))
+		{
+			std::cerr << "Cooked texture could not be loaded: " << filename << std::endl;
+			texture->pending_mip = -1;
+		}
+		texture->loading = false;
+		return;
+	}
+
+	//upload to GPU (create() removes it from the manager)
+	if (num_levels > 1)
+	{
+		texture->create(image->width, image->height, image->num_channels == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, true, NULL);
+		texture->uploadMipChain(&mip_chain[0], num_levels);
+	}
+	else
+		texture->loadFromImage(image);
+	texture->setName(filename.c_str());
 	texture->loading = false;
+	texture->full_width = full_width ? full_width : image->width;
+	texture->full_height = full_height ? full_height : image->height;
+	texture->resident_mip = mip;
+	texture->pending_mip = -1;
 
 	//delete image
 	delete image;
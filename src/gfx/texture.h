@@ -73,6 +73,7 @@ public:
 	bool load(const char* filename);
 
 	bool loadTGA(const char* filename);
+	bool loadTGA(std::vector<unsigned char>& buffer);
 	bool loadPNG(const char* filename, bool flip_y = true);
 	bool loadPNG(std::vector<unsigned char>& buffer, bool flip_y = false);
 	bool loadJPG(const char* filename, bool flip_y = false);
@@ -97,7 +98,7 @@ public:
 		if(num_channels == 4)
 			data[pos + 3] = v.w;
 	};
-	void fromTexture(GFX::Texture* texture);
+	void fromTexture(GFX::Texture* texture, int cubemap_face = -1);
 	void fromScreen(int width, int height);
 	bool loadIBIN(const char* filename);
 	bool saveIBIN(const char* filename);
@@ -112,6 +113,9 @@ namespace GFX {
 		static int default_mag_filter;
 		static int default_min_filter;
 		static FBO* global_fbo;
+		static bool use_cooked_textures; //load the .ktx cooked version of an image when it is up to date
+		static bool cook_missing_textures; //cook the images without .ktx when loading them (slow)
+		static unsigned int hdre_format; //HDRE cubemaps are converted to GL_RGB9_E5 or GL_RGBA16F (keeps the alpha)
 
 		//a general struct to store all the information about a TGA file
 
@@ -138,6 +142,19 @@ namespace GFX {
 		unsigned int wrapS;
 		unsigned int wrapT;
 
+		//streaming (only textures loaded with GetAsync), see TextureStreamer
+		bool streamed = false;
+		int full_width = 0; //size of the source, width and height are the ones in VRAM
+		int full_height = 0;
+		int resident_mip = 0; //mip of the source that is the level 0 in VRAM
+		int required_mip = 0; //the biggest one needed by the render calls of the last frame used
+		int pending_mip = -1; //mip being loaded
+		long last_used_frame = -1;
+
+		//mipmaps generated in the CPU, see generateMipChain
+		int mip_flags = -1; //eMipFlags, -1 means guessed from the filename
+		float alpha_cutoff = 0.5f; //for MIP_ALPHA_COVERAGE
+
 		//original data info
 		::Image image;
 
@@ -152,18 +169,24 @@ namespace GFX {
 		void clear();
 
 		void create(unsigned int width, unsigned int height, unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
-		//void create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
+		void create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 		void createCubemap(unsigned int width, unsigned int height, Uint8** data = NULL, unsigned int format = GL_RGBA, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, unsigned int internal_format = 0);
 
 		void upload(::Image* img);
 		void upload(::FloatImage* img);
 		void upload(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, const Uint8* data = NULL, unsigned int internal_format = 0);
-		//void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
+		void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 		void uploadCubemap(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8** data = NULL, unsigned int internal_format = 0, int level = 0);
 		void uploadAsArray(unsigned int texture_size, bool mipmaps = true);
+		//all the levels one after the other (as generateMipChain writes them), the texture must be created with the size of the first one
+		void uploadMipChain(const Uint8* data, int num_levels);
+		int getMipFlags();
 
 		bool loadKTX(const char* filename);
-		bool loadKTX(std::vector<unsigned char>& buffer);
+		bool loadKTX(std::vector<unsigned char>& buffer, int first_mip = 0); //first_mip -1 means the streaming preview
+
+		float getBytesPerPixel();
+		uint32 getVRAMSize(); //estimation, including mips
 
 		void bind();
 		void unbind();
@@ -180,7 +203,7 @@ namespace GFX {
 
 		//load using the manager (caching loaded ones to avoid reloading them)
 		static Texture* Get(const char* filename, bool mipmaps = true, bool wrap = true);
-		static Texture* GetAsync(const char* filename, bool mipmaps = true, bool wrap = true);
+		static Texture* GetAsync(const char* filename, bool mipmaps = true, bool wrap = true, int mip_flags = -1, float alpha_cutoff = 0.5f);
 		static Texture* Find(const char* filename);
 		void setName(const char* name) {
 			filename = name;
@@ -197,6 +220,7 @@ namespace GFX {
 		static FBO* getGlobalFBO(Texture* texture);
 		static Texture* getBlackTexture();
 		static Texture* getWhiteTexture();
+		static Texture* getFlatNormalTexture(); //for materials without normal map
 	};
 
 };
@@ -214,8 +238,11 @@ class LoadTextureTask : public Task {
 public:
 	std::string filename;
 	Image* image;
+	int mip; //first mip to load, -1 means the streaming preview
+	int mip_flags;
+	float alpha_cutoff;
 
-	LoadTextureTask(const char* filename);
+	LoadTextureTask(const char* filename, int mip = -1, int mip_flags = -1, float alpha_cutoff = 0.5f);
 	void onExecute();
 };
 
@@ -223,8 +250,15 @@ class UploadTextureTask : public Task {
 public:
 	std::string filename;
 	Image* image;
-
-	UploadTextureTask(const char* filename, Image* image);
+	std::vector<unsigned char> ktx_data; //used instead of the image for cooked textures
+	std::vector<unsigned char> mip_chain; //all the levels of the image, generated in the loading thread
+	int num_levels;
+	int mip;
+	int full_width;
+	int full_height;
+
+	UploadTextureTask(const char* filename, Image* image, int mip = 0, int full_width = 0, int full_height = 0);
+	UploadTextureTask(const char* filename, std::vector<unsigned char>& ktx_data, int mip = -1);
 	void onExecute();
 };
 
@@ -0,0 +1,162 @@
+#include "texturestreamer.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+namespace GFX {
+
+TextureStreamer TextureStreamer::global;
+
+TextureStreamer::TextureStreamer()
+{
+	enabled = true;
+	budget = 256 << 20;
+	preview_size = 64;
+	min_size = 32;
+	max_loads = 4;
+	unused_frames = 120;
+	frame = 0;
+	resident_bytes = 0;
+	num_streamed = 0;
+	num_loading = 0;
+	num_refined = 0;
+	num_reduced = 0;
+}
+
+int TextureStreamer::getPreviewMip(int width, int height)
+{
+	if (!enabled)
+		return 0;
+	int mip = 0;
+	while (std::max(width >> mip, height >> mip) > preview_size)
+		mip++;
+	return mip;
+}
+
+int TextureStreamer::getMaxMip(int width, int height)
+{
+	int mip = 0;
+	while (std::max(width >> (mip + 1), height >> (mip + 1)) >= min_size)
+		mip++;
+	return mip;
+}
+
+uint32 TextureStreamer::getSizeAtMip(Texture* texture, int mip)
+{
+	float width = (float)std::max(texture->full_width >> mip, 1);
+	float height = (float)std::max(texture->full_height >> mip, 1);
+	return (uint32)(width * height * texture->getBytesPerPixel() * 4.0f / 3.0f);
+}
+
+void TextureStreamer::request(Texture* texture, float screen_size)
+{
+	if (!enabled || !texture || !texture->streamed || !texture->full_width)
+		return;
+
+	//one texel per pixel, assuming the texture covers the object once
+	float texels = (float)std::max(texture->full_width, texture->full_height);
+	int mip = (int)std::floor(std::log2(texels / std::max(screen_size, 1.0f)));
+	mip = std::min(std::max(mip, 0), getMaxMip(texture->full_width, texture->full_height));
+
+	//the biggest of all the calls of this frame
+	if (texture->last_used_frame != frame || mip < texture->required_mip)
+		texture->required_mip = mip;
+	texture->last_used_frame = frame;
+}
+
+void TextureStreamer::streamMip(Texture* texture, int mip)
+{
+	texture->pending_mip = mip;
+	TaskManager::background.addTask(new LoadTextureTask(texture->filename.c_str(), mip, texture->mip_flags, texture->alpha_cutoff));
+	num_loading++;
+}
+
+void TextureStreamer::update()
+{
+	resident_bytes = 0;
+	num_streamed = 0;
+	num_loading = 0;
+
+	std::vector<Texture*> refine;
+	std::vector<Texture*> reduce;
+	for (auto it : Texture::sTextures)
+	{
+		Texture* texture = it.second;
+		if (!texture->streamed || !texture->full_width)
+			continue;
+		num_streamed++;
+
+		//a texture being loaded counts as the biggest of both
+		int mip = texture->resident_mip;
+		if (texture->pending_mip != -1)
+		{
+			mip = std::min(mip, texture->pending_mip);
+			num_loading++;
+		}
+		resident_bytes += getSizeAtMip(texture, mip);
+		if (texture->pending_mip != -1 || !enabled)
+			continue;
+
+		if (texture->last_used_frame == frame && texture->required_mip < texture->resident_mip)
+			refine.push_back(texture);
+		else if (texture->last_used_frame < frame - unused_frames && texture->resident_mip < getMaxMip(texture->full_width, texture->full_height))
+			reduce.push_back(texture); //not seen for a while
+		else if (texture->last_used_frame == frame && texture->required_mip > texture->resident_mip + 1)
+			reduce.push_back(texture); //seen smaller than it is, but keep one extra mip to avoid reloading it all the time
+	}
+
+	if (enabled)
+	{
+		//the ones that look worse first
+		std::sort(refine.begin(), refine.end(), [](Texture* a, Texture* b) { return a->resident_mip - a->required_mip > b->resident_mip - b->required_mip; });
+		//least recently used first
+		std::sort(reduce.begin(), reduce.end(), [](Texture* a, Texture* b) { return a->last_used_frame < b->last_used_frame; });
+		size_t next_reduce = 0;
+
+		//make room by reducing textures, returns false if there are no more to reduce
+		auto reduceNext = [&]() -> bool {
+			if (next_reduce == reduce.size() || num_loading >= max_loads)
+				return false;
+			Texture* texture = reduce[next_reduce++];
+			int mip = texture->last_used_frame == frame ? texture->required_mip - 1 : getMaxMip(texture->full_width, texture->full_height);
+			resident_bytes -= getSizeAtMip(texture, texture->resident_mip) - getSizeAtMip(texture, mip);
+			streamMip(texture, mip);
+			num_reduced++;
+			return true;
+		};
+
+		for (Texture* texture : refine)
+		{
+			if (num_loading >= max_loads)
+				break;
+			uint32 current_size = getSizeAtMip(texture, texture->resident_mip);
+			int mip = texture->required_mip;
+			while (mip < texture->resident_mip && resident_bytes - current_size + getSizeAtMip(texture, mip) > budget)
+				if (!reduceNext())
+					mip++; //it doesnt fit, take a smaller one
+			if (mip >= texture->resident_mip || num_loading >= max_loads)
+				continue;
+			resident_bytes += getSizeAtMip(texture, mip) - current_size;
+			streamMip(texture, mip);
+			num_refined++;
+		}
+
+		//the budget could have been reduced
+		while (resident_bytes > budget && reduceNext());
+	}
+
+	frame++;
+}
+
+std::string TextureStreamer::getStats()
+{
+	char str[256];
+	sprintf(str, "Streamed textures: %d VRAM: %.1f/%.1fMB Loading: %d Refined: %d Reduced: %d",
+		num_streamed, resident_bytes / (1024.0f * 1024.0f), budget / (1024.0f * 1024.0f), num_loading, num_refined, num_reduced);
+	return str;
+}
+
+};
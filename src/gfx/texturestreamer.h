@@ -0,0 +1,56 @@
+#ifndef TEXTURESTREAMER_H
+#define TEXTURESTREAMER_H
+
+#include "../core/math.h"
+
+#include <string>
+
+namespace GFX {
+
+	class Texture;
+
+	//keeps the textures loaded with GetAsync at the resolution they are seen on screen, inside a VRAM budget.
+	//The renderer calls request() with the size in pixels of every visible render call, so every texture knows
+	//the biggest mip needed. They are first loaded at a small preview size and then reloaded (from the cooked .ktx
+	//or decoding the image again) at the required mip. When the budget is full the least recently used textures
+	//are reduced to make room.
+	class TextureStreamer {
+	public:
+		static TextureStreamer global;
+
+		bool enabled;
+		uint32 budget; //in bytes
+		int preview_size; //biggest side of the first load
+		int min_size; //textures are never reduced below this size
+		int max_loads; //loads in progress at the same time
+		int unused_frames; //frames without being used before a texture can be reduced
+		long frame;
+
+		//stats
+		uint32 resident_bytes;
+		int num_streamed;
+		int num_loading;
+		int num_refined;
+		int num_reduced;
+
+		TextureStreamer();
+
+		//first mip loaded of a new texture
+		int getPreviewMip(int width, int height);
+		//lowest resolution allowed for a texture of that size
+		int getMaxMip(int width, int height);
+		//estimated VRAM of the texture if only that mip and the smaller ones were resident
+		uint32 getSizeAtMip(Texture* texture, int mip);
+
+		void request(Texture* texture, float screen_size); //screen_size in pixels
+		void update(); //once per frame, from the main thread
+
+		std::string getStats();
+
+	private:
+		void streamMip(Texture* texture, int mip);
+	};
+
+};
+
+#endif
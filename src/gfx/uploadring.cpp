@@ -0,0 +1,380 @@
+#include "uploadring.h"
+#include "texture.h"
+#include "gfx.h"
+#include "../utils/mipmaps.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+namespace GFX {
+
+TextureUploadRing TextureUploadRing::global;
+
+TextureUploadRing::TextureUploadRing()
+{
+	capacity = 0;
+	max_bytes_per_frame = 8 << 20;
+	max_ms_per_frame = 2.0f;
+	enabled = true;
+	pbo_id = 0;
+	memory = NULL;
+	persistent = false;
+	head = 0;
+	bytes_last_frame = 0;
+	uploads_last_frame = 0;
+	textures_uploaded = 0;
+	worker_waits = 0;
+}
+
+bool TextureUploadRing::isPersistentSupported()
+{
+	//glBufferStorage is core since 4.4
+	GLint major = 0;
+	GLint minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	if (major > 4 || (major == 4 && minor >= 4))
+		return true;
+
+	GLint num_extensions = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+	for (int i = 0; i < num_extensions; ++i)
+		if (strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), "GL_ARB_buffer_storage") == 0)
+			return true;
+	return false;
+}
+
+void TextureUploadRing::init(uint32 capacity)
+{
+	if (memory)
+		return;
+
+	this->capacity = capacity;
+	head = 0;
+	persistent = isPersistentSupported();
+	if (persistent)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glGenBuffers(1, &pbo_id);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo_id);
+		glBufferStorage(GL_PIXEL_UNPACK_BUFFER, capacity, NULL, flags);
+		memory = (uint8*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, capacity, flags);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		if (!memory)
+		{
+			std::cout << "[WARN] Upload ring: PBO could not be mapped, using RAM" << std::endl;
+			glDeleteBuffers(1, &pbo_id);
+			pbo_id = 0;
+			persistent = false;
+		}
+	}
+
+	if (!persistent)
+	{
+		ram.resize(capacity);
+		memory = &ram[0];
+	}
+
+	std::cout << " * Texture upload ring: " << (capacity >> 20) << "MB " << (persistent ? "persistent PBO" : "RAM") << std::endl;
+	checkGLErrors();
+}
+
+void TextureUploadRing::release()
+{
+	//pending uploads are lost, their textures stay with the placeholder
+	{
+		const std::lock_guard<std::mutex> lock(uploads_mutex);
+		for (auto& upload : uploads)
+			if (upload.texture_id)
+				glDeleteTextures(1, &upload.texture_id);
+		uploads.clear();
+	}
+
+	const std::lock_guard<std::mutex> lock(ring_mutex);
+	for (auto& region : regions)
+		if (region.fence)
+			glDeleteSync(region.fence);
+	regions.clear();
+	head = 0;
+
+	if (pbo_id)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo_id);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glDeleteBuffers(1, &pbo_id);
+		pbo_id = 0;
+	}
+	ram.clear();
+	ram.shrink_to_fit();
+	memory = NULL;
+	persistent = false;
+}
+
+uint8* TextureUploadRing::allocate(uint32 size, Region** region)
+{
+	size = (size + 255) & ~255u; //keep every range aligned
+	if (!memory || !size || size > capacity)
+		return NULL;
+
+	const std::lock_guard<std::mutex> lock(ring_mutex);
+	if (!memory)
+		return NULL;
+
+	uint32 offset = 0;
+	if (regions.empty())
+		head = 0;
+	else
+	{
+		uint32 tail = regions.front().offset;
+		if (head > tail) //free space at the end and before the tail
+		{
+			if (head + size <= capacity)
+				offset = head;
+			else if (size <= tail)
+				offset = 0; //wrap around
+			else
+				return NULL;
+		}
+		else if (head + size <= tail) //already wrapped, only the space till the tail
+			offset = head;
+		else
+			return NULL;
+	}
+
+	head = offset + size;
+	Region new_region = { offset, size, NULL, false };
+	regions.push_back(new_region);
+	*region = &regions.back();
+	return memory + offset;
+}
+
+uint8* TextureUploadRing::allocateBlocking(uint32 size, Region** region)
+{
+	using namespace std::chrono_literals;
+	//rounded like allocate does, a size that can never fit must not wait
+	uint32 aligned_size = (size + 255) & ~255u;
+	while (memory && enabled && size && aligned_size <= capacity)
+	{
+		uint8* data = allocate(size, region);
+		if (data)
+			return data;
+		//the main thread frees space every frame
+		worker_waits++;
+		std::this_thread::sleep_for(1ms);
+	}
+	return NULL;
+}
+
+void TextureUploadRing::queueUpload(const char* filename, Region* region, int width, int height, int num_channels, int mip, int full_width, int full_height, int num_levels)
+{
+	Upload upload;
+	upload.filename = filename;
+	upload.region = region;
+	upload.width = width;
+	upload.height = height;
+	upload.num_channels = num_channels;
+	upload.num_levels = num_levels;
+	upload.level = 0;
+	upload.rows_done = 0;
+	upload.mip = mip;
+	upload.full_width = full_width ? full_width : width;
+	upload.full_height = full_height ? full_height : height;
+	upload.texture_id = 0;
+
+	const std::lock_guard<std::mutex> lock(uploads_mutex);
+	uploads.push_back(upload);
+}
+
+void TextureUploadRing::discard(Region* region)
+{
+	//nothing was sent to the GPU, so no fence
+	const std::lock_guard<std::mutex> lock(ring_mutex);
+	region->done = true;
+}
+
+void TextureUploadRing::freeRegion(Region* region)
+{
+	const std::lock_guard<std::mutex> lock(ring_mutex);
+	//the GPU could still be reading from it
+	if (persistent)
+		region->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	region->done = true;
+}
+
+void TextureUploadRing::recycleRegions()
+{
+	const std::lock_guard<std::mutex> lock(ring_mutex);
+	//only from the front, so the ring stays contiguous
+	while (regions.size())
+	{
+		Region& region = regions.front();
+		if (!region.done)
+			break;
+		if (region.fence)
+		{
+			GLenum state = glClientWaitSync(region.fence, 0, 0);
+			if (state != GL_ALREADY_SIGNALED && state != GL_CONDITION_SATISFIED)
+				break;
+			glDeleteSync(region.fence);
+		}
+		regions.pop_front();
+	}
+	if (regions.empty())
+		head = 0;
+}
+
+void TextureUploadRing::update()
+{
+	bytes_last_frame = 0;
+	uploads_last_frame = 0;
+	if (!memory)
+		return;
+
+	recycleRegions();
+
+	const std::lock_guard<std::mutex> lock(uploads_mutex);
+	if (uploads.empty())
+		return;
+
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	if (persistent)
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo_id);
+
+	std::list<Upload>::iterator it = uploads.begin();
+	while (it != uploads.end())
+	{
+		//at least one band per frame so it always progresses
+		float elapsed_ms = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		if (bytes_last_frame && (bytes_last_frame >= max_bytes_per_frame || elapsed_ms >= max_ms_per_frame))
+			break;
+
+		Upload& upload = *it;
+		unsigned int format = upload.num_channels == 3 ? GL_RGB : GL_RGBA;
+
+		//the texture was removed while loading
+		if (!Texture::Find(upload.filename.c_str()))
+		{
+			if (upload.texture_id)
+				glDeleteTextures(1, &upload.texture_id);
+			freeRegion(upload.region);
+			it = uploads.erase(it);
+			continue;
+		}
+
+		//it is uploaded to a new texture so the placeholder is used till all the rows are there
+		if (!upload.texture_id)
+		{
+			glGenTextures(1, &upload.texture_id);
+			glBindTexture(GL_TEXTURE_2D, upload.texture_id);
+			if (persistent) //otherwise NULL would be read as an offset in the PBO
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			for (int level = 0; level < upload.num_levels; ++level)
+				glTexImage2D(GL_TEXTURE_2D, level, format, std::max(upload.width >> level, 1), std::max(upload.height >> level, 1), 0, format, GL_UNSIGNED_BYTE, NULL);
+			if (persistent)
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo_id);
+		}
+		else
+			glBindTexture(GL_TEXTURE_2D, upload.texture_id);
+
+		int level_width = std::max(upload.width >> upload.level, 1);
+		int level_height = std::max(upload.height >> upload.level, 1);
+		uint32 row_size = level_width * upload.num_channels;
+		uint32 budget_rows = bytes_last_frame < max_bytes_per_frame ? (max_bytes_per_frame - bytes_last_frame) / row_size : 0;
+		int num_rows = std::min(std::max((int)budget_rows, 1), level_height - upload.rows_done);
+
+		//with a PBO bound the pointer is an offset inside the buffer
+		uint32 level_offset = (uint32)getMipChainSize(upload.width, upload.height, upload.num_channels, upload.level);
+		uint32 offset = upload.region->offset + level_offset + upload.rows_done * row_size;
+		const void* pixels = persistent ? (const void*)(size_t)offset : (const void*)(memory + offset);
+		glTexSubImage2D(GL_TEXTURE_2D, upload.level, 0, upload.rows_done, level_width, num_rows, format, GL_UNSIGNED_BYTE, pixels);
+
+		upload.rows_done += num_rows;
+		bytes_last_frame += num_rows * row_size;
+		if (upload.rows_done < level_height)
+			break; //out of budget
+
+		//the next level, in the same frame if there is budget
+		upload.level++;
+		upload.rows_done = 0;
+		if (upload.level < upload.num_levels)
+			continue;
+
+		finishUpload(upload);
+		uploads_last_frame++;
+		it = uploads.erase(it);
+	}
+
+	if (persistent)
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void TextureUploadRing::finishUpload(Upload& upload)
+{
+	Texture* texture = Texture::Find(upload.filename.c_str());
+	assert(texture);
+	bool mipmaps = upload.num_levels > 1;
+
+	glBindTexture(GL_TEXTURE_2D, upload.texture_id);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, upload.num_levels - 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, mipmaps ? Texture::default_min_filter : GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, mipmaps ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, mipmaps ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+
+	//replace the placeholder
+	if (texture->texture_id)
+		glDeleteTextures(1, &texture->texture_id);
+	texture->texture_id = upload.texture_id;
+	texture->texture_type = GL_TEXTURE_2D;
+	texture->width = (float)upload.width;
+	texture->height = (float)upload.height;
+	texture->format = upload.num_channels == 3 ? GL_RGB : GL_RGBA;
+	texture->type = GL_UNSIGNED_BYTE;
+	texture->internal_format = 0;
+	texture->mipmaps = mipmaps;
+	texture->loading = false;
+	texture->full_width = upload.full_width;
+	texture->full_height = upload.full_height;
+	texture->resident_mip = upload.mip;
+	texture->pending_mip = -1;
+	upload.texture_id = 0;
+
+	freeRegion(upload.region);
+	textures_uploaded++;
+}
+
+std::string TextureUploadRing::getStats()
+{
+	if (!memory)
+		return "Upload ring: not used";
+
+	uint32 used = 0;
+	int num_uploads = 0;
+	{
+		const std::lock_guard<std::mutex> lock(ring_mutex);
+		for (auto& region : regions)
+			used += region.size;
+	}
+	{
+		const std::lock_guard<std::mutex> lock(uploads_mutex);
+		num_uploads = (int)uploads.size();
+	}
+
+	char str[256];
+	sprintf(str, "Upload ring (%s): %d%% of %dMB Pending: %d Last frame: %dKB in %d textures Uploaded: %d Worker waits: %d",
+		persistent ? "PBO" : "RAM",
+		int(100.0f * used / capacity), (int)(capacity >> 20),
+		num_uploads, (int)(bytes_last_frame >> 10), uploads_last_frame, textures_uploaded, (int)worker_waits);
+	return str;
+}
+
+};
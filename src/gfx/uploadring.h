@@ -0,0 +1,99 @@
+#ifndef UPLOADRING_H
+#define UPLOADRING_H
+
+#include "../core/includes.h"
+#include "../core/math.h"
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace GFX {
+
+	//staging memory shared by the loading threads and the main thread to stream textures to VRAM.
+	//Worker threads copy the decoded pixels (and the mipmaps they generate) into the ring and queue the upload, the main thread
+	//calls update() once per frame and uploads them with glTexSubImage2D under a budget of bytes and time,
+	//in bands of rows, so a big texture is spread among several frames instead of causing a hitch.
+	//With GL 4.4 (or ARB_buffer_storage) the ring is a persistent mapped PBO and the copy to VRAM is done by the driver
+	//without stalling, every range is reused once the fence of its upload is signaled.
+	//Otherwise the ring is plain RAM and the upload is done from client memory (still under the budget).
+	class TextureUploadRing {
+	public:
+		struct Region {
+			uint32 offset;
+			uint32 size;
+			GLsync fence; //signaled when the GPU has consumed the data
+			bool done; //the main thread doesnt need it anymore
+		};
+
+		struct Upload {
+			std::string filename;
+			Region* region;
+			int width;
+			int height;
+			int num_channels;
+			int num_levels; //mipmaps come after the first level in the region, already generated
+			int level; //being uploaded
+			int rows_done; //of that level
+			int mip; //of the source, for the streaming
+			int full_width;
+			int full_height;
+			GLuint texture_id; //new texture, swapped with the 1x1 placeholder when finished
+		};
+
+		static TextureUploadRing global;
+
+		uint32 capacity;
+		uint32 max_bytes_per_frame;
+		float max_ms_per_frame;
+		bool enabled;
+
+		GLuint pbo_id;
+		uint8* memory; //mapped PBO or RAM
+		std::vector<uint8> ram; //used when persistent mapping is not available
+		bool persistent;
+
+		std::mutex ring_mutex; //protects regions and head
+		std::list<Region> regions; //in allocation order, freed from the front
+		uint32 head;
+
+		std::mutex uploads_mutex;
+		std::list<Upload> uploads;
+
+		//stats
+		uint32 bytes_last_frame;
+		int uploads_last_frame;
+		int textures_uploaded;
+		std::atomic<int> worker_waits; //times a worker had to wait for free space
+
+		TextureUploadRing();
+
+		//main thread
+		void init(uint32 capacity = 64 << 20);
+		void update();
+		void release();
+		bool isReady() { return memory != NULL; }
+		static bool isPersistentSupported();
+
+		//any thread, returns NULL if there is no space (or the ring is not ready)
+		uint8* allocate(uint32 size, Region** region);
+		//wait till there is space, returns NULL if it cannot fit at all
+		uint8* allocateBlocking(uint32 size, Region** region);
+		//once the pixels are in the ring, the upload to the texture with that name is done in the main thread
+		void queueUpload(const char* filename, Region* region, int width, int height, int num_channels, int mip = 0, int full_width = 0, int full_height = 0, int num_levels = 1);
+		//the data could not be written, the range is reused without uploading it
+		void discard(Region* region);
+
+		std::string getStats();
+
+	private:
+		void finishUpload(Upload& upload);
+		void freeRegion(Region* region);
+		void recycleRegions();
+	};
+
+};
+
+#endif
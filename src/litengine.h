@@ -11,6 +11,7 @@
 #include "gfx/shader.h"
 #include "gfx/mesh.h"
 #include "gfx/fbo.h"
+#include "gfx/texturestreamer.h"
 
 #include "utils/utils.h"
 
@@ -10,6 +10,9 @@
 #include "litengine.h"
 
 #include "application.h"
+#include "utils/texture_cooker.h"
+#include "utils/image_decoder.h"
+#include "utils/mipmaps.h"
 
 
 #include <iostream> //to output
@@ -24,6 +27,33 @@ int main(int argc, char **argv)
 	std::cout << "Initiating app..." << std::endl;
 	CORE::init();
 
+	//offline texture cooking, no window needed: GTR --cook image1.png image2.jpg ...
+	if (argc > 2 && std::string(argv[1]) == "--cook")
+	{
+		int failed = 0;
+		for (int i = 2; i < argc; ++i)
+			if (!cookTexture(argv[i]))
+				failed++;
+		SDL_Quit(); //there is no window or UI to destroy
+		return failed ? 1 : 0;
+	}
+
+	//compares the image decoders: GTR --decode-benchmark [image1.png image2.jpg ...]
+	if (argc > 1 && std::string(argv[1]) == "--decode-benchmark")
+	{
+		benchmarkImageDecoders(std::vector<std::string>(argv + 2, argv + argc));
+		SDL_Quit();
+		return 0;
+	}
+
+	//compares the mipmap filters: GTR --mip-benchmark [image1.png image2.jpg ...]
+	if (argc > 1 && std::string(argv[1]) == "--mip-benchmark")
+	{
+		benchmarkMipmaps(std::vector<std::string>(argv + 2, argv + argc));
+		SDL_Quit();
+		return 0;
+	}
+
 	//define window size
 	bool fullscreen = false; 
 	Vector2f size(1024,768);
@@ -7,8 +7,19 @@
 
 Camera* Camera::current = NULL;
 
+//moves the image in clip space, x and y get an offset proportional to w (so it is the same in every depth)
+static void addJitter(Matrix44& m, Vector2f jitter)
+{
+	for (int i = 0; i < 4; ++i)
+	{
+		m.M[i][0] += jitter.x * m.M[i][3];
+		m.M[i][1] += jitter.y * m.M[i][3];
+	}
+}
+
 Camera::Camera()
 {
+	jitter.set(0, 0);
 	lookAt( Vector3f(0, 0, 0), Vector3f(0, 0, -1), Vector3f(0, 1, 0) );
 	setOrthographic(-100,100,-100, 100,-100,100);
 }
@@ -31,6 +42,8 @@ void Camera::updateViewMatrix()
 	viewprojection_matrix = view_matrix * projection_matrix;
 	inverse_viewprojection_matrix = viewprojection_matrix;
 	inverse_viewprojection_matrix.inverse();
+	unjittered_viewprojection_matrix = viewprojection_matrix;
+	addJitter(unjittered_viewprojection_matrix, jitter * -1.0f);
 
 	extractFrustum();
 }
@@ -43,10 +56,13 @@ void Camera::updateProjectionMatrix()
 		projection_matrix.ortho(left,right,bottom,top,near_plane,far_plane);
 	else
 		projection_matrix.perspective(fov, aspect, near_plane, far_plane);
+	addJitter(projection_matrix, jitter);
 
 	viewprojection_matrix = view_matrix * projection_matrix;
 	inverse_viewprojection_matrix = viewprojection_matrix;
 	inverse_viewprojection_matrix.inverse();
+	unjittered_viewprojection_matrix = viewprojection_matrix;
+	addJitter(unjittered_viewprojection_matrix, jitter * -1.0f);
 
 	extractFrustum();
 }
@@ -153,6 +169,12 @@ void Camera::setPerspective(float fov, float aspect, float near_plane, float far
 	updateProjectionMatrix();
 }
 
+void Camera::setJitter(float x, float y)
+{
+	jitter.set(x, y);
+	updateProjectionMatrix();
+}
+
 void Camera::lookAt(const Vector3f& eye, const Vector3f& center, const Vector3f& up)
 {
 	this->eye = eye;
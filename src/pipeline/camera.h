@@ -40,6 +40,10 @@ public:
 	Matrix44 projection_matrix;
 	Matrix44 viewprojection_matrix;
 	Matrix44 inverse_viewprojection_matrix;
+	Matrix44 unjittered_viewprojection_matrix; //without the jitter, for the velocity
+
+	//subpixel offset of the projection in clip space, for the temporal antialiasing
+	Vector2f jitter;
 
 	Vector3f front;
 
@@ -61,6 +65,7 @@ public:
 	//set the info
 	void setPerspective(float fov, float aspect, float near_plane, float far_plane);
 	void setOrthographic(float left, float right, float bottom, float top, float near_plane, float far_plane);
+	void setJitter(float x, float y); //in clip space, (0,0) to disable it
 	void lookAt(const Vector3f& eye, const Vector3f& center, const Vector3f& up);
 	void lookAt(const Matrix44& m);
 
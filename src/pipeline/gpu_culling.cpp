@@ -0,0 +1,499 @@
+#include "gpu_culling.h"
+
+#include <algorithm> //sort
+#include <cstring> //memcpy
+
+#include "camera.h"
+#include "scene.h"
+#include "prefab.h"
+#include "material.h"
+#include "../gfx/gfx.h"
+#include "../gfx/shader.h"
+#include "../gfx/texture.h"
+#include "../gfx/geometrypool.h"
+
+SCN::GPUCulling::GPUCulling()
+{
+	enabled = false;
+	use_hiz = true;
+	dirty = true;
+
+	scene = nullptr;
+	scene_signature = 0;
+	transform_signature = 0;
+	instances_moved = false;
+
+	vao = 0;
+	instance_ids_vbo_id = 0;
+	instances_ssbo_id = 0;
+	commands_buffer_id = 0;
+
+	cull_shader = nullptr;
+	hiz_shader = nullptr;
+	gbuffers_shader = nullptr;
+	flat_shader = nullptr;
+
+	hiz_texture = nullptr;
+	hiz_levels = 0;
+	hiz_valid = false;
+
+	supported = -1;
+}
+
+SCN::GPUCulling::~GPUCulling()
+{
+	release();
+	if (hiz_texture)
+		delete hiz_texture;
+}
+
+void SCN::GPUCulling::release()
+{
+	if (vao) glDeleteVertexArrays(1, &vao);
+	if (instance_ids_vbo_id) glDeleteBuffers(1, &instance_ids_vbo_id);
+	if (instances_ssbo_id) glDeleteBuffers(1, &instances_ssbo_id);
+	if (commands_buffer_id) glDeleteBuffers(1, &commands_buffer_id);
+	vao = instance_ids_vbo_id = instances_ssbo_id = commands_buffer_id = 0;
+}
+
+bool SCN::GPUCulling::isSupported()
+{
+	//compute shaders, SSBOs and multidraw indirect are core since 4.3
+	GLint major = 0;
+	GLint minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	return major > 4 || (major == 4 && minor >= 3);
+}
+
+bool SCN::GPUCulling::init()
+{
+	if (supported != -1)
+		return supported == 1;
+	supported = 0;
+
+	if (!isSupported())
+	{
+		std::cout << " * GPU culling not available, it requires OpenGL 4.3, using CPU path" << std::endl;
+		return false;
+	}
+
+	//these shaders are not in the atlas header because they would not compile in a GL 3.x context
+	std::string cull_code, hiz_code, vs_code, gbuffers_code, flat_code;
+	if (!GFX::Shader::GetShaderFile("cull.cs", cull_code) ||
+		!GFX::Shader::GetShaderFile("hiz.cs", hiz_code) ||
+		!GFX::Shader::GetShaderFile("indirect.vs", vs_code) ||
+		!GFX::Shader::GetShaderFile("gbuffers.fs", gbuffers_code) ||
+		!GFX::Shader::GetShaderFile("flat.fs", flat_code))
+	{
+		std::cout << " * Error in shader atlas, couldnt find files for GPU culling" << std::endl;
+		return false;
+	}
+
+	cull_shader = GFX::Shader::CompileComputeShader("cull", cull_code.c_str(), nullptr);
+	hiz_shader = GFX::Shader::CompileComputeShader("hiz", hiz_code.c_str(), nullptr);
+	gbuffers_shader = GFX::Shader::CompileShader("gbuffers_indirect", vs_code.c_str(), gbuffers_code.c_str(), nullptr);
+	flat_shader = GFX::Shader::CompileShader("flat_indirect", vs_code.c_str(), flat_code.c_str(), nullptr);
+
+	if (!cull_shader || !hiz_shader || !gbuffers_shader || !flat_shader)
+		return false;
+
+	supported = 1;
+	return true;
+}
+
+uint32 SCN::GPUCulling::computeSignature(Scene* scene)
+{
+	//cheap test to know if something was added, removed or hidden, only checks entities (not every node)
+	uint32 hash = (uint32)scene->entities.size();
+	for (auto ent : scene->entities)
+	{
+		hash = hash * 31 + (uint32)(size_t)ent;
+		hash = hash * 31 + (ent->visible ? 1 : 0);
+	}
+	return hash;
+}
+
+uint32 SCN::GPUCulling::computeTransformSignature(Scene* scene)
+{
+	//only the root of every entity, the nodes of a prefab do not move on their own
+	uint32 hash = 1;
+	for (auto ent : scene->entities)
+	{
+		for (int i = 0; i < 16; ++i)
+		{
+			uint32 v;
+			memcpy(&v, &ent->root.model.m[i], sizeof(uint32));
+			hash = hash * 31 + v;
+		}
+	}
+	return hash;
+}
+
+void SCN::GPUCulling::update(Scene* scene)
+{
+	uint32 signature = computeSignature(scene);
+	uint32 transforms = computeTransformSignature(scene);
+	if (dirty || scene != this->scene || signature != scene_signature || !updateRanges())
+		build(scene);
+	else if (transforms != transform_signature)
+		updateInstances();
+	else if (instances_moved)
+		updateInstances(false); //they stopped, so the velocity must go back to zero
+	scene_signature = signature;
+	transform_signature = transforms;
+}
+
+void SCN::GPUCulling::setInstanceModel(sGPUInstance& instance, const Matrix44& model)
+{
+	BoundingBox world_bounding = transformBoundingBox(model, ranges[instance.mesh_index].mesh->box);
+	instance.model = model;
+	instance.center = Vector4f(world_bounding.center.x, world_bounding.center.y, world_bounding.center.z, 0.0f);
+	instance.halfsize = Vector4f(world_bounding.halfsize.x, world_bounding.halfsize.y, world_bounding.halfsize.z, 0.0f);
+}
+
+void SCN::GPUCulling::updateInstances(bool read_nodes)
+{
+	instances_moved = read_nodes;
+	if (!instances.size())
+		return;
+
+	//not in the order of the tree, so every node goes up to its root
+	for (size_t i = 0; i < instances.size(); ++i)
+	{
+		instances[i].prev_model = instances[i].model;
+		if (read_nodes)
+			setInstanceModel(instances[i], instance_nodes[i]->getGlobalMatrix());
+	}
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, instances_ssbo_id);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, instances.size() * sizeof(sGPUInstance), &instances[0]);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	//the pyramid was tested with the old positions
+	if (read_nodes)
+		hiz_valid = false;
+}
+
+bool SCN::GPUCulling::updateRanges()
+{
+	bool changed = false;
+	for (auto& range : ranges)
+	{
+		GFX::Mesh* mesh = range.mesh;
+		if (mesh->pool_vertex_offset == -1 || !mesh->pool_num_indices)
+			return false;
+		if (range.base_vertex == mesh->pool_vertex_offset && range.first_index == (uint32)mesh->pool_index_offset && range.num_indices == mesh->pool_num_indices)
+			continue;
+		range.base_vertex = mesh->pool_vertex_offset;
+		range.first_index = (uint32)mesh->pool_index_offset;
+		range.num_indices = mesh->pool_num_indices;
+		changed = true;
+	}
+
+	//the pool was compacted, only the commands point to the old places
+	if (changed)
+		uploadCommands();
+	return true;
+}
+
+int SCN::GPUCulling::addMesh(GFX::Mesh* mesh)
+{
+	auto it = mesh_indices.find(mesh);
+	if (it != mesh_indices.end())
+		return it->second;
+
+	//the geometry is referenced where it already is, so the CPU arrays are not needed
+	if (mesh->pool_vertex_offset == -1 || !mesh->pool_num_indices)
+		return -1;
+
+	sMeshRange range;
+	range.mesh = mesh;
+	range.base_vertex = mesh->pool_vertex_offset;
+	range.first_index = (uint32)mesh->pool_index_offset;
+	range.num_indices = mesh->pool_num_indices;
+
+	int index = (int)ranges.size();
+	ranges.push_back(range);
+	mesh_indices[mesh] = index;
+	return index;
+}
+
+void SCN::GPUCulling::addNode(Node* node, std::vector<sDraw>& draws)
+{
+	if (!node->visible)
+		return;
+
+	Matrix44 node_model = node->getGlobalMatrix(true);
+
+	//only opaque, the ones with alpha still go through the CPU path
+	if (node->mesh && node->material && node->material->alpha_mode == eAlphaMode::NO_ALPHA)
+	{
+		int mesh_index = addMesh(node->mesh);
+		if (mesh_index == -1)
+			missing_meshes.insert(node->mesh);
+		else
+		{
+			sDraw draw;
+			draw.material = node->material;
+			draw.node = node;
+			draw.instance.mesh_index = mesh_index;
+			draw.instance.command_index = 0;
+			draw.instance.padding[0] = draw.instance.padding[1] = 0;
+			setInstanceModel(draw.instance, node_model);
+			draw.instance.prev_model = node_model;
+			draws.push_back(draw);
+		}
+	}
+
+	for (size_t i = 0; i < node->children.size(); ++i)
+		addNode(node->children[i], draws);
+}
+
+void SCN::GPUCulling::build(Scene* scene)
+{
+	this->scene = scene;
+	dirty = false;
+	hiz_valid = false;
+	instances_moved = false;
+
+	mesh_indices.clear();
+	missing_meshes.clear();
+	ranges.clear();
+	instances.clear();
+	instance_nodes.clear();
+	batches.clear();
+
+	std::vector<sDraw> draws;
+
+	for (auto ent : scene->entities)
+	{
+		if (!ent->visible || ent->getType() != eEntityType::PREFAB)
+			continue;
+		PrefabEntity* pent = (SCN::PrefabEntity*)ent;
+		if (pent->prefab)
+			addNode(&pent->root, draws);
+	}
+
+	release();
+	if (!draws.size())
+		return;
+
+	//sort by material so every batch is a contiguous range of commands
+	std::stable_sort(draws.begin(), draws.end(), [](const sDraw& a, const sDraw& b)
+		{ return a.material->index < b.material->index; });
+
+	std::vector<uint32> instance_ids(draws.size());
+	instances.resize(draws.size());
+	instance_nodes.resize(draws.size());
+
+	for (size_t i = 0; i < draws.size(); ++i)
+	{
+		Material* material = draws[i].material;
+		if (!batches.size() || batches.back().material != material)
+		{
+			sDrawBatch batch;
+			batch.material = material;
+			batch.first_command = (uint32)i;
+			batch.num_commands = 0;
+			batches.push_back(batch);
+		}
+		batches.back().num_commands++;
+
+		sGPUInstance& instance = instances[i];
+		instance = draws[i].instance;
+		instance.command_index = (uint32)i;
+		instance_nodes[i] = draws[i].node;
+		instance_ids[i] = (uint32)i;
+	}
+
+	//upload everything, the geometry is already in the pool
+	glGenVertexArrays(1, &vao);
+
+	glGenBuffers(1, &instance_ids_vbo_id);
+	glBindBuffer(GL_ARRAY_BUFFER, instance_ids_vbo_id);
+	glBufferData(GL_ARRAY_BUFFER, instance_ids.size() * sizeof(uint32), &instance_ids[0], GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glGenBuffers(1, &instances_ssbo_id);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, instances_ssbo_id);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, instances.size() * sizeof(sGPUInstance), &instances[0], GL_DYNAMIC_DRAW); //updated when entities move
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	uploadCommands();
+
+	std::cout << " + GPU culling: " << instances.size() << " instances, " << ranges.size() << " meshes, " << batches.size() << " batches" << std::endl;
+}
+
+//one command per instance, with the range of its mesh in the pool
+void SCN::GPUCulling::uploadCommands()
+{
+	std::vector<sDrawElementsIndirectCommand> commands(instances.size());
+	for (size_t i = 0; i < instances.size(); ++i)
+	{
+		sMeshRange& range = ranges[instances[i].mesh_index];
+		sDrawElementsIndirectCommand& command = commands[i];
+		command.count = range.num_indices;
+		command.instance_count = 1; //the cull pass overwrites it
+		command.first_index = range.first_index;
+		command.base_vertex = range.base_vertex;
+		command.base_instance = (uint32)i; //used to fetch a_instance_id
+	}
+
+	if (!commands_buffer_id)
+		glGenBuffers(1, &commands_buffer_id);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, commands_buffer_id);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, commands.size() * sizeof(sDrawElementsIndirectCommand), &commands[0], GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	GFX::checkGLErrors();
+}
+
+void SCN::GPUCulling::cull(Camera* camera, bool test_hiz)
+{
+	if (!instances.size())
+		return;
+
+	bool hiz = test_hiz && use_hiz && hiz_valid;
+
+	cull_shader->enable();
+	cull_shader->setUniform("u_num_instances", (int)instances.size());
+	cull_shader->setUniform4Array("u_frustum", &camera->frustum[0][0], 6);
+	cull_shader->setUniform("u_use_hiz", hiz ? 1 : 0);
+	if (hiz)
+	{
+		cull_shader->setUniform("u_hiz_texture", hiz_texture, 0);
+		cull_shader->setUniform("u_hiz_viewprojection", hiz_viewprojection);
+		cull_shader->setUniform("u_hiz_size", vec2(hiz_texture->width, hiz_texture->height));
+		cull_shader->setUniform("u_hiz_levels", hiz_levels);
+	}
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, instances_ssbo_id);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, commands_buffer_id);
+
+	glDispatchCompute(((uint32)instances.size() + 63) / 64, 1, 1);
+
+	//the commands are read by the indirect draw
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+	cull_shader->disable();
+}
+
+void SCN::GPUCulling::draw(GFX::Shader* shader, int batch_index)
+{
+	if (!instances.size())
+		return;
+
+	uint32 first = 0;
+	uint32 num = (uint32)instances.size();
+	if (batch_index != -1)
+	{
+		first = batches[batch_index].first_command;
+		num = batches[batch_index].num_commands;
+	}
+
+	glBindVertexArray(vao);
+
+	//locations depend on the program, so pointers are set on every draw (only a few per frame)
+	int spacing = sizeof(GFX::Mesh::tInterleaved);
+	int vertex_location = shader->getAttribLocation("a_vertex");
+	int normal_location = shader->getAttribLocation("a_normal");
+	int uv_location = shader->getAttribLocation("a_coord");
+	int instance_location = shader->getAttribLocation("a_instance_id");
+
+	glBindBuffer(GL_ARRAY_BUFFER, GFX::GeometryPool::global.vertices.buffer_id);
+	if (vertex_location != -1)
+	{
+		glEnableVertexAttribArray(vertex_location);
+		glVertexAttribPointer(vertex_location, 3, GL_FLOAT, GL_FALSE, spacing, (void*)0);
+	}
+	if (normal_location != -1)
+	{
+		glEnableVertexAttribArray(normal_location);
+		glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, (void*)sizeof(Vector3f));
+	}
+	if (uv_location != -1)
+	{
+		glEnableVertexAttribArray(uv_location);
+		glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, (void*)(sizeof(Vector3f) * 2));
+	}
+	if (instance_location != -1)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, instance_ids_vbo_id);
+		glEnableVertexAttribArray(instance_location);
+		glVertexAttribIPointer(instance_location, 1, GL_UNSIGNED_INT, 0, (void*)0);
+		glVertexAttribDivisor(instance_location, 1); //advanced by base_instance
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, GFX::GeometryPool::global.indices.buffer_id);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, instances_ssbo_id);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commands_buffer_id);
+
+	glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(first * sizeof(sDrawElementsIndirectCommand)), num, 0);
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	glBindVertexArray(0);
+	GFX::checkGLErrors();
+
+	GFX::Mesh::num_meshes_rendered++;
+}
+
+void SCN::GPUCulling::updateHiZ(GFX::Texture* depth_texture, Camera* camera)
+{
+	if (!hiz_shader)
+		return;
+
+	//power of two so every level is half the previous one
+	int width = 1;
+	int height = 1;
+	while (width * 2 <= depth_texture->width) width *= 2;
+	while (height * 2 <= depth_texture->height) height *= 2;
+
+	if (!hiz_texture || hiz_texture->width != width || hiz_texture->height != height)
+	{
+		if (hiz_texture)
+			delete hiz_texture;
+		hiz_texture = new GFX::Texture(width, height, GL_RED, GL_FLOAT, true, NULL, GL_R32F);
+		hiz_texture->generateMipmaps(); //allocates all the levels
+		hiz_texture->bind();
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		hiz_texture->unbind();
+
+		hiz_levels = 1;
+		while ((std::max(width, height) >> hiz_levels) > 0) hiz_levels++;
+	}
+
+	hiz_shader->enable();
+	hiz_shader->setUniform("u_depth_texture", depth_texture, 0);
+
+	int input_width = (int)depth_texture->width;
+	int input_height = (int)depth_texture->height;
+	for (int level = 0; level < hiz_levels; ++level)
+	{
+		int w = std::max(1, width >> level);
+		int h = std::max(1, height >> level);
+
+		glBindImageTexture(0, hiz_texture->texture_id, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+		glBindImageTexture(1, hiz_texture->texture_id, level ? level - 1 : 0, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+
+		hiz_shader->setUniform("u_from_depth", level == 0 ? 1 : 0);
+		hiz_shader->setUniform2("u_input_size", input_width, input_height);
+		hiz_shader->setUniform2("u_output_size", w, h);
+
+		glDispatchCompute((w + 7) / 8, (h + 7) / 8, 1);
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+		input_width = w;
+		input_height = h;
+	}
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+	hiz_shader->disable();
+
+	hiz_viewprojection = camera->viewprojection_matrix;
+	hiz_valid = true;
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <set>
+
+#include "../core/includes.h"
+#include "../core/math.h"
+#include "../gfx/mesh.h"
+
+//forward declarations
+class Camera;
+
+namespace GFX {
+	class Shader;
+	class Texture;
+}
+
+namespace SCN {
+
+	class Scene;
+	class Node;
+	class Material;
+
+	//same layout as the command read by glMultiDrawElementsIndirect
+	struct sDrawElementsIndirectCommand {
+		uint32 count;
+		uint32 instance_count;
+		uint32 first_index;
+		int base_vertex;
+		uint32 base_instance;
+	};
+
+	//per instance info stored in the SSBO (std430, must match the struct in the shader atlas)
+	struct sGPUInstance {
+		Matrix44 model;
+		Matrix44 prev_model; //model of the previous frame, for the velocity
+		Vector4f center; //world bounding
+		Vector4f halfsize;
+		uint32 mesh_index;
+		uint32 command_index;
+		uint32 padding[2];
+	};
+
+	//where is every mesh inside the buffers of the GeometryPool (they move when the pool is compacted)
+	struct sMeshRange {
+		GFX::Mesh* mesh;
+		uint32 first_index;
+		uint32 num_indices;
+		int base_vertex;
+	};
+
+	//consecutive commands sharing the same material
+	struct sDrawBatch {
+		Material* material;
+		uint32 first_command;
+		uint32 num_commands;
+	};
+
+	//GPU driven rendering of the static opaque geometry:
+	//the meshes are already in the shared buffers of the GeometryPool, the commands point to their ranges, a compute pass does
+	//frustum and Hi-Z culling writing the indirect commands and every pass is a glMultiDrawElementsIndirect.
+	//Meshes outside the pool or without indices are left in missing_meshes.
+	//Requires GL 4.3, when not available the renderer keeps using the CPU path.
+	class GPUCulling
+	{
+	public:
+		bool enabled;
+		bool use_hiz;
+		bool dirty; //force a rebuild of the buffers
+
+		Scene* scene;
+		uint32 scene_signature; //visibility and set of entities, a change rebuilds everything
+		uint32 transform_signature; //a change only uploads the instances again
+		bool instances_moved; //the prev_model of the instances still has to catch up with the model
+
+		std::map<GFX::Mesh*, int> mesh_indices;
+		std::set<GFX::Mesh*> missing_meshes; //not in the pool, the renderer draws them from the CPU
+		std::vector<sMeshRange> ranges;
+		std::vector<sGPUInstance> instances;
+		std::vector<Node*> instance_nodes; //where every instance comes from
+		std::vector<sDrawBatch> batches;
+
+		GLuint vao;
+		GLuint instance_ids_vbo_id;
+		GLuint instances_ssbo_id;
+		GLuint commands_buffer_id;
+
+		GFX::Shader* cull_shader;
+		GFX::Shader* hiz_shader;
+		GFX::Shader* gbuffers_shader;
+		GFX::Shader* flat_shader;
+
+		//depth pyramid of the previous frame
+		GFX::Texture* hiz_texture;
+		Matrix44 hiz_viewprojection;
+		int hiz_levels;
+		bool hiz_valid;
+
+		GPUCulling();
+		~GPUCulling();
+
+		static bool isSupported(); //checks the version of the current context
+
+		//compiles the shaders the first time, returns false if this path cannot be used
+		bool init();
+
+		//rebuilds the buffers if the scene changed, call it once per frame because it also shifts the prev_model of the instances
+		void update(Scene* scene);
+		void build(Scene* scene);
+
+		//fills the instance_count of every command according to the camera
+		void cull(Camera* camera, bool test_hiz);
+
+		//batch -1 draws all the commands in a single call
+		void draw(GFX::Shader* shader, int batch_index = -1);
+
+		//builds the depth pyramid used to test occlusion on the next frame
+		void updateHiZ(GFX::Texture* depth_texture, Camera* camera);
+
+	private:
+		int supported; //-1 not checked yet
+
+		struct sDraw {
+			Material* material;
+			Node* node;
+			sGPUInstance instance;
+		};
+
+		void addNode(Node* node, std::vector<sDraw>& draws);
+		int addMesh(GFX::Mesh* mesh);
+		uint32 computeSignature(Scene* scene);
+		uint32 computeTransformSignature(Scene* scene);
+		void setInstanceModel(sGPUInstance& instance, const Matrix44& model);
+		void updateInstances(bool read_nodes = true); //the models from the nodes, without rebuilding
+		bool updateRanges(); //returns false if a mesh left the pool
+		void uploadCommands();
+		void release();
+	};
+
+};
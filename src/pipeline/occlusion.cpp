@@ -0,0 +1,377 @@
+#include "occlusion.h"
+
+#include <algorithm> //sort
+#include <chrono>
+#include <iostream>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define OCCLUSION_USE_SSE
+	#include <emmintrin.h>
+#endif
+
+#include "camera.h"
+#include "renderer.h"
+#include "../gfx/mesh.h"
+#include "../core/task.h"
+
+#define OCCLUSION_TILES_X (OCCLUSION_BUFFER_WIDTH / OCCLUSION_TILE_SIZE)
+#define OCCLUSION_TILES_Y (OCCLUSION_BUFFER_HEIGHT / OCCLUSION_TILE_SIZE)
+#define OCCLUSION_NUM_BANDS (OCCLUSION_BUFFER_HEIGHT / OCCLUSION_BAND_HEIGHT)
+#define OCCLUSION_MIN_W 0.001f //vertices behind this are not rasterized (they are skipped, which is conservative)
+
+typedef std::chrono::high_resolution_clock occlusion_clock;
+
+static float elapsedMs(occlusion_clock::time_point start)
+{
+	return std::chrono::duration<float, std::milli>(occlusion_clock::now() - start).count();
+}
+
+SCN::OcclusionCuller::OcclusionCuller()
+{
+	enabled = false;
+	use_threads = true;
+	max_occluders = 32;
+	max_occluder_triangles = 20000;
+	min_occluder_size = 0.1f;
+
+	camera = nullptr;
+
+	num_occluders = 0;
+	num_triangles = 0;
+	num_tested = 0;
+	num_culled = 0;
+	raster_time = 0;
+	test_time = 0;
+
+	depth.resize(OCCLUSION_BUFFER_WIDTH * OCCLUSION_BUFFER_HEIGHT);
+	tiles.resize(OCCLUSION_TILES_X * OCCLUSION_TILES_Y);
+	clear();
+}
+
+void SCN::OcclusionCuller::clear()
+{
+	std::fill(depth.begin(), depth.end(), 0.0f);
+	std::fill(tiles.begin(), tiles.end(), 0.0f);
+}
+
+void SCN::OcclusionCuller::setupTriangles(GFX::Mesh* mesh, const Matrix44& mvp, std::vector<sScreenTriangle>& triangles)
+{
+	unsigned int num_vertices = mesh->getNumCPUVertices();
+
+	//project all the vertices once
+	std::vector<Vector4f> projected(num_vertices);
+	for (unsigned int i = 0; i < num_vertices; ++i)
+	{
+		const Vector3f& v = mesh->interleaved.size() ? mesh->interleaved[i].vertex : mesh->vertices[i];
+		Vector4f clip = mvp * Vector4f(v.x, v.y, v.z, 1.0f);
+		if (clip.w < OCCLUSION_MIN_W)
+		{
+			projected[i].w = 0.0f; //mark as invalid
+			continue;
+		}
+		float iw = 1.0f / clip.w;
+		projected[i].x = (clip.x * iw * 0.5f + 0.5f) * OCCLUSION_BUFFER_WIDTH;
+		projected[i].y = (clip.y * iw * 0.5f + 0.5f) * OCCLUSION_BUFFER_HEIGHT;
+		projected[i].z = iw;
+		projected[i].w = 1.0f;
+	}
+
+	unsigned int num_indices = mesh->m_indices.size() ? (unsigned int)mesh->m_indices.size() : num_vertices;
+	for (unsigned int i = 0; i + 2 < num_indices; i += 3)
+	{
+		const Vector4f* v[3];
+		for (int j = 0; j < 3; ++j)
+			v[j] = &projected[mesh->m_indices.size() ? mesh->m_indices[i + j] : i + j];
+
+		//crosses the near plane
+		if (v[0]->w == 0.0f || v[1]->w == 0.0f || v[2]->w == 0.0f)
+			continue;
+
+		//both faces are rasterized, so make it counter clockwise
+		float area = (v[1]->x - v[0]->x) * (v[2]->y - v[0]->y) - (v[2]->x - v[0]->x) * (v[1]->y - v[0]->y);
+		if (fabs(area) < 0.0001f)
+			continue;
+		if (area < 0.0f)
+		{
+			std::swap(v[1], v[2]);
+			area = -area;
+		}
+
+		sScreenTriangle t;
+		t.min_x = std::max(0, (int)floor(std::min(v[0]->x, std::min(v[1]->x, v[2]->x))));
+		t.max_x = std::min(OCCLUSION_BUFFER_WIDTH - 1, (int)ceil(std::max(v[0]->x, std::max(v[1]->x, v[2]->x))));
+		t.min_y = std::max(0, (int)floor(std::min(v[0]->y, std::min(v[1]->y, v[2]->y))));
+		t.max_y = std::min(OCCLUSION_BUFFER_HEIGHT - 1, (int)ceil(std::max(v[0]->y, std::max(v[1]->y, v[2]->y))));
+		if (t.min_x > t.max_x || t.min_y > t.max_y)
+			continue;
+
+		for (int j = 0; j < 3; ++j)
+		{
+			const Vector4f& a = *v[j];
+			const Vector4f& b = *v[(j + 1) % 3];
+			t.a[j] = a.y - b.y;
+			t.b[j] = b.x - a.x;
+			t.c[j] = -(t.a[j] * a.x + t.b[j] * a.y);
+		}
+
+		float iarea = 1.0f / area;
+		t.zdx = ((v[1]->z - v[0]->z) * (v[2]->y - v[0]->y) - (v[2]->z - v[0]->z) * (v[1]->y - v[0]->y)) * iarea;
+		t.zdy = ((v[2]->z - v[0]->z) * (v[1]->x - v[0]->x) - (v[1]->z - v[0]->z) * (v[2]->x - v[0]->x)) * iarea;
+		t.zc = v[0]->z - t.zdx * v[0]->x - t.zdy * v[0]->y;
+
+		triangles.push_back(t);
+	}
+}
+
+void SCN::OcclusionCuller::rasterizeTriangle(const sScreenTriangle& t, int y_start, int y_end)
+{
+	int min_y = std::max(t.min_y, y_start);
+	int max_y = std::min(t.max_y, y_end - 1);
+	int min_x = t.min_x & ~3; //aligned to 4 pixels
+	int max_x = t.max_x;
+
+#ifdef OCCLUSION_USE_SSE
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+	const __m128 a0 = _mm_set1_ps(t.a[0]), a1 = _mm_set1_ps(t.a[1]), a2 = _mm_set1_ps(t.a[2]);
+	const __m128 zdx = _mm_set1_ps(t.zdx);
+	const __m128 step_x = _mm_set1_ps(4.0f);
+#endif
+
+	for (int y = min_y; y <= max_y; ++y)
+	{
+		float py = y + 0.5f;
+		float* row = &depth[y * OCCLUSION_BUFFER_WIDTH];
+
+#ifdef OCCLUSION_USE_SSE
+		//values for the first 4 pixels of the row, then they are incremented
+		__m128 px = _mm_add_ps(_mm_set1_ps((float)min_x), offsets);
+		__m128 e0 = _mm_add_ps(_mm_mul_ps(a0, px), _mm_set1_ps(t.b[0] * py + t.c[0]));
+		__m128 e1 = _mm_add_ps(_mm_mul_ps(a1, px), _mm_set1_ps(t.b[1] * py + t.c[1]));
+		__m128 e2 = _mm_add_ps(_mm_mul_ps(a2, px), _mm_set1_ps(t.b[2] * py + t.c[2]));
+		__m128 z = _mm_add_ps(_mm_mul_ps(zdx, px), _mm_set1_ps(t.zdy * py + t.zc));
+		const __m128 e0_step = _mm_mul_ps(a0, step_x);
+		const __m128 e1_step = _mm_mul_ps(a1, step_x);
+		const __m128 e2_step = _mm_mul_ps(a2, step_x);
+		const __m128 z_step = _mm_mul_ps(zdx, step_x);
+
+		for (int x = min_x; x <= max_x; x += 4)
+		{
+			__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+			if (_mm_movemask_ps(inside))
+			{
+				__m128 old = _mm_loadu_ps(row + x);
+				__m128 closest = _mm_max_ps(old, z);
+				_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, closest), _mm_andnot_ps(inside, old)));
+			}
+			e0 = _mm_add_ps(e0, e0_step);
+			e1 = _mm_add_ps(e1, e1_step);
+			e2 = _mm_add_ps(e2, e2_step);
+			z = _mm_add_ps(z, z_step);
+		}
+#else
+		for (int x = min_x; x <= max_x; ++x)
+		{
+			float px = x + 0.5f;
+			if (t.a[0] * px + t.b[0] * py + t.c[0] < 0.0f ||
+				t.a[1] * px + t.b[1] * py + t.c[1] < 0.0f ||
+				t.a[2] * px + t.b[2] * py + t.c[2] < 0.0f)
+				continue;
+			float z = t.zdx * px + t.zdy * py + t.zc;
+			if (z > row[x])
+				row[x] = z;
+		}
+#endif
+	}
+}
+
+void SCN::OcclusionCuller::rasterizeBand(int band)
+{
+	int y_start = band * OCCLUSION_BAND_HEIGHT;
+	int y_end = y_start + OCCLUSION_BAND_HEIGHT;
+
+	for (auto& triangles : occluder_triangles)
+		for (auto& t : triangles)
+			if (t.max_y >= y_start && t.min_y < y_end)
+				rasterizeTriangle(t, y_start, y_end);
+
+	//update the farthest depth of the tiles in this band
+	for (int ty = y_start / OCCLUSION_TILE_SIZE; ty < y_end / OCCLUSION_TILE_SIZE; ++ty)
+		for (int tx = 0; tx < OCCLUSION_TILES_X; ++tx)
+		{
+			float farthest = 1e10f;
+			for (int y = ty * OCCLUSION_TILE_SIZE; y < (ty + 1) * OCCLUSION_TILE_SIZE; ++y)
+			{
+				const float* row = &depth[y * OCCLUSION_BUFFER_WIDTH + tx * OCCLUSION_TILE_SIZE];
+				for (int x = 0; x < OCCLUSION_TILE_SIZE; ++x)
+					farthest = std::min(farthest, row[x]);
+			}
+			tiles[ty * OCCLUSION_TILES_X + tx] = farthest;
+		}
+}
+
+void SCN::OcclusionCuller::renderOccluders(Camera* camera, std::vector<RenderCall>& calls)
+{
+	occlusion_clock::time_point start = occlusion_clock::now();
+
+	this->camera = camera;
+	viewprojection = camera->viewprojection_matrix;
+	clear();
+
+	//choose the biggest ones in screen
+	std::vector<std::pair<float, int>> candidates;
+	for (int i = 0; i < (int)calls.size(); ++i)
+	{
+		RenderCall& rc = calls[i];
+		//meshes with KEEP_NONE retention have no positions in RAM to rasterize, they are only tested
+		if (!rc.mesh || !rc.mesh->getNumCPUVertices() || rc.material->alpha_mode != eAlphaMode::NO_ALPHA)
+			continue;
+		unsigned int num_tris = (rc.mesh->m_indices.size() ? (unsigned int)rc.mesh->m_indices.size() : rc.mesh->getNumCPUVertices()) / 3;
+		if ((int)num_tris > max_occluder_triangles)
+			continue;
+		BoundingBox box = transformBoundingBox(rc.model, rc.mesh->box);
+		float size = box.halfsize.length() / std::max(rc.camera_distance, 0.001f);
+		if (size >= min_occluder_size)
+			candidates.push_back(std::make_pair(size, i));
+	}
+	std::sort(candidates.begin(), candidates.end(), [](const std::pair<float, int>& a, const std::pair<float, int>& b) { return a.first > b.first; });
+	if ((int)candidates.size() > max_occluders)
+		candidates.resize(max_occluders);
+
+	num_occluders = (int)candidates.size();
+	occluder_triangles.resize(candidates.size());
+	for (auto& triangles : occluder_triangles)
+		triangles.clear();
+
+	//transform and setup in parallel, one job per occluder
+	auto setup_job = [&](int i) {
+		RenderCall& rc = calls[candidates[i].second];
+		setupTriangles(rc.mesh, rc.model * viewprojection, occluder_triangles[i]);
+	};
+	if (use_threads)
+		WorkerPool::global.parallelFor((int)candidates.size(), setup_job);
+	else
+		for (int i = 0; i < (int)candidates.size(); ++i)
+			setup_job(i);
+
+	num_triangles = 0;
+	for (auto& triangles : occluder_triangles)
+		num_triangles += (int)triangles.size();
+
+	//every band of rows is independent
+	if (use_threads)
+		WorkerPool::global.parallelFor(OCCLUSION_NUM_BANDS, [&](int band) { rasterizeBand(band); });
+	else
+		for (int i = 0; i < OCCLUSION_NUM_BANDS; ++i)
+			rasterizeBand(i);
+
+	raster_time = elapsedMs(start);
+}
+
+bool SCN::OcclusionCuller::isOccluded(const BoundingBox& box)
+{
+	float min_x = 1e10f, min_y = 1e10f, max_x = -1e10f, max_y = -1e10f;
+	float nearest = 0.0f; //biggest 1/w
+
+	for (int i = 0; i < 8; ++i)
+	{
+		Vector3f corner(box.center.x + ((i & 1) ? box.halfsize.x : -box.halfsize.x),
+			box.center.y + ((i & 2) ? box.halfsize.y : -box.halfsize.y),
+			box.center.z + ((i & 4) ? box.halfsize.z : -box.halfsize.z));
+		Vector4f clip = viewprojection * Vector4f(corner.x, corner.y, corner.z, 1.0f);
+		if (clip.w < OCCLUSION_MIN_W)
+			return false; //crosses the camera plane
+		float iw = 1.0f / clip.w;
+		float x = (clip.x * iw * 0.5f + 0.5f) * OCCLUSION_BUFFER_WIDTH;
+		float y = (clip.y * iw * 0.5f + 0.5f) * OCCLUSION_BUFFER_HEIGHT;
+		min_x = std::min(min_x, x); max_x = std::max(max_x, x);
+		min_y = std::min(min_y, y); max_y = std::max(max_y, y);
+		nearest = std::max(nearest, iw);
+	}
+
+	int tx0 = std::max(0, (int)floor(min_x) / OCCLUSION_TILE_SIZE);
+	int tx1 = std::min(OCCLUSION_TILES_X - 1, (int)ceil(max_x) / OCCLUSION_TILE_SIZE);
+	int ty0 = std::max(0, (int)floor(min_y) / OCCLUSION_TILE_SIZE);
+	int ty1 = std::min(OCCLUSION_TILES_Y - 1, (int)ceil(max_y) / OCCLUSION_TILE_SIZE);
+	if (tx0 > tx1 || ty0 > ty1)
+		return false; //outside the screen, frustum culling deals with it
+
+	//occluded only if every tile is closer than the closest point of the box
+	for (int ty = ty0; ty <= ty1; ++ty)
+		for (int tx = tx0; tx <= tx1; ++tx)
+			if (tiles[ty * OCCLUSION_TILES_X + tx] <= nearest)
+				return false;
+	return true;
+}
+
+int SCN::OcclusionCuller::testCalls(std::vector<RenderCall>& calls)
+{
+	//chunks of calls so the jobs are not too small
+	const int chunk = 64;
+	int num_chunks = ((int)calls.size() + chunk - 1) / chunk;
+	std::vector<int> culled(num_chunks, 0);
+
+	auto test_job = [&](int c) {
+		int end = std::min((int)calls.size(), (c + 1) * chunk);
+		for (int i = c * chunk; i < end; ++i)
+		{
+			RenderCall& rc = calls[i];
+			rc.occluded = isOccluded(transformBoundingBox(rc.model, rc.mesh->box));
+			if (rc.occluded)
+				culled[c]++;
+		}
+	};
+	if (use_threads)
+		WorkerPool::global.parallelFor(num_chunks, test_job);
+	else
+		for (int i = 0; i < num_chunks; ++i)
+			test_job(i);
+
+	int total = 0;
+	for (int n : culled)
+		total += n;
+	return total;
+}
+
+int SCN::OcclusionCuller::cull(Camera* camera, std::vector<RenderCall>& calls, std::vector<RenderCall>& calls_alpha)
+{
+	renderOccluders(camera, calls);
+
+	occlusion_clock::time_point start = occlusion_clock::now();
+	num_tested = (int)(calls.size() + calls_alpha.size());
+	num_culled = testCalls(calls) + testCalls(calls_alpha);
+	test_time = elapsedMs(start);
+
+	return num_culled;
+}
+
+void SCN::OcclusionCuller::benchmark(Camera* camera, std::vector<RenderCall>& calls, std::vector<RenderCall>& calls_alpha, int iterations)
+{
+	bool prev_use_threads = use_threads;
+
+	std::cout << " * Occlusion benchmark: " << calls.size() + calls_alpha.size() << " render calls, " << iterations << " iterations, buffer " << OCCLUSION_BUFFER_WIDTH << "x" << OCCLUSION_BUFFER_HEIGHT;
+#ifdef OCCLUSION_USE_SSE
+	std::cout << " (SSE)" << std::endl;
+#else
+	std::cout << " (scalar)" << std::endl;
+#endif
+
+	for (int mode = 0; mode < 2; ++mode)
+	{
+		use_threads = mode == 1;
+		float total_raster = 0;
+		float total_test = 0;
+		for (int i = 0; i < iterations; ++i)
+		{
+			cull(camera, calls, calls_alpha);
+			total_raster += raster_time;
+			total_test += test_time;
+		}
+		std::cout << "   " << (use_threads ? "threads: " : "single:  ") << WorkerPool::global.getNumThreads() * use_threads + !use_threads
+			<< " raster: " << total_raster / iterations << "ms test: " << total_test / iterations << "ms"
+			<< " occluders: " << num_occluders << " triangles: " << num_triangles
+			<< " culled: " << num_culled << "/" << num_tested << std::endl;
+	}
+
+	use_threads = prev_use_threads;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <vector>
+
+#include "../core/math.h"
+
+//forward declarations
+class Camera;
+
+namespace GFX {
+	class Mesh;
+}
+
+//low resolution depth buffer, width must be multiple of 4 (SIMD) and both of the tile size
+#define OCCLUSION_BUFFER_WIDTH 320
+#define OCCLUSION_BUFFER_HEIGHT 192
+#define OCCLUSION_TILE_SIZE 8
+#define OCCLUSION_BAND_HEIGHT 16 //rows rasterized by every job, multiple of the tile size
+
+namespace SCN {
+
+	struct RenderCall;
+
+	//CPU occlusion culling: the biggest objects are rasterized in a small depth buffer (SSE when available)
+	//using the worker threads, then the bounding box of every render call is tested against it.
+	//It doesnt use the GPU at all.
+	class OcclusionCuller
+	{
+	public:
+		bool enabled;
+		bool use_threads;
+		int max_occluders;
+		int max_occluder_triangles; //skip very dense meshes
+		float min_occluder_size; //radius / distance
+
+		Camera* camera; //the camera used for the last buffer
+		Matrix44 viewprojection;
+
+		std::vector<float> depth; //1/w per pixel, 0 means empty
+		std::vector<float> tiles; //farthest 1/w of every tile
+
+		//stats of the last frame
+		int num_occluders;
+		int num_triangles;
+		int num_tested;
+		int num_culled;
+		float raster_time; //in ms
+		float test_time;
+
+		OcclusionCuller();
+
+		void clear();
+
+		//picks the biggest calls as occluders and rasterizes them
+		void renderOccluders(Camera* camera, std::vector<RenderCall>& calls);
+
+		//test a world bounding box against the buffer
+		bool isOccluded(const BoundingBox& box);
+
+		//fills the occluded flag of every call, returns how many were culled
+		int cull(Camera* camera, std::vector<RenderCall>& calls, std::vector<RenderCall>& calls_alpha);
+
+		//runs the culling several times and prints the timings
+		void benchmark(Camera* camera, std::vector<RenderCall>& calls, std::vector<RenderCall>& calls_alpha, int iterations = 100);
+
+	private:
+		struct sScreenTriangle {
+			float a[3], b[3], c[3]; //edge equations, inside when all are positive
+			float zdx, zdy, zc; //plane of 1/w
+			int min_x, max_x, min_y, max_y;
+		};
+
+		std::vector<std::vector<sScreenTriangle>> occluder_triangles; //one list per occluder
+
+		void setupTriangles(GFX::Mesh* mesh, const Matrix44& mvp, std::vector<sScreenTriangle>& triangles);
+		void rasterizeBand(int band);
+		void rasterizeTriangle(const sScreenTriangle& t, int y_start, int y_end);
+		int testCalls(std::vector<RenderCall>& calls);
+	};
+
+};
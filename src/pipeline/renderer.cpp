@@ -9,6 +9,12 @@
 #include "../gfx/texture.h"
 #include "../gfx/fbo.h"
 #include "../gfx/sphericalharmonics.h"
+#include "../gfx/environment.h"
+#include "../gfx/geometrypool.h"
+#include "../gfx/uploadring.h"
+#include "../gfx/texturestreamer.h"
+#include "../gfx/rendertargetpool.h"
+#include "../gfx/framegraph.h"
 #include "../pipeline/prefab.h"
 #include "../pipeline/material.h"
 #include "../pipeline/animation.h"
@@ -27,6 +33,8 @@ SCN::Renderer::Renderer(const char* shader_atlas_filename)
 
 	scene = nullptr;
 	skybox_cubemap = nullptr;
+	skybox_prefiltered = nullptr;
+	skybox_prefiltered_source = nullptr;
 	show_shadowmaps = false;
 	show_gbuffers = false;
 	shadowmap_on = false;
@@ -38,32 +46,99 @@ SCN::Renderer::Renderer(const char* shader_atlas_filename)
 	show_ref_probes = false;
 	show_volumetric = false;
 	show_postFX = false;
-
-	ssao_points = generateSpherePoints(64, 1, false);
+	use_motion_blur = true;
+	use_bloom = true;
+	bloom_threshold = 1.0;
+	bloom_intensity = 0.2;
+	use_environment = true;
+
+	dynamic_resolution = false;
+	target_frame_ms = 16.6;
+	resolution_scale = 1.0;
+	min_resolution_scale = 0.5;
+	upscale_sharpness = 0.5;
+	gpu_frame_ms = 0;
+	frames_since_resize = 0;
+
+	use_taa = true;
+	taa_upsample = false;
+	taa_upsample_scale = 0.67;
+	taa_feedback = 0.9;
+	taa_frame = 0;
+	taa_history = 0;
+	taa_history_valid = false;
+
+	small_light_size = 0.1;
+	num_volume_lights = 0;
+	num_batched_lights = 0;
+
+	ssao_points = generateSpherePoints(16, 1, true);
 	ssao_radius = 5.0;
+	ssao_temporal = true;
+	ssao_frame = 0;
+	ssao_history = 0;
+	ssao_history_valid = false;
 
 	irr_mulitplier = 1.0;
 
 	air_density = 0.01;
 
+	froxel_dims[0] = 160;
+	froxel_dims[1] = 90;
+	froxel_dims[2] = 64;
+	froxel_distance = 500;
+	froxel_frame = 0;
+	froxel_history = 0;
+	froxel_history_valid = false;
+	froxel_scattering = nullptr;
+	froxel_history_volumes[0] = froxel_history_volumes[1] = nullptr;
+	froxel_integrated = nullptr;
+	froxel_inject_shader = nullptr;
+	froxel_temporal_shader = nullptr;
+	froxel_integrate_shader = nullptr;
+
+	use_layered_capture = true;
+	num_layers = 0;
+	irr_cubemap = nullptr;
+
+	update_ref_probes = false;
+	ref_faces_per_frame = 2;
+	ref_faces_rendered = 0;
+
 	gbuffer_fbo = nullptr;
 	illumination_fbo = nullptr;
 	ssao_fbo = nullptr;
+	ssao_history_fbo[0] = ssao_history_fbo[1] = nullptr;
 	irr_fbo = nullptr;
 	ref_fbo = nullptr;
+	layered_fbo = nullptr;
 	plane_ref_fbo = nullptr;
-	volumetric_fbo = nullptr;
+	froxel_fbo = nullptr;
 	clone_depth_buffer = nullptr;
-	postFX_fbo_A = nullptr;
-	postFX_fbo_B = nullptr;
-	postFX_fbo_temp = nullptr;
 
-	probes_texture = nullptr;
+	for (int i = 0; i < SH_VOLUMES; ++i)
+		probes_volumes[i] = nullptr;
 
 	brightness = 1.0;
 	tonemapper_scale = 1.0;
 	average_lum = 1.0;
 	lum_white2 = 1.0;
+	auto_exposure = true;
+	exposure_speed = 2.0;
+	exposure_time = 0;
+	exposure_current = 0;
+	exposure_valid = false;
+	exposure_readback = 0;
+	exposure_frame = 0;
+	for (int i = 0; i < EXPOSURE_READBACKS; ++i)
+	{
+		exposure_pbos[i] = 0;
+		exposure_fences[i] = 0;
+	}
+	exposure_sync = -1;
+	luminance_fbo = nullptr;
+	exposure_fbos[0] = exposure_fbos[1] = nullptr;
+	taa_history_fbo[0] = taa_history_fbo[1] = nullptr;
 	gamma = 1.0;
 
 	if (!GFX::Shader::LoadAtlas(shader_atlas_filename))	exit(1);
@@ -76,6 +151,8 @@ SCN::Renderer::Renderer(const char* shader_atlas_filename)
 	quad->uploadToVRAM();
 	cube.createCube(1.0f);
 	cube.uploadToVRAM();
+	cone.createCone(1.0f, 1.0f);
+	cone.uploadToVRAM();
 
 	irradiance_cache_info.num_probes = 0;
 }
@@ -87,6 +164,14 @@ void SCN::Renderer::setupScene(Camera* camera)
 	else
 		skybox_cubemap = nullptr;
 
+	//only when the skybox changes
+	if (skybox_cubemap != skybox_prefiltered_source)
+	{
+		delete skybox_prefiltered;
+		skybox_prefiltered = skybox_cubemap ? GFX::prefilterEnvironment(skybox_cubemap) : nullptr;
+		skybox_prefiltered_source = skybox_cubemap;
+	}
+
 	//to avoid adding lights infinetly
 	lights.clear();
 	visible_lights.clear();
@@ -123,6 +208,9 @@ void SCN::Renderer::setupScene(Camera* camera)
 	std::sort(render_calls.begin(), render_calls.end(), [](const RenderCall a, const RenderCall b)
 		{ return a.camera_distance > b.camera_distance; });
 
+	//hide the calls behind the big occluders
+	if (occlusion.enabled)
+		occlusion.cull(camera, render_calls, render_calls_alpha);
 }
 
 void SCN::Renderer::renderScene(SCN::Scene* scene, Camera* camera)
@@ -131,11 +219,29 @@ void SCN::Renderer::renderScene(SCN::Scene* scene, Camera* camera)
 
 	setupScene(camera);
 
+	updateResolutionScale();
+
+	//once per frame, every pass has to see the same prev_model of the instances
+	if (gpu_culling.enabled && gpu_culling.init())
+		gpu_culling.update(scene);
+
 	if (shader_mode != eShaderMode::FLAT) generateShadowMaps();
 
+	if (update_ref_probes) updateReflectionProbes(scene, camera);
+
 	renderFrame(scene, camera);
 
 	if (show_shadowmaps) debugShadowMaps();
+
+	//for the velocity of the next frame
+	prev_viewprojection = camera->unjittered_viewprojection_matrix;
+	prev_models.swap(current_models);
+	current_models.clear();
+
+	GFX::RenderTargetPool::global.release(plane_ref_fbo);
+	plane_ref_fbo = nullptr;
+	releaseDisabledTargets();
+	GFX::RenderTargetPool::global.endFrame();
 }
 
 void SCN::Renderer::renderFrame(SCN::Scene* scene, Camera* camera)
@@ -153,316 +259,565 @@ void SCN::Renderer::renderFrame(SCN::Scene* scene, Camera* camera)
 	//renderPlanarReflection(scene, &simmetric_camera);
 }
 
-void SCN::Renderer::renderDeferred(SCN::Scene* scene, Camera* camera)
+//sync objects are core since 3.2, the context may be older
+static bool isSyncSupported()
 {
-	vec2 size = CORE::getWindowSize();
-	GFX::Shader* shader = nullptr;
-
-	//generate FBOs
-	if (!gbuffer_fbo)
-	{
-		gbuffer_fbo = new GFX::FBO();
-		gbuffer_fbo->create(size.x, size.y, 3, GL_RGBA, GL_UNSIGNED_BYTE, true);
+	GLint major = 0;
+	GLint minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	if (major > 3 || (major == 3 && minor >= 2))
+		return true;
+
+	GLint num_extensions = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+	for (int i = 0; i < num_extensions; ++i)
+		if (strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), "GL_ARB_sync") == 0)
+			return true;
+	return false;
+}
 
-		clone_depth_buffer = new GFX::Texture(size.x, size.y, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT);
-	}
-	if(!illumination_fbo)
+//low discrepancy sequence for the jitter, in [0,1)
+static float halton(int index, int base)
+{
+	float f = 1.0f;
+	float result = 0.0f;
+	while (index > 0)
 	{
-		illumination_fbo = new GFX::FBO();
-		illumination_fbo->create(size.x, size.y, 1, GL_RGB, GL_HALF_FLOAT, false); //half_float for SDR	
+		f /= base;
+		result += f * (index % base);
+		index /= base;
 	}
-	if (!ssao_fbo)
+	return result;
+}
+
+//the FBOs are created with nearest, linear for the ones that are sampled at another resolution
+static void setFilter(GFX::Texture* texture, GLint filter)
+{
+	glBindTexture(texture->texture_type, texture->texture_id);
+	glTexParameteri(texture->texture_type, GL_TEXTURE_MAG_FILTER, filter);
+	glTexParameteri(texture->texture_type, GL_TEXTURE_MIN_FILTER, filter);
+	glBindTexture(texture->texture_type, 0);
+}
+
+//the mesh that contains all the pixels a point or spot light reaches
+GFX::Mesh* SCN::Renderer::getLightVolume(LightEntity* light, Matrix44& model)
+{
+	//the meshes are inscribed in the real shape, a bit bigger to cover it
+	float radius = light->max_distance * 1.05f;
+	if (light->light_type == eLightType::SPOT && light->cone_info.y < 80)
 	{
-		ssao_fbo = new GFX::FBO();
-		ssao_fbo->create(size.x, size.y, 3, GL_RGB, GL_UNSIGNED_BYTE, false);
+		//the spot lights the opposite side of its front (see compute_light), the cone mesh opens to +Z
+		float cone_radius = tan(light->cone_info.y * DEG2RAD) * radius;
+		model = light->root.model;
+		model.rotate((float)PI, vec3(0, 1, 0));
+		model.scale(cone_radius, cone_radius, radius);
+		return &cone;
 	}
-	if (!volumetric_fbo)
+
+	vec3 center = light->root.model.getTranslation();
+	model.setTranslation(center.x, center.y, center.z);
+	model.scale(radius, radius, radius);
+	return &sphere;
+}
+
+void SCN::Renderer::renderLightVolumes(Camera* camera)
+{
+	//the ones that are small on the screen and without shadows go in one instanced draw,
+	//the stencil would cost more than the pixels it saves
+	std::vector<LightEntity*> volume_lights;
+	std::vector<LightEntity*> batched_lights;
+	float tan_half_fov = tan(camera->fov * 0.5f * DEG2RAD);
+	for (auto light : lights)
 	{
-		volumetric_fbo = new GFX::FBO();
-		volumetric_fbo->create(size.x, size.y, 3, GL_RGBA, GL_UNSIGNED_BYTE, false); //GL_LUMINANCE?
+		if (light->light_type == eLightType::DIRECTIONAL)
+			continue;
+		float distance = camera->eye.distance(light->root.model.getTranslation());
+		bool small = camera->type == Camera::PERSPECTIVE && !light->shadowmap && distance > light->max_distance + camera->near_plane &&
+			light->max_distance / (distance * tan_half_fov) < small_light_size;
+		if (small) batched_lights.push_back(light);
+		else volume_lights.push_back(light);
 	}
+	num_volume_lights = (int)volume_lights.size();
+	num_batched_lights = (int)batched_lights.size();
+
+	bool pbr = shader_mode == eShaderMode::PBR;
+	vec2 iRes = vec2(1.0 / illumination_fbo->color_textures[0]->width, 1.0 / illumination_fbo->color_textures[0]->height);
+
+	glDepthMask(false);
+	glEnable(GL_DEPTH_CLAMP); //the volumes beyond the far plane are not clipped
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+	glClear(GL_STENCIL_BUFFER_BIT);
 
-	//render inside the fbo all that is in the bind 
-	gbuffer_fbo->bind();
+	GFX::Shader* stencil_shader = GFX::Shader::Get("flat");
+	GFX::Shader* shader = GFX::Shader::Get(pbr ? "deferred_geometry_pbr" : "deferred_geometry");
+	if (volume_lights.size() && stencil_shader && shader)
 	{
-		//gbuffer_fbo->enableBuffers(true, false, false, false);
-		glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		//gbuffer_fbo->enableAllBuffers();
+		stencil_shader->enable();
+		cameraToShader(camera, stencil_shader);
 
-		camera->enable();
-		renderObjects(camera, render_mode);
-	}
-	gbuffer_fbo->unbind();
+		shader->enable();
+		shader->setTexture("u_albedo_texture", gbuffer_fbo->color_textures[0], 0);
+		shader->setTexture("u_normal_texture", gbuffer_fbo->color_textures[1], 1);
+		shader->setTexture("u_material_texture", gbuffer_fbo->color_textures[2], 2);
+		shader->setTexture("u_depth_texture", gbuffer_fbo->depth_texture, 3);
+		shader->setUniform("u_iRes", iRes);
+		shader->setMatrix44("u_ivp", camera->inverse_viewprojection_matrix);
+		cameraToShader(camera, shader);
 
-	if(decals.size())
-	{		
-		gbuffer_fbo->depth_texture->copyTo(clone_depth_buffer);
+		glEnable(GL_STENCIL_TEST);
+		for (auto light : volume_lights)
+		{
+			Matrix44 model;
+			GFX::Mesh* mesh = getLightVolume(light, model);
+
+			//the faces behind the surface count, +1 the back ones and -1 the front ones (depth fail),
+			//so only the pixels with the surface inside the volume end with a value, also with the camera inside
+			glColorMask(false, false, false, false);
+			glDisable(GL_BLEND);
+			glEnable(GL_DEPTH_TEST);
+			glDepthFunc(GL_LESS);
+			glDisable(GL_CULL_FACE);
+			glStencilFunc(GL_ALWAYS, 0, 0xFF);
+			glStencilOpSeparate(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
+			glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
+			stencil_shader->enable();
+			stencil_shader->setUniform("u_model", model);
+			mesh->render(GL_TRIANGLES);
+
+			//the light in those pixels, with the back faces because the front ones can be behind the camera
+			//and the stencil back to 0 for the next one
+			glColorMask(true, true, true, true);
+			glEnable(GL_BLEND);
+			glDisable(GL_DEPTH_TEST);
+			glEnable(GL_CULL_FACE);
+			glFrontFace(GL_CW);
+			glStencilFunc(GL_NOTEQUAL, 0, 0xFF);
+			glStencilOp(GL_KEEP, GL_KEEP, GL_ZERO);
+			shader->enable();
+			lightToShader(light, shader);
+			shader->setUniform("u_model", model);
+			mesh->render(GL_TRIANGLES);
+			glFrontFace(GL_CCW);
+		}
+		glDisable(GL_STENCIL_TEST);
+	}
 
+	GFX::Shader* batch_shader = GFX::Shader::Get(pbr ? "deferred_lights_batch_pbr" : "deferred_lights_batch");
+	if (batched_lights.size() && batch_shader)
+	{
+		//one pass, the back faces behind the surface, some pixels in front of the volume are shaded for nothing
+		glEnable(GL_BLEND);
 		glEnable(GL_DEPTH_TEST);
-		glDepthMask(false);
 		glDepthFunc(GL_GREATER);
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-		glFrontFace(GL_CW);
 		glEnable(GL_CULL_FACE);
+		glFrontFace(GL_CW);
 
-		gbuffer_fbo->bind();
+		batch_shader->enable();
+		batch_shader->setTexture("u_albedo_texture", gbuffer_fbo->color_textures[0], 0);
+		batch_shader->setTexture("u_normal_texture", gbuffer_fbo->color_textures[1], 1);
+		batch_shader->setTexture("u_material_texture", gbuffer_fbo->color_textures[2], 2);
+		batch_shader->setTexture("u_depth_texture", gbuffer_fbo->depth_texture, 3);
+		batch_shader->setUniform("u_iRes", iRes);
+		batch_shader->setMatrix44("u_ivp", camera->inverse_viewprojection_matrix);
+		cameraToShader(camera, batch_shader);
+
+		vec4 positions[MAX_BATCHED_LIGHTS];
+		vec4 colors[MAX_BATCHED_LIGHTS];
+		vec4 fronts[MAX_BATCHED_LIGHTS];
+		vec4 cones[MAX_BATCHED_LIGHTS];
+		for (size_t start = 0; start < batched_lights.size(); start += MAX_BATCHED_LIGHTS)
 		{
-			camera->enable();
-			GFX::Shader* shader = GFX::Shader::Get("decals");
-			shader->enable();
-			shader->setTexture("u_depth_texture", clone_depth_buffer, 4);
-			shader->setUniform("u_iRes", vec2(1.0 / gbuffer_fbo->color_textures[0]->width, 1.0 / gbuffer_fbo->color_textures[0]->height));
-			shader->setMatrix44("u_ivp", camera->inverse_viewprojection_matrix);
-			cameraToShader(camera, shader);
-	
-			for (auto decal : decals)
+			int count = std::min((int)(batched_lights.size() - start), MAX_BATCHED_LIGHTS);
+			for (int i = 0; i < count; ++i)
 			{
-				if (!decal->filename.size()) continue;
-
-				mat4 imodel = decal->root.model;
-				imodel.inverse();
-				GFX::Texture* decal_texture = GFX::Texture::Get((std::string("data/") + decal->filename).c_str());
-				shader->setTexture("u_color_texture", decal_texture, 5);
-				shader->setUniform("u_model", decal->root.model);
-				shader->setUniform("u_imodel", imodel);
-				cube.render(GL_TRIANGLES);
+				LightEntity* light = batched_lights[start + i];
+				positions[i] = vec4(light->root.model.getTranslation(), light->max_distance);
+				colors[i] = vec4(light->color * light->intensity, (float)light->light_type);
+				fronts[i] = vec4(light->root.model.rotateVector(vec3(0, 0, 1)), 0.0f);
+				cones[i] = vec4(cos(light->cone_info.x * DEG2RAD), cos(light->cone_info.y * DEG2RAD), 0.0f, 0.0f);
 			}
+			batch_shader->setUniform4Array("u_lights_position", (float*)positions, count);
+			batch_shader->setUniform4Array("u_lights_color", (float*)colors, count);
+			batch_shader->setUniform4Array("u_lights_front", (float*)fronts, count);
+			batch_shader->setUniform4Array("u_lights_cone", (float*)cones, count);
+			sphere.render(GL_TRIANGLES, -1, count);
 		}
-		glDepthMask(true);
-		glFrontFace(GL_CCW);
-		glDepthFunc(GL_LESS);
-		gbuffer_fbo->unbind();
+		batch_shader->disable();
 	}
 
-	illumination_fbo->bind();
+	glFrontFace(GL_CCW);
+	glDisable(GL_CULL_FACE);
+	glDisable(GL_BLEND);
+	glDepthFunc(GL_LESS);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_DEPTH_CLAMP);
+	glDepthMask(true);
+}
+
+void SCN::Renderer::updateResolutionScale()
+{
+	if (!dynamic_resolution)
 	{
-		camera->enable();
+		resolution_scale = use_taa && taa_upsample ? taa_upsample_scale : 1.0f;
+		return;
+	}
 
-		//to clear the scene
-		glDisable(GL_DEPTH_TEST);
-		glDisable(GL_BLEND);
+	//the query of a frame arrives some frames later, so it reacts slowly on purpose
+	float frame_ms = GFX::gpu_frame_microseconds * 0.001f;
+	if (frame_ms <= 0.0f)
+		return;
+	gpu_frame_ms = gpu_frame_ms > 0.0f ? gpu_frame_ms * 0.9f + frame_ms * 0.1f : frame_ms;
+	if (++frames_since_resize < 30) //the average has to settle after every change
+		return;
 
-		glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	//down fast, with the cost proportional to the pixels, and up one step at a time
+	//the gap between both limits avoids going up and down every time
+	float scale = resolution_scale;
+	if (gpu_frame_ms > target_frame_ms * 1.05f)
+	{
+		scale = resolution_scale * sqrtf(target_frame_ms / gpu_frame_ms);
+		scale = std::max(scale, resolution_scale - 2 * RESOLUTION_STEP);
+		scale = std::min(floorf(scale / RESOLUTION_STEP + 0.01f) * RESOLUTION_STEP, resolution_scale - RESOLUTION_STEP);
+	}
+	else if (gpu_frame_ms < target_frame_ms * 0.8f)
+		scale = resolution_scale + RESOLUTION_STEP;
+	scale = clamp(scale, min_resolution_scale, 1.0f);
 
-		if (skybox_cubemap) renderSkybox(skybox_cubemap, scene->skybox_intensity);
+	if (fabsf(scale - resolution_scale) > RESOLUTION_STEP * 0.5f)
+	{
+		resolution_scale = scale;
+		frames_since_resize = 0;
+	}
+}
 
-		shader = GFX::Shader::Get("deferred_global");
+void SCN::Renderer::createRenderTargets(int width, int height)
+{
+	//the rest of the targets of the frame are transient, from the pool
+	delete gbuffer_fbo;
+	delete clone_depth_buffer;
+	clone_depth_buffer = nullptr;
 
-		shader->enable();
-		shader->setTexture("u_albedo_texture", gbuffer_fbo->color_textures[0], 0);
-		shader->setTexture("u_normal_texture", gbuffer_fbo->color_textures[1], 1);
-		shader->setTexture("u_emissive_texture", gbuffer_fbo->color_textures[2], 2);
-		shader->setTexture("u_depth_texture", gbuffer_fbo->depth_texture, 3);
-		shader->setUniform("u_ambient_light", show_irradiance ? 0.0 : scene->ambient_light);
+	//every target with the smallest format for what it stores, 18 bytes per pixel with the 32 bits depth
+	//the roughness goes in the free channel of the normal, with 10 bits it doesnt band in the highlights
+	//the emissive is not here, the geometry pass writes it in the illumination buffer
+	std::vector<GFX::Texture*> gbuffers;
+	gbuffers.push_back(new GFX::Texture(width, height, GL_RGBA, GL_UNSIGNED_BYTE, false)); //albedo, occlusion
+	gbuffers.push_back(new GFX::Texture(width, height, GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV, false, nullptr, GL_RGB10_A2)); //octahedral normal, roughness
+	gbuffers.push_back(new GFX::Texture(width, height, GL_RG, GL_UNSIGNED_BYTE, false, nullptr, GL_RG8)); //metallic, material id
+	gbuffers.push_back(new GFX::Texture(width, height, GL_RG, GL_HALF_FLOAT, false, nullptr, GL_RG16F)); //velocity
+	for (auto texture : gbuffers)
+		setFilter(texture, GL_NEAREST);
+
+	gbuffer_fbo = new GFX::FBO();
+	gbuffer_fbo->setTextures(gbuffers, new GFX::Texture(width, height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT));
+	gbuffer_fbo->owns_textures = true;
+}
 
-		quad->render(GL_TRIANGLES);
+void SCN::Renderer::renderDeferred(SCN::Scene* scene, Camera* camera)
+{
+	vec2 size = CORE::getWindowSize();
 
-		//DIRECTIONAL LIGHTS
-		//chose a shader
-		switch (shader_mode)
-		{
-		case eShaderMode::MULTIPASS: shader = GFX::Shader::Get("deferred_light"); break;
-		case eShaderMode::PBR: shader = GFX::Shader::Get("deferred_pbr"); break;
-		}
+	//the targets follow the window size and the dynamic resolution
+	int render_width = std::max((int)(size.x * resolution_scale), 1);
+	int render_height = std::max((int)(size.y * resolution_scale), 1);
+	if (!gbuffer_fbo || gbuffer_fbo->width != render_width || gbuffer_fbo->height != render_height)
+		createRenderTargets(render_width, render_height);
 
-		shader->enable();
+	//a different subpixel offset every frame, the TAA accumulates them
+	//with a lower resolution there are less samples per pixel of the window, so it needs a longer sequence
+	if (use_taa)
+	{
+		int num_samples = render_width < size.x ? 16 : 8;
+		int index = taa_frame++ % num_samples + 1;
+		camera->setJitter((halton(index, 2) - 0.5f) * 2.0f / render_width, (halton(index, 3) - 0.5f) * 2.0f / render_height);
+	}
 
-		shader->setTexture("u_albedo_texture", gbuffer_fbo->color_textures[0], 0);
-		shader->setTexture("u_normal_texture", gbuffer_fbo->color_textures[1], 1);
-		shader->setTexture("u_emissive_texture", gbuffer_fbo->color_textures[2], 2);
-		shader->setTexture("u_depth_texture", gbuffer_fbo->depth_texture, 3);
-		shader->setUniform("u_iRes", vec2(1.0 / illumination_fbo->color_textures[0]->width, 1.0 / illumination_fbo->color_textures[0]->height));
-		shader->setMatrix44("u_ivp", camera->inverse_viewprojection_matrix);
-		cameraToShader(camera, shader);
+	//every pass declares what it reads and writes, the ones nobody reads are culled (like the SSAO without its debug view)
+	//and the transient targets only exist from the first to the last pass that uses them
+	GFX::FrameGraph& graph = frame_graph;
+	graph.begin();
+	int gbuffer = graph.importTarget("gbuffer", gbuffer_fbo);
+	int illumination = graph.createTarget("illumination", render_width, render_height, 1, GL_RGB, GL_HALF_FLOAT, false); //half_float for SDR
+	int ssao = graph.createTarget("ssao", render_width, render_height, 1, GL_RGB, GL_UNSIGNED_BYTE, false); //full resolution, the result
+	int volumetric = graph.importTarget("volumetric", nullptr); //the froxel volumes
+
+	int pass = graph.addPass("geometry", [&]() {
+		illumination_fbo = graph.getTarget(illumination);
+		setFilter(illumination_fbo->color_textures[0], GL_LINEAR); //linear because it is scaled to the window
+
+		//render inside the fbo all that is in the bind 
+		//the illumination is the fifth target, so the emissive and the sky do not need a target of their own
+		GLenum geometry_bufs[5] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3, GL_COLOR_ATTACHMENT4 };
+		GLenum illumination_buf = GL_COLOR_ATTACHMENT4;
+		gbuffer_fbo->bind();
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT4, GL_TEXTURE_2D, illumination_fbo->color_textures[0]->texture_id, 0);
+		glDrawBuffers(5, geometry_bufs);
+		{
+			glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			float zero[4] = { 0, 0, 0, 0 };
+			glClearBufferfv(GL_COLOR, 3, zero); //no velocity, the background is reprojected with the camera
 
-		glDisable(GL_DEPTH_TEST);
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+			camera->enable();
 
-		for (auto light : lights)
-		{
-			if (light->light_type == eLightType::DIRECTIONAL)
+			//the objects overwrite it with their emissive
+			if (skybox_cubemap)
 			{
-				lightToShader(light, shader);
-				quad->render(GL_TRIANGLES);
+				glDrawBuffers(1, &illumination_buf);
+				renderSkybox(skybox_cubemap, scene->skybox_intensity);
+				glDrawBuffers(5, geometry_bufs);
 			}
+
+			renderObjects(camera, render_mode);
 		}
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT4, GL_TEXTURE_2D, 0, 0);
+		gbuffer_fbo->enableAllBuffers();
+		gbuffer_fbo->unbind();
 
-		glDisable(GL_BLEND);
-		glEnable(GL_DEPTH_TEST);
+		//depth pyramid for the occlusion test of the next frame
+		if (gpu_culling.enabled && gpu_culling.use_hiz)
+			gpu_culling.updateHiZ(gbuffer_fbo->depth_texture, camera);
+	});
+	graph.write(pass, gbuffer);
+	graph.write(pass, illumination);
 
-		//OTHER LIGHTS
-		switch (shader_mode)
-		{
-		case eShaderMode::MULTIPASS: shader = GFX::Shader::Get("deferred_geometry"); glDisable(GL_DEPTH_TEST); break;
-		case eShaderMode::PBR: shader = GFX::Shader::Get("deferred_geometry_pbr"); glEnable(GL_DEPTH_TEST); break;
-		}
-		
-		shader->enable();
-		shader->setTexture("u_albedo_texture", gbuffer_fbo->color_textures[0], 0);
-		shader->setTexture("u_normal_texture", gbuffer_fbo->color_textures[1], 1);
-		shader->setTexture("u_emissive_texture", gbuffer_fbo->color_textures[2], 2);
-		shader->setTexture("u_depth_texture", gbuffer_fbo->depth_texture, 3);
-		shader->setUniform("u_iRes", vec2(1.0 / size.x, 1.0 / size.y));
-		shader->setMatrix44("u_ivp", camera->inverse_viewprojection_matrix);
-		cameraToShader(camera, shader);
-		
-		glDepthFunc(GL_GREATER);
-		glEnable(GL_BLEND);
-		glFrontFace(GL_CW);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-		glDisable(GL_CULL_FACE);
-		glDepthMask(false);
-		
-		for (auto light : lights)
-		{
-			Matrix44 model;
-		
-			if (light->light_type != eLightType::DIRECTIONAL)
+	if (decals.size())
+	{
+		pass = graph.addPass("decals", [&]() {
+			if (!clone_depth_buffer)
+				clone_depth_buffer = new GFX::Texture(render_width, render_height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT);
+			gbuffer_fbo->depth_texture->copyTo(clone_depth_buffer);
+
+			glEnable(GL_DEPTH_TEST);
+			glDepthMask(false);
+			glDepthFunc(GL_GREATER);
+			glEnable(GL_BLEND);
+			glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE); //the alpha is the occlusion of the surface
+			glFrontFace(GL_CW);
+			glEnable(GL_CULL_FACE);
+
+			gbuffer_fbo->bind();
+			gbuffer_fbo->enableBuffers(true, false, false, false); //only the albedo, the rest is of the surface
 			{
-				lightToShader(light, shader);
-		
-				vec3 center = light->root.model.getTranslation();
-				float radius = light->max_distance;
-				model.setTranslation(center.x, center.y, center.z);
-				model.scale(radius, radius, radius);
-		
-				shader->setUniform("u_model", model);
-		
-				sphere.render(GL_TRIANGLES);
+				camera->enable();
+				GFX::Shader* shader = GFX::Shader::Get("decals");
+				shader->enable();
+				shader->setTexture("u_depth_texture", clone_depth_buffer, 4);
+				shader->setUniform("u_iRes", vec2(1.0 / gbuffer_fbo->color_textures[0]->width, 1.0 / gbuffer_fbo->color_textures[0]->height));
+				shader->setMatrix44("u_ivp", camera->inverse_viewprojection_matrix);
+				cameraToShader(camera, shader);
+
+				for (auto decal : decals)
+				{
+					if (!decal->filename.size()) continue;
+
+					mat4 imodel = decal->root.model;
+					imodel.inverse();
+					GFX::Texture* decal_texture = GFX::Texture::Get((std::string("data/") + decal->filename).c_str());
+					shader->setTexture("u_color_texture", decal_texture, 5);
+					shader->setUniform("u_model", decal->root.model);
+					shader->setUniform("u_imodel", imodel);
+					cube.render(GL_TRIANGLES);
+				}
 			}
-		}
-		
-		glFrontFace(GL_CCW);
-		glDisable(GL_BLEND);
-		glDepthFunc(GL_LESS);
-		glDisable(GL_DEPTH_TEST);
-		glDepthMask(true);
-		
-		shader->disable();
+			glDepthMask(true);
+			glFrontFace(GL_CCW);
+			glDepthFunc(GL_LESS);
+			gbuffer_fbo->enableAllBuffers();
+			gbuffer_fbo->unbind();
+		});
+		graph.read(pass, gbuffer);
+		graph.write(pass, gbuffer);
+	}
 
-		if (show_irradiance) applyIrradiance();
+	pass = graph.addPass("lighting", [&]() {
+		illumination_fbo = graph.getTarget(illumination);
+		illumination_fbo->bind();
+		{
+			camera->enable();
 
-		//reflection and illumination probes
-		showProbes();
-	}
-	illumination_fbo->unbind();
-	
-	ssao_fbo->bind();
-	{
-		glDisable(GL_DEPTH_TEST);
-		glDisable(GL_BLEND);
+			//the color already has the sky and the emissive of the geometry pass
+			//the depth is a copy of the gbuffer one for the light volumes, the shaders read the original
+			gbuffer_fbo->depth_texture->copyTo(NULL);
+			glEnable(GL_BLEND);
+			glBlendFunc(GL_ONE, GL_ONE);
 
-		shader = GFX::Shader::Get("ssao");
+			GFX::Shader* shader = GFX::Shader::Get("deferred_global");
 
-		shader->enable();
-		shader->setTexture("u_normal_texture", gbuffer_fbo->color_textures[1], 1);
-		shader->setTexture("u_depth_texture", gbuffer_fbo->depth_texture, 2);
-		shader->setMatrix44("u_ivp", camera->inverse_viewprojection_matrix);
-		shader->setUniform("u_iRes", vec2(1.0 / ssao_fbo->color_textures[0]->width, 1.0 / ssao_fbo->color_textures[0]->height));
+			shader->enable();
+			shader->setTexture("u_albedo_texture", gbuffer_fbo->color_textures[0], 0);
+			shader->setTexture("u_depth_texture", gbuffer_fbo->depth_texture, 3);
+			shader->setUniform("u_ambient_light", show_irradiance ? 0.0 : scene->ambient_light);
 
-		shader->setUniform3Array("u_points", (float*)(&ssao_points[0]), 64);
-		shader->setUniform("u_radius", ssao_radius);
+			quad->render(GL_TRIANGLES);
+			glDisable(GL_BLEND);
 
-		shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-		shader->setUniform("u_camera_pos", camera->eye);
-		shader->setUniform("u_camera_front", camera->front);
+			//DIRECTIONAL LIGHTS
+			//chose a shader
+			switch (shader_mode)
+			{
+			case eShaderMode::MULTIPASS: shader = GFX::Shader::Get("deferred_light"); break;
+			case eShaderMode::PBR: shader = GFX::Shader::Get("deferred_pbr"); break;
+			}
 
-		quad->render(GL_TRIANGLES);
-	}
-	ssao_fbo->unbind();
+			shader->enable();
 
-	volumetric_fbo->bind();
-	{
-		shader = GFX::Shader::Get("volumetric");
+			shader->setTexture("u_albedo_texture", gbuffer_fbo->color_textures[0], 0);
+			shader->setTexture("u_normal_texture", gbuffer_fbo->color_textures[1], 1);
+			shader->setTexture("u_material_texture", gbuffer_fbo->color_textures[2], 2);
+			shader->setTexture("u_depth_texture", gbuffer_fbo->depth_texture, 3);
+			shader->setUniform("u_iRes", vec2(1.0 / illumination_fbo->color_textures[0]->width, 1.0 / illumination_fbo->color_textures[0]->height));
+			shader->setMatrix44("u_ivp", camera->inverse_viewprojection_matrix);
+			cameraToShader(camera, shader);
 
-		shader->enable();
-		shader->setTexture("u_depth_texture", gbuffer_fbo->depth_texture, 2);
-		shader->setMatrix44("u_ivp", camera->inverse_viewprojection_matrix);
-		shader->setUniform("u_iRes", vec2(1.0 / volumetric_fbo->color_textures[0]->width, 1.0 / volumetric_fbo->color_textures[0]->height));
-		shader->setUniform("u_camera_position", camera->eye);
-		shader->setUniform("u_air_density", air_density); //place air_density in scene (scene->air_density)
-		shader->setUniform("u_ambient_light", scene->ambient_light);
-		shader->setUniform("u_time", getTime() * 0.001f);
-		shader->setUniform("u_rand", random());
+			//the specular of the environment is added by the first pass, from the closest probe or the skybox
+			//the probes captured the skybox already scaled by its intensity
+			sReflectionProbe* probe = getClosestReflectionProbe(camera->eye);
+			GFX::Texture* environment_texture = probe ? probe->texture : skybox_prefiltered;
+			float environment_intensity = probe ? 1.0f : scene->skybox_intensity;
+			bool environment = use_environment && environment_texture && shader_mode == eShaderMode::PBR;
+			if (environment)
+			{
+				shader->setTexture("u_environment_texture", environment_texture, 4);
+				shader->setTexture("u_brdf_lut", GFX::getBRDFLUT(), 5);
+				shader->setUniform("u_environment_max_lod", (float)(PREFILTER_LEVELS - 1));
+			}
+			shader->setUniform("u_environment_intensity", environment ? environment_intensity : 0.0f);
 
-		for (auto light : lights)
-		{
-			if (light->light_type != eLightType::POINT)
+			glDisable(GL_DEPTH_TEST);
+			glEnable(GL_BLEND);
+			glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+
+			for (auto light : lights)
+			{
+				if (light->light_type == eLightType::DIRECTIONAL)
+				{
+					lightToShader(light, shader);
+					quad->render(GL_TRIANGLES);
+					if (environment)
+					{
+						shader->setUniform("u_environment_intensity", 0.0f);
+						environment = false;
+					}
+				}
+			}
+
+			//no directional lights, a pass just for the environment
+			if (environment)
 			{
-				lightToShader(light, shader);
-				quad->render(GL_TRIANGLES);	
-				glEnable(GL_BLEND);
+				shader->setUniform("u_light_info", vec4((int)eLightType::NO_LIGHT, 0, 0, 0));
+				shader->setUniform("u_light_color", vec3(0.0f));
+				shader->setUniform("u_shadow_param", vec2(0, 0));
+				quad->render(GL_TRIANGLES);
 			}
+
+			glDisable(GL_BLEND);
+
+			//OTHER LIGHTS
+			renderLightVolumes(camera);
+
+			shader->disable();
+
+			if (show_irradiance) applyIrradiance();
+
+			//reflection and illumination probes
+			showProbes();
 		}
-		glDisable(GL_BLEND);
-	}
-	volumetric_fbo->unbind();
+		illumination_fbo->unbind();
+	});
+	graph.read(pass, gbuffer);
+	graph.read(pass, illumination);
+	graph.write(pass, illumination);
+
+	//nothing uses the occlusion yet, only the debug view
+	int ssao_pass = graph.addPass("ssao", [&]() {
+		ssao_fbo = graph.getTarget(ssao);
+		renderSSAO(camera);
+	});
+	graph.read(ssao_pass, gbuffer);
+	graph.write(ssao_pass, ssao);
+
+	int volumetric_pass = graph.addPass("volumetric", [&]() {
+		renderFroxels(scene, camera);
+	});
+	graph.write(volumetric_pass, volumetric);
 
 	if (show_gbuffers)
 	{
-		glDisable(GL_DEPTH_TEST);
-		glDisable(GL_BLEND);
+		pass = graph.addPass("show gbuffers", [&]() {
+			glDisable(GL_DEPTH_TEST);
+			glDisable(GL_BLEND);
 
-		//albedo
-		glViewport(0, size.y / 2, size.x / 2, size.y / 2);
-		gbuffer_fbo->color_textures[0]->toViewport();
-		//normal
-		glViewport(size.x / 2, size.y / 2, size.x / 2, size.y / 2);
-		gbuffer_fbo->color_textures[1]->toViewport();
-		glViewport(0, 0, size.x / 2, size.y / 2);
-		//emissive
-		gbuffer_fbo->color_textures[2]->toViewport();
-		glViewport(size.x / 2, 0, size.x / 2, size.y / 2);
-		//depth
-		shader = GFX::Shader::getDefaultShader("linear_depth");
-		shader->enable();
-		shader->setUniform("u_camera_nearfar", vec2(camera->near_plane, camera->far_plane));
-		gbuffer_fbo->depth_texture->toViewport(shader);
-		glViewport(0, 0, size.x, size.y);
+			//albedo
+			glViewport(0, size.y / 2, size.x / 2, size.y / 2);
+			gbuffer_fbo->color_textures[0]->toViewport();
+			//octahedral normal and roughness
+			glViewport(size.x / 2, size.y / 2, size.x / 2, size.y / 2);
+			gbuffer_fbo->color_textures[1]->toViewport();
+			glViewport(0, 0, size.x / 2, size.y / 2);
+			//metallic and material id
+			gbuffer_fbo->color_textures[2]->toViewport();
+			glViewport(size.x / 2, 0, size.x / 2, size.y / 2);
+			//depth
+			GFX::Shader* shader = GFX::Shader::getDefaultShader("linear_depth");
+			shader->enable();
+			shader->setUniform("u_camera_nearfar", vec2(camera->near_plane, camera->far_plane));
+			gbuffer_fbo->depth_texture->toViewport(shader);
+			glViewport(0, 0, size.x, size.y);
+			taa_history_valid = false;
+		}, true);
+		graph.read(pass, gbuffer);
+	}
+	else
+	{
+		pass = graph.addPass("postfx", [&]() {
+			GFX::Texture* color_buffer = graph.getTarget(illumination)->color_textures[0];
+			if (use_taa)
+				color_buffer = resolveTAA(color_buffer, camera);
+			renderPostFX(color_buffer, gbuffer_fbo->depth_texture, camera);
+		}, true);
+		graph.read(pass, gbuffer);
+		graph.read(pass, illumination);
+		if (show_volumetric)
+			graph.read(pass, volumetric);
 	}
-	else illumination_fbo->color_textures[0]->toViewport();
 
 	if (show_global_position)
-	{	
-		shader = GFX::Shader::Get("deferred_world_color");
-		shader->enable();
-		shader->setTexture("u_depth_texture", gbuffer_fbo->depth_texture, 3);
-		shader->setUniform("u_iRes", vec2(1.0 / gbuffer_fbo->color_textures[0]->width, 1.0 / gbuffer_fbo->color_textures[0]->height));
-		shader->setUniform("u_ivp", camera->inverse_viewprojection_matrix);
-		quad->render(GL_TRIANGLES);
-	}
-	if (show_ssao) ssao_fbo->color_textures[0]->toViewport();	
-	if (show_tonemapper)
 	{
-		shader = GFX::Shader::Get("tonemapper");
-
-		shader->enable();
-		shader->setUniform("u_scale", tonemapper_scale);
-		shader->setUniform("u_average_lum", average_lum);
-		shader->setUniform("u_lumwhite2", lum_white2);
-		shader->setUniform("u_igamma", 1.0f / gamma);
-		shader->setUniform("u_brightness", brightness);
-
-		illumination_fbo->color_textures[0]->toViewport(shader);
+		pass = graph.addPass("show global position", [&]() {
+			GFX::Shader* shader = GFX::Shader::Get("deferred_world_color");
+			shader->enable();
+			shader->setTexture("u_depth_texture", gbuffer_fbo->depth_texture, 3);
+			shader->setUniform("u_iRes", vec2(1.0 / size.x, 1.0 / size.y)); //on the screen
+			shader->setUniform("u_ivp", camera->inverse_viewprojection_matrix);
+			quad->render(GL_TRIANGLES);
+		}, true);
+		graph.read(pass, gbuffer);
 	}
-	if (show_volumetric)
-		{
-			glEnable(GL_BLEND);
-			glDisable(GL_DEPTH_TEST);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-			volumetric_fbo->color_textures[0]->toViewport();
-			glDisable(GL_BLEND);
-		}
 
-	if (show_postFX)
+	if (show_ssao)
 	{
-		renderPostFX(illumination_fbo->color_textures[0], gbuffer_fbo->depth_texture, camera);
+		pass = graph.addPass("show ssao", [&]() {
+			graph.getTarget(ssao)->color_textures[0]->toViewport();
+		}, true);
+		graph.read(pass, ssao);
 	}
-	
+
+	graph.execute();
+	illumination_fbo = nullptr;
+	ssao_fbo = nullptr;
+
+	//the histories are not valid after the frames their pass was culled
+	if (graph.isCulled(ssao_pass))
+		ssao_history_valid = false;
+	if (graph.isCulled(volumetric_pass))
+		froxel_history_valid = false;
+
+	if (use_taa)
+		camera->setJitter(0, 0);
+	else
+		taa_history_valid = false;
 }
 
 void SCN::Renderer::renderForward(SCN::Scene* scene, Camera* camera, eRenderMode mode)
@@ -487,19 +842,21 @@ void SCN::Renderer::renderForward(SCN::Scene* scene, Camera* camera, eRenderMode
 
 }
 
-void Renderer::renderSkybox(GFX::Texture* cubemap)
+void SCN::Renderer::renderSkybox(GFX::Texture* cubemap, float intensity)
 {
 	Camera* camera = Camera::current;
 
+	//the layered version while rendering the six faces of a cubemap at once
+	GFX::Shader* shader = getShader("skybox");
+	if (!shader)
+		return;
+
 	glDisable(GL_BLEND);
 	glDisable(GL_DEPTH_TEST);
 	glDisable(GL_CULL_FACE);
 	if (render_wireframe)
 		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
-	GFX::Shader* shader = GFX::Shader::Get("skybox");
-	if (!shader)
-		return;
 	shader->enable();
 
 	Matrix44 m;
@@ -509,7 +866,7 @@ void Renderer::renderSkybox(GFX::Texture* cubemap)
 	cameraToShader(camera, shader);
 	shader->setUniform("u_texture", cubemap, 0);
 	shader->setUniform("u_skybox_intensity", intensity);
-	sphere.render(GL_TRIANGLES);
+	sphere.render(GL_TRIANGLES, -1, num_layers);
 	shader->disable();
 	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 	glEnable(GL_DEPTH_TEST);
@@ -530,14 +887,28 @@ void SCN::Renderer::orderRender(SCN::Node* node, Camera* camera)
 		BoundingBox world_bounding = transformBoundingBox(node_model, node->mesh->box);
 
 		//if bounding box is inside the camera frustum then the object is probably visible
-		if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize))
+		if (testBoundingInView(camera, world_bounding))
 		{
 			Vector3f node_pos = node_model.getTranslation();
 			RenderCall rc;
 			rc.mesh = node->mesh;
 			rc.material = node->material;
 			rc.model = node_model;
+			auto prev = prev_models.find(node);
+			rc.prev_model = prev != prev_models.end() ? prev->second : node_model;
+			current_models[node] = node_model;
 			rc.camera_distance = camera->eye.distance(node_pos);
+			rc.occluded = false;
+
+			//size on screen, so the streaming knows which mips of the textures are needed
+			if (GFX::TextureStreamer::global.enabled && camera->type == Camera::PERSPECTIVE)
+			{
+				float radius = world_bounding.halfsize.length();
+				float distance = std::max(camera->eye.distance(world_bounding.center) - radius, camera->near_plane);
+				float screen_size = (2.0f * radius) / (2.0f * distance * tan(camera->fov * 0.5f * DEG2RAD)) * CORE::getWindowSize().y;
+				for (int j = 0; j < eTextureChannel::ALL; ++j)
+					GFX::TextureStreamer::global.request(rc.material->textures[j].texture, screen_size);
+			}
 
 			//material to the appropriate render call if it has alpha or not
 			if (rc.material->alpha_mode == eAlphaMode::NO_ALPHA) render_calls.push_back(rc);
@@ -552,24 +923,83 @@ void SCN::Renderer::orderRender(SCN::Node* node, Camera* camera)
 
 void SCN::Renderer::renderObjects(Camera* camera, eRenderMode mode)
 {
-	//render entities (first opaques)
-	for (int i = 0; i < render_calls.size(); ++i)
-	{	
+	//occlusion was computed from the main camera, the other passes have to render everything
+	bool skip_occluded = occlusion.enabled && camera == occlusion.camera;
+
+	//opaques of the gbuffer and shadowmap passes can be culled and drawn by the GPU
+	bool indirect = gpu_culling.enabled && !render_boundaries && (shadowmap_on || (mode == eRenderMode::DEFERRED && shader_mode != eShaderMode::FLAT));
+
+	//render entities (first opaques)
+	indirect = indirect && gpu_culling.init();
+	if (indirect)
+		renderObjectsIndirect(camera);
+
+	//the ones that are not in the GPU scene still go through the CPU
+	for (size_t i = 0; i < render_calls.size(); ++i)
+	{
 		RenderCall rc = render_calls[i];
-		renderNode(rc.model, rc.mesh, rc.material, camera, mode);
+		if (skip_occluded && rc.occluded)
+			continue;
+		if (indirect && !gpu_culling.missing_meshes.count(rc.mesh))
+			continue;
+		renderNode(rc.model, rc.mesh, rc.material, camera, mode, &rc.prev_model);
 	}
 	//render entities
-	for (int i = 0; i < render_calls_alpha.size(); ++i)
+	for (size_t i = 0; i < render_calls_alpha.size(); ++i)
 	{
 		RenderCall rc = render_calls_alpha[i];
-		renderNode(rc.model, rc.mesh, rc.material, camera, mode);
+		if (skip_occluded && rc.occluded)
+			continue;
+		renderNode(rc.model, rc.mesh, rc.material, camera, mode, &rc.prev_model);
 	}
 }
 
 
 
+//renders all the static opaque objects with one multidraw per material (one for shadowmaps)
+void SCN::Renderer::renderObjectsIndirect(Camera* camera)
+{
+	//the depth pyramid is only valid from the main camera
+	gpu_culling.cull(camera, !shadowmap_on);
+
+	GFX::Shader* shader = shadowmap_on ? gpu_culling.flat_shader : gpu_culling.gbuffers_shader;
+	shader->enable();
+	cameraToShader(camera, shader);
+
+	glDisable(GL_BLEND);
+	glEnable(GL_DEPTH_TEST);
+	if (render_wireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+
+	if (shadowmap_on)
+	{
+		glDisable(GL_CULL_FACE);
+		gpu_culling.draw(shader);
+	}
+	else
+	{
+		//the instances are static, only the camera moves
+		shader->setUniform("u_unjittered_viewprojection", camera->unjittered_viewprojection_matrix);
+		shader->setUniform("u_prev_viewprojection", prev_viewprojection);
+		shader->setUniform("u_time", (float)getTime());
+		shader->setUniform("u_ambient_light", scene->ambient_light);
+		for (size_t i = 0; i < gpu_culling.batches.size(); ++i)
+		{
+			Material* material = gpu_culling.batches[i].material;
+
+			if (material->two_sided) glDisable(GL_CULL_FACE);
+			else glEnable(GL_CULL_FACE);
+
+			materialToShader(material, shader);
+			gpu_culling.draw(shader, (int)i);
+		}
+	}
+
+	shader->disable();
+	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+}
+
 //renders a node of the prefab and its children
-void SCN::Renderer::renderNode(Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, Camera* camera, eRenderMode mode)
+void SCN::Renderer::renderNode(Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, Camera* camera, eRenderMode mode, const Matrix44* prev_model)
 {
 	//does this node have a mesh? then we must render it
 	if (mesh && material)
@@ -578,7 +1008,7 @@ void SCN::Renderer::renderNode(Matrix44 model, GFX::Mesh* mesh, SCN::Material* m
 		BoundingBox world_bounding = transformBoundingBox(model, mesh->box);
 
 		//if bounding box is inside the camera frustum then the object is probably visible
-		if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize))
+		if (testBoundingInView(camera, world_bounding))
 		{
 			//switch between render modes
 			if (render_boundaries)
@@ -600,7 +1030,7 @@ void SCN::Renderer::renderNode(Matrix44 model, GFX::Mesh* mesh, SCN::Material* m
 				case eRenderMode::DEFERRED:
 				{
 					if (shadowmap_on || shader_mode == eShaderMode::FLAT) renderMeshWithMaterialFlat(model, mesh, material);
-					else renderMeshWithMaterialGBuffers(model, mesh, material);
+					else renderMeshWithMaterialGBuffers(model, mesh, material, prev_model);
 					break;
 				}
 			}
@@ -699,7 +1129,7 @@ void SCN::Renderer::renderMeshWithMaterialFlat(Matrix44 model, GFX::Mesh* mesh,
 
 	glEnable(GL_DEPTH_TEST);
 
-	shader = GFX::Shader::Get("flat");
+	shader = getShader("flat");
 
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -715,7 +1145,7 @@ void SCN::Renderer::renderMeshWithMaterialFlat(Matrix44 model, GFX::Mesh* mesh,
 		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
 	//do the draw call that renders the mesh into the screen
-	mesh->render(GL_TRIANGLES);
+	mesh->render(GL_TRIANGLES, -1, num_layers);
 
 	//disable shader
 	shader->disable();
@@ -764,8 +1194,8 @@ void SCN::Renderer::renderMeshWithMaterialLight(const Matrix44 model, GFX::Mesh*
 	//chose a shader
 	switch (shader_mode)
 	{
-	case eShaderMode::MULTIPASS: shader = GFX::Shader::Get("light"); break;
-	case eShaderMode::PBR: shader = GFX::Shader::Get("pbr"); break;
+	case eShaderMode::MULTIPASS: shader = getShader("light"); break;
+	case eShaderMode::PBR: shader = getShader("pbr"); break;
 	}
 
 	assert(glGetError() == GL_NO_ERROR);
@@ -786,7 +1216,7 @@ void SCN::Renderer::renderMeshWithMaterialLight(const Matrix44 model, GFX::Mesh*
 	shader->setUniform("u_roughness_factor", material->roughness_factor);
 	shader->setUniform("u_albedo_texture", albedo_texture ? albedo_texture : white, 0);
 	shader->setUniform("u_emissive_texture", emissive_texture ? emissive_texture : white, 1);
-	shader->setUniform("u_normal_texture", normal_texture ? normal_texture : white, 2);
+	shader->setUniform("u_normal_texture", normal_texture ? normal_texture : GFX::Texture::getFlatNormalTexture(), 2);
 	shader->setUniform("u_metallic_texture", metallic_texture ? metallic_texture : white, 3);
 	shader->setUniform("u_ambient_light", scene->ambient_light);
 
@@ -800,7 +1230,7 @@ void SCN::Renderer::renderMeshWithMaterialLight(const Matrix44 model, GFX::Mesh*
 	if (lights.size() == 0)
 	{
 		shader->setUniform("u_light_info", 0);
-		mesh->render(GL_TRIANGLES);
+		mesh->render(GL_TRIANGLES, -1, num_layers);
 	}
 	else
 	{
@@ -813,7 +1243,7 @@ void SCN::Renderer::renderMeshWithMaterialLight(const Matrix44 model, GFX::Mesh*
 			
 			lightToShader(light, shader);
 
-			mesh->render(GL_TRIANGLES);
+			mesh->render(GL_TRIANGLES, -1, num_layers);
 
 			glEnable(GL_BLEND);
 			glBlendFunc(GL_ONE, GL_ONE);
@@ -826,7 +1256,7 @@ void SCN::Renderer::renderMeshWithMaterialLight(const Matrix44 model, GFX::Mesh*
 	}
 
 	//do the draw call that renders the mesh into the screen	
-	mesh->render(GL_TRIANGLES);
+	mesh->render(GL_TRIANGLES, -1, num_layers);
 
 	//disable shader
 	shader->disable();
@@ -891,7 +1321,7 @@ void Renderer::renderProbe(sProbe& probe){
 
 
 //renders a mesh given its transform and material with gbffers
-void SCN::Renderer::renderMeshWithMaterialGBuffers(Matrix44 model, GFX::Mesh* mesh, SCN::Material* material)
+void SCN::Renderer::renderMeshWithMaterialGBuffers(Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, const Matrix44* prev_model)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material) return;
@@ -902,14 +1332,6 @@ void SCN::Renderer::renderMeshWithMaterialGBuffers(Matrix44 model, GFX::Mesh* me
 	//define locals to simplify coding
 	GFX::Shader* shader = NULL;
 	Camera* camera = Camera::current;
-	GFX::Texture* white = GFX::Texture::getWhiteTexture();
-
-	GFX::Texture* albedo_texture = material->textures[SCN::eTextureChannel::ALBEDO].texture;
-	GFX::Texture* emissive_texture = material->textures[SCN::eTextureChannel::EMISSIVE].texture;
-	GFX::Texture* normal_texture = material->textures[SCN::eTextureChannel::NORMALMAP].texture;
-	GFX::Texture* metallic_texture = material->textures[SCN::eTextureChannel::METALLIC_ROUGHNESS].texture;
-
-	if (albedo_texture == NULL) albedo_texture = white; //a 1x1 white texture
 
 	glDisable(GL_BLEND);
 
@@ -931,21 +1353,14 @@ void SCN::Renderer::renderMeshWithMaterialGBuffers(Matrix44 model, GFX::Mesh* me
 
 	//upload uniforms
 	shader->setUniform("u_model", model);
+	shader->setUniform("u_prev_model", prev_model ? *prev_model : model);
+	shader->setUniform("u_unjittered_viewprojection", camera->unjittered_viewprojection_matrix);
+	shader->setUniform("u_prev_viewprojection", prev_viewprojection);
 	cameraToShader(camera, shader);
 	float t = getTime();
 	shader->setUniform("u_time", t);
 
-	shader->setUniform("u_albedo_factor", material->color);
-	shader->setUniform("u_emissive_factor", material->emissive_factor);
-	shader->setUniform("u_metallic_factor", material->metallic_factor);
-	shader->setUniform("u_roughness_factor", material->roughness_factor);
-	shader->setUniform("u_albedo_texture", albedo_texture ? albedo_texture : white, 0);
-	shader->setUniform("u_emissive_texture", emissive_texture ? emissive_texture : white, 1);
-	shader->setUniform("u_normal_texture", normal_texture ? normal_texture : white, 2);
-	shader->setUniform("u_metallic_texture", metallic_texture ? metallic_texture : white, 3);
-
-	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == SCN::eAlphaMode::MASK ? material->alpha_cutoff : 0.001f);
+	materialToShader(material, shader);
 	shader->setUniform("u_ambient_light", scene->ambient_light);
 
 	if (render_wireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
@@ -967,6 +1382,90 @@ void Renderer::cameraToShader(Camera* camera, GFX::Shader* shader)
 {
 	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
 	shader->setUniform("u_camera_position", camera->eye);
+	if (num_layers)
+		shader->setMatrix44Array("u_layer_viewprojection", layer_viewprojection, num_layers);
+}
+
+GFX::Shader* SCN::Renderer::getShader(const char* name)
+{
+	return num_layers ? GFX::Shader::GetLayered(name) : GFX::Shader::Get(name);
+}
+
+bool SCN::Renderer::testBoundingInView(Camera* camera, const BoundingBox& box)
+{
+	//the six faces of a cubemap together see all around, only the distance matters
+	if (num_layers)
+		return camera->eye.distance(box.center) - box.halfsize.length() < camera->far_plane;
+	return camera->testBoxInFrustum(box.center, box.halfsize);
+}
+
+bool SCN::Renderer::renderCubemapLayered(SCN::Scene* scene, vec3 eye, float far_plane, GFX::Texture* cubemap)
+{
+	//the shaders that renderForward will use
+	const char* name = shadowmap_on || shader_mode == eShaderMode::FLAT ? "flat" : (shader_mode == eShaderMode::PBR ? "pbr" : "light");
+	if (!GFX::Shader::GetLayered(name) || (skybox_cubemap && !GFX::Shader::GetLayered("skybox")))
+	{
+		std::cout << " * Layered rendering not available, capturing the probes face by face" << std::endl;
+		use_layered_capture = false;
+		return false;
+	}
+
+	if (!layered_fbo)
+		layered_fbo = new GFX::FBO();
+	if (!layered_fbo->setLayeredTexture(cubemap))
+		return false;
+
+	Camera* current = Camera::current;
+	Camera cam;
+	cam.setPerspective(90, 1, 0.1, far_plane);
+	for (int i = 0; i < 6; ++i)
+	{
+		cam.lookAt(eye, eye + cubemapFaceNormals[i][2], cubemapFaceNormals[i][1]);
+		layer_viewprojection[i] = cam.viewprojection_matrix;
+	}
+	num_layers = 6;
+
+	//every object is culled once for the six faces and drawn once with an instance per face
+	std::vector<RenderCall> main_calls;
+	std::vector<RenderCall> main_calls_alpha;
+	main_calls.swap(render_calls);
+	main_calls_alpha.swap(render_calls_alpha);
+	for (auto ent : scene->entities)
+		if (ent->visible && ent->getType() == eEntityType::PREFAB && ((SCN::PrefabEntity*)ent)->prefab)
+			orderRender(&ent->root, &cam);
+
+	layered_fbo->bind();
+	renderForward(scene, &cam, eRenderMode::LIGHTS);
+	layered_fbo->unbind();
+
+	render_calls.swap(main_calls);
+	render_calls_alpha.swap(main_calls_alpha);
+	num_layers = 0;
+	if (current)
+		current->enable();
+	return true;
+}
+
+void SCN::Renderer::materialToShader(SCN::Material* material, GFX::Shader* shader)
+{
+	GFX::Texture* white = GFX::Texture::getWhiteTexture();
+
+	GFX::Texture* albedo_texture = material->textures[SCN::eTextureChannel::ALBEDO].texture;
+	GFX::Texture* emissive_texture = material->textures[SCN::eTextureChannel::EMISSIVE].texture;
+	GFX::Texture* normal_texture = material->textures[SCN::eTextureChannel::NORMALMAP].texture;
+	GFX::Texture* metallic_texture = material->textures[SCN::eTextureChannel::METALLIC_ROUGHNESS].texture;
+
+	shader->setUniform("u_albedo_factor", material->color);
+	shader->setUniform("u_emissive_factor", material->emissive_factor);
+	shader->setUniform("u_metallic_factor", material->metallic_factor);
+	shader->setUniform("u_roughness_factor", material->roughness_factor);
+	shader->setUniform("u_albedo_texture", albedo_texture ? albedo_texture : white, 0);
+	shader->setUniform("u_emissive_texture", emissive_texture ? emissive_texture : white, 1);
+	shader->setUniform("u_normal_texture", normal_texture ? normal_texture : GFX::Texture::getFlatNormalTexture(), 2);
+	shader->setUniform("u_metallic_texture", metallic_texture ? metallic_texture : white, 3);
+
+	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
+	shader->setUniform("u_alpha_cutoff", material->alpha_mode == SCN::eAlphaMode::MASK ? material->alpha_cutoff : 0.001f);
 }
 
 void Renderer::lightToShader(LightEntity* light, GFX::Shader* shader)
@@ -1069,27 +1568,26 @@ void SCN::Renderer::loadIrradianceCache()
 
 void SCN::Renderer::uploadIrradianceCache()
 {
-	if (probes_texture) delete probes_texture;
-
 	vec3 dim = irradiance_cache_info.dims;
+	int num_probes = dim.x * dim.y * dim.z;
+	assert((int)probes.size() == num_probes);
 
-	probes_texture = new GFX::Texture(9, probes.size(), GL_RGB, GL_FLOAT);
-
-	SphericalHarmonics* sh_data = NULL;
-	sh_data = new SphericalHarmonics[dim.x * dim.y * dim.z];
-
-	for (int i = 0; i < probes.size(); ++i)	sh_data[i] = probes[i].sh;
-
-	//now upload the data to the GPU as a texture
-	probes_texture->upload(GL_RGB, GL_FLOAT, false, (uint8*)sh_data);
-
-	//disable any texture filtering when reading
-	probes_texture->bind();
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	//one texel per probe, the probes are stored x first like the texels of a 3D texture
+	//so the hardware does the trilinear interpolation between the 8 closest probes
+	std::vector<float> texels(num_probes * 4);
+	for (int v = 0; v < SH_VOLUMES; ++v)
+	{
+		for (int i = 0; i < num_probes; ++i)
+			for (int j = 0; j < 4; ++j)
+			{
+				int k = v * 4 + j; //float of the 27 of the coeffs
+				texels[i * 4 + j] = k < 27 ? probes[i].sh.coeffs[k / 3].v[k % 3] : 0.0f;
+			}
 
-	//always free memory after allocating it!!!
-	delete[] sh_data;
+		if (!probes_volumes[v])
+			probes_volumes[v] = new GFX::Texture();
+		probes_volumes[v]->create3D(dim.x, dim.y, dim.z, GL_RGBA, GL_FLOAT, false, (Uint8*)&texels[0], GL_RGBA16F);
+	}
 }
 
 void SCN::Renderer::captureProbe(sProbe& probe) {
@@ -1100,6 +1598,22 @@ void SCN::Renderer::captureProbe(sProbe& probe) {
 	Camera* global_cam = Camera::current;
 	cam.setPerspective(90, 1, 0.1, global_cam->far_plane);
 
+	if (use_layered_capture)
+	{
+		if (!irr_cubemap)
+		{
+			irr_cubemap = new GFX::Texture();
+			irr_cubemap->createCubemap(64, 64, nullptr, GL_RGB, GL_FLOAT, false);
+		}
+		if (renderCubemapLayered(scene, probe.pos, global_cam->far_plane, irr_cubemap))
+		{
+			for (int i = 0; i < 6; ++i)
+				images[i].fromTexture(irr_cubemap, i);
+			probe.sh = computeSH(images);
+			return;
+		}
+	}
+
 	if (!irr_fbo) 
 	{
 		irr_fbo = new GFX::FBO();
@@ -1157,9 +1671,249 @@ void SCN::Renderer::renderProbe(sProbe& probe)
 
 }
 
+void SCN::Renderer::renderSSAO(Camera* camera)
+{
+	GFX::Shader* shader = nullptr;
+	GFX::RenderTargetPool& pool = GFX::RenderTargetPool::global;
+
+	//the occlusion is low frequency, half the resolution is enough
+	int half_width = (gbuffer_fbo->width + 1) / 2;
+	int half_height = (gbuffer_fbo->height + 1) / 2;
+	GFX::FBO* ssao_half_fbo = pool.acquire(half_width, half_height, 1, GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV, true); //normal (packed like in the gbuffer) and depth
+	GFX::FBO* ssao_raw_fbo = pool.acquire(half_width, half_height, 1, GL_RGB, GL_HALF_FLOAT, false);
+
+	//the history lives between frames, it cannot come from the pool
+	if (ssao_temporal && (!ssao_history_fbo[0] || ssao_history_fbo[0]->width != half_width || ssao_history_fbo[0]->height != half_height))
+	{
+		for (int i = 0; i < 2; ++i)
+		{
+			delete ssao_history_fbo[i];
+			ssao_history_fbo[i] = new GFX::FBO();
+			ssao_history_fbo[i]->create(half_width, half_height, 1, GL_RGB, GL_HALF_FLOAT, false);
+		}
+		ssao_history_valid = false;
+	}
+
+	vec2 half_res = vec2(1.0 / half_width, 1.0 / half_height);
+	vec2 camera_nearfar = vec2(camera->near_plane, camera->far_plane);
+
+	glDisable(GL_BLEND);
+
+	//one of every 2x2 pixels, not the average, so the normal and the depth are of a real surface
+	ssao_half_fbo->bind();
+	{
+		glEnable(GL_DEPTH_TEST);
+		glDepthFunc(GL_ALWAYS);
+
+		shader = GFX::Shader::Get("ssao_downsample");
+		shader->enable();
+		shader->setTexture("u_normal_texture", gbuffer_fbo->color_textures[1], 1);
+		shader->setTexture("u_depth_texture", gbuffer_fbo->depth_texture, 2);
+		quad->render(GL_TRIANGLES);
+
+		glDepthFunc(GL_LESS);
+		glDisable(GL_DEPTH_TEST);
+	}
+	ssao_half_fbo->unbind();
+
+	ssao_raw_fbo->bind();
+	{
+		shader = GFX::Shader::Get("ssao");
+		shader->enable();
+		shader->setTexture("u_normal_texture", ssao_half_fbo->color_textures[0], 1);
+		shader->setTexture("u_depth_texture", ssao_half_fbo->depth_texture, 2);
+		shader->setMatrix44("u_ivp", camera->inverse_viewprojection_matrix);
+		shader->setUniform("u_iRes", half_res);
+		shader->setUniform("u_camera_nearfar", camera_nearfar);
+
+		shader->setUniform3Array("u_points", (float*)(&ssao_points[0]), (int)ssao_points.size());
+		shader->setUniform("u_radius", ssao_radius);
+		shader->setUniform("u_frame", ssao_temporal ? ssao_frame % 64 : 0);
+
+		shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+
+		quad->render(GL_TRIANGLES);
+	}
+	ssao_raw_fbo->unbind();
+
+	//every frame uses other rotations, reprojecting the previous result averages them
+	GFX::Texture* half_ao = ssao_raw_fbo->color_textures[0];
+	if (ssao_temporal)
+	{
+		GFX::FBO* history = ssao_history_fbo[ssao_history];
+		GFX::FBO* output = ssao_history_fbo[1 - ssao_history];
+		output->bind();
+		{
+			shader = GFX::Shader::Get("ssao_temporal");
+			shader->enable();
+			shader->setTexture("u_ao_texture", ssao_raw_fbo->color_textures[0], 0);
+			shader->setTexture("u_history_texture", history->color_textures[0], 1);
+			shader->setTexture("u_depth_texture", ssao_half_fbo->depth_texture, 2);
+			shader->setMatrix44("u_ivp", camera->inverse_viewprojection_matrix);
+			shader->setMatrix44("u_prev_viewprojection", ssao_prev_viewprojection);
+			shader->setUniform("u_iRes", half_res);
+			shader->setUniform("u_history_weight", ssao_history_valid ? 0.9f : 0.0f);
+			quad->render(GL_TRIANGLES);
+		}
+		output->unbind();
+
+		half_ao = output->color_textures[0];
+		ssao_history = 1 - ssao_history;
+		ssao_history_valid = true;
+	}
+	else
+		ssao_history_valid = false;
+	ssao_prev_viewprojection = camera->viewprojection_matrix;
+	ssao_frame++;
+
+	//to full resolution, blurring only between pixels of the same surface
+	ssao_fbo->bind();
+	{
+		shader = GFX::Shader::Get("ssao_upsample");
+		shader->enable();
+		shader->setTexture("u_ao_texture", half_ao, 0);
+		shader->setTexture("u_half_depth_texture", ssao_half_fbo->depth_texture, 1);
+		shader->setTexture("u_depth_texture", gbuffer_fbo->depth_texture, 2);
+		shader->setUniform("u_iRes", vec2(1.0 / ssao_fbo->color_textures[0]->width, 1.0 / ssao_fbo->color_textures[0]->height));
+		shader->setUniform("u_camera_nearfar", camera_nearfar);
+		quad->render(GL_TRIANGLES);
+	}
+	ssao_fbo->unbind();
+
+	pool.release(ssao_half_fbo);
+	pool.release(ssao_raw_fbo);
+}
+
+bool SCN::Renderer::initFroxels()
+{
+	//not in the atlas header, the same vertex and geometry shaders for all of them
+	std::string vs_code, gs_code, inject_code, temporal_code, integrate_code;
+	if (!GFX::Shader::GetShaderFile("froxel.vs", vs_code) ||
+		!GFX::Shader::GetShaderFile("froxel.gs", gs_code) ||
+		!GFX::Shader::GetShaderFile("froxel_inject.fs", inject_code) ||
+		!GFX::Shader::GetShaderFile("froxel_temporal.fs", temporal_code) ||
+		!GFX::Shader::GetShaderFile("froxel_integrate.fs", integrate_code))
+	{
+		std::cout << " * Error in shader atlas, couldnt find files for the froxels" << std::endl;
+		return false;
+	}
+
+	//the volumes are released when the volumetric is off, the shaders are kept
+	if (!froxel_inject_shader || !froxel_temporal_shader || !froxel_integrate_shader)
+	{
+		froxel_inject_shader = GFX::Shader::CompileShader("froxel_inject", vs_code.c_str(), inject_code.c_str(), nullptr, gs_code.c_str());
+		froxel_temporal_shader = GFX::Shader::CompileShader("froxel_temporal", vs_code.c_str(), temporal_code.c_str(), nullptr, gs_code.c_str());
+		froxel_integrate_shader = GFX::Shader::CompileShader("froxel_integrate", vs_code.c_str(), integrate_code.c_str(), nullptr, gs_code.c_str());
+		if (!froxel_inject_shader || !froxel_temporal_shader || !froxel_integrate_shader)
+			return false;
+	}
+
+	//rgb is the light and alpha the density (or the transmittance once integrated)
+	froxel_scattering = new GFX::Texture();
+	froxel_scattering->create3D(froxel_dims[0], froxel_dims[1], froxel_dims[2], GL_RGBA, GL_HALF_FLOAT, false, nullptr, GL_RGBA16F);
+	for (int i = 0; i < 2; ++i)
+	{
+		froxel_history_volumes[i] = new GFX::Texture();
+		froxel_history_volumes[i]->create3D(froxel_dims[0], froxel_dims[1], froxel_dims[2], GL_RGBA, GL_HALF_FLOAT, false, nullptr, GL_RGBA16F);
+	}
+	froxel_integrated = new GFX::Texture();
+	froxel_integrated->create3D(froxel_dims[0], froxel_dims[1], froxel_dims[2], GL_RGBA, GL_HALF_FLOAT, false, nullptr, GL_RGBA16F);
+
+	froxel_fbo = new GFX::FBO();
+	froxel_history_valid = false;
+	return froxel_fbo->setLayeredTexture(froxel_scattering);
+}
+
+void SCN::Renderer::renderFroxels(SCN::Scene* scene, Camera* camera)
+{
+	if (!froxel_fbo && !initFroxels())
+	{
+		show_volumetric = false;
+		return;
+	}
+
+	GFX::Shader* shader = nullptr;
+	int slices = froxel_dims[2];
+
+	auto froxelToShader = [&](GFX::Shader* shader) {
+		shader->setMatrix44("u_ivp", camera->inverse_viewprojection_matrix);
+		shader->setUniform("u_camera_position", camera->eye);
+		shader->setUniform("u_camera_nearfar", vec2(camera->near_plane, camera->far_plane));
+		shader->setUniform("u_froxel_range", vec2(camera->near_plane, froxel_distance));
+		shader->setUniform("u_froxel_slices", (float)slices);
+	};
+
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_BLEND);
+
+	//light and density of every froxel, one instanced draw per light for all the slices
+	froxel_fbo->setLayeredTexture(froxel_scattering);
+	froxel_fbo->bind();
+	{
+		shader = froxel_inject_shader;
+		shader->enable();
+		froxelToShader(shader);
+		shader->setUniform("u_jitter", fmod(froxel_frame * 0.618034f, 1.0f));
+
+		//the first one only the ambient and the density of the air, the same scale than the old ray marching
+		shader->setUniform("u_light_info", vec4((int)eLightType::NO_LIGHT, 0, 0, 0));
+		shader->setUniform("u_shadow_param", vec2(0, 0));
+		shader->setUniform("u_ambient_light", scene->ambient_light);
+		shader->setUniform("u_density", air_density * 0.1f);
+		quad->render(GL_TRIANGLES, -1, slices);
+
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_ONE, GL_ONE);
+		shader->setUniform("u_ambient_light", vec3(0.0f));
+		shader->setUniform("u_density", 0.0f);
+		for (auto light : lights)
+		{
+			if (light->light_type != eLightType::DIRECTIONAL && camera->testSphereInFrustum(light->root.model.getTranslation(), light->max_distance) == CLIP_OUTSIDE)
+				continue;
+			lightToShader(light, shader);
+			quad->render(GL_TRIANGLES, -1, slices);
+		}
+		glDisable(GL_BLEND);
+	}
+	froxel_fbo->unbind();
+
+	//the jittered samples of the previous frames, reprojected
+	GFX::Texture* history = froxel_history_volumes[froxel_history];
+	GFX::Texture* scattering = froxel_history_volumes[1 - froxel_history];
+	froxel_fbo->setLayeredTexture(scattering);
+	froxel_fbo->bind();
+	{
+		shader = froxel_temporal_shader;
+		shader->enable();
+		froxelToShader(shader);
+		shader->setTexture("u_scattering_texture", froxel_scattering, 0);
+		shader->setTexture("u_history_texture", history, 1);
+		shader->setMatrix44("u_prev_viewprojection", froxel_prev_viewprojection);
+		shader->setUniform("u_history_weight", froxel_history_valid ? 0.9f : 0.0f);
+		quad->render(GL_TRIANGLES, -1, slices);
+	}
+	froxel_fbo->unbind();
+	froxel_history = 1 - froxel_history;
+	froxel_history_valid = true;
+	froxel_prev_viewprojection = camera->viewprojection_matrix;
+	froxel_frame++;
+
+	froxel_fbo->setLayeredTexture(froxel_integrated);
+	froxel_fbo->bind();
+	{
+		shader = froxel_integrate_shader;
+		shader->enable();
+		froxelToShader(shader);
+		shader->setTexture("u_scattering_texture", scattering, 0);
+		quad->render(GL_TRIANGLES, -1, slices);
+	}
+	froxel_fbo->unbind();
+	shader->disable();
+}
+
 void::SCN::Renderer::applyIrradiance()
 {
-	if (!probes_texture) return;
+	if (!probes_volumes[0]) return;
 	Camera* camera = Camera::current;
 
 	glDisable(GL_DEPTH_TEST);
@@ -1172,7 +1926,8 @@ void::SCN::Renderer::applyIrradiance()
 	shader->setTexture("u_albedo_texture", gbuffer_fbo->color_textures[0], 0);
 	shader->setTexture("u_normal_texture", gbuffer_fbo->color_textures[1], 1);
 	shader->setTexture("u_depth_texture", gbuffer_fbo->depth_texture, 3);
-	shader->setUniform("u_probes_texture", probes_texture, 4);
+	for (int i = 0; i < SH_VOLUMES; ++i)
+		shader->setTexture(("u_probes_volumes[" + std::to_string(i) + "]").c_str(), probes_volumes[i], 4 + i);
 
 	shader->setUniform("u_iRes", vec2(1.0 / gbuffer_fbo->width, 1.0 / gbuffer_fbo->height));
 	shader->setUniform("u_ivp", camera->inverse_viewprojection_matrix);
@@ -1189,22 +1944,15 @@ void::SCN::Renderer::applyIrradiance()
 	shader->setUniform("u_irr_delta", delta);
 	shader->setUniform("u_irr_normal_distance", 5.0f); 
 	shader->setUniform("u_irr_multiplier", irr_mulitplier);
-	shader->setUniform("u_num_probes", irradiance_cache_info.num_probes);
 
 	quad->render(GL_TRIANGLES);
 }
 
 
-void SCN::Renderer::captureReflection(SCN::Scene* scene)
+void SCN::Renderer::createReflectionProbes()
 {
-	Camera cam;
-	cam.setPerspective(90, 1, 0.1, 1000);
-
 	if (!ref_fbo)
-	{
 		ref_fbo = new GFX::FBO();
-		//ref_fbo->create(64, 64, 1, GL_RGB, GL_FLOAT);
-	}
 
 	//define the corners of the axis aligned grid
 	//this can be done using the boundings of our scene
@@ -1223,7 +1971,8 @@ void SCN::Renderer::captureReflection(SCN::Scene* scene)
 	delta.y /= (dim.y - 1);
 	delta.z /= (dim.z - 1);
 
-	ref_probes.resize(dim.x * dim.y * dim.z);
+	ref_probes.clear();
+	ref_probes.reserve(dim.x * dim.y * dim.z);
 
 	//lets compute the centers
 	//pay attention at the order at which we add them
@@ -1232,33 +1981,197 @@ void SCN::Renderer::captureReflection(SCN::Scene* scene)
 			for (int x = 0; x < dim.x; ++x)
 			{
 				sReflectionProbe ref_probe;
-				ref_probe.texture = new GFX::Texture();
-				ref_probe.texture->createCubemap(256, 256, nullptr, GL_RGB, GL_FLOAT); //increase size if its too pixelated
-
 				ref_probe.pos = start_pos + delta * vec3(x, y, z);
+				ref_probe.radius = delta.length(); //reaches the neighbours
+				//they live as long as the renderer, the same size than the prefiltered one
+				ref_probe.capture = new GFX::Texture();
+				ref_probe.capture->createCubemap(128, 128, nullptr, GL_RGB, GL_HALF_FLOAT);
+				ref_probes.push_back(ref_probe);
+			}
+}
 
-				for (int i = 0; i < 6; i++)
-				{
-					vec3 eye = ref_probe.pos;
-					vec3 front = cubemapFaceNormals[i][2];
-					vec3 center = eye + front;
-					vec3 up = cubemapFaceNormals[i][1];
-					cam.lookAt(eye, center, up);
-					cam.enable();
+void SCN::Renderer::checkReflectionProbes(SCN::Scene* scene)
+{
+	//like the signature of the GPU culling, only checks entities (not every node)
+	struct sEntityInfo {
+		vec3 center;
+		float radius; //-1 affects everything
+		uint32 hash;
+	};
+	std::vector<sEntityInfo> infos;
+	infos.reserve(scene->entities.size());
+	for (auto ent : scene->entities)
+	{
+		sEntityInfo info;
+		info.center = ent->root.model.getTranslation();
+		info.radius = 0;
+		info.hash = ent->visible ? 1 : 0;
+		for (int i = 0; i < 16; ++i)
+		{
+			uint32 v;
+			memcpy(&v, &ent->root.model.m[i], sizeof(uint32));
+			info.hash = info.hash * 31 + v;
+		}
+
+		if (ent->getType() == eEntityType::PREFAB)
+		{
+			PrefabEntity* pent = (SCN::PrefabEntity*)ent;
+			if (pent->prefab)
+			{
+				BoundingBox box = transformBoundingBox(ent->root.model, pent->prefab->bounding);
+				info.center = box.center;
+				info.radius = box.halfsize.length();
+			}
+		}
+		else if (ent->getType() == eEntityType::LIGHT)
+		{
+			LightEntity* lent = (SCN::LightEntity*)ent;
+			info.radius = lent->light_type == eLightType::DIRECTIONAL ? -1 : lent->max_distance;
+			vec3 color = lent->color * lent->intensity;
+			for (int i = 0; i < 3; ++i)
+			{
+				uint32 v;
+				memcpy(&v, &color.v[i], sizeof(uint32));
+				info.hash = info.hash * 31 + v;
+			}
+		}
+		infos.push_back(info);
+	}
 
-					ref_fbo->setTexture(ref_probe.texture, i);
+	for (auto& probe : ref_probes)
+	{
+		uint32 signature = 1;
+		for (auto& info : infos)
+			if (info.radius < 0 || probe.pos.distance(info.center) < probe.radius + info.radius)
+				signature = signature * 31 + info.hash;
+		if (signature != probe.signature)
+			probe.dirty = true;
+		probe.signature = signature;
+	}
+}
 
-					ref_fbo->bind();
+void SCN::Renderer::captureReflectionFace(SCN::Scene* scene, sReflectionProbe& probe, int face)
+{
+	Camera* current = Camera::current;
+	Camera cam;
+	cam.setPerspective(90, 1, 0.1, 1000);
 
-					renderForward(scene, &cam, eRenderMode::LIGHTS);
+	vec3 eye = probe.pos;
+	vec3 front = cubemapFaceNormals[face][2];
+	vec3 center = eye + front;
+	vec3 up = cubemapFaceNormals[face][1];
+	cam.lookAt(eye, center, up);
+	cam.enable();
+
+	//the render calls were culled with the main camera, the face needs its own
+	std::vector<RenderCall> main_calls;
+	std::vector<RenderCall> main_calls_alpha;
+	main_calls.swap(render_calls);
+	main_calls_alpha.swap(render_calls_alpha);
+	for (auto ent : scene->entities)
+		if (ent->visible && ent->getType() == eEntityType::PREFAB && ((SCN::PrefabEntity*)ent)->prefab)
+			orderRender(&ent->root, &cam);
+
+	ref_fbo->setTexture(probe.capture, face);
+	ref_fbo->bind();
+	renderForward(scene, &cam, eRenderMode::LIGHTS);
+	ref_fbo->unbind();
+
+	render_calls.swap(main_calls);
+	render_calls_alpha.swap(main_calls_alpha);
+	if (current)
+		current->enable();
+}
 
-					ref_fbo->unbind();
-				}
-				glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
-				ref_probe.texture->generateMipmaps();
-				ref_probes.push_back(ref_probe);
+void SCN::Renderer::updateReflectionProbes(SCN::Scene* scene, Camera* camera)
+{
+	ref_faces_rendered = 0;
+	if (ref_probes.empty())
+		createReflectionProbes();
+	checkReflectionProbes(scene);
+
+	while (ref_faces_rendered < ref_faces_per_frame)
+	{
+		//the one half updated goes first, then the dirty one closest to the camera
+		sReflectionProbe* probe = nullptr;
+		float min_distance = 0;
+		for (auto& ref_probe : ref_probes)
+		{
+			if (ref_probe.next_face > 0)
+			{
+				probe = &ref_probe;
+				break;
 			}
-		
+			float distance = camera->eye.distance(ref_probe.pos);
+			if (ref_probe.dirty && (!probe || distance < min_distance))
+			{
+				probe = &ref_probe;
+				min_distance = distance;
+			}
+		}
+		if (!probe)
+			break;
+
+		//changes from now on need another update
+		if (probe->next_face == 0)
+			probe->dirty = false;
+
+		//the whole probe in one pass when the budget allows it
+		if (probe->next_face == 0 && use_layered_capture && ref_faces_per_frame - ref_faces_rendered >= 6 && renderCubemapLayered(scene, probe->pos, 1000, probe->capture))
+		{
+			probe->next_face = 6;
+			ref_faces_rendered += 6;
+		}
+		else
+		{
+			captureReflectionFace(scene, *probe, probe->next_face++);
+			ref_faces_rendered++;
+		}
+
+		//the mips are the source of the GGX convolution
+		if (probe->next_face == 6)
+		{
+			probe->capture->generateMipmaps();
+			probe->texture = GFX::prefilterEnvironment(probe->capture, 128, 64, probe->texture);
+			probe->next_face = 0;
+		}
+	}
+}
+
+void SCN::Renderer::captureReflection(SCN::Scene* scene)
+{
+	if (ref_probes.empty())
+		createReflectionProbes();
+	checkReflectionProbes(scene);
+
+	for (auto& probe : ref_probes)
+	{
+		if (!use_layered_capture || !renderCubemapLayered(scene, probe.pos, 1000, probe.capture))
+			for (int i = 0; i < 6; i++)
+				captureReflectionFace(scene, probe, i);
+		probe.capture->generateMipmaps();
+		probe.texture = GFX::prefilterEnvironment(probe.capture, 128, 64, probe.texture);
+		probe.next_face = 0;
+		probe.dirty = false;
+	}
+}
+
+SCN::sReflectionProbe* SCN::Renderer::getClosestReflectionProbe(vec3 pos)
+{
+	sReflectionProbe* closest = nullptr;
+	float min_distance = 0;
+	for (auto& ref_probe : ref_probes)
+	{
+		if (!ref_probe.texture)
+			continue;
+		float distance = pos.distance(ref_probe.pos);
+		if (distance < ref_probe.radius && (!closest || distance < min_distance))
+		{
+			closest = &ref_probe;
+			min_distance = distance;
+		}
+	}
+	return closest;
 }
 
 void SCN::Renderer::rendereReflectionProbe(sReflectionProbe& ref_probe)
@@ -1289,10 +2202,7 @@ void SCN::Renderer::renderPlanarReflection(SCN::Scene* scene, Camera* camera)
 	Camera cam;
 
 	if (!plane_ref_fbo)
-	{
-		plane_ref_fbo = new::GFX::FBO();
-		plane_ref_fbo->create(size.x, size.y, 1, GL_RGB, GL_FLOAT);
-	}
+		plane_ref_fbo = GFX::RenderTargetPool::global.acquire(size.x, size.y, 1, GL_RGB, GL_FLOAT);
 
 	vec3 pos = camera->eye;
 	vec3 center = camera->center;
@@ -1306,6 +2216,59 @@ void SCN::Renderer::renderPlanarReflection(SCN::Scene* scene, Camera* camera)
 }
 
 
+GFX::Texture* SCN::Renderer::resolveTAA(GFX::Texture* color_buffer, Camera* camera)
+{
+	GFX::Shader* shader = GFX::Shader::Get("taa");
+	if (!shader)
+		return color_buffer;
+
+	//the history is always at the window size, with a smaller render the resolve is also the upsample
+	vec2 size = CORE::getWindowSize();
+	if (!taa_history_fbo[0] || taa_history_fbo[0]->width != (int)size.x || taa_history_fbo[0]->height != (int)size.y)
+	{
+		for (int i = 0; i < 2; ++i)
+		{
+			delete taa_history_fbo[i];
+			taa_history_fbo[i] = new GFX::FBO();
+			taa_history_fbo[i]->create(size.x, size.y, 1, GL_RGB, GL_HALF_FLOAT, false);
+			setFilter(taa_history_fbo[i]->color_textures[0], GL_LINEAR); //reprojected to any position
+		}
+		taa_history_valid = false;
+	}
+
+	Matrix44 ivp = camera->unjittered_viewprojection_matrix;
+	ivp.inverse();
+
+	//the jitter in pixels of the render, the shader needs where every sample was taken
+	vec2 jitter = camera->jitter * 0.5f;
+	jitter.x *= color_buffer->width;
+	jitter.y *= color_buffer->height;
+
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+
+	int next = (taa_history + 1) % 2;
+	taa_history_fbo[next]->bind();
+	shader->enable();
+	shader->setTexture("u_texture", color_buffer, 0);
+	shader->setTexture("u_history_texture", taa_history_fbo[taa_history]->color_textures[0], 1);
+	shader->setTexture("u_velocity_texture", gbuffer_fbo->color_textures[3], 2);
+	shader->setTexture("u_depth_texture", gbuffer_fbo->depth_texture, 3);
+	shader->setUniform("u_iRes", vec2(1.0 / size.x, 1.0 / size.y));
+	shader->setUniform("u_source_size", vec2(color_buffer->width, color_buffer->height));
+	shader->setUniform("u_jitter", jitter);
+	shader->setUniform("u_feedback", taa_history_valid ? taa_feedback : 0.0f);
+	shader->setMatrix44("u_ivp", ivp);
+	shader->setMatrix44("u_prev_vp", prev_viewprojection);
+	quad->render(GL_TRIANGLES);
+	shader->disable();
+	taa_history_fbo[next]->unbind();
+
+	taa_history = next;
+	taa_history_valid = true;
+	return taa_history_fbo[next]->color_textures[0];
+}
+
 void  SCN::Renderer::renderPostFX(GFX::Texture* color_buffer, GFX::Texture* depth_buffer, Camera* camera)
 {
 	assert(color_buffer && depth_buffer);
@@ -1314,79 +2277,308 @@ void  SCN::Renderer::renderPostFX(GFX::Texture* color_buffer, GFX::Texture* dept
 	float width = color_buffer->width;
 	float height = color_buffer->height;
 
-	Matrix44 prev_viewprojection_matrix;
+	bool motion_blur = show_postFX && use_motion_blur;
+	bool bloom = show_postFX && use_bloom;
+	bool volumetric = show_volumetric && froxel_integrated;
+	bool sharpen = resolution_scale < 1.0f && upscale_sharpness > 0.0f;
+	vec2 screen_size = CORE::getWindowSize(); //the color buffer can be smaller with the dynamic resolution
 
-	if (!postFX_fbo_A)
+	if (bloom)
 	{
-		postFX_fbo_A = new GFX::FBO();
-		postFX_fbo_B = new GFX::FBO();
-		postFX_fbo_temp = new GFX::FBO();
-		postFX_fbo_A->create(width, height, 1, GL_RGB, GL_HALF_FLOAT);
-		postFX_fbo_B->create(width, height, 1, GL_RGB, GL_HALF_FLOAT);
-		postFX_fbo_temp->create(width, height, 1, GL_RGB, GL_HALF_FLOAT);
+		//the bloom pyramid starts at half resolution, only for this frame
+		int level_width = (int)width / 2;
+		int level_height = (int)height / 2;
+		while (bloom_fbos.size() < BLOOM_LEVELS && level_width >= 8 && level_height >= 8)
+		{
+			GFX::FBO* fbo = GFX::RenderTargetPool::global.acquire(level_width, level_height, 1, GL_RGB, GL_HALF_FLOAT, false);
+			setFilter(fbo->color_textures[0], GL_LINEAR); //the taps of the downsample and the upsample are bilinear
+			bloom_fbos.push_back(fbo);
+			level_width /= 2;
+			level_height /= 2;
+		}
 	}
 
-	postFX_fbo_A->bind();
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+
+	if (show_tonemapper && auto_exposure)
+		computeExposure(color_buffer);
+
+	//BLOOM, the only one that needs other passes
+	//every level is the 13 taps downsample of the previous one, the first one only keeps what is over the threshold
+	if (bloom)
+	{
+		GFX::Texture* source = color_buffer;
+		float knee = bloom_threshold * 0.5f;
+		shader = GFX::Shader::Get("bloom_downsample");
+		shader->enable();
+		shader->setUniform("u_threshold", vec4(bloom_threshold, bloom_threshold - knee, 2.0f * knee, 0.25f / (knee + 0.0001f)));
+		for (int i = 0; i < (int)bloom_fbos.size(); ++i)
+		{
+			shader->setUniform("u_prefilter", i == 0 ? 1 : 0);
+			shader->setUniform("u_texel", vec2(1.0 / source->width, 1.0 / source->height));
+			bloom_fbos[i]->bind();
+				source->toViewport(shader);
+			bloom_fbos[i]->unbind();
+			source = bloom_fbos[i]->color_textures[0];
+		}
+
+		//and back up, adding every level to the bigger one with a tent filter
+		shader = GFX::Shader::Get("bloom_upsample");
+		shader->enable();
+		shader->setUniform("u_intensity", 1.0f);
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_ONE, GL_ONE);
+		for (int i = (int)bloom_fbos.size() - 1; i > 0; --i)
+		{
+			source = bloom_fbos[i]->color_textures[0];
+			shader->setUniform("u_texel", vec2(1.0 / source->width, 1.0 / source->height));
+			bloom_fbos[i - 1]->bind();
+				source->toViewport(shader);
+			bloom_fbos[i - 1]->unbind();
+		}
+		glDisable(GL_BLEND);
+	}
+
+	//all the rest in one pass, the ubershader only has the code of the enabled effects
+	GFX::Shader::UberShader* postfx = GFX::Shader::GetUberShader("@postfx");
+	uint64 macros = 0;
+	if (postfx)
+	{
+		if (motion_blur) macros |= (uint64)1 << postfx->getMacroIndex("MOTION_BLUR");
+		if (volumetric) macros |= (uint64)1 << postfx->getMacroIndex("VOLUMETRIC");
+		if (bloom && bloom_fbos.size()) macros |= (uint64)1 << postfx->getMacroIndex("BLOOM");
+		if (show_tonemapper) macros |= (uint64)1 << postfx->getMacroIndex("TONEMAPPER");
+		if (show_tonemapper && auto_exposure && exposure_valid) macros |= (uint64)1 << postfx->getMacroIndex("AUTO_EXPOSURE");
+		if (sharpen) macros |= (uint64)1 << postfx->getMacroIndex("SHARPEN");
+		shader = postfx->get(macros);
+	}
+	if (!postfx || !shader)
+	{
 		color_buffer->toViewport();
-	postFX_fbo_A->unbind();
+		releaseBloom();
+		return;
+	}
 
-	//MOTION BLUR
-	shader = GFX::Shader::Get("motion_blur");
-	shader->enable();
-	shader->setUniform("u_iRes", vec2(1.0 / width, 1.0 / height));
-	shader->setMatrix44("u_ivp", camera->inverse_viewprojection_matrix);
-	shader->setMatrix44("u_prev_vp", prev_viewprojection_matrix);
-	shader->setTexture("u_depth_texture", depth_buffer, 4);
-	postFX_fbo_B->bind();
-		postFX_fbo_A->color_textures[0]->toViewport(shader);
-	postFX_fbo_B->unbind();
-
-	std::swap(postFX_fbo_A, postFX_fbo_B);
-
-	prev_viewprojection_matrix = camera->viewprojection_matrix;
-
-	//save image
-	postFX_fbo_temp->bind();
-		postFX_fbo_A->color_textures[0]->toViewport(shader);
-	postFX_fbo_temp->unbind();
-	
-	//BLOOM
-	shader = GFX::Shader::Get("blur");
 	shader->enable();
-	shader->setUniform("u_intensity", 1.0f);
-	
-	int power = 1;
-	for (int i = 0; i < 4; i++)
-	{		
-	
-		shader->setUniform("u_offset", vec2(0.0f, (float)power / height));
-		shader->setUniform("u_texture", postFX_fbo_A->color_textures[0], 0);
-		postFX_fbo_B->bind();
-			quad->render(GL_TRIANGLES);
-		postFX_fbo_B->unbind();
-	
-		std::swap(postFX_fbo_A, postFX_fbo_B);
-	
-		shader->setUniform("u_offset", vec2((float)power / width, 0.0f));
-		shader->setUniform("u_texture", postFX_fbo_A->color_textures[0], 0);
-		postFX_fbo_B->bind();
-			quad->render(GL_TRIANGLES);
-		postFX_fbo_B->unbind();
-	
-		std::swap(postFX_fbo_A, postFX_fbo_B);
-	
-		power = power << 1;
+	shader->setTexture("u_texture", color_buffer, 0);
+	shader->setTexture("u_depth_texture", depth_buffer, 1);
+	shader->setUniform("u_iRes", vec2(1.0 / screen_size.x, 1.0 / screen_size.y));
+
+	if (sharpen)
+	{
+		shader->setUniform("u_source_texel", vec2(1.0 / width, 1.0 / height));
+		shader->setUniform("u_sharpness", upscale_sharpness);
+	}
+
+	if (motion_blur)
+	{
+		//the objects have their velocity, the background only moves with the camera
+		Matrix44 ivp = camera->unjittered_viewprojection_matrix;
+		ivp.inverse();
+		shader->setTexture("u_velocity_texture", gbuffer_fbo->color_textures[3], 5);
+		shader->setMatrix44("u_ivp", ivp);
+		shader->setMatrix44("u_prev_vp", prev_viewprojection);
+	}
+
+	if (volumetric)
+	{
+		shader->setTexture("u_integrated_texture", froxel_integrated, 2);
+		shader->setUniform("u_camera_nearfar", vec2(camera->near_plane, camera->far_plane));
+		shader->setUniform("u_froxel_range", vec2(camera->near_plane, froxel_distance));
+		shader->setUniform("u_froxel_slices", (float)froxel_dims[2]);
+	}
+
+	if (bloom && bloom_fbos.size())
+	{
+		GFX::Texture* bloom_texture = bloom_fbos[0]->color_textures[0];
+		shader->setTexture("u_bloom_texture", bloom_texture, 3);
+		shader->setUniform("u_bloom_texel", vec2(1.0 / bloom_texture->width, 1.0 / bloom_texture->height));
+		shader->setUniform("u_bloom_intensity", bloom_intensity);
+	}
+
+	if (show_tonemapper)
+	{
+		shader->setUniform("u_scale", tonemapper_scale);
+		shader->setUniform("u_average_lum", average_lum);
+		shader->setUniform("u_lumwhite2", lum_white2);
+		shader->setUniform("u_igamma", 1.0f / gamma);
+		shader->setUniform("u_brightness", brightness);
+		if (auto_exposure && exposure_valid)
+			shader->setTexture("u_exposure_texture", exposure_fbos[exposure_current]->color_textures[0], 4);
+	}
+
+	quad->render(GL_TRIANGLES);
+	shader->disable();
+
+	releaseBloom();
+}
+
+void SCN::Renderer::releaseBloom()
+{
+	for (auto fbo : bloom_fbos)
+		GFX::RenderTargetPool::global.release(fbo);
+	bloom_fbos.clear();
+}
+
+//histories and volumes cannot come from the pool, so a disabled pass frees its own
+void SCN::Renderer::releaseDisabledTargets()
+{
+	bool deferred = render_mode == eRenderMode::DEFERRED;
+
+	//4 volumes of RGBA16F
+	if (froxel_fbo && !(deferred && show_volumetric))
+	{
+		delete froxel_fbo;
+		delete froxel_scattering;
+		delete froxel_history_volumes[0];
+		delete froxel_history_volumes[1];
+		delete froxel_integrated;
+		froxel_fbo = nullptr;
+		froxel_scattering = froxel_history_volumes[0] = froxel_history_volumes[1] = froxel_integrated = nullptr;
+		froxel_history_valid = false;
+	}
+
+	if (taa_history_fbo[0] && !(deferred && use_taa))
+	{
+		for (int i = 0; i < 2; ++i)
+		{
+			delete taa_history_fbo[i];
+			taa_history_fbo[i] = nullptr;
+		}
+		taa_history_valid = false;
+	}
+
+	if (ssao_history_fbo[0] && !(deferred && show_ssao && ssao_temporal))
+	{
+		for (int i = 0; i < 2; ++i)
+		{
+			delete ssao_history_fbo[i];
+			ssao_history_fbo[i] = nullptr;
+		}
+		ssao_history_valid = false;
+	}
+
+	//the value already read stays in the UI
+	if (luminance_fbo && !(deferred && show_tonemapper && auto_exposure))
+	{
+		delete luminance_fbo;
+		luminance_fbo = nullptr;
+		for (int i = 0; i < 2; ++i)
+		{
+			delete exposure_fbos[i];
+			exposure_fbos[i] = nullptr;
+		}
+		exposure_valid = false;
+	}
+}
+
+void SCN::Renderer::computeExposure(GFX::Texture* color_buffer)
+{
+	GFX::Shader* shader = nullptr;
+
+	if (!luminance_fbo)
+	{
+		luminance_fbo = new GFX::FBO();
+		luminance_fbo->create(256, 256, 1, GL_RGB, GL_HALF_FLOAT, false);
+		for (int i = 0; i < 2; ++i)
+		{
+			exposure_fbos[i] = new GFX::FBO();
+			exposure_fbos[i]->create(1, 1, 1, GL_RGB, GL_FLOAT, false);
+		}
+		//the readbacks are only a float each, they are kept when the targets are released
+		if (!exposure_pbos[0])
+		{
+			glGenBuffers(EXPOSURE_READBACKS, exposure_pbos);
+			for (int i = 0; i < EXPOSURE_READBACKS; ++i)
+			{
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, exposure_pbos[i]);
+				glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(float), nullptr, GL_STREAM_READ);
+			}
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		}
+		exposure_valid = false;
 	}
 
-	postFX_fbo_A->bind();
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-		postFX_fbo_temp->color_textures[0]->toViewport();
-	postFX_fbo_A->unbind();
 	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
 
-	postFX_fbo_A->color_textures[0]->toViewport(shader);
+	//log of the luminance, the mipmaps average it down to 1x1
+	GFX::Texture* luminance = luminance_fbo->color_textures[0];
+	shader = GFX::Shader::Get("luminance");
+	shader->enable();
+	shader->setUniform("u_texel", vec2(1.0 / color_buffer->width, 1.0 / color_buffer->height));
+	luminance_fbo->bind();
+		color_buffer->toViewport(shader);
+	luminance_fbo->unbind();
+	luminance->generateMipmaps();
+
+	//towards the new average with the time, not every frame
+	float time = getTime();
+	float elapsed = exposure_valid ? (time - exposure_time) * 0.001f : 0.0f;
+	exposure_time = time;
+
+	GFX::FBO* prev = exposure_fbos[exposure_current];
+	exposure_current = 1 - exposure_current;
+	shader = GFX::Shader::Get("exposure");
+	shader->enable();
+	shader->setTexture("u_luminance_texture", luminance, 0);
+	shader->setTexture("u_prev_exposure_texture", prev->color_textures[0], 1);
+	shader->setUniform("u_luminance_lod", log2f(luminance->width));
+	shader->setUniform("u_adaptation", exposure_valid ? 1.0f - expf(-elapsed * exposure_speed) : 1.0f);
+	exposure_fbos[exposure_current]->bind();
+	{
+		quad->render(GL_TRIANGLES);
+
+		if (exposure_sync == -1)
+			exposure_sync = isSyncSupported() ? 1 : 0;
+
+		//copied to a PBO, the glReadPixels returns without waiting
+		int index = exposure_frame % EXPOSURE_READBACKS;
+		if (!exposure_sync)
+		{
+			//without fences it cannot know when the copy is done, so it waits
+			GFX::Texture* exposure = exposure_fbos[exposure_current]->color_textures[0];
+			glBindTexture(GL_TEXTURE_2D, exposure->texture_id);
+			glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_FLOAT, &exposure_readback);
+			glBindTexture(GL_TEXTURE_2D, 0);
+		}
+		else if (!exposure_fences[index])
+		{
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, exposure_pbos[index]);
+			glReadPixels(0, 0, 1, 1, GL_RED, GL_FLOAT, 0);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			exposure_fences[index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+	}
+	exposure_fbos[exposure_current]->unbind();
+	shader->disable();
 
+	exposure_valid = true;
+	exposure_frame++;
+	readbackExposure();
+}
+
+void SCN::Renderer::readbackExposure()
+{
+	if (exposure_sync != 1)
+		return;
+
+	//only the copies already finished, the last one read wins
+	for (int i = 0; i < EXPOSURE_READBACKS; ++i)
+	{
+		int index = (exposure_frame + i) % EXPOSURE_READBACKS;
+		if (!exposure_fences[index])
+			continue;
+		GLenum state = glClientWaitSync(exposure_fences[index], 0, 0);
+		if (state != GL_ALREADY_SIGNALED && state != GL_CONDITION_SATISFIED)
+			continue;
+		glDeleteSync(exposure_fences[index]);
+		exposure_fences[index] = 0;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, exposure_pbos[index]);
+		glGetBufferSubData(GL_PIXEL_PACK_BUFFER, 0, sizeof(float), &exposure_readback);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
 }
 
 
@@ -1400,6 +2592,7 @@ void SCN::Renderer::showUI()
 	ImGui::Checkbox("Boundaries", &render_boundaries);
 
 	ImGui::SliderFloat("Skybox intensity", &scene->skybox_intensity, 0, 10);
+	ImGui::Checkbox("Environment reflections", &use_environment);
 
 	ImGui::Checkbox("Show volumetric", &show_volumetric);
 	if (show_volumetric) ImGui::DragFloat("Air density", &air_density, 0.0001, 0.0, 0.1);
@@ -1421,11 +2614,57 @@ void SCN::Renderer::showUI()
 	}
 
 	ImGui::Checkbox("Show reflection probes", &show_ref_probes);
-	if (ImGui::Button("Update Reflections"))
+	ImGui::Checkbox("Layered probe capture", &use_layered_capture);
+	if (ImGui::Button("Bake Reflections"))
 	{
 		captureReflection(scene);
 		show_ref_probes = true;
 	}
+	ImGui::SameLine();
+	ImGui::Checkbox("Update reflections", &update_ref_probes);
+	if (update_ref_probes)
+	{
+		ImGui::SliderInt("Faces per frame", &ref_faces_per_frame, 1, 12);
+		ImGui::Text("Faces rendered: %d", ref_faces_rendered);
+	}
+
+	if (ImGui::Checkbox("GPU culling", &gpu_culling.enabled) && gpu_culling.enabled && !gpu_culling.init())
+		gpu_culling.enabled = false;
+	if (gpu_culling.enabled)
+	{
+		ImGui::Checkbox("Hi-Z occlusion", &gpu_culling.use_hiz);
+		ImGui::Text("Instances: %d Batches: %d", (int)gpu_culling.instances.size(), (int)gpu_culling.batches.size());
+		if (ImGui::Button("Rebuild GPU scene"))
+			gpu_culling.dirty = true;
+	}
+
+	ImGui::Checkbox("CPU occlusion", &occlusion.enabled);
+	if (occlusion.enabled)
+	{
+		ImGui::Checkbox("Occlusion threads", &occlusion.use_threads);
+		ImGui::SliderInt("Max occluders", &occlusion.max_occluders, 1, 128);
+		ImGui::Text("Occluders: %d Triangles: %d Culled: %d/%d", occlusion.num_occluders, occlusion.num_triangles, occlusion.num_culled, occlusion.num_tested);
+		ImGui::Text("Raster: %.3fms Test: %.3fms", occlusion.raster_time, occlusion.test_time);
+		if (ImGui::Button("Benchmark occlusion") && occlusion.camera)
+			occlusion.benchmark(occlusion.camera, render_calls, render_calls_alpha);
+	}
+
+	ImGui::Text("%s", GFX::GeometryPool::global.getStats().c_str());
+	if (ImGui::Button("Defragment geometry"))
+		GFX::GeometryPool::global.defragment();
+	ImGui::Text("%s", GFX::Mesh::getMemoryReport().c_str());
+	if (ImGui::Combo("Mesh RAM", (int*)&GFX::Mesh::default_retention, "KEEP_ALL\0KEEP_COLLISION\0KEEP_NONE", 3))
+		GFX::Mesh::setRetentionToAll(GFX::Mesh::default_retention);
+
+	ImGui::Text("%s", GFX::TextureUploadRing::global.getStats().c_str());
+	ImGui::Checkbox("Texture upload ring", &GFX::TextureUploadRing::global.enabled);
+	int upload_budget_kb = GFX::TextureUploadRing::global.max_bytes_per_frame >> 10;
+	if (ImGui::SliderInt("Upload KB/frame", &upload_budget_kb, 256, 32768))
+		GFX::TextureUploadRing::global.max_bytes_per_frame = upload_budget_kb << 10;
+	ImGui::SliderFloat("Upload ms/frame", &GFX::TextureUploadRing::global.max_ms_per_frame, 0.25f, 16.0f);
+	ImGui::Text("%s", GFX::TextureStreamer::global.getStats().c_str());
+	ImGui::Text("%s", GFX::RenderTargetPool::global.getStats().c_str());
+	ImGui::Text("%s", frame_graph.getStats().c_str());
 
 	ImGui::Combo("Render Mode", (int*)&render_mode, "TEXTURED\0LIGHTS\0DEFERRED", 3);
 	
@@ -1454,21 +2693,57 @@ void SCN::Renderer::showUI()
 
 		ImGui::Checkbox("Show ShadowMaps", &show_shadowmaps);
 		ImGui::Checkbox("Show Gbuffers", &show_gbuffers);
+		ImGui::SliderFloat("Small light size", &small_light_size, 0, 0.5);
+		ImGui::Text("Light volumes: %d Batched lights: %d", num_volume_lights, num_batched_lights);
 		ImGui::Checkbox("Show GlobalPosition", &show_global_position);
 		ImGui::Checkbox("Show SSAO", &show_ssao);
 		ImGui::SliderFloat("SSAO radius", &ssao_radius, 0, 50);
+		ImGui::Checkbox("SSAO temporal", &ssao_temporal);
 
 		ImGui::Checkbox("Show Tonemapper", &show_tonemapper);
 		if (show_tonemapper)
 		{
 			ImGui::SliderFloat("tonemapper_scale", &tonemapper_scale, 0, 2);
-			ImGui::SliderFloat("average_lum", &average_lum, 0, 2);
+			ImGui::Checkbox("Auto exposure", &auto_exposure);
+			if (auto_exposure)
+			{
+				ImGui::SliderFloat("Adaptation speed", &exposure_speed, 0.1, 10);
+				ImGui::Text("Average luminance: %.3f", exposure_readback);
+			}
+			else
+				ImGui::SliderFloat("average_lum", &average_lum, 0, 2);
 			ImGui::SliderFloat("lum_white2", &lum_white2, 0, 2);
 			ImGui::SliderFloat("gamma", &gamma, 0, 2);
 			ImGui::SliderFloat("brightness", &brightness, 0, 2);
 		}
 
+		ImGui::Checkbox("TAA", &use_taa);
+		if (use_taa)
+		{
+			ImGui::SliderFloat("TAA feedback", &taa_feedback, 0.5, 0.98);
+			ImGui::Checkbox("TAA upsample", &taa_upsample);
+			if (taa_upsample && !dynamic_resolution)
+				ImGui::SliderFloat("Render scale", &taa_upsample_scale, 0.5, 1);
+		}
+
+		ImGui::Checkbox("Dynamic resolution", &dynamic_resolution);
+		if (dynamic_resolution)
+		{
+			ImGui::SliderFloat("Target GPU ms", &target_frame_ms, 4, 50);
+			ImGui::SliderFloat("Min resolution", &min_resolution_scale, 0.25, 1);
+			ImGui::SliderFloat("Upscale sharpness", &upscale_sharpness, 0, 1);
+			if (gbuffer_fbo)
+				ImGui::Text("Resolution: %dx%d (%d%%) GPU: %.2fms", gbuffer_fbo->width, gbuffer_fbo->height, (int)(resolution_scale * 100 + 0.5f), gpu_frame_ms);
+		}
+
 		ImGui::Checkbox("show_postFX", &show_postFX);
+		if (show_postFX)
+		{
+			ImGui::Checkbox("Motion blur", &use_motion_blur);
+			ImGui::Checkbox("Bloom", &use_bloom);
+			ImGui::SliderFloat("Bloom threshold", &bloom_threshold, 0, 4);
+			ImGui::SliderFloat("Bloom intensity", &bloom_intensity, 0, 1);
+		}
 
 	}	
 }
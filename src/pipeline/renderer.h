@@ -2,7 +2,10 @@
 #include "scene.h"
 #include "prefab.h"
 #include "light.h"
+#include "gpu_culling.h"
+#include "occlusion.h"
 #include "../gfx/sphericalharmonics.h"
+#include "../gfx/framegraph.h"
 
 
 //forward declarations
@@ -22,6 +25,21 @@ struct sProbe {
 	SphericalHarmonics sh; //coeffs
 };
 
+//frames of latency of the exposure shown in the UI
+#define EXPOSURE_READBACKS 3
+
+//steps of the dynamic resolution, to avoid recreating the targets for small changes
+#define RESOLUTION_STEP 0.05f
+
+//point and spot lights drawn by the same instanced call, must match lights_batch in the atlas
+#define MAX_BATCHED_LIGHTS 32
+
+//levels of the bloom pyramid
+#define BLOOM_LEVELS 6
+
+//the 9 RGB coeffs of the irradiance cache packed in RGBA 3D textures
+#define SH_VOLUMES 7
+
 namespace SCN {
 
 	class Prefab;
@@ -45,8 +63,10 @@ namespace SCN {
 		GFX::Mesh* mesh;
 		Material* material;
 		Matrix44 model;
+		Matrix44 prev_model; //of the last frame, for the velocity
 
 		float camera_distance;
+		bool occluded; //filled by the CPU occlusion culling
 	};
 
 	struct sIrradianceCahceInfo {
@@ -58,7 +78,12 @@ namespace SCN {
 
 	struct sReflectionProbe {
 		vec3 pos;
-		GFX::Texture* texture = nullptr;
+		float radius = 0; //a change in the entities inside makes it dirty
+		GFX::Texture* capture = nullptr; //the faces rendered so far, the source of the prefilter
+		GFX::Texture* texture = nullptr; //prefiltered, null till its first update
+		int next_face = 0; //the faces are rendered along several frames
+		bool dirty = true;
+		uint32 signature = 0; //of the entities inside
 	};
 
 	// This class is in charge of rendering anything in our system.
@@ -79,6 +104,37 @@ namespace SCN {
 		bool show_ref_probes;
 		bool show_volumetric;
 		bool show_postFX;
+		bool use_motion_blur;
+		bool use_bloom;
+		float bloom_threshold; //of the brightest channel, with a soft knee
+		float bloom_intensity;
+		bool use_environment; //specular reflections of the closest reflection probe (or the prefiltered skybox) in the PBR
+
+		//the deferred targets are rendered at a fraction of the window and the post pass scales them up
+		bool dynamic_resolution;
+		float target_frame_ms; //of the GPU
+		float resolution_scale; //of the window, multiple of RESOLUTION_STEP
+		float min_resolution_scale;
+		float upscale_sharpness;
+		float gpu_frame_ms; //smoothed
+		int frames_since_resize;
+
+		//temporal antialiasing, the camera is jittered every frame and the history is reprojected with the velocity
+		bool use_taa;
+		bool taa_upsample; //renders at taa_upsample_scale and the resolve reconstructs the window size
+		float taa_upsample_scale; //when the dynamic resolution is disabled
+		float taa_feedback; //weight of the history
+		int taa_frame;
+		int taa_history; //the one of the two with the last result
+		bool taa_history_valid;
+		Matrix44 prev_viewprojection; //without jitter
+		std::map<SCN::Node*, Matrix44> prev_models; //global matrices of the last frame
+		std::map<SCN::Node*, Matrix44> current_models;
+
+		//point and spot lights, in a stencil masked volume or in the instanced batch when they are small
+		float small_light_size; //radius over the half height of the screen, 0 to disable the batch
+		int num_volume_lights; //last frame, for the UI
+		int num_batched_lights;
 
 		eRenderMode render_mode;
 		eShaderMode shader_mode;
@@ -87,16 +143,29 @@ namespace SCN {
 		float tonemapper_scale;
 		float average_lum;
 		float lum_white2;
+		bool auto_exposure; //the average luminance is computed in the GPU every frame instead of average_lum
+		float exposure_speed; //of the adaptation, per second
+		float exposure_time;
+		int exposure_current; //the one of the two exposure_fbos with the last result
+		bool exposure_valid;
+		float exposure_readback; //average luminance of some frames ago, only for the UI
+		int exposure_frame;
+		GLuint exposure_pbos[EXPOSURE_READBACKS];
+		GLsync exposure_fences[EXPOSURE_READBACKS];
+		int exposure_sync; //-1 not checked yet, the fences need GL 3.2 or ARB_sync
 		float gamma;
 
 		GFX::Texture* skybox_cubemap;
-		GFX::Texture* probes_texture;
+		GFX::Texture* skybox_prefiltered; //GGX convolution in the mips
+		GFX::Texture* skybox_prefiltered_source; //to know when the skybox changes
+		GFX::Texture* probes_volumes[SH_VOLUMES]; //the 27 floats of the SH, 4 per texel, one texel per probe
 
 		SCN::Scene* scene;
 
 		GFX::Mesh sphere;
 		GFX::Mesh* quad;
 		GFX::Mesh cube;
+		GFX::Mesh cone; //volume of the spot lights
 
 		//vector of all the lights of the scene
 		std::vector<LightEntity*> lights;
@@ -105,8 +174,13 @@ namespace SCN {
 		std::vector<RenderCall> render_calls_alpha;
 		std::vector<DecalEntity*> decals;
 		
-		std::vector<vec3> ssao_points;
+		std::vector<vec3> ssao_points; //hemisphere, rotated around the normal of every pixel
 		float ssao_radius;
+		bool ssao_temporal; //accumulates the rotations of the previous frames
+		int ssao_frame;
+		int ssao_history; //the one of the two with the last result
+		bool ssao_history_valid;
+		Matrix44 ssao_prev_viewprojection;
 
 		sIrradianceCahceInfo irradiance_cache_info;
 		std::vector<sProbe> probes;
@@ -114,21 +188,58 @@ namespace SCN {
 
 		std::vector<sReflectionProbe> ref_probes;
 
+		bool use_layered_capture; //the probes render the six faces in one pass, one instanced draw per object
+		int num_layers; //6 while rendering all the faces of a cubemap at once, 0 otherwise
+		Matrix44 layer_viewprojection[6];
+		GFX::Texture* irr_cubemap; //target of the layered capture of the irradiance probes
+		bool update_ref_probes; //re-renders the dirty probes, some faces every frame
+		int ref_faces_per_frame;
+		int ref_faces_rendered; //in the last frame
+
 		float air_density;
 
+		//volumetric light in a grid of froxels (voxels aligned with the frustum), see the froxel shaders
+		int froxel_dims[3];
+		float froxel_distance; //of the last slice
+		int froxel_frame;
+		int froxel_history; //the one of the two with the last result
+		bool froxel_history_valid;
+		Matrix44 froxel_prev_viewprojection;
+		GFX::Texture* froxel_scattering; //light and density injected this frame
+		GFX::Texture* froxel_history_volumes[2]; //the scattering blended with the previous frames
+		GFX::Texture* froxel_integrated; //light and transmittance from the camera to every froxel
+		GFX::Shader* froxel_inject_shader;
+		GFX::Shader* froxel_temporal_shader;
+		GFX::Shader* froxel_integrate_shader;
+
 		GFX::FBO* gbuffer_fbo;
+		//illumination_fbo and ssao_fbo come from frame_graph, only valid inside the passes that declared them
+		//bloom_fbos come from GFX::RenderTargetPool, only valid during renderPostFX
+		//plane_ref_fbo too, valid till the end of the frame
 		GFX::FBO* illumination_fbo;
-		GFX::FBO* ssao_fbo;
+		GFX::FBO* ssao_fbo; //full resolution, the result
+		GFX::FBO* ssao_history_fbo[2];
 		GFX::FBO* irr_fbo;
 		GFX::FBO* ref_fbo;
+		GFX::FBO* layered_fbo;
 		GFX::FBO* plane_ref_fbo;
-		GFX::FBO* volumetric_fbo;
-		GFX::FBO* postFX_fbo_A;
-		GFX::FBO* postFX_fbo_B;
-		GFX::FBO* postFX_fbo_temp;
+		GFX::FBO* froxel_fbo;
+		std::vector<GFX::FBO*> bloom_fbos; //mip pyramid, from half resolution
+		GFX::FBO* luminance_fbo; //log luminance, its last mipmap is the average
+		GFX::FBO* exposure_fbos[2]; //1x1, adapted average luminance
+		GFX::FBO* taa_history_fbo[2]; //window size
+
+
+		GFX::Texture* clone_depth_buffer; //only with decals
 
+		//GPU driven path for the opaque objects (only with GL 4.3)
+		GPUCulling gpu_culling;
 
-		GFX::Texture* clone_depth_buffer;
+		//the passes of renderDeferred with their targets, declared every frame
+		GFX::FrameGraph frame_graph;
+
+		//software depth buffer to skip hidden objects in the main camera
+		OcclusionCuller occlusion;
 
 		//updated every frame
 		Renderer(const char* shaders_atlas_filename);
@@ -140,12 +251,20 @@ namespace SCN {
 		//...
 		void orderRender(SCN::Node* node, Camera* camera);
 		void renderObjects(Camera* camera, eRenderMode mode);
+		void renderObjectsIndirect(Camera* camera);
 
 		//renders several elements of the scene
 		void renderScene(SCN::Scene* scene, Camera* camera);
 		void renderForward(SCN::Scene* scene, Camera* camera, eRenderMode mode);
 		void renderDeferred(SCN::Scene* scene, Camera* camera);
+		void renderSSAO(Camera* camera); //at half resolution, upsampled to ssao_fbo
+		void renderLightVolumes(Camera* camera); //inside illumination_fbo, with the depth of the gbuffer
+		GFX::Mesh* getLightVolume(LightEntity* light, Matrix44& model);
+		bool initFroxels(); //returns false if the shaders cannot be compiled
+		void renderFroxels(SCN::Scene* scene, Camera* camera);
 		void renderFrame(SCN::Scene* scene, Camera* camera);
+		void updateResolutionScale(); //from the GPU time of the last frames
+		void createRenderTargets(int width, int height); //the gbuffer, the rest are transient, deletes the previous ones
 
 		void generateShadowMaps();
 
@@ -159,23 +278,42 @@ namespace SCN {
 
 		void showProbes();
 
-		void captureReflection(SCN::Scene* scene);
+		void createReflectionProbes();
+		void checkReflectionProbes(SCN::Scene* scene); //marks as dirty the probes where something changed
+		void captureReflectionFace(SCN::Scene* scene, sReflectionProbe& probe, int face);
+		void updateReflectionProbes(SCN::Scene* scene, Camera* camera); //the dirty ones, under the budget of faces
+		void captureReflection(SCN::Scene* scene); //all the probes at once, for static scenes
+		sReflectionProbe* getClosestReflectionProbe(vec3 pos); //with a prefiltered texture and pos inside its radius
+
+		//the six faces in one pass, returns false if the GPU cannot do it (the shaders need geometry shaders)
+		bool renderCubemapLayered(SCN::Scene* scene, vec3 eye, float far_plane, GFX::Texture* cubemap);
+		GFX::Shader* getShader(const char* name); //the layered version while rendering a cubemap in one pass
+		bool testBoundingInView(Camera* camera, const BoundingBox& box);
 		void rendereReflectionProbe(sReflectionProbe& probe);
 		void renderPlanarReflection(SCN::Scene* scene, Camera* camera);
 
+		void computeExposure(GFX::Texture* color_buffer); //stays in the GPU, the tonemapper reads it
+		void readbackExposure(); //for the UI, without waiting for the GPU
+
+		//returns the antialiased color at the window size, the gbuffer has to have the velocity of this frame
+		GFX::Texture* resolveTAA(GFX::Texture* color_buffer, Camera* camera);
+
+		//bloom pyramid and then a single pass with the rest of the effects (see @postfx), draws to the current framebuffer
 		void renderPostFX(GFX::Texture* color_buffer, GFX::Texture* depth_buffer, Camera* camera);
+		void releaseBloom(); //back to the pool
+		void releaseDisabledTargets(); //the ones that live between frames, of the effects that are off (created again when turned on)
 
 		//render the skybox
 		void renderSkybox(GFX::Texture* cubemap, float intensity);
 
 		//to render one node from the prefab and its children
-		void renderNode(Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, Camera* camera, eRenderMode mode);
+		void renderNode(Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, Camera* camera, eRenderMode mode, const Matrix44* prev_model = nullptr);
 		
 		//to render one mesh given its material and transformation matrix
 		void renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material);
 		void renderMeshWithMaterialFlat(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material);
 		void renderMeshWithMaterialLight(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material);
-		void renderMeshWithMaterialGBuffers(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material);
+		void renderMeshWithMaterialGBuffers(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, const Matrix44* prev_model = nullptr); //prev_model for the velocity
 
 		void captureProbe(sProbe& probe);
 		void renderProbe(sProbe& probe);
@@ -184,6 +322,7 @@ namespace SCN {
 
 		void cameraToShader(Camera* camera, GFX::Shader* shader); //sends camera uniforms to shader
 		void lightToShader(LightEntity* light, GFX::Shader* shader); //sends light uniforms to shader
+		void materialToShader(SCN::Material* material, GFX::Shader* shader); //sends material uniforms to shader
 
 		void debugShadowMaps();
 	};
@@ -10,6 +10,7 @@
 #include "../pipeline/material.h"
 #include "../pipeline/prefab.h"
 #include "../utils/utils.h"
+#include "../utils/mipmaps.h"
 
 #include <iostream>
 
@@ -335,6 +336,7 @@ std::vector<GFX::Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename
 				parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
 		}
 		mesh->uploadToVRAM();
+		mesh->applyRetention();
 		if (meshdata->name)
 			mesh->registerMesh(submesh_name);
 		result.push_back(mesh);
@@ -345,7 +347,8 @@ std::vector<GFX::Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename
 
 int GLTF_TEXTURE_LAST_ID = 1;
 
-GFX::Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
+//mip_flags tell how to filter the mipmaps, -1 guesses them from the filename
+GFX::Texture* parseGLTFTexture(cgltf_image* image, const char* filename, int mip_flags = -1, float alpha_cutoff = 0.5f)
 {
 	if (!load_textures || !image )
 		return NULL;
@@ -353,7 +356,7 @@ GFX::Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
 	std::string fullpath = filename ? filename : "";
 
 	if (image->uri)
-		return GFX::Texture::GetAsync((std::string(base_folder) + "/" + image->uri).c_str());
+		return GFX::Texture::GetAsync((std::string(base_folder) + "/" + image->uri).c_str(), true, true, mip_flags, alpha_cutoff);
 	else
 	if (filename)
 	{
@@ -391,6 +394,8 @@ GFX::Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
 			return NULL;
 		}
 		GFX::Texture* tex = new GFX::Texture();
+		tex->mip_flags = mip_flags >= 0 ? mip_flags : MIP_SRGB;
+		tex->alpha_cutoff = alpha_cutoff;
 		tex->loadFromImage(&img);
 		if (filename)
 		{
@@ -428,10 +433,15 @@ SCN::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 	material->alpha_cutoff = matdata->alpha_cutoff;
 	material->two_sided = matdata->double_sided;
 
+	//the material tells what every texture is, so the mipmaps are filtered accordingly
+	int albedo_mip_flags = MIP_SRGB;
+	if (material->alpha_mode == SCN::eAlphaMode::MASK)
+		albedo_mip_flags |= MIP_ALPHA_COVERAGE;
+
 	//normalmap
 	if (matdata->normal_texture.texture)
 	{
-		material->textures[SCN::eTextureChannel::NORMALMAP].texture = parseGLTFTexture( matdata->normal_texture.texture->image, matdata->normal_texture.texture->name);
+		material->textures[SCN::eTextureChannel::NORMALMAP].texture = parseGLTFTexture( matdata->normal_texture.texture->image, matdata->normal_texture.texture->name, MIP_NORMALMAP);
 		material->textures[SCN::eTextureChannel::NORMALMAP].uv_channel = matdata->normal_texture.texcoord;
 	}
 
@@ -439,7 +449,7 @@ SCN::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 	material->emissive_factor = matdata->emissive_factor;
 	if (matdata->emissive_texture.texture)
 	{
-		material->textures[SCN::eTextureChannel::EMISSIVE].texture = parseGLTFTexture(matdata->emissive_texture.texture->image, matdata->emissive_texture.texture->name);
+		material->textures[SCN::eTextureChannel::EMISSIVE].texture = parseGLTFTexture(matdata->emissive_texture.texture->image, matdata->emissive_texture.texture->name, MIP_SRGB);
 		material->textures[SCN::eTextureChannel::EMISSIVE].uv_channel = matdata->emissive_texture.texcoord;
 	}
 
@@ -448,7 +458,7 @@ SCN::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 	if (matdata->has_pbr_specular_glossiness)
 	{
 		if (matdata->pbr_specular_glossiness.diffuse_texture.texture)
-			material->textures[SCN::eTextureChannel::ALBEDO].texture = parseGLTFTexture(matdata->pbr_specular_glossiness.diffuse_texture.texture->image, matdata->pbr_specular_glossiness.diffuse_texture.texture->name);
+			material->textures[SCN::eTextureChannel::ALBEDO].texture = parseGLTFTexture(matdata->pbr_specular_glossiness.diffuse_texture.texture->image, matdata->pbr_specular_glossiness.diffuse_texture.texture->name, albedo_mip_flags, material->alpha_cutoff);
 	}
 	if (matdata->has_pbr_metallic_roughness)
 	{
@@ -460,12 +470,12 @@ SCN::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 		{
 			if (matdata->pbr_metallic_roughness.base_color_texture.texture)
 			{
-				material->textures[SCN::eTextureChannel::ALBEDO].texture = parseGLTFTexture(matdata->pbr_metallic_roughness.base_color_texture.texture->image, matdata->pbr_metallic_roughness.base_color_texture.texture->name);
+				material->textures[SCN::eTextureChannel::ALBEDO].texture = parseGLTFTexture(matdata->pbr_metallic_roughness.base_color_texture.texture->image, matdata->pbr_metallic_roughness.base_color_texture.texture->name, albedo_mip_flags, material->alpha_cutoff);
 				material->textures[SCN::eTextureChannel::ALBEDO].uv_channel = matdata->pbr_metallic_roughness.base_color_texture.texcoord;
 			}
 			if (matdata->pbr_metallic_roughness.metallic_roughness_texture.texture)
 			{
-				material->textures[SCN::eTextureChannel::METALLIC_ROUGHNESS].texture = parseGLTFTexture(matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->image, matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->name);
+				material->textures[SCN::eTextureChannel::METALLIC_ROUGHNESS].texture = parseGLTFTexture(matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->image, matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->name, 0);
 				material->textures[SCN::eTextureChannel::METALLIC_ROUGHNESS].uv_channel = matdata->pbr_metallic_roughness.metallic_roughness_texture.texcoord;
 			}
 		}
@@ -473,7 +483,7 @@ SCN::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 
 	if (matdata->occlusion_texture.texture)
 	{
-		material->textures[SCN::eTextureChannel::OCCLUSION].texture = parseGLTFTexture(matdata->occlusion_texture.texture->image, matdata->occlusion_texture.texture->name);
+		material->textures[SCN::eTextureChannel::OCCLUSION].texture = parseGLTFTexture(matdata->occlusion_texture.texture->image, matdata->occlusion_texture.texture->name, 0);
 		material->textures[SCN::eTextureChannel::OCCLUSION].uv_channel = matdata->occlusion_texture.texcoord;
 	}
 
@@ -0,0 +1,260 @@
+#include "image_decoder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include "../gfx/texture.h"
+#include "../core/task.h"
+#include "utils.h"
+
+#include "../extra/picopng.h"
+#include "../extra/jpgd.h"
+#include "../extra/stb_image.h" //the implementation is in texture.cpp
+
+const char* image_decoder_str[] = { "auto", "stb", "picopng", "jpgd" };
+
+//stb was the fastest for both in the benchmark with the road textures (png 2.3x picopng, jpg 1.3x jpgd)
+eImageDecoder best_decoder[NUM_IMAGE_FORMATS] = { DECODER_STB, DECODER_STB, DECODER_STB, DECODER_STB };
+
+static float elapsedMs(std::chrono::high_resolution_clock::time_point start)
+{
+	return std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+eImageFormat getImageFormat(const std::vector<unsigned char>& buffer, const char* filename)
+{
+	static const unsigned char png_signature[] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+	if (buffer.size() >= 8 && memcmp(&buffer[0], png_signature, 8) == 0)
+		return IMAGE_PNG;
+	if (buffer.size() >= 3 && buffer[0] == 0xFF && buffer[1] == 0xD8 && buffer[2] == 0xFF)
+		return IMAGE_JPG;
+
+	//tga has no signature
+	if (filename)
+	{
+		std::string ext = toLowerCase(getExtension(filename));
+		if (ext == "tga")
+			return IMAGE_TGA;
+	}
+	return IMAGE_UNKNOWN;
+}
+
+bool getImageInfo(const std::vector<unsigned char>& buffer, int& width, int& height, int& channels)
+{
+	eImageFormat format = getImageFormat(buffer);
+	if (format != IMAGE_PNG && format != IMAGE_JPG)
+		return false;
+	int file_channels = 0;
+	if (!stbi_info_from_memory(&buffer[0], (int)buffer.size(), &width, &height, &file_channels))
+		return false;
+	//gray + alpha keeps the alpha
+	channels = (file_channels == 2 || file_channels == 4) ? 4 : 3;
+	return true;
+}
+
+//the old Image::loadPNG flipped every png, the textures and the uvs expect it
+static void flipRows(unsigned char* pixels, int width, int height, int channels)
+{
+	int row_size = width * channels;
+	for (int y = 0; y < height / 2; ++y)
+		std::swap_ranges(pixels + y * row_size, pixels + (y + 1) * row_size, pixels + (height - 1 - y) * row_size);
+}
+
+static bool decodeJPGD(const std::vector<unsigned char>& buffer, unsigned char* output, int width, int height, int channels)
+{
+	jpgd::jpeg_decoder_mem_stream stream(&buffer[0], (jpgd::uint)buffer.size());
+	jpgd::jpeg_decoder decoder(&stream, 0);
+	if (decoder.get_error_code() != jpgd::JPGD_SUCCESS || decoder.get_width() != width || decoder.get_height() != height)
+		return false;
+	if (decoder.begin_decoding() != jpgd::JPGD_SUCCESS)
+		return false;
+
+	//every row is converted directly into the output, without an intermediate image
+	int components = decoder.get_num_components();
+	for (int y = 0; y < height; ++y)
+	{
+		const unsigned char* scan_line = NULL;
+		jpgd::uint scan_line_len = 0;
+		if (decoder.decode((const void**)&scan_line, &scan_line_len) != jpgd::JPGD_SUCCESS)
+			return false;
+
+		unsigned char* dst = output + y * width * channels;
+		for (int x = 0; x < width; ++x, dst += channels)
+		{
+			//gray is one byte per pixel, color comes as RGBA
+			const unsigned char* src = components == 1 ? scan_line + x : scan_line + x * 4;
+			dst[0] = src[0];
+			dst[1] = components == 1 ? src[0] : src[1];
+			dst[2] = components == 1 ? src[0] : src[2];
+			if (channels == 4)
+				dst[3] = 255;
+		}
+	}
+	return true;
+}
+
+bool decodeImage(const std::vector<unsigned char>& buffer, unsigned char* output, int width, int height, int channels, eImageDecoder decoder)
+{
+	eImageFormat format = getImageFormat(buffer);
+	if (decoder == DECODER_AUTO)
+		decoder = best_decoder[format];
+
+	if (format == IMAGE_JPG && decoder == DECODER_JPGD)
+		return decodeJPGD(buffer, output, width, height, channels);
+
+	if (format == IMAGE_PNG && decoder == DECODER_PICOPNG)
+	{
+		//picopng always outputs RGBA
+		std::vector<unsigned char> out_image;
+		unsigned int w = 0, h = 0;
+		if (decodePNG(out_image, w, h, &buffer[0], buffer.size(), true) != 0 || (int)w != width || (int)h != height)
+			return false;
+		if (channels == 4)
+			memcpy(output, &out_image[0], out_image.size());
+		else
+			for (int i = 0; i < width * height; ++i)
+				memcpy(output + i * channels, &out_image[i * 4], channels);
+		flipRows(output, width, height, channels);
+		return true;
+	}
+
+	if (format == IMAGE_PNG || format == IMAGE_JPG)
+	{
+		int w = 0, h = 0, file_channels = 0;
+		unsigned char* pixels = stbi_load_from_memory(&buffer[0], (int)buffer.size(), &w, &h, &file_channels, channels);
+		if (!pixels)
+			return false;
+		bool ok = w == width && h == height;
+		if (ok)
+			memcpy(output, pixels, width * height * channels);
+		stbi_image_free(pixels);
+		if (ok && format == IMAGE_PNG)
+			flipRows(output, width, height, channels);
+		return ok;
+	}
+
+	return false;
+}
+
+bool decodeImage(const std::vector<unsigned char>& buffer, Image* image, eImageDecoder decoder)
+{
+	int width, height, channels;
+	if (!getImageInfo(buffer, width, height, channels))
+		return false;
+
+	unsigned char* data = new unsigned char[width * height * channels];
+	if (!decodeImage(buffer, data, width, height, channels, decoder))
+	{
+		delete[] data;
+		return false;
+	}
+
+	image->clear();
+	image->data = data;
+	image->width = width;
+	image->height = height;
+	image->num_channels = channels;
+	return true;
+}
+
+void decodeImages(std::vector<ImageDecodeJob>& jobs, bool use_threads)
+{
+	auto decodeJob = [&](int i) {
+		ImageDecodeJob& job = jobs[i];
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		if (!job.image)
+			job.image = new Image();
+		std::vector<unsigned char> buffer;
+		job.loaded = readFileBin(job.filename, buffer) && decodeImage(buffer, job.image);
+		job.time = elapsedMs(start);
+	};
+
+	if (use_threads)
+		WorkerPool::global.parallelFor((int)jobs.size(), decodeJob);
+	else
+		for (int i = 0; i < (int)jobs.size(); ++i)
+			decodeJob(i);
+}
+
+void benchmarkImageDecoders(std::vector<std::string> filenames, int iterations)
+{
+	//the textures that come with the framework
+	if (filenames.empty())
+	{
+		filenames.push_back("data/prefabs/road/asphalt_02_diff_2k.jpg");
+		filenames.push_back("data/prefabs/road/dirty_concrete_diff_2k.jpg");
+		filenames.push_back("data/prefabs/road/dirty_concrete_nor_2k.jpg");
+		filenames.push_back("data/prefabs/road/dirty_concrete_rough_2k.png");
+		filenames.push_back("data/prefabs/house_test/textures/unknown_normal.png");
+	}
+
+	std::cout << "Image decoders benchmark (" << iterations << " iterations)" << std::endl;
+	float total_time[NUM_IMAGE_FORMATS][4] = {};
+	for (const std::string& filename : filenames)
+	{
+		std::vector<unsigned char> buffer;
+		int width, height, channels;
+		if (!readFileBin(filename, buffer) || !getImageInfo(buffer, width, height, channels))
+		{
+			std::cout << " * " << filename << " [ERROR] cannot be read" << std::endl;
+			continue;
+		}
+
+		eImageFormat format = getImageFormat(buffer);
+		std::vector<unsigned char> output(width * height * channels);
+		std::cout << " * " << filename << " " << width << "x" << height << std::endl;
+		for (int decoder = DECODER_STB; decoder <= DECODER_JPGD; ++decoder)
+		{
+			if ((decoder == DECODER_PICOPNG && format != IMAGE_PNG) || (decoder == DECODER_JPGD && format != IMAGE_JPG))
+				continue;
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			bool ok = true;
+			for (int i = 0; i < iterations && ok; ++i)
+				ok = decodeImage(buffer, &output[0], width, height, channels, (eImageDecoder)decoder);
+			float time = elapsedMs(start) / iterations;
+			if (!ok)
+			{
+				std::cout << "   " << image_decoder_str[decoder] << ": [ERROR]" << std::endl;
+				total_time[format][decoder] = 1e10f;
+				continue;
+			}
+			total_time[format][decoder] += time;
+			printf("   %-8s %8.2fms %7.1f MPixels/s\n", image_decoder_str[decoder], time, (width * height) / (time * 1000.0f));
+		}
+	}
+
+	//the fastest one is used from now on
+	for (int format = IMAGE_PNG; format <= IMAGE_JPG; ++format)
+	{
+		int best = 0;
+		for (int decoder = DECODER_STB; decoder <= DECODER_JPGD; ++decoder)
+			if (total_time[format][decoder] > 0 && (!best || total_time[format][decoder] < total_time[format][best]))
+				best = decoder;
+		if (best)
+			best_decoder[format] = (eImageDecoder)best;
+		std::cout << " * Best for " << (format == IMAGE_PNG ? "png" : "jpg") << ": " << image_decoder_str[best_decoder[format]] << std::endl;
+	}
+
+	//all the files at the same time
+	for (int threads = 0; threads < 2; ++threads)
+	{
+		std::vector<ImageDecodeJob> jobs(filenames.size());
+		for (size_t i = 0; i < filenames.size(); ++i)
+		{
+			jobs[i].filename = filenames[i];
+			jobs[i].image = NULL;
+		}
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		decodeImages(jobs, threads == 1);
+		float time = elapsedMs(start);
+		for (ImageDecodeJob& job : jobs)
+			delete job.image;
+		std::cout << " * Batch of " << jobs.size() << (threads ? " in " : " single thread") ;
+		if (threads)
+			std::cout << WorkerPool::global.getNumThreads() << " threads";
+		printf(": %.2fms\n", time);
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+class Image;
+
+//Image decoding: detects the format from the content of the file, picks the fastest decoder for it
+//and can decode straight into memory owned by the caller.
+//Many images can be decoded at the same time with decodeImages, and the decoders can be compared with
+//GTR --decode-benchmark [image1.png image2.jpg ...]
+
+enum eImageFormat {
+	IMAGE_UNKNOWN,
+	IMAGE_PNG,
+	IMAGE_JPG,
+	IMAGE_TGA,
+	NUM_IMAGE_FORMATS
+};
+
+enum eImageDecoder {
+	DECODER_AUTO, //the one in best_decoder for that format
+	DECODER_STB,
+	DECODER_PICOPNG, //only png
+	DECODER_JPGD //only jpg
+};
+
+extern const char* image_decoder_str[];
+extern eImageDecoder best_decoder[NUM_IMAGE_FORMATS]; //updated by the benchmark
+
+//from the first bytes, the extension is only used if it is not recognized
+eImageFormat getImageFormat(const std::vector<unsigned char>& buffer, const char* filename = NULL);
+
+//size of the image without decoding it, channels from the header of the file: 4 if it has alpha, otherwise 3 (gray is expanded)
+bool getImageInfo(const std::vector<unsigned char>& buffer, int& width, int& height, int& channels);
+
+//output must have width * height * channels bytes, as returned by getImageInfo.
+//Rows are stored like the old loaders did: png bottom to top (flipped), jpg top to bottom
+bool decodeImage(const std::vector<unsigned char>& buffer, unsigned char* output, int width, int height, int channels, eImageDecoder decoder = DECODER_AUTO);
+bool decodeImage(const std::vector<unsigned char>& buffer, Image* image, eImageDecoder decoder = DECODER_AUTO);
+
+struct ImageDecodeJob {
+	std::string filename;
+	Image* image; //filled with the result
+	bool loaded;
+	float time; //ms reading and decoding
+};
+
+//reads and decodes all the jobs spread among the WorkerPool threads (call it from the main thread)
+void decodeImages(std::vector<ImageDecodeJob>& jobs, bool use_threads = true);
+
+//compares the decoders available for every file and the batch decoding with and without threads
+void benchmarkImageDecoders(std::vector<std::string> filenames, int iterations = 3);
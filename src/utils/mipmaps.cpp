@@ -0,0 +1,384 @@
+#include "mipmaps.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define MIPS_USE_SSE
+	#include <emmintrin.h>
+#endif
+#ifdef __AVX__
+	#define MIPS_USE_AVX
+	#include <immintrin.h>
+#endif
+
+#include "../gfx/texture.h"
+#include "utils.h"
+
+#define KAISER_TAPS 6
+#define LINEAR_TO_SRGB_SIZE 8192
+
+//created the first time they are used (thread safe)
+struct sMipTables {
+	float srgb_to_linear[256];
+	uint8 linear_to_srgb[LINEAR_TO_SRGB_SIZE + 1];
+	float kaiser[KAISER_TAPS];
+
+	sMipTables()
+	{
+		for (int i = 0; i < 256; ++i)
+		{
+			float c = i / 255.0f;
+			srgb_to_linear[i] = c <= 0.04045f ? c / 12.92f : pow((c + 0.055f) / 1.055f, 2.4f);
+		}
+		for (int i = 0; i <= LINEAR_TO_SRGB_SIZE; ++i)
+		{
+			float c = i / (float)LINEAR_TO_SRGB_SIZE;
+			c = c <= 0.0031308f ? c * 12.92f : 1.055f * pow(c, 1.0f / 2.4f) - 0.055f;
+			linear_to_srgb[i] = (uint8)(c * 255.0f + 0.5f);
+		}
+
+		//taps centered between the two source pixels, sinc of half the frequency with a kaiser window (beta 4, radius 3)
+		auto besselI0 = [](float x) { float sum = 1, term = 1; for (int k = 1; k < 12; ++k) { term *= (x / (2 * k)) * (x / (2 * k)); sum += term; } return sum; };
+		float total = 0;
+		for (int i = 0; i < KAISER_TAPS; ++i)
+		{
+			float t = i - 2.5f;
+			float x = t * 0.5f * (float)PI;
+			float sinc = sin(x) / x;
+			float r = t / 3.0f;
+			kaiser[i] = sinc * besselI0(4.0f * sqrt(1.0f - r * r)) / besselI0(4.0f);
+			total += kaiser[i];
+		}
+		for (int i = 0; i < KAISER_TAPS; ++i)
+			kaiser[i] /= total;
+	}
+};
+
+static const sMipTables& getTables()
+{
+	static sMipTables tables;
+	return tables;
+}
+
+int getMipFlagsFromName(const char* filename)
+{
+	std::string name = toLowerCase(filename);
+	if (name.find("normal") != std::string::npos || name.find("_nor") != std::string::npos)
+		return MIP_NORMALMAP;
+	const char* linear_names[] = { "metal", "rough", "occlusion", "height", "_orm", "_mr." };
+	for (const char* linear_name : linear_names)
+		if (name.find(linear_name) != std::string::npos)
+			return 0;
+	return MIP_SRGB;
+}
+
+int getNumMipLevels(int width, int height)
+{
+	int num_levels = 1;
+	while (width > 1 || height > 1)
+	{
+		width = std::max(width / 2, 1);
+		height = std::max(height / 2, 1);
+		num_levels++;
+	}
+	return num_levels;
+}
+
+size_t getMipChainSize(int width, int height, int channels, int num_levels)
+{
+	size_t size = 0;
+	for (int i = 0; i < num_levels; ++i)
+	{
+		size += (size_t)width * height * channels;
+		width = std::max(width / 2, 1);
+		height = std::max(height / 2, 1);
+	}
+	return size;
+}
+
+// KERNELS (always 4 floats per pixel) *****************
+
+static void downsampleBox(const float* src, int width, int height, float* dst, int dst_width, int dst_height, bool simd)
+{
+	//output pixels with both source columns inside the image
+	int simd_width = (width > 1 && simd) ? dst_width : 0;
+
+	for (int y = 0; y < dst_height; ++y)
+	{
+		const float* row0 = src + std::min(y * 2, height - 1) * width * 4;
+		const float* row1 = src + std::min(y * 2 + 1, height - 1) * width * 4;
+		float* out = dst + y * dst_width * 4;
+		int x = 0;
+#if defined(MIPS_USE_AVX)
+		__m128 quarter = _mm_set1_ps(0.25f);
+		for (; x < simd_width; ++x)
+		{
+			//the two pixels of every row in one register
+			__m256 sum = _mm256_add_ps(_mm256_loadu_ps(row0 + x * 8), _mm256_loadu_ps(row1 + x * 8));
+			__m128 pixel = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+			_mm_storeu_ps(out + x * 4, _mm_mul_ps(pixel, quarter));
+		}
+#elif defined(MIPS_USE_SSE)
+		__m128 quarter = _mm_set1_ps(0.25f);
+		for (; x < simd_width; ++x)
+		{
+			__m128 top = _mm_add_ps(_mm_loadu_ps(row0 + x * 8), _mm_loadu_ps(row0 + x * 8 + 4));
+			__m128 bottom = _mm_add_ps(_mm_loadu_ps(row1 + x * 8), _mm_loadu_ps(row1 + x * 8 + 4));
+			_mm_storeu_ps(out + x * 4, _mm_mul_ps(_mm_add_ps(top, bottom), quarter));
+		}
+#endif
+		for (; x < dst_width; ++x)
+		{
+			int x0 = std::min(x * 2, width - 1) * 4;
+			int x1 = std::min(x * 2 + 1, width - 1) * 4;
+			for (int c = 0; c < 4; ++c)
+				out[x * 4 + c] = 0.25f * (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c]);
+		}
+	}
+}
+
+//one dimension of the kaiser filter, stride is the distance in floats between two source pixels
+static void kaiserPass(const float* src, int src_size, int src_stride, float* dst, int dst_size, int dst_stride, bool simd)
+{
+	const float* weights = getTables().kaiser;
+	for (int i = 0; i < dst_size; ++i)
+	{
+		int first = i * 2 - 2;
+#ifdef MIPS_USE_SSE
+		if (simd)
+		{
+			__m128 acc = _mm_setzero_ps();
+			for (int k = 0; k < KAISER_TAPS; ++k)
+			{
+				int pos = std::min(std::max(first + k, 0), src_size - 1);
+				acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(src + pos * src_stride), _mm_set1_ps(weights[k])));
+			}
+			_mm_storeu_ps(dst + i * dst_stride, acc);
+			continue;
+		}
+#endif
+		float acc[4] = { 0, 0, 0, 0 };
+		for (int k = 0; k < KAISER_TAPS; ++k)
+		{
+			const float* p = src + std::min(std::max(first + k, 0), src_size - 1) * src_stride;
+			for (int c = 0; c < 4; ++c)
+				acc[c] += p[c] * weights[k];
+		}
+		memcpy(dst + i * dst_stride, acc, sizeof(acc));
+	}
+}
+
+static void downsampleKaiser(const float* src, int width, int height, float* dst, int dst_width, int dst_height, std::vector<float>& temp, bool simd)
+{
+	//horizontal to temp (dst_width x height), then vertical
+	temp.resize(dst_width * height * 4);
+	for (int y = 0; y < height; ++y)
+		kaiserPass(src + y * width * 4, width, 4, &temp[y * dst_width * 4], dst_width, 4, simd);
+	for (int x = 0; x < dst_width; ++x)
+		kaiserPass(&temp[x * 4], height, dst_width * 4, dst + x * 4, dst_height, dst_width * 4, simd);
+}
+
+static void renormalize(float* pixels, int num_pixels)
+{
+	for (int i = 0; i < num_pixels; ++i)
+	{
+		float* p = pixels + i * 4;
+		float x = p[0] * 2.0f - 1.0f, y = p[1] * 2.0f - 1.0f, z = p[2] * 2.0f - 1.0f;
+		float length = sqrt(x * x + y * y + z * z);
+		if (length < 0.000001f)
+			continue;
+		p[0] = x / length * 0.5f + 0.5f;
+		p[1] = y / length * 0.5f + 0.5f;
+		p[2] = z / length * 0.5f + 0.5f;
+	}
+}
+
+static float getAlphaCoverage(const uint8* pixels, int num_pixels, int channels, float cutoff)
+{
+	int passed = 0;
+	for (int i = 0; i < num_pixels; ++i)
+		if (pixels[i * channels + channels - 1] >= cutoff * 255.0f)
+			passed++;
+	return passed / (float)num_pixels;
+}
+
+static float getAlphaCoverage(const float* pixels, int num_pixels, float cutoff, float scale)
+{
+	int passed = 0;
+	for (int i = 0; i < num_pixels; ++i)
+		if (pixels[i * 4 + 3] * scale >= cutoff)
+			passed++;
+	return passed / (float)num_pixels;
+}
+
+//scale for the alpha so the level has the same coverage than the first one
+static float findAlphaScale(const float* pixels, int num_pixels, float cutoff, float coverage)
+{
+	float min_scale = 0.0f;
+	float max_scale = 4.0f;
+	for (int i = 0; i < 10; ++i)
+	{
+		float scale = (min_scale + max_scale) * 0.5f;
+		if (getAlphaCoverage(pixels, num_pixels, cutoff, scale) < coverage)
+			min_scale = scale;
+		else
+			max_scale = scale;
+	}
+	return max_scale;
+}
+
+static void toFloats(const uint8* pixels, int num_pixels, int channels, bool srgb, float* out)
+{
+	const float* to_linear = getTables().srgb_to_linear;
+	for (int i = 0; i < num_pixels; ++i)
+	{
+		const uint8* p = pixels + i * channels;
+		for (int c = 0; c < 3; ++c)
+		{
+			uint8 v = channels >= 3 ? p[c] : p[0];
+			out[i * 4 + c] = srgb ? to_linear[v] : v * (1.0f / 255.0f);
+		}
+		out[i * 4 + 3] = channels == 4 ? p[3] / 255.0f : (channels == 2 ? p[1] / 255.0f : 1.0f);
+	}
+}
+
+static void toBytes(const float* pixels, int num_pixels, int channels, bool srgb, float alpha_scale, uint8* out)
+{
+	const uint8* to_srgb = getTables().linear_to_srgb;
+	for (int i = 0; i < num_pixels; ++i)
+	{
+		const float* p = pixels + i * 4;
+		uint8* o = out + i * channels;
+		int color_channels = channels >= 3 ? 3 : 1;
+		for (int c = 0; c < color_channels; ++c)
+		{
+			float v = std::min(std::max(p[c], 0.0f), 1.0f);
+			o[c] = srgb ? to_srgb[(int)(v * LINEAR_TO_SRGB_SIZE + 0.5f)] : (uint8)(v * 255.0f + 0.5f);
+		}
+		if (channels == 4 || channels == 2)
+			o[channels - 1] = (uint8)(std::min(std::max(p[3] * alpha_scale, 0.0f), 1.0f) * 255.0f + 0.5f);
+	}
+}
+
+//the first level is the biggest, so it is converted two rows at a time instead of all of it to floats
+static void downsampleBoxBytes(const uint8* pixels, int width, int height, int channels, bool srgb, float* dst, int dst_width, int dst_height, std::vector<float>& temp, bool simd)
+{
+	temp.resize(width * 2 * 4);
+	for (int y = 0; y < dst_height; ++y)
+	{
+		int num_rows = std::min(height - y * 2, 2);
+		toFloats(pixels + y * 2 * width * channels, width * num_rows, channels, srgb, &temp[0]);
+		downsampleBox(&temp[0], width, num_rows, dst + y * dst_width * 4, dst_width, 1, simd);
+	}
+}
+
+void generateMipChain(const unsigned char* pixels, int width, int height, int channels, unsigned char* output, int flags, float alpha_cutoff, int num_levels, int first_level)
+{
+	if (!num_levels)
+		num_levels = getNumMipLevels(width, height);
+
+	if (first_level == 0)
+	{
+		size_t size = (size_t)width * height * channels;
+		memcpy(output, pixels, size);
+		output += size;
+	}
+	if (num_levels < 2)
+		return;
+
+	bool srgb = (flags & MIP_SRGB) != 0;
+	bool simd = (flags & MIP_SCALAR) == 0; //per call, the loading threads can be generating mips while the benchmark runs
+	bool coverage = (flags & MIP_ALPHA_COVERAGE) && (channels == 4 || channels == 2);
+	std::vector<float> level;
+	std::vector<float> next_level;
+	std::vector<float> temp;
+	float target_coverage = coverage ? getAlphaCoverage(pixels, width * height, channels, alpha_cutoff) : 0.0f;
+
+	for (int i = 1; i < num_levels; ++i)
+	{
+		int next_width = std::max(width / 2, 1);
+		int next_height = std::max(height / 2, 1);
+		next_level.resize(next_width * next_height * 4);
+		if (flags & MIP_KAISER)
+		{
+			if (i == 1)
+			{
+				level.resize(width * height * 4);
+				toFloats(pixels, width * height, channels, srgb, &level[0]);
+			}
+			downsampleKaiser(&level[0], width, height, &next_level[0], next_width, next_height, temp, simd);
+		}
+		else if (i == 1)
+			downsampleBoxBytes(pixels, width, height, channels, srgb, &next_level[0], next_width, next_height, temp, simd);
+		else
+			downsampleBox(&level[0], width, height, &next_level[0], next_width, next_height, simd);
+		level.swap(next_level);
+		width = next_width;
+		height = next_height;
+
+		if (flags & MIP_NORMALMAP)
+			renormalize(&level[0], width * height); //in place, the next level is filtered from it
+		if (i < first_level)
+			continue;
+		float alpha_scale = coverage ? findAlphaScale(&level[0], width * height, alpha_cutoff, target_coverage) : 1.0f;
+
+		toBytes(&level[0], width * height, channels, srgb, alpha_scale, output);
+		output += (size_t)width * height * channels;
+	}
+}
+
+void benchmarkMipmaps(std::vector<std::string> filenames, int iterations)
+{
+	if (filenames.empty())
+	{
+		filenames.push_back("data/prefabs/road/asphalt_02_diff_2k.jpg");
+		filenames.push_back("data/prefabs/road/dirty_concrete_nor_2k.jpg");
+		filenames.push_back("data/prefabs/house_test/textures/unknown_normal.png");
+	}
+
+#if defined(MIPS_USE_AVX)
+	const char* simd_name = "AVX";
+#elif defined(MIPS_USE_SSE)
+	const char* simd_name = "SSE";
+#else
+	const char* simd_name = "none";
+#endif
+	std::cout << "Mipmaps benchmark (" << iterations << " iterations, SIMD: " << simd_name << ")" << std::endl;
+
+	struct sConfig { const char* name; int flags; };
+	sConfig configs[] = {
+		{ "box", 0 },
+		{ "box srgb", MIP_SRGB },
+		{ "box normal", MIP_NORMALMAP },
+		{ "box coverage", MIP_SRGB | MIP_ALPHA_COVERAGE },
+		{ "kaiser srgb", MIP_SRGB | MIP_KAISER },
+	};
+
+	for (const std::string& filename : filenames)
+	{
+		Image image;
+		if (!image.load(filename.c_str()))
+		{
+			std::cout << " * " << filename << " [ERROR] cannot be read" << std::endl;
+			continue;
+		}
+		std::cout << " * " << filename << " " << image.width << "x" << image.height << std::endl;
+		int num_levels = getNumMipLevels(image.width, image.height);
+		std::vector<unsigned char> output(getMipChainSize(image.width, image.height, image.num_channels, num_levels));
+		for (sConfig& config : configs)
+			for (int simd = 1; simd >= 0; --simd)
+			{
+				int flags = simd ? config.flags : config.flags | MIP_SCALAR;
+				std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+				for (int i = 0; i < iterations; ++i)
+					generateMipChain(image.data, image.width, image.height, image.num_channels, &output[0], flags);
+				float time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+				printf("   %-13s %-6s %8.2fms %7.1f MPixels/s\n", config.name, simd ? simd_name : "scalar", time, (image.width * image.height) / (time * 1000.0f));
+			}
+	}
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+//CPU mipmap generation, so textures are uploaded with all their levels and the GPU doesnt have to generate them.
+//It runs in the loading threads, every level is filtered in floats with SSE (AVX if the build enables it)
+//from the previous one. It can be benchmarked with GTR --mip-benchmark [image1.png ...]
+
+enum eMipFlags {
+	MIP_SRGB = 1, //color textures, filtered in linear space
+	MIP_NORMALMAP = 2, //rgb is renormalized as a vector, alpha (metalness in this framework) is filtered as is
+	MIP_ALPHA_COVERAGE = 4, //alpha tested textures keep the same amount of pixels passing the test in every level
+	MIP_KAISER = 8, //6 taps kaiser windowed sinc instead of the 2x2 box, sharper
+	MIP_SCALAR = 16 //without SIMD, to compare in the benchmark
+};
+
+//guesses the flags from the name of the file (normal, rough, metal... are linear)
+int getMipFlagsFromName(const char* filename);
+
+int getNumMipLevels(int width, int height); //till 1x1
+size_t getMipChainSize(int width, int height, int channels, int num_levels);
+
+//writes all the levels one after the other in output (getMipChainSize bytes), the first one is a copy of pixels.
+//output is only written, so it can be mapped GPU memory.
+//The levels before first_level are filtered but not written, so a streamed texture gets the same levels than the full chain
+void generateMipChain(const unsigned char* pixels, int width, int height, int channels, unsigned char* output, int flags = 0, float alpha_cutoff = 0.5f, int num_levels = 0, int first_level = 0);
+
+void benchmarkMipmaps(std::vector<std::string> filenames, int iterations = 3);
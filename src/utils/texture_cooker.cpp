@@ -0,0 +1,482 @@
+#include "texture_cooker.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+#include <sys/stat.h>
+
+#include "../gfx/texture.h"
+#include "utils.h"
+#include "mipmaps.h"
+#include "../core/task.h"
+#include "../extra/hdre.h"
+
+//values used in the KTX header
+#define KTX_COMPRESSED_RGB_S3TC_DXT1 0x83F0
+#define KTX_COMPRESSED_RGBA_S3TC_DXT5 0x83F3
+#define KTX_COMPRESSED_LUMINANCE_ALPHA_LATC2 0x8C72 //same blocks as RG_RGTC2, it is the one the KTX parser recognizes as BC5
+#define KTX_RGB 0x1907
+#define KTX_RGBA 0x1908
+#define KTX_RG 0x8227
+#define KTX_RGB9_E5 0x8C3D
+#define KTX_RGBA16F 0x881A
+#define KTX_UNSIGNED_INT_5_9_9_9_REV 0x8C3E
+#define KTX_HALF_FLOAT 0x140B
+
+struct sKTXHeader {
+	uint8 id[12];
+	uint32 endianness;
+	uint32 gl_type;
+	uint32 gl_type_size;
+	uint32 gl_format;
+	uint32 gl_internal_format;
+	uint32 gl_base_internal_format;
+	uint32 width;
+	uint32 height;
+	uint32 depth;
+	uint32 array_elements;
+	uint32 faces;
+	uint32 mip_levels;
+	uint32 key_value_bytes;
+};
+
+// BLOCK COMPRESSION *********************************
+
+static uint16 packRGB565(const float* c)
+{
+	int r = (int)(clamp(c[0], 0.0f, 255.0f) * 31.0f / 255.0f + 0.5f);
+	int g = (int)(clamp(c[1], 0.0f, 255.0f) * 63.0f / 255.0f + 0.5f);
+	int b = (int)(clamp(c[2], 0.0f, 255.0f) * 31.0f / 255.0f + 0.5f);
+	return (uint16)((r << 11) | (g << 5) | b);
+}
+
+static void unpackRGB565(uint16 c, float* out)
+{
+	int r = (c >> 11) & 31;
+	int g = (c >> 5) & 63;
+	int b = c & 31;
+	out[0] = (float)((r << 3) | (r >> 2));
+	out[1] = (float)((g << 2) | (g >> 4));
+	out[2] = (float)((b << 3) | (b >> 2));
+}
+
+//BC1 color block from 16 RGBA pixels, endpoints along the principal axis of the colors
+static void compressColorBlock(const uint8* pixels, uint8* output)
+{
+	float mean[3] = { 0,0,0 };
+	for (int i = 0; i < 16; ++i)
+		for (int j = 0; j < 3; ++j)
+			mean[j] += pixels[i * 4 + j] / 16.0f;
+
+	float cov[6] = { 0,0,0,0,0,0 }; //rr rg rb gg gb bb
+	for (int i = 0; i < 16; ++i)
+	{
+		float r = pixels[i * 4] - mean[0];
+		float g = pixels[i * 4 + 1] - mean[1];
+		float b = pixels[i * 4 + 2] - mean[2];
+		cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+		cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+	}
+
+	//power iteration to find the main axis
+	float axis[3] = { 1,1,1 };
+	for (int it = 0; it < 4; ++it)
+	{
+		float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+		float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+		float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+		float len = std::max(std::max(fabs(x), fabs(y)), fabs(z));
+		if (len < 0.0001f)
+			break;
+		axis[0] = x / len; axis[1] = y / len; axis[2] = z / len;
+	}
+
+	float min_dot = 1e10f, max_dot = -1e10f;
+	int min_index = 0, max_index = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		float d = pixels[i * 4] * axis[0] + pixels[i * 4 + 1] * axis[1] + pixels[i * 4 + 2] * axis[2];
+		if (d < min_dot) { min_dot = d; min_index = i; }
+		if (d > max_dot) { max_dot = d; max_index = i; }
+	}
+
+	//inset the endpoints a little, the extremes are usually outliers
+	float c_max[3], c_min[3];
+	for (int j = 0; j < 3; ++j)
+	{
+		float a = pixels[max_index * 4 + j];
+		float b = pixels[min_index * 4 + j];
+		float inset = (a - b) / 16.0f;
+		c_max[j] = a - inset;
+		c_min[j] = b + inset;
+	}
+
+	uint16 c0 = packRGB565(c_max);
+	uint16 c1 = packRGB565(c_min);
+	if (c0 < c1)
+		std::swap(c0, c1);
+
+	float palette[4][3];
+	unpackRGB565(c0, palette[0]);
+	unpackRGB565(c1, palette[1]);
+	for (int j = 0; j < 3; ++j)
+	{
+		palette[2][j] = (2.0f * palette[0][j] + palette[1][j]) / 3.0f;
+		palette[3][j] = (palette[0][j] + 2.0f * palette[1][j]) / 3.0f;
+	}
+
+	uint32 indices = 0;
+	if (c0 != c1) //when equal the block is solid and all indices are 0
+		for (int i = 0; i < 16; ++i)
+		{
+			int best = 0;
+			float best_dist = 1e10f;
+			for (int k = 0; k < 4; ++k)
+			{
+				float dr = pixels[i * 4] - palette[k][0];
+				float dg = pixels[i * 4 + 1] - palette[k][1];
+				float db = pixels[i * 4 + 2] - palette[k][2];
+				float dist = dr * dr + dg * dg + db * db;
+				if (dist < best_dist) { best_dist = dist; best = k; }
+			}
+			indices |= best << (i * 2);
+		}
+
+	output[0] = c0 & 0xFF; output[1] = c0 >> 8;
+	output[2] = c1 & 0xFF; output[3] = c1 >> 8;
+	output[4] = indices & 0xFF; output[5] = (indices >> 8) & 0xFF;
+	output[6] = (indices >> 16) & 0xFF; output[7] = (indices >> 24) & 0xFF;
+}
+
+//BC4 block of one channel (used for the alpha of BC3 and both channels of BC5)
+static void compressChannelBlock(const uint8* pixels, int channel, uint8* output)
+{
+	int min_v = 255, max_v = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		min_v = std::min(min_v, (int)pixels[i * 4 + channel]);
+		max_v = std::max(max_v, (int)pixels[i * 4 + channel]);
+	}
+
+	output[0] = (uint8)max_v;
+	output[1] = (uint8)min_v;
+
+	//8 values mode (a0 > a1), when equal every index is 0
+	uint64_t indices = 0;
+	if (max_v > min_v)
+	{
+		float palette[8];
+		palette[0] = (float)max_v;
+		palette[1] = (float)min_v;
+		for (int k = 1; k < 7; ++k)
+			palette[k + 1] = ((7 - k) * max_v + k * min_v) / 7.0f;
+
+		for (int i = 0; i < 16; ++i)
+		{
+			float v = pixels[i * 4 + channel];
+			int best = 0;
+			float best_dist = 1e10f;
+			for (int k = 0; k < 8; ++k)
+			{
+				float dist = fabs(v - palette[k]);
+				if (dist < best_dist) { best_dist = dist; best = k; }
+			}
+			indices |= (uint64_t)best << (i * 3);
+		}
+	}
+
+	for (int i = 0; i < 6; ++i)
+		output[2 + i] = (indices >> (i * 8)) & 0xFF;
+}
+
+//compresses one level, the borders of images not multiple of 4 repeat the last pixel
+static void compressLevel(const uint8* rgba, int width, int height, eCookFormat format, std::vector<uint8>& output)
+{
+	int blocks_x = std::max(1, (width + 3) / 4);
+	int blocks_y = std::max(1, (height + 3) / 4);
+	int block_bytes = format == COOK_BC1 ? 8 : 16;
+	output.resize(blocks_x * blocks_y * block_bytes);
+
+	uint8 block[16 * 4];
+	uint8* out = &output[0];
+	for (int by = 0; by < blocks_y; ++by)
+		for (int bx = 0; bx < blocks_x; ++bx)
+		{
+			for (int y = 0; y < 4; ++y)
+				for (int x = 0; x < 4; ++x)
+				{
+					int px = std::min(bx * 4 + x, width - 1);
+					int py = std::min(by * 4 + y, height - 1);
+					memcpy(block + (y * 4 + x) * 4, &rgba[(py * width + px) * 4], 4);
+				}
+
+			if (format == COOK_BC1)
+				compressColorBlock(block, out);
+			else if (format == COOK_BC3)
+			{
+				compressChannelBlock(block, 3, out);
+				compressColorBlock(block, out + 8);
+			}
+			else //BC5
+			{
+				compressChannelBlock(block, 0, out);
+				compressChannelBlock(block, 1, out + 8);
+			}
+			out += block_bytes;
+		}
+}
+
+// COOKER *********************************
+
+std::string getCookedTextureFilename(const char* filename)
+{
+	std::string cooked = std::string(filename) + ".ktx";
+	struct stat cooked_info;
+	if (stat(cooked.c_str(), &cooked_info) != 0)
+		return "";
+
+	//the source may not be shipped, then the cooked one is always valid
+	struct stat source_info;
+	if (stat(filename, &source_info) == 0 && source_info.st_mtime > cooked_info.st_mtime)
+		return "";
+	return cooked;
+}
+
+bool cookTexture(const char* filename, eCookFormat format)
+{
+	if (toLowerCase(getExtension(filename)) == "hdre")
+		return cookHDRE(filename, (std::string(filename) + ".ktx").c_str(), GFX::Texture::hdre_format);
+
+	Image image;
+	if (!image.load(filename))
+		return false;
+	return cookImage(&image, (std::string(filename) + ".ktx").c_str(), format, getMipFlagsFromName(filename));
+}
+
+bool cookImage(Image* image, const char* output_filename, eCookFormat format, int mip_flags)
+{
+	if (!image->data || !image->width || !image->height)
+		return false;
+
+	long time = getTime();
+	std::cout << " + Cooking texture: " << TermColor::YELLOW << output_filename << TermColor::DEFAULT << " ... ";
+
+	int width = image->width;
+	int height = image->height;
+	int channels = image->num_channels;
+
+	//all the levels are generated first, in RGBA
+	bool has_alpha = false;
+	std::vector<uint8> rgba(width * height * 4);
+	for (int i = 0; i < width * height; ++i)
+	{
+		uint8* p = image->data + i * channels;
+		for (int c = 0; c < 3; ++c)
+			rgba[i * 4 + c] = channels == 1 ? p[0] : p[c];
+		rgba[i * 4 + 3] = channels == 4 ? p[3] : 255;
+		if (rgba[i * 4 + 3] != 255)
+			has_alpha = true;
+	}
+	int num_mips = getNumMipLevels(width, height);
+	std::vector<uint8> chain(getMipChainSize(width, height, 4, num_mips));
+	generateMipChain(&rgba[0], width, height, 4, &chain[0], mip_flags, 0.5f, num_mips);
+
+	//normal maps only need xy (the shaders rebuild z), unless the alpha is used
+	if (format == COOK_AUTO)
+		format = has_alpha ? COOK_BC3 : ((mip_flags & MIP_NORMALMAP) ? COOK_BC5 : COOK_BC1);
+
+	FILE* f = fopen(output_filename, "wb");
+	if (!f)
+	{
+		std::cout << "[ERROR] cannot write file" << std::endl;
+		return false;
+	}
+
+	sKTXHeader header;
+	const uint8 ktx_id[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+	memcpy(header.id, ktx_id, 12);
+	header.endianness = 0x04030201;
+	header.gl_type = 0; //compressed
+	header.gl_type_size = 1;
+	header.gl_format = 0;
+	header.gl_internal_format = format == COOK_BC1 ? KTX_COMPRESSED_RGB_S3TC_DXT1 : (format == COOK_BC3 ? KTX_COMPRESSED_RGBA_S3TC_DXT5 : KTX_COMPRESSED_LUMINANCE_ALPHA_LATC2);
+	header.gl_base_internal_format = format == COOK_BC1 ? KTX_RGB : (format == COOK_BC3 ? KTX_RGBA : KTX_RG);
+	header.width = width;
+	header.height = height;
+	header.depth = 0;
+	header.array_elements = 0;
+	header.faces = 1;
+	header.mip_levels = num_mips;
+	header.key_value_bytes = 0;
+	fwrite(&header, sizeof(header), 1, f);
+
+	size_t total_bytes = 0;
+	std::vector<uint8> blocks;
+	size_t offset = 0;
+	for (int mip = 0; mip < num_mips; ++mip)
+	{
+		compressLevel(&chain[offset], width, height, format, blocks);
+		offset += width * height * 4;
+
+		uint32 size = (uint32)blocks.size(); //blocks are 8 or 16 bytes, no padding needed
+		fwrite(&size, sizeof(size), 1, f);
+		fwrite(&blocks[0], size, 1, f);
+		total_bytes += size;
+
+		width = std::max(1, width / 2);
+		height = std::max(1, height / 2);
+	}
+	fclose(f);
+
+	const char* format_names[] = { "AUTO", "BC1", "BC3", "BC5" };
+	std::cout << "[OK] " << format_names[format] << " Mips: " << num_mips << " Size: " << total_bytes / 1024 << "KB ("
+		<< (int)(image->width * image->height * channels * 1.33f / std::max(total_bytes, (size_t)1)) << "x smaller) Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	return true;
+}
+
+// HDR CUBEMAPS *********************************
+
+static uint16 floatToHalf(float value)
+{
+	uint32 bits;
+	memcpy(&bits, &value, 4);
+	uint32 sign = (bits >> 16) & 0x8000;
+	int exponent = (int)((bits >> 23) & 0xFF) - 127 + 15;
+	uint32 mantissa = bits & 0x7FFFFF;
+	if (exponent <= 0)
+		return sign; //too small, flushed to zero
+	if (exponent >= 31)
+		return sign | 0x7BFF; //the biggest half (also for inf and nan)
+	uint32 half = sign | (exponent << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000)
+		half++; //round, it can carry to the exponent
+	if ((half & 0x7FFF) == 0x7C00)
+		half--;
+	return (uint16)half;
+}
+
+//three mantissas of 9 bits sharing an exponent of 5 bits (EXT_texture_shared_exponent)
+static uint32 packRGB9E5(float r, float g, float b)
+{
+	const float max_value = 65408.0f; //(2^9 - 1) / 2^9 * 2^16
+	r = std::min(std::max(r, 0.0f), max_value);
+	g = std::min(std::max(g, 0.0f), max_value);
+	b = std::min(std::max(b, 0.0f), max_value);
+	float max_channel = std::max(r, std::max(g, b));
+
+	int exponent = 0;
+	frexp(max_channel, &exponent); //max_channel = m * 2^exponent, m in [0.5, 1)
+	int shared_exponent = std::max(-16, exponent - 1) + 16;
+	float scale = (float)ldexp(1.0, shared_exponent - 15 - 9);
+	if ((int)floor(max_channel / scale + 0.5f) == 512)
+	{
+		scale *= 2.0f;
+		shared_exponent++;
+	}
+	uint32 mr = (uint32)floor(r / scale + 0.5f);
+	uint32 mg = (uint32)floor(g / scale + 0.5f);
+	uint32 mb = (uint32)floor(b / scale + 0.5f);
+	return mr | (mg << 9) | (mb << 18) | ((uint32)shared_exponent << 27);
+}
+
+bool convertHDRE(HDRE* hdre, unsigned int gl_internal_format, std::vector<std::vector<uint8>>& levels)
+{
+	if (gl_internal_format != GL_RGB9_E5 && gl_internal_format != GL_RGBA16F)
+		return false;
+	int channels = hdre->header.numChannels;
+	int bytes_per_pixel = gl_internal_format == GL_RGB9_E5 ? 4 : 8;
+
+	levels.clear();
+	for (int level = 0; level < N_LEVELS; ++level)
+	{
+		//a level that doesnt fit the mip chain (old files store the small ones as 8x8) ends it
+		int size = hdre->getLevelSize(level);
+		if (!size || size != std::max(hdre->width >> level, 1))
+			break;
+
+		levels.push_back(std::vector<uint8>(size * size * bytes_per_pixel * N_FACES));
+		std::vector<uint8>& output = levels.back();
+		int num_pixels = size * size;
+
+		//every face in a different thread
+		WorkerPool::global.parallelFor(N_FACES, [&](int face) {
+			const float* src = hdre->getFacef(level, face);
+			uint8* dst = &output[face * num_pixels * bytes_per_pixel];
+			for (int i = 0; i < num_pixels; ++i, src += channels)
+			{
+				if (gl_internal_format == GL_RGB9_E5)
+					((uint32*)dst)[i] = packRGB9E5(src[0], src[1], src[2]);
+				else
+				{
+					uint16* half = (uint16*)dst + i * 4;
+					half[0] = floatToHalf(src[0]);
+					half[1] = floatToHalf(src[1]);
+					half[2] = floatToHalf(src[2]);
+					half[3] = floatToHalf(channels == 4 ? src[3] : 1.0f);
+				}
+			}
+		});
+	}
+	return levels.size() > 0;
+}
+
+bool writeCubemapKTX(const char* filename, int size, unsigned int gl_internal_format, std::vector<std::vector<uint8>>& levels)
+{
+	FILE* f = fopen(filename, "wb");
+	if (!f)
+	{
+		std::cout << "[ERROR] cannot write file: " << filename << std::endl;
+		return false;
+	}
+
+	bool rgb9e5 = gl_internal_format == GL_RGB9_E5;
+	sKTXHeader header;
+	const uint8 ktx_id[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+	memcpy(header.id, ktx_id, 12);
+	header.endianness = 0x04030201;
+	header.gl_type = rgb9e5 ? KTX_UNSIGNED_INT_5_9_9_9_REV : KTX_HALF_FLOAT;
+	header.gl_type_size = rgb9e5 ? 4 : 2;
+	header.gl_format = rgb9e5 ? KTX_RGB : KTX_RGBA;
+	header.gl_internal_format = rgb9e5 ? KTX_RGB9_E5 : KTX_RGBA16F;
+	header.gl_base_internal_format = header.gl_format;
+	header.width = size;
+	header.height = size;
+	header.depth = 0;
+	header.array_elements = 0;
+	header.faces = N_FACES;
+	header.mip_levels = (uint32)levels.size();
+	header.key_value_bytes = 0;
+	fwrite(&header, sizeof(header), 1, f);
+
+	//the size is the one of a single face, the pixels are 4 or 8 bytes so there is no padding
+	for (std::vector<uint8>& level : levels)
+	{
+		uint32 face_size = (uint32)level.size() / N_FACES;
+		fwrite(&face_size, sizeof(face_size), 1, f);
+		fwrite(&level[0], level.size(), 1, f);
+	}
+	fclose(f);
+	return true;
+}
+
+bool cookHDRE(const char* filename, const char* output_filename, unsigned int gl_internal_format)
+{
+	long time = getTime();
+	HDRE hdre;
+	if (!hdre.load(filename))
+		return false;
+
+	std::cout << " + Cooking cubemap: " << TermColor::YELLOW << output_filename << TermColor::DEFAULT << " ... ";
+	std::vector<std::vector<uint8>> levels;
+	if (!convertHDRE(&hdre, gl_internal_format, levels) || !writeCubemapKTX(output_filename, hdre.width, gl_internal_format, levels))
+	{
+		std::cout << "[ERROR]" << std::endl;
+		return false;
+	}
+	std::cout << "[OK] " << (gl_internal_format == GL_RGB9_E5 ? "RGB9E5" : "RGBA16F") << " Mips: " << levels.size() << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	return true;
+}
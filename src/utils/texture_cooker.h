@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "mipmaps.h"
+
+class Image;
+class HDRE;
+
+//Texture cooker: converts images to block compressed KTX files with all the mips already generated,
+//so loading them is just reading the file and copying it to VRAM (no decoding, no glGenerateMipmap).
+//Cooked files are stored next to the source image as "filename.ktx" and Texture::Get uses them when they are up to date.
+//It can be run offline from the command line: GTR --cook image1.png image2.jpg sky.hdre ...
+
+enum eCookFormat {
+	COOK_AUTO, //BC3 if the image uses alpha, otherwise BC5 for normal maps and BC1 for the rest
+	COOK_BC1, //RGB, 4 bits per pixel
+	COOK_BC3, //RGBA, 8 bits per pixel
+	COOK_BC5 //only red and green, 8 bits per pixel
+};
+
+//returns the cooked file if exists and is newer than the source, otherwise an empty string
+std::string getCookedTextureFilename(const char* filename);
+
+//loads the image and writes the cooked file, the mip flags are guessed from the name (normal, roughness... are linear)
+bool cookTexture(const char* filename, eCookFormat format = COOK_AUTO);
+
+bool cookImage(Image* image, const char* output_filename, eCookFormat format = COOK_AUTO, int mip_flags = MIP_SRGB);
+
+//HDR cubemaps (HDRE files) packed in GL_RGB9_E5 (4 bytes per pixel) or GL_RGBA16F (8 bytes, keeps the alpha) instead of floats.
+//Every level has the 6 faces one after the other
+bool convertHDRE(HDRE* hdre, unsigned int gl_internal_format, std::vector<std::vector<unsigned char>>& levels);
+bool writeCubemapKTX(const char* filename, int size, unsigned int gl_internal_format, std::vector<std::vector<unsigned char>>& levels);
+bool cookHDRE(const char* filename, const char* output_filename, unsigned int gl_internal_format);